@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
@@ -15,6 +17,7 @@
 #ifdef _WIN32
     #include <windows.h>
     #include <direct.h>
+    #include <io.h>
     #define CSVTMT_MKDIR(path) _mkdir(path)
 #else
     #include <sys/stat.h>
@@ -23,11 +26,25 @@
     #include <unistd.h>
     #include <utime.h>
 	#include <fcntl.h>
+	#include <time.h>
+	#include <pthread.h>
+	#include <stdatomic.h>
 	#include <signal.h>
 	#include <dirent.h>
     #define CSVTMT_MKDIR(path) mkdir(path, 0755)
 #endif
 
+// io_uringはカーネルのヘッダがあれば使う。liburingは使わない。
+#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#include <linux/io_uring.h>
+		#include <sys/syscall.h>
+		#include <sys/uio.h>
+		#include <sys/eventfd.h>
+		#define CSVTMT_HAVE_IO_URING 1
+	#endif
+#endif
+
 /************
 * constants *
 ************/
@@ -37,6 +54,7 @@ typedef enum {
 	CSVTMT_ERROR,
 	CSVTMT_DONE,
 	CSVTMT_ROW,
+	CSVTMT_WOULD_BLOCK, // csvtmt_step_async()で、読み込みを待つ必要がある
 } CsvTomatoResult;
 
 typedef enum {
@@ -49,15 +67,21 @@ enum {
 	CSVTMT_STR_SIZE = 256,
 	CSVTMT_IDENT_SIZE = 256,
 	CSVTMT_PATH_SIZE = 256,
-	CSVTMT_COLUMN_NAMES_ARRAY_SIZE = 32,
-	CSVTMT_VALUES_ARRAY_SIZE = 32,
-	CSVTMT_TYPES_ARRAY_SIZE = 64,
-	CSVTMT_TYPE_NAME_SIZE = 256,
-	CSVTMT_TYPE_DEF_SIZE = 256,
-	CSVTMT_CSV_COLS_SIZE = 128,
-	CSVTMT_EXEC_STACK_SIZE = 256,
-	CSVTMT_ASSIGNS_ARRAY_SIZE = 128,
 	CSVTMT_NUM_STR_SIZE = 1024,
+	CSVTMT_WRITE_ALIGN = 4096,
+	CSVTMT_WRITE_BUF_SIZE = 1024 * 1024,
+	CSVTMT_STMT_CACHE_SIZE = 16,
+	CSVTMT_ARENA_CHUNK_SIZE = 8 * 1024,
+	CSVTMT_STATS_KMV_SIZE = 64, // distinctの見積もりに残すハッシュ値の数
+	CSVTMT_COMPACT_CHUNK_SIZE = 64 * 1024, // 詰め直しで読み書きの速さを確かめる間隔
+	CSVTMT_IO_DEPTH = 16, // io_uringで同時に投げる先読みの数（32以下。io.cで確かめる）
+	CSVTMT_IO_CHUNK_SIZE = 128 * 1024, // 先読み1回の大きさ
+	CSVTMT_IO_READAHEAD_MIN = 1024 * 1024, // これより小さいテーブルは先読みしない
+	CSVTMT_ASYNC_WINDOW = CSVTMT_IO_DEPTH * CSVTMT_IO_CHUNK_SIZE, // csvtmt_step_async()が一度に読み込む範囲
+	CSVTMT_SCAN_WILLNEED = 2 * 1024 * 1024, // 走査を始める時にすぐ読ませる範囲
+	CSVTMT_SCAN_DROP_CHUNK = 8 * 1024 * 1024, // 読み終えたページを捨てる間隔
+	CSVTMT_SCAN_DROP_DIV = 4, // 物理メモリのこの分の1より大きなファイルは読んだ後ろから捨てる
+	CSVTMT_MMAP_WINDOW = 64 * 1024 * 1024, // テーブルを一度にmmapする大きさ
 };
 
 typedef enum {
@@ -70,8 +94,27 @@ typedef enum {
 	CSVTMT_ERR_FILE_IO,
 	CSVTMT_ERR_INDEX_OUT_OF_RANGE,
 	CSVTMT_ERR_PARSE,
+	CSVTMT_ERR_BUSY, // 他の接続がテーブルをロックしている
 } CsvTomatoErrorKind;
 
+// csvtmt_open_v2()のflags
+typedef enum {
+	CSVTMT_OPEN_THREADSAFE = 1 << 0, // 1つのCsvTomatoを複数のスレッドで使う
+} CsvTomatoOpenFlag;
+
+// I/Oのバックエンド。URINGを使えない環境ではPOSIXになる。
+typedef enum {
+	CSVTMT_IO_POSIX, // mmapのページフォールトとwrite()/fdatasync()
+	CSVTMT_IO_URING, // io_uringで先読みし、書き込みと同期をまとめて投げる
+} CsvTomatoIoBackend;
+
+// テーブルのロック。読む文はSHARED、書く文はEXCLUSIVEを取る。
+typedef enum {
+	CSVTMT_LOCK_NONE,
+	CSVTMT_LOCK_SHARED,
+	CSVTMT_LOCK_EXCLUSIVE,
+} CsvTomatoLockMode;
+
 typedef enum {
 	CSVTMT_TK_NONE,
 	CSVTMT_TK_ROOT,
@@ -130,6 +173,8 @@ typedef enum {
 	CSVTMT_ND_DELETE_STMT,
 	CSVTMT_ND_SHOW_STMT,
 	CSVTMT_ND_SHOW_TABLES_STMT,
+	CSVTMT_ND_COPY_STMT,
+	CSVTMT_ND_ANALYZE_STMT,
 	CSVTMT_ND_FUNCTION,
 	CSVTMT_ND_VALUES,
 	CSVTMT_ND_EXPR,
@@ -173,6 +218,11 @@ typedef enum {
 	CSVTMT_OP_STRING_VALUE,
 	CSVTMT_OP_COLUMN_DEF,
 	CSVTMT_OP_PLACE_HOLDER,
+	CSVTMT_OP_COPY_FROM,
+	CSVTMT_OP_COPY_TO,
+	CSVTMT_OP_COPY_TO_BEG,
+	CSVTMT_OP_COPY_TO_END,
+	CSVTMT_OP_ANALYZE,
 } CsvTomatoOpcodeKind;
 
 /*********
@@ -185,6 +235,10 @@ typedef enum {
 #define csvtmt_move(o) o
 #define csvtmt_numof(ary) (sizeof ary / sizeof ary[0])
 
+// 配列ptrの容量capaをneed個以上に伸ばす。成功: true, 失敗: false
+#define csvtmt_reserve(ptr, capa, need)\
+	csvtmt_grow((void **) &(ptr), &(capa), (need), sizeof(*(ptr)))
+
 /********
 * types *
 ********/
@@ -243,6 +297,27 @@ typedef struct CsvTomatoColumnTypeDef CsvTomatoColumnTypeDef;
 struct CsvTomatoHeader;
 typedef struct CsvTomatoHeader CsvTomatoHeader;
 
+struct CsvTomatoSchema;
+typedef struct CsvTomatoSchema CsvTomatoSchema;
+
+struct CsvTomatoCatalog;
+typedef struct CsvTomatoCatalog CsvTomatoCatalog;
+
+struct CsvTomatoTableLock;
+typedef struct CsvTomatoTableLock CsvTomatoTableLock;
+
+struct CsvTomatoLockManager;
+typedef struct CsvTomatoLockManager CsvTomatoLockManager;
+
+// ロックを待つかを決める。countは何回目の待ちか。0を返すと諦めてCSVTMT_ERR_BUSYにする。
+typedef int (*CsvTomatoBusyHandler)(void *arg, int count);
+
+struct CsvTomatoColumnStats;
+typedef struct CsvTomatoColumnStats CsvTomatoColumnStats;
+
+struct CsvTomatoTableStats;
+typedef struct CsvTomatoTableStats CsvTomatoTableStats;
+
 struct CsvTomatoValue;
 typedef struct CsvTomatoValue CsvTomatoValue;
 
@@ -267,6 +342,54 @@ typedef struct CsvTomatoColumnInfoArray CsvTomatoColumnInfoArray;
 struct CsvTomatoRowArray;
 typedef struct CsvTomatoRowArray CsvTomatoRowArray;
 
+struct CsvTomatoFieldSpan;
+typedef struct CsvTomatoFieldSpan CsvTomatoFieldSpan;
+
+struct CsvTomatoFieldSpans;
+typedef struct CsvTomatoFieldSpans CsvTomatoFieldSpans;
+
+struct CsvTomatoWriter;
+typedef struct CsvTomatoWriter CsvTomatoWriter;
+
+struct CsvTomatoCopyOpts;
+typedef struct CsvTomatoCopyOpts CsvTomatoCopyOpts;
+
+struct CsvTomatoBatch;
+typedef struct CsvTomatoBatch CsvTomatoBatch;
+
+struct CsvTomatoColumnCache;
+typedef struct CsvTomatoColumnCache CsvTomatoColumnCache;
+
+struct CsvTomatoPredicate;
+typedef struct CsvTomatoPredicate CsvTomatoPredicate;
+
+struct CsvTomatoStmtCacheEntry;
+typedef struct CsvTomatoStmtCacheEntry CsvTomatoStmtCacheEntry;
+
+struct CsvTomatoRing;
+typedef struct CsvTomatoRing CsvTomatoRing;
+
+struct CsvTomatoColumnarMap;
+typedef struct CsvTomatoColumnarMap CsvTomatoColumnarMap;
+
+struct CsvTomatoColumnarColumn;
+typedef struct CsvTomatoColumnarColumn CsvTomatoColumnarColumn;
+
+struct CsvTomatoCompactOpts;
+typedef struct CsvTomatoCompactOpts CsvTomatoCompactOpts;
+
+struct CsvTomatoCompactTable;
+typedef struct CsvTomatoCompactTable CsvTomatoCompactTable;
+
+struct CsvTomatoCompactor;
+typedef struct CsvTomatoCompactor CsvTomatoCompactor;
+
+struct CsvTomatoArenaChunk;
+typedef struct CsvTomatoArenaChunk CsvTomatoArenaChunk;
+
+struct CsvTomatoArena;
+typedef struct CsvTomatoArena CsvTomatoArena;
+
 /************
 * templates *
 ************/
@@ -276,6 +399,7 @@ DECL_STRING(CsvTomatoString, csvtmt_str, char)
 
 #include "src/arraytmpl.h"
 DECL_ARRAY(CsvTomatoRows, csvtmt_rows, CsvTomatoRow)
+DECL_ARRAY(CsvTomatoOffsets, csvtmt_offsets, size_t)
 
 /**********
 * structs *
@@ -298,6 +422,19 @@ struct CsvTomatoDir {
 #endif
 };
 
+struct CsvTomatoArenaChunk {
+	struct CsvTomatoArenaChunk *next;
+	size_t len;
+	size_t capa;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+// 文のコンパイル中に作るトークン、AST、名前の文字列をまとめて持つ。
+// 個別には解放せず、文と一緒に一度に解放する。
+struct CsvTomatoArena {
+	CsvTomatoArenaChunk *head;
+};
+
 struct CsvTomatoErrorElem {
 	CsvTomatoErrorKind kind;
 	char message[CSVTMT_ERR_MSG_SIZE];
@@ -311,7 +448,7 @@ struct CsvTomatoError {
 
 struct CsvTomatoToken {
 	CsvTomatoTokenKind kind;
-	char text[CSVTMT_STR_SIZE];
+	const char *text; // クエリ文字列の中を指す。NUL終端しない
 	size_t len;
 	int64_t int_value;
 	double double_value;
@@ -319,6 +456,7 @@ struct CsvTomatoToken {
 };
 
 struct CsvTomatoTokenizer {
+	CsvTomatoArena *arena;
 	CsvTomatoToken *root_token;
 	size_t index;
 	size_t len;
@@ -344,6 +482,8 @@ struct CsvTomatoNode {
 			struct CsvTomatoNode *update_stmt;
 			struct CsvTomatoNode *delete_stmt;
 			struct CsvTomatoNode *show_stmt;
+			struct CsvTomatoNode *copy_stmt;
+			struct CsvTomatoNode *analyze_stmt;
 		} sql_stmt;
 		struct {
 			struct CsvTomatoNode *show_tables_stmt;
@@ -351,6 +491,17 @@ struct CsvTomatoNode {
 		struct {
 			char *db_name;
 		} show_tables_stmt;
+		struct {
+			char *table_name;
+			struct CsvTomatoNode *select_stmt;
+			char *path;
+			bool to;
+			bool header;
+			char delimiter;
+		} copy_stmt;
+		struct {
+			char *table_name; // NULLなら全てのテーブル
+		} analyze_stmt;
 		struct {
 			char *table_name;
 			struct CsvTomatoNode *column_def_list;
@@ -424,6 +575,7 @@ struct CsvTomatoNode {
 };
 
 struct CsvTomatoParser {
+	CsvTomatoArena *arena;
 	CsvTomatoNode *root_node;
 };
 
@@ -431,6 +583,7 @@ struct CsvTomatoOpcode {
 	CsvTomatoOpcodeElem *elems;
 	size_t capa;
 	size_t len;
+	CsvTomatoOffsets *place_holders; // ?の番号-1 -> elemsの位置
 };
 
 struct CsvTomatoOpcodeElem {
@@ -457,6 +610,15 @@ struct CsvTomatoOpcodeElem {
 		struct {
 			char *db_name;
 		} show_tables_stmt;
+		struct {
+			char *table_name;
+			char *path;
+			bool header;
+			char delimiter;
+		} copy_stmt;
+		struct {
+			char *table_name;
+		} analyze_stmt;
 		struct {
 			char *value;
 		} ident;
@@ -539,9 +701,11 @@ struct CsvTomatoStackElem {
 		} bool_value;
 		struct {
 			const char *value;
+			int index; // ヘッダ上のカラムの位置。-1なら未解決
 		} ident;
 		struct {
 			const char *key;
+			int index;
 			CsvTomatoValue value;
 		} key_value;
 	} obj;
@@ -549,6 +713,7 @@ struct CsvTomatoStackElem {
 
 struct CsvTomatoKeyValue {
 	const char *key;
+	int index; // ヘッダ上のカラムの位置。-1なら未解決
 	CsvTomatoValue value;
 };
 
@@ -557,8 +722,9 @@ struct CsvTomatoExecutor {
 };
 
 struct CsvTomatoRow {
-	char *columns[CSVTMT_CSV_COLS_SIZE];
+	char **columns;
 	size_t len;
+	size_t capa;
 };
 
 struct CsvTomatoRowArray {
@@ -566,9 +732,141 @@ struct CsvTomatoRowArray {
 	size_t len;
 };
 
+// CSV行内の1フィールドの生のバイト範囲（クォートを含む）。
+struct CsvTomatoFieldSpan {
+	const char *beg;
+	const char *end;
+};
+
+// 1行分のフィールドの範囲。走査するたびに使い回す。
+struct CsvTomatoFieldSpans {
+	CsvTomatoFieldSpan *array;
+	size_t len;
+	size_t capa;
+};
+
+struct CsvTomatoWriter {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t capa;
+	off_t offset; // 次に書く位置
+	// io_uringで書く時はbufを投げている間にspareへ書き溜める
+	CsvTomatoRing *ring;
+	char *spare;
+	bool pending; // 投げた書き込みの完了をまだ受け取っていない
+	size_t pending_len;
+};
+
+/**
+ * io_uringのリング。liburingを使わずにシステムコールで扱う。
+ * 先読みに使う時はdepth個のCSVTMT_IO_CHUNK_SIZEのバッファを登録する。
+ */
+struct CsvTomatoRing {
+	int fd;
+	unsigned depth;
+	unsigned to_submit; // キューに積んでまだ投げていない数
+	unsigned inflight; // 投げて完了をまだ受け取っていない数
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	void *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_entries;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes;
+	char *bufs;
+	bool fixed; // bufsを登録できた
+};
+
+// 列ストアのカラムの持ち方
+typedef enum {
+	CSVTMT_COLUMNAR_MODE, // __MODE__。uint8_tで1なら論理削除
+	CSVTMT_COLUMNAR_INT, // int64_t
+	CSVTMT_COLUMNAR_TEXT, // 値を'\0'で区切って並べたものと、各値の終わりの位置（uint64_t）
+} CsvTomatoColumnarKind;
+
+// 列ストアの1ファイルを読み込み専用でmmapしたもの。lenが0ならptrはNULL。
+struct CsvTomatoColumnarMap {
+	void *ptr;
+	size_t len;
+};
+
+struct CsvTomatoColumnarColumn {
+	CsvTomatoColumnarKind kind;
+	CsvTomatoColumnarMap data;
+	CsvTomatoColumnarMap ends; // TEXTだけ
+};
+
+// COPYのオプション。delimiterが0なら','を使う。
+struct CsvTomatoCopyOpts {
+	bool header;
+	char delimiter;
+};
+
+// csvtmt_step_batch()で型付きの列も埋める時にflagsに立てる
+typedef enum {
+	CSVTMT_BATCH_INT64 = 1 << 0,
+	CSVTMT_BATCH_DOUBLE = 1 << 1,
+} CsvTomatoBatchFlag;
+
+/**
+ * csvtmt_step_batch()が埋める列指向の結果。{0}で初期化し、flagsだけ呼び出し側がセットする。
+ *
+ * 各配列は列ごとにstride個ずつ並ぶ。row行目のcol列は [col * stride + row]。
+ * 値はdataに'\0'終端で詰めてあり、offsetsがその位置、lengthsが長さ。
+ * intsとdoublesはflagsで頼んだ時だけ埋まる。次の呼び出しで上書きされる。
+ */
+struct CsvTomatoBatch {
+	unsigned flags; // CsvTomatoBatchFlagの組み合わせ
+	size_t rows_len;
+	size_t columns_len;
+	size_t stride;
+	char *data;
+	size_t data_len;
+	size_t data_capa;
+	size_t *offsets;
+	size_t *lengths;
+	int64_t *ints;
+	double *doubles;
+	size_t cells_capa;
+};
+
+// csvtmt_column_*()が今の行で変換した値。serialがモデルのrow_serialと違えば古い。
+typedef enum {
+	CSVTMT_COLUMN_CACHE_INT64 = 1 << 0,
+	CSVTMT_COLUMN_CACHE_DOUBLE = 1 << 1,
+	CSVTMT_COLUMN_CACHE_BYTES = 1 << 2,
+} CsvTomatoColumnCacheFlag;
+
+struct CsvTomatoColumnCache {
+	uint64_t serial;
+	unsigned flags; // CsvTomatoColumnCacheFlagの組み合わせ
+	int64_t int64_value;
+	double double_value;
+	size_t bytes;
+};
+
+// 「カラム = リテラル」だけのWHEREをコンパイルしたもの。
+// 行を解釈せずに生のフィールドと比較できる。allならWHEREが無い。
+struct CsvTomatoPredicate {
+	bool all;
+	size_t column_index;
+	const char *value;
+	char num[CSVTMT_NUM_STR_SIZE];
+};
+
 struct CsvTomatoValues {
-	CsvTomatoValue values[CSVTMT_VALUES_ARRAY_SIZE];
+	CsvTomatoValue *values;
 	size_t len;
+	size_t capa;
 };
 
 struct CsvTomatoColumnTypeDef {
@@ -581,17 +879,108 @@ struct CsvTomatoColumnTypeDef {
 };
 
 struct CsvTomatoColumnType {
-	char type_name[CSVTMT_TYPE_NAME_SIZE];
-	char type_def[CSVTMT_TYPE_DEF_SIZE];
+	char *type_name;
+	char *type_def;
 	CsvTomatoColumnTypeDef type_def_info;
 	size_t index;
 };
 
+// 解析済みのヘッダ。スキーマに載せた後は書き換えず、読み直す時は作り直して差し替える。
+// 文は参照を持ってから読むので、差し替えた後も最後の文が離すまで残る。
 struct CsvTomatoHeader {
-	CsvTomatoColumnType types[CSVTMT_TYPES_ARRAY_SIZE];
+	CsvTomatoColumnType *types;
 	size_t types_len;
+	size_t types_capa;
+	uint64_t version; // 解析し直すたびに進む
+	atomic_size_t refs; // csvtmt_header_new()で作ったものだけが使う
+};
+
+// カラムの統計。min/maxは書き込みで広げるだけなので範囲の外側を表す。
+// distinctは値のハッシュの小さい方からK個（KMV）を覚えておいて見積もる。
+struct CsvTomatoColumnStats {
+	char *name;
+	char *min; // NULLなら値がまだ無い
+	char *max;
+	uint64_t kmv[CSVTMT_STATS_KMV_SIZE]; // 昇順
+	size_t kmv_len;
 };
 
+// テーブルの統計。<db>/stats/<table>.csvに保存する。
+// 書き込みのたびにメモリ上で更新し、csvtmt_close()とANALYZEでファイルに書き出す。
+struct CsvTomatoTableStats {
+	bool loaded; // ファイルを読みに行ったか
+	bool valid; // falseなら統計が無いか表と合わない。ANALYZEで作り直す
+	bool dirty;
+	uint64_t live; // 論理削除されていない行数
+	uint64_t dead; // 論理削除された行数
+	uint64_t bytes; // 表のファイルサイズ
+	CsvTomatoColumnStats *columns; // ヘッダと同じ並び（__MODE__を含む）
+	size_t columns_len;
+	size_t columns_capa;
+};
+
+// 解析済みのヘッダと、それを読んだファイルの情報。
+// 同じファイル（dev, ino, mtime）か同じヘッダ行なら解析し直さない。
+struct CsvTomatoSchema {
+	char *table_path; // カタログのスキーマだけが持つ
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char *line; // ヘッダ行の生のバイト列
+	size_t line_len;
+	CsvTomatoHeader *header; // 今のヘッダ。NULLならまだ読んでいない
+	CsvTomatoTableStats stats; // カタログのスキーマだけが使う
+};
+
+// データベース単位のスキーマのカタログ。文をまたいでテーブルのヘッダを使い回す。
+struct CsvTomatoCatalog {
+	CsvTomatoSchema **schemas; // 文が指しているのでアドレスは変えない
+	size_t len;
+	size_t capa;
+	uint64_t clock; // versionの元。テーブルをまたいで重ならない
+	bool threadsafe; // trueならrwlockで守る
+	pthread_rwlock_t rwlock;
+};
+
+/**
+ * テーブルごとのアドバイザリロック。<db>/lock/<table>.lockにfcntlのOFDロックを掛ける。
+ * テーブルのファイルはUPDATEでrenameされるので、ロックは別のファイルに置く。
+ *
+ * 同じデータベースの文どうしは1つのfdを共有し、参照を数える。
+ * fdに掛けているロックはmodeで、EXCLUSIVEの参照が無くなるとSHAREDに戻す。
+ */
+struct CsvTomatoTableLock {
+	char *table_name;
+	int fd;
+	bool writable; // falseならfdは読み込み専用で、共有ロックしか取れない
+	CsvTomatoLockMode mode;
+	size_t shared_refs;
+	size_t exclusive_refs;
+	bool compacting; // 同じデータベースで詰め直している。マネージャのmutexで守る
+};
+
+struct CsvTomatoLockManager {
+	CsvTomatoTableLock **locks; // 文が指しているのでアドレスは変えない
+	size_t len;
+	size_t capa;
+	int busy_timeout; // ミリ秒。0なら待たない
+	CsvTomatoBusyHandler busy_handler; // あればbusy_timeoutより優先する
+	void *busy_arg;
+	// trueなら参照の数をmutexで守り、同じデータベースの文どうしも排他する
+	bool threadsafe;
+	pthread_mutex_t mutex;
+};
+
+// 書き込みの永続化レベル。
+// NONE: OSに任せる（デフォルト）。
+// NORMAL: 文の終わりにデータをfdatasync()する。
+// FULL: fsync()に加えてrenameやファイル作成をしたディレクトリもfsync()する。
+typedef enum {
+	CSVTMT_SYNC_NONE,
+	CSVTMT_SYNC_NORMAL,
+	CSVTMT_SYNC_FULL,
+} CsvTomatoSyncLevel;
+
 typedef enum {
 	CSVTMT_MODE_FIRST,
 	CSVTMT_MODE_WHERE,
@@ -603,40 +992,172 @@ struct CsvTomatoModel {
 	bool skip;
 	size_t opcodes_index;
 	size_t save_opcodes_index;
-	CsvTomatoStackElem stack[CSVTMT_EXEC_STACK_SIZE];
+	CsvTomatoStackElem *stack;
 	size_t stack_len;
+	size_t stack_capa;
 	const char *table_name;
 	const char *db_name;
 	char table_path[CSVTMT_PATH_SIZE];
 	bool do_create_table;
-	const char *column_names[CSVTMT_COLUMN_NAMES_ARRAY_SIZE];
+	const char **column_names;
 	size_t column_names_len;
+	size_t column_names_capa;
 	bool column_names_is_star;
-	CsvTomatoValues values[CSVTMT_VALUES_ARRAY_SIZE];
+	CsvTomatoValues *values;
 	size_t values_len;
-	CsvTomatoHeader header;
-	CsvTomatoKeyValue update_set_key_values[CSVTMT_ASSIGNS_ARRAY_SIZE];
+	size_t values_capa;
+	CsvTomatoCatalog *catalog; // NULLなら文ごとのown_schemaを使う
+	CsvTomatoSchema own_schema;
+	CsvTomatoSchema *schema; // 今のテーブルのスキーマ。own_schemaかカタログの要素
+	CsvTomatoHeader *header; // 文が読んでいるヘッダ。schema->headerの参照を持つ
+	CsvTomatoLockManager *locks; // NULLならロックしない
+	CsvTomatoTableLock *lock; // 文が持っているロック
+	CsvTomatoLockMode lock_mode;
+	CsvTomatoIoBackend io_backend;
+	CsvTomatoKeyValue *update_set_key_values;
 	size_t update_set_key_values_len;
+	size_t update_set_key_values_capa;
 	CsvTomatoRow row;
 	CsvTomatoRows *rows;
-	const char *selected_columns[CSVTMT_COLUMN_NAMES_ARRAY_SIZE];
+	const char **selected_columns;
 	size_t selected_columns_len;
+	size_t selected_columns_capa;
+	uint64_t row_serial; // selected_columnsを詰め直すたびに増える
+	CsvTomatoColumnCache *column_cache;
+	size_t column_cache_capa;
+	// テーブルの[base, base + len)だけをmmapした窓。走査が進むと窓をずらす
 	struct {
-		char *ptr;
+		char *ptr; // 窓の先頭。ファイルのbaseの位置
 		char *cur;
 		int fd;
-		size_t size;
+		int prot;
+		size_t base;
+		size_t len;
+		size_t window; // 窓の大きさ。長い行を読む時だけ広げる
+		size_t size; // 開いた時のファイルの大きさ。ここから先は読まない
+		bool dirty;
+		struct stat st;
 	} mmap;
+	// SELECTが開いた時点のテーブルの見え方。長さはmmap.sizeで固定し、
+	// 論理削除ログのtomb_len件目より後の論理削除は無かったことにする。
+	struct {
+		bool active; // スナップショットを取った
+		int fd; // 論理削除ログ。0なら開いていない（取った時にログが無かった）
+		size_t tomb_len;
+		CsvTomatoOffsets *later; // 開いた後に論理削除された行の先頭。昇順
+	} snapshot;
+	// io_uringでの先読み。ringがNULLなら先読みしない
+	struct {
+		CsvTomatoRing *ring;
+		size_t issued; // ここまで先読みを投げた
+		uint32_t free_bufs; // 空いているバッファのビット
+	} readahead;
+	// csvtmt_step_async()の状態。ringの読み込みが終わるとfdに知らせる
+	struct {
+		bool enabled; // 今の実行はページフォールトで待ちそうなら止まる
+		bool unavailable; // io_uringが使えないので止まらない
+		CsvTomatoRing *ring;
+		int fd; // eventfd。0なら作っていない
+		size_t ready; // ここまではページキャッシュに載っているのを確かめた
+		size_t issued; // ここまで読み込みを投げた
+	} async;
+	// 大きな走査で読み終えたページをページキャッシュから落とす
+	struct {
+		bool enabled;
+		size_t dropped; // ここまで捨てた
+	} behind;
+	// 列ストア（<db>/<table>.col/）。activeならSELECTはCSVを解析せずにここから行を作る
+	struct {
+		bool enabled; // csvtmt_set_columnar()で使うようにした
+		bool active;
+		size_t rows;
+		size_t row; // 次に返す行
+		CsvTomatoColumnarMap head; // 行の先頭のCSV上の位置
+		CsvTomatoColumnarColumn *columns;
+		size_t columns_len;
+		size_t columns_capa;
+	} columnar;
+	CsvTomatoOffsets *tombstones; // 文の終わりに論理削除する行の先頭
+	// op-codeの位置 -> IDENTのヘッダ上の位置。schema->versionごとに1回解決する。
+	int *column_indexes;
+	size_t column_indexes_capa;
+	uint64_t column_indexes_version;
+	// SELECTするカラム -> ヘッダ上の位置
+	size_t *selected_indexes;
+	size_t selected_indexes_capa;
+	uint64_t selected_indexes_version;
 	FILE *fp;
 	char *row_head;
 	CsvTomatoMode mode;
+	CsvTomatoSyncLevel sync_level;
+	size_t changes; // 直前の文で変更した行数
+	struct {
+		CsvTomatoWriter *writer;
+		char tmp_path[CSVTMT_PATH_SIZE + 32];
+		const char *path;
+		int sep;
+		bool header;
+		bool wrote_header;
+		size_t opcodes_beg;
+	} copy;
+};
+
+// csvtmt_exec()でコンパイルした文のキャッシュ。
+struct CsvTomatoStmtCacheEntry {
+	char *query; // 正規化したクエリ
+	CsvTomatoStmt *stmt;
+	uint64_t last_used;
+	bool busy; // 他のスレッドが実行している
+};
+
+// csvtmt_compactor_start()のオプション。0のフィールドはデフォルトを使う。
+struct CsvTomatoCompactOpts {
+	int interval_ms; // 表を見て回る間隔。デフォルトは1000
+	double dead_ratio; // 論理削除された行の割合がこれ以上なら詰める。デフォルトは0.2
+	uint64_t min_dead_rows; // 論理削除された行がこれより少なければ詰めない。デフォルトは1000
+	double growth_ratio; // 前に詰めた時からファイルがこの割合だけ伸びたら詰め直す。デフォルトは1.0、負なら見ない
+	uint64_t bytes_per_sec; // 詰める時に読み書きするバイト数の上限。0なら絞らない
+};
+
+// 前に詰めた（初めて見た）時の表のファイルサイズ
+struct CsvTomatoCompactTable {
+	char *table_name;
+	uint64_t bytes;
+};
+
+// 表を見て回り、論理削除された行が増えたり伸びたりした表を詰め直すワーカースレッド。
+struct CsvTomatoCompactor {
+	CsvTomato *db;
+	CsvTomatoCompactOpts opts;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool stop; // mutexで守る
+	uint64_t compactions; // 詰め直した回数。mutexで守る
+	CsvTomatoCompactTable *tables; // ワーカーだけが触る
+	size_t tables_len;
+	size_t tables_capa;
 };
 
 struct CsvTomato {
 	char db_dir[CSVTMT_PATH_SIZE];
+	CsvTomatoSyncLevel sync_level;
+	size_t changes;
+	CsvTomatoStmtCacheEntry stmt_cache[CSVTMT_STMT_CACHE_SIZE];
+	size_t stmt_cache_len;
+	uint64_t stmt_cache_clock;
+	CsvTomatoCatalog catalog;
+	CsvTomatoLockManager locks;
+	bool threadsafe;
+	pthread_mutex_t stmt_cache_mutex;
+	CsvTomatoCompactor *compactor; // csvtmt_compactor_start()で動かす
+	CsvTomatoIoBackend io_backend;
+	size_t mmap_window;
+	bool columnar; // SELECTが列ストアを作って使う
 };
 
 struct CsvTomatoStmt {
+	CsvTomatoArena *arena;
 	CsvTomatoTokenizer *tokenizer;
 	CsvTomatoParser *parser;
 	CsvTomatoExecutor *executor;
@@ -644,6 +1165,7 @@ struct CsvTomatoStmt {
 	CsvTomatoToken *token;
 	CsvTomatoNode *node;
 	CsvTomatoModel model;
+	bool batch_done; // csvtmt_step_batch()が最後の行まで返した。csvtmt_reset()で戻る
 };
 
 /*************
@@ -669,6 +1191,245 @@ csvtmt_error_show(const CsvTomatoError *self);
 const char *
 csvtmt_error_msg(const CsvTomatoError *self);
 
+// arena.c
+
+CsvTomatoArena *
+csvtmt_arena_new(CsvTomatoError *error);
+
+void
+csvtmt_arena_del(CsvTomatoArena *self);
+
+void *
+csvtmt_arena_alloc(CsvTomatoArena *self, size_t size, CsvTomatoError *error);
+
+char *
+csvtmt_arena_strndup(CsvTomatoArena *self, const char *s, size_t len, CsvTomatoError *error);
+
+// catalog.c
+
+void
+csvtmt_schema_final(CsvTomatoSchema *self);
+
+void
+csvtmt_catalog_init(CsvTomatoCatalog *self, bool threadsafe);
+
+void
+csvtmt_catalog_final(CsvTomatoCatalog *self);
+
+void
+csvtmt_catalog_read_lock(CsvTomatoCatalog *self);
+
+void
+csvtmt_catalog_write_lock(CsvTomatoCatalog *self);
+
+void
+csvtmt_catalog_unlock(CsvTomatoCatalog *self);
+
+CsvTomatoSchema *
+csvtmt_catalog_find(CsvTomatoCatalog *self, const char *table_path, CsvTomatoError *error);
+
+void
+csvtmt_catalog_flush(CsvTomatoCatalog *self, CsvTomatoSyncLevel level, CsvTomatoError *error);
+
+// io.c
+
+CsvTomatoRing *
+csvtmt_ring_new(unsigned depth, bool bufs);
+
+void
+csvtmt_ring_del(CsvTomatoRing *self);
+
+bool
+csvtmt_ring_read(CsvTomatoRing *self, int fd, unsigned buf_index, off_t offset, size_t len);
+
+bool
+csvtmt_ring_write(CsvTomatoRing *self, int fd, const void *buf, size_t len, off_t offset, uint64_t user_data);
+
+bool
+csvtmt_ring_fsync(CsvTomatoRing *self, int fd, CsvTomatoSyncLevel level, uint64_t user_data);
+
+int
+csvtmt_ring_submit(CsvTomatoRing *self, unsigned wait_nr);
+
+bool
+csvtmt_ring_reap(CsvTomatoRing *self, uint64_t *user_data, int *res, bool wait);
+
+bool
+csvtmt_ring_notify(CsvTomatoRing *self, int efd);
+
+bool
+csvtmt_io_backend_available(CsvTomatoIoBackend backend);
+
+void
+csvtmt_scan_advise(CsvTomatoModel *model);
+
+bool
+csvtmt_scan_too_large(size_t size);
+
+void
+csvtmt_readahead_start(CsvTomatoModel *model);
+
+void
+csvtmt_readahead(CsvTomatoModel *model, const char *pos);
+
+void
+csvtmt_readahead_stop(CsvTomatoModel *model);
+
+bool
+csvtmt_async_ready(CsvTomatoModel *model, CsvTomatoError *error);
+
+void
+csvtmt_async_rewind(CsvTomatoModel *model);
+
+void
+csvtmt_async_final(CsvTomatoModel *model);
+
+// lock.c
+
+void
+csvtmt_lock_manager_init(CsvTomatoLockManager *self, bool threadsafe);
+
+void
+csvtmt_lock_manager_final(CsvTomatoLockManager *self);
+
+CsvTomatoTableLock *
+csvtmt_lock_acquire(
+	CsvTomatoLockManager *self,
+	const char *db_dir,
+	const char *table_name,
+	CsvTomatoLockMode mode,
+	CsvTomatoError *error
+);
+
+void
+csvtmt_lock_release(CsvTomatoLockManager *self, CsvTomatoTableLock *lock, CsvTomatoLockMode mode);
+
+CsvTomatoTableLock *
+csvtmt_lock_begin_compaction(
+	CsvTomatoLockManager *self,
+	const char *db_dir,
+	const char *table_name,
+	CsvTomatoError *error
+);
+
+void
+csvtmt_lock_end_compaction(CsvTomatoLockManager *self, CsvTomatoTableLock *lock);
+
+bool
+csvtmt_model_lock(CsvTomatoModel *model, CsvTomatoLockMode mode, CsvTomatoError *error);
+
+void
+csvtmt_model_unlock(CsvTomatoModel *model);
+
+// snapshot.c
+
+void
+csvtmt_tomb_log_append(CsvTomatoModel *model, const CsvTomatoOffsets *offsets, CsvTomatoError *error);
+
+void
+csvtmt_tomb_log_remove(CsvTomatoModel *model, ino_t ino);
+
+void
+csvtmt_snapshot_open(CsvTomatoModel *model, CsvTomatoError *error);
+
+void
+csvtmt_snapshot_close(CsvTomatoModel *model);
+
+bool
+csvtmt_snapshot_is_deleted(CsvTomatoModel *model, const char *row_head);
+
+bool
+csvtmt_snapshot_is_deleted_at(CsvTomatoModel *model, size_t offset);
+
+size_t
+csvtmt_tomb_log_len(const CsvTomatoModel *model, ino_t ino);
+
+void
+csvtmt_tomb_log_read(CsvTomatoModel *model, size_t from, CsvTomatoOffsets *dst, CsvTomatoError *error);
+
+const CsvTomatoOffsets *
+csvtmt_snapshot_later(CsvTomatoModel *model, CsvTomatoError *error);
+
+// columnar.c
+
+void
+csvtmt_columnar_refresh(CsvTomatoModel *model);
+
+void
+csvtmt_columnar_open(CsvTomatoModel *model);
+
+void
+csvtmt_columnar_close(CsvTomatoModel *model);
+
+bool
+csvtmt_columnar_at_end(const CsvTomatoModel *model);
+
+size_t
+csvtmt_columnar_read_row(CsvTomatoModel *model, CsvTomatoError *error);
+
+// compact.c
+
+CsvTomatoResult
+csvtmt_compact(CsvTomato *db, const char *table_name, CsvTomatoError *error);
+
+CsvTomatoResult
+csvtmt_compactor_start(CsvTomato *db, const CsvTomatoCompactOpts *opts, CsvTomatoError *error);
+
+void
+csvtmt_compactor_stop(CsvTomato *db);
+
+uint64_t
+csvtmt_compactor_count(CsvTomato *db);
+
+// stats.c
+
+void
+csvtmt_stats_final(CsvTomatoTableStats *self);
+
+void
+csvtmt_stats_load(CsvTomatoSchema *schema);
+
+void
+csvtmt_stats_save(CsvTomatoSchema *schema, CsvTomatoSyncLevel level, CsvTomatoError *error);
+
+CsvTomatoTableStats *
+csvtmt_model_stats(CsvTomatoModel *model);
+
+void
+csvtmt_stats_reset(CsvTomatoModel *model);
+
+void
+csvtmt_stats_add_rows(CsvTomatoTableStats *self, const char *table_path, uint64_t before, int64_t live, int64_t dead);
+
+void
+csvtmt_stats_set_rows(CsvTomatoTableStats *self, const char *table_path, uint64_t live, uint64_t dead);
+
+bool
+csvtmt_stats_start(CsvTomatoTableStats *self, const CsvTomatoHeader *header);
+
+void
+csvtmt_stats_add_row(CsvTomatoTableStats *self, const CsvTomatoHeader *header, const CsvTomatoRow *row);
+
+void
+csvtmt_stats_install(CsvTomatoModel *model, CsvTomatoTableStats *stats);
+
+void
+csvtmt_stats_add_value(CsvTomatoTableStats *self, const CsvTomatoHeader *header, size_t index, const char *value);
+
+void
+csvtmt_stats_add_key_values(
+	CsvTomatoTableStats *self,
+	const CsvTomatoHeader *header,
+	const CsvTomatoKeyValue *key_values,
+	size_t key_values_len
+);
+
+uint64_t
+csvtmt_stats_distinct(const CsvTomatoTableStats *self, size_t index);
+
+CsvTomatoResult
+csvtmt_analyze(CsvTomatoModel *model, CsvTomatoError *error);
+
 // utils.c
 
 char *
@@ -677,6 +1438,12 @@ csvtmt_wrap_column(const char *col, CsvTomatoError *error);
 char *
 csvtmt_strdup(const char *s, CsvTomatoError *error);
 
+bool
+csvtmt_grow(void **array, size_t *capa, size_t need, size_t elem_size);
+
+int64_t
+csvtmt_now_ms(void);
+
 void
 csvtmt_quick_exec(const char *db_dir, const char *query);
 
@@ -700,6 +1467,9 @@ csvtmt_stmt_step(CsvTomatoStmt *self, CsvTomatoError *error);
 CsvTomato *
 csvtmt_open(const char *db_dir, CsvTomatoError *error);
 
+CsvTomato *
+csvtmt_open_v2(const char *db_dir, unsigned flags, CsvTomatoError *error);
+
 CsvTomatoResult
 csvtmt_exec(
 	CsvTomato *db,
@@ -747,40 +1517,118 @@ csvtmt_bind_double(
 	CsvTomatoError *error
 );
 
+void
+csvtmt_bind_row(
+	CsvTomatoStmt *stmt,
+	const CsvTomatoValue values[],
+	size_t values_len,
+	CsvTomatoError *error
+);
+
+size_t
+csvtmt_bind_parameter_count(CsvTomatoStmt *stmt);
+
 CsvTomatoResult
 csvtmt_step(CsvTomatoStmt *stmt, CsvTomatoError *error);
 
+CsvTomatoResult
+csvtmt_step_batch(CsvTomatoStmt *stmt, CsvTomatoBatch *batch, size_t n, CsvTomatoError *error);
+
+const char *
+csvtmt_batch_text(const CsvTomatoBatch *batch, size_t row, size_t col);
+
+void
+csvtmt_batch_final(CsvTomatoBatch *batch);
+
+void
+csvtmt_reset(CsvTomatoStmt *stmt);
+
+void
+csvtmt_clear_bindings(CsvTomatoStmt *stmt);
+
 int
 csvtmt_column_int(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error);
 
+int64_t
+csvtmt_column_int64(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error);
+
 double
 csvtmt_column_double(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error);
 
 const char *
 csvtmt_column_text(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error);
 
+const void *
+csvtmt_column_blob(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error);
+
+size_t
+csvtmt_column_bytes(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error);
+
+CsvTomatoResult
+csvtmt_step_async(CsvTomatoStmt *stmt, CsvTomatoError *error);
+
+int
+csvtmt_step_fd(CsvTomatoStmt *stmt);
+
 void
 csvtmt_finalize(CsvTomatoStmt *stmt);
 
 void
 csvtmt_close(CsvTomato *self);
 
+void
+csvtmt_set_sync_level(CsvTomato *self, CsvTomatoSyncLevel level);
+
+CsvTomatoIoBackend
+csvtmt_set_io_backend(CsvTomato *self, CsvTomatoIoBackend backend);
+
+void
+csvtmt_set_mmap_window(CsvTomato *self, size_t bytes);
+
+void
+csvtmt_set_columnar(CsvTomato *self, bool enabled);
+
+void
+csvtmt_busy_timeout(CsvTomato *self, int ms);
+
+void
+csvtmt_busy_handler(CsvTomato *self, CsvTomatoBusyHandler handler, void *arg);
+
+size_t
+csvtmt_changes(CsvTomato *self);
+
+CsvTomatoResult
+csvtmt_copy_from(
+	CsvTomato *db,
+	const char *table_name,
+	const char *path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+);
+
+CsvTomatoResult
+csvtmt_copy_to(
+	CsvTomato *db,
+	const char *table_name,
+	const char *path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+);
+
+const CsvTomatoTableStats *
+csvtmt_table_stats(CsvTomato *db, const char *table_name, CsvTomatoError *error);
+
 // tokenizer.c
 
 CsvTomatoToken *
 csvtmt_token_new(
+	CsvTomatoArena *arena,
 	CsvTomatoTokenKind kind,
 	CsvTomatoError *error
 );
 
-void
-csvtmt_token_del(CsvTomatoToken *self);
-
-void
-csvtmt_token_del_all(CsvTomatoToken *self);
-
 CsvTomatoTokenizer *
-csvtmt_tokenizer_new(CsvTomatoError *error);
+csvtmt_tokenizer_new(CsvTomatoArena *arena, CsvTomatoError *error);
 
 void
 csvtmt_tokenizer_del(CsvTomatoTokenizer *self);
@@ -795,16 +1643,10 @@ csvtmt_tokenizer_tokenize(
 // parser.c
 
 CsvTomatoNode *
-csvtmt_node_new(CsvTomatoNodeKind kind, CsvTomatoError *error);
-
-void
-csvtmt_node_del(CsvTomatoNode *self);
-
-void
-csvtmt_node_del_all(CsvTomatoNode *self);
+csvtmt_node_new(CsvTomatoArena *arena, CsvTomatoNodeKind kind, CsvTomatoError *error);
 
 CsvTomatoParser *
-csvtmt_parser_new(CsvTomatoError *error);
+csvtmt_parser_new(CsvTomatoArena *arena, CsvTomatoError *error);
 
 void
 csvtmt_parser_del(CsvTomatoParser *self);
@@ -831,6 +1673,15 @@ csvtmt_opcode_parse(
 	CsvTomatoError *error
 );
 
+void
+csvtmt_opcode_unbind_elem(CsvTomatoOpcodeElem *elem);
+
+void
+csvtmt_opcode_clear_bindings(CsvTomatoOpcode *self);
+
+CsvTomatoOpcodeElem *
+csvtmt_opcode_place_holder(CsvTomatoOpcode *self, size_t index);
+
 // executor.c
 
 CsvTomatoExecutor *
@@ -886,6 +1737,15 @@ csvtmt_file_touch(const char *path);
 int
 csvtmt_file_rename(const char *old, const char *new);
 
+int
+csvtmt_file_sync(int fd, CsvTomatoSyncLevel level);
+
+int
+csvtmt_file_sync_stream(FILE *fp, CsvTomatoSyncLevel level);
+
+int
+csvtmt_file_sync_dir(const char *path, CsvTomatoSyncLevel level);
+
 // stringlist.c 
 
 CsvTomatoStringList *
@@ -928,6 +1788,23 @@ csvtmt_row_parse_string(
 	CsvTomatoError *error
 );
 
+const char *
+csvtmt_row_parse_string_sep(
+	CsvTomatoRow *self,
+	const char *str,
+	int sep,
+	CsvTomatoError *error
+);
+
+const char *
+csvtmt_row_parse_range(
+	CsvTomatoRow *self,
+	const char *str,
+	const char *end,
+	int sep,
+	CsvTomatoError *error
+);
+
 void
 csvtmt_row_append_to_stream(
 	CsvTomatoRow *self,
@@ -939,6 +1816,59 @@ csvtmt_row_append_to_stream(
 void
 csvtmt_row_final(CsvTomatoRow *self);
 
+void
+csvtmt_row_clear(CsvTomatoRow *self);
+
+const char *
+csvtmt_row_scan_spans(
+	const char *p,
+	const char *end,
+	CsvTomatoFieldSpans *spans,
+	CsvTomatoError *error
+);
+
+void
+csvtmt_spans_final(CsvTomatoFieldSpans *self);
+
+// writer.c
+
+CsvTomatoWriter *
+csvtmt_writer_new(const char *path, int flags, CsvTomatoError *error);
+
+void
+csvtmt_writer_del(CsvTomatoWriter *self);
+
+void
+csvtmt_writer_use_backend(CsvTomatoWriter *self, CsvTomatoIoBackend backend);
+
+void
+csvtmt_writer_truncate(CsvTomatoWriter *self, off_t size);
+
+void
+csvtmt_writer_write(
+	CsvTomatoWriter *self,
+	const void *data,
+	size_t len,
+	CsvTomatoError *error
+);
+
+void
+csvtmt_writer_write_str(CsvTomatoWriter *self, const char *s, CsvTomatoError *error);
+
+void
+csvtmt_writer_flush(CsvTomatoWriter *self, CsvTomatoError *error);
+
+void
+csvtmt_writer_sync(CsvTomatoWriter *self, CsvTomatoSyncLevel level, CsvTomatoError *error);
+
+void
+csvtmt_writer_write_field(
+	CsvTomatoWriter *self,
+	const char *col,
+	int sep,
+	CsvTomatoError *error
+);
+
 // models.c
 
 const char *
@@ -963,6 +1893,9 @@ csvtmt_model_init(CsvTomatoModel *self, const char *db_dir, CsvTomatoError *erro
 void
 csvtmt_model_final(CsvTomatoModel *self);
 
+void
+csvtmt_model_reset(CsvTomatoModel *self);
+
 CsvTomatoResult
 csvtmt_select(CsvTomatoModel *model, CsvTomatoError *error);
 
@@ -973,7 +1906,7 @@ CsvTomatoResult
 csvtmt_update(CsvTomatoModel *model, CsvTomatoError *error);
 
 CsvTomatoResult
-csvtmt_delete(CsvTomatoModel *model, CsvTomatoError *error);
+csvtmt_delete(CsvTomatoModel *model, const CsvTomatoPredicate *pred, CsvTomatoError *error);
 
 CsvTomatoResult
 csvtmt_show_tables(CsvTomatoModel *model, CsvTomatoError *error);
@@ -981,12 +1914,30 @@ csvtmt_show_tables(CsvTomatoModel *model, CsvTomatoError *error);
 void
 csvtmt_header_read_from_table(CsvTomatoHeader *self, const char *table_path, CsvTomatoError *error);
 
+void
+csvtmt_header_final(CsvTomatoHeader *self);
+
+CsvTomatoHeader *
+csvtmt_header_new(void);
+
+CsvTomatoHeader *
+csvtmt_header_ref(CsvTomatoHeader *self);
+
+void
+csvtmt_header_unref(CsvTomatoHeader *self);
+
 void
 csvtmt_header_read_from_stream(CsvTomatoHeader *self, FILE *fp, CsvTomatoError *error);
 
 const char *
 csvtmt_header_read_from_string(CsvTomatoHeader *self, const char *p, CsvTomatoError *error);
 
+const char *
+csvtmt_header_load_from_mmap(CsvTomatoModel *model, CsvTomatoError *error);
+
+void
+csvtmt_header_load_from_table(CsvTomatoModel *model, CsvTomatoError *error);
+
 void
 csvtmt_open_mmap_for_read(
 	CsvTomatoModel *model,
@@ -1013,20 +1964,45 @@ csvtmt_open_mmap_for_read_write(
 void
 csvtmt_close_mmap(CsvTomatoModel *model);
 
+size_t
+csvtmt_mmap_offset(const CsvTomatoModel *model, const char *p);
+
+const char *
+csvtmt_mmap_end(const CsvTomatoModel *model);
+
+char *
+csvtmt_mmap_seek(CsvTomatoModel *model, size_t offset, size_t need, CsvTomatoError *error);
+
+bool
+csvtmt_mmap_at_end(CsvTomatoModel *model, CsvTomatoError *error);
+
+const char *
+csvtmt_mmap_scan_row(CsvTomatoModel *model, const char **pos, CsvTomatoFieldSpans *spans, CsvTomatoError *error);
+
+const char *
+csvtmt_mmap_parse_row(CsvTomatoModel *model, const char **pos, CsvTomatoRow *row, CsvTomatoError *error);
+
+void
+csvtmt_sync_mmap(CsvTomatoModel *model, CsvTomatoError *error);
+
 void
 csvtmt_parse_row_from_mmap(CsvTomatoModel *model, CsvTomatoError *error);
 
 int
 csvtmt_find_type_index(CsvTomatoModel *model, const char *type_name);
 
-void
+bool
 csvtmt_delete_row_head(CsvTomatoModel *model);
 
+void
+csvtmt_flush_tombstones(CsvTomatoModel *model, CsvTomatoError *error);
+
 void
 csvtmt_append_rows_to_table(
 	const char *table_path,
 	CsvTomatoRows *rows,
 	bool wrap,
+	CsvTomatoSyncLevel sync_level,
 	CsvTomatoError *error
 );
 
@@ -1053,6 +2029,22 @@ csvtmt_replace_row(
 int
 csvtmt_update_all(CsvTomatoModel *model, CsvTomatoError *error);
 
+CsvTomatoResult
+csvtmt_copy_from_file(
+	CsvTomatoModel *model,
+	const char *src_path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+);
+
+CsvTomatoResult
+csvtmt_copy_table_to_file(
+	CsvTomatoModel *model,
+	const char *dst_path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+);
+
 bool
 csvtmt_is_deleted_row(const CsvTomatoRow *row);
 
@@ -0,0 +1,96 @@
+#include <csvtomato.h>
+
+// ポインタを突き合わせるだけの確保なので、整列はmax_align_tに合わせる。
+#define ALIGN _Alignof(max_align_t)
+#define align_up(n) (((n) + ALIGN - 1) & ~(ALIGN - 1))
+
+static CsvTomatoArenaChunk *
+chunk_new(size_t capa, CsvTomatoError *error) {
+	errno = 0;
+	CsvTomatoArenaChunk *self = malloc(sizeof(*self) + capa);
+	if (!self) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate arena chunk: %s", strerror(errno));
+		return NULL;
+	}
+
+	self->next = NULL;
+	self->len = 0;
+	self->capa = capa;
+
+	return self;
+}
+
+CsvTomatoArena *
+csvtmt_arena_new(CsvTomatoError *error) {
+	errno = 0;
+	CsvTomatoArena *self = calloc(1, sizeof(*self));
+	if (!self) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
+		return NULL;
+	}
+
+	return self;
+}
+
+void
+csvtmt_arena_del(CsvTomatoArena *self) {
+	if (!self) {
+		return;
+	}
+
+	for (CsvTomatoArenaChunk *cur = self->head; cur; ) {
+		CsvTomatoArenaChunk *rm = cur;
+		cur = cur->next;
+		free(rm);
+	}
+	free(self);
+}
+
+// 0で埋めたsizeバイトを確保する。個別に解放はできず、arenaと一緒に解放される。
+void *
+csvtmt_arena_alloc(CsvTomatoArena *self, size_t size, CsvTomatoError *error) {
+	size = align_up(size ? size : 1);
+
+	CsvTomatoArenaChunk *chunk = self->head;
+	if (!chunk || chunk->capa - chunk->len < size) {
+		if (size > CSVTMT_ARENA_CHUNK_SIZE / 4) {
+			// 大きな確保は専用のチャンクにして、今のチャンクの残りを無駄にしない
+			chunk = chunk_new(size, error);
+			if (!chunk) {
+				return NULL;
+			}
+			if (self->head) {
+				chunk->next = self->head->next;
+				self->head->next = chunk;
+			} else {
+				self->head = chunk;
+			}
+		} else {
+			chunk = chunk_new(CSVTMT_ARENA_CHUNK_SIZE, error);
+			if (!chunk) {
+				return NULL;
+			}
+			chunk->next = self->head;
+			self->head = chunk;
+		}
+	}
+
+	void *p = chunk->data + chunk->len;
+	chunk->len += size;
+	memset(p, 0, size);
+
+	return p;
+}
+
+char *
+csvtmt_arena_strndup(CsvTomatoArena *self, const char *s, size_t len, CsvTomatoError *error) {
+	char *p = csvtmt_arena_alloc(self, len + 1, error);
+	if (!p) {
+		return NULL;
+	}
+
+	memcpy(p, s, len);
+	p[len] = '\0';
+
+	return p;
+}
@@ -0,0 +1,97 @@
+#include <csvtomato.h>
+
+void
+csvtmt_schema_final(CsvTomatoSchema *self) {
+	csvtmt_header_unref(self->header);
+	free(self->table_path);
+	free(self->line);
+	csvtmt_stats_final(&self->stats);
+}
+
+void
+csvtmt_catalog_init(CsvTomatoCatalog *self, bool threadsafe) {
+	memset(self, 0, sizeof(*self));
+	self->threadsafe = threadsafe;
+	if (threadsafe) {
+		pthread_rwlock_init(&self->rwlock, NULL);
+	}
+}
+
+void
+csvtmt_catalog_final(CsvTomatoCatalog *self) {
+	for (size_t i = 0; i < self->len; i++) {
+		csvtmt_schema_final(self->schemas[i]);
+		free(self->schemas[i]);
+	}
+	free(self->schemas);
+	if (self->threadsafe) {
+		pthread_rwlock_destroy(&self->rwlock);
+	}
+	memset(self, 0, sizeof(*self));
+}
+
+// スキーマを引くだけならread、読み込んだり書き換えたりするならwriteで守る。
+// スレッドセーフでないカタログでは何もしない。
+void
+csvtmt_catalog_read_lock(CsvTomatoCatalog *self) {
+	if (self && self->threadsafe) {
+		pthread_rwlock_rdlock(&self->rwlock);
+	}
+}
+
+void
+csvtmt_catalog_write_lock(CsvTomatoCatalog *self) {
+	if (self && self->threadsafe) {
+		pthread_rwlock_wrlock(&self->rwlock);
+	}
+}
+
+void
+csvtmt_catalog_unlock(CsvTomatoCatalog *self) {
+	if (self && self->threadsafe) {
+		pthread_rwlock_unlock(&self->rwlock);
+	}
+}
+
+// 書き込みで更新した統計をファイルに書き出す。
+void
+csvtmt_catalog_flush(CsvTomatoCatalog *self, CsvTomatoSyncLevel level, CsvTomatoError *error) {
+	for (size_t i = 0; i < self->len; i++) {
+		CsvTomatoSchema *schema = self->schemas[i];
+		if (schema->stats.valid && schema->stats.dirty) {
+			csvtmt_stats_save(schema, level, error);
+		}
+	}
+}
+
+// table_pathのスキーマを返す。無ければヘッダを読んでいない空のスキーマを追加する。
+// スキーマは個別に確保するので、追加しても返したポインタは無効にならない。
+CsvTomatoSchema *
+csvtmt_catalog_find(CsvTomatoCatalog *self, const char *table_path, CsvTomatoError *error) {
+	for (size_t i = 0; i < self->len; i++) {
+		if (!strcmp(self->schemas[i]->table_path, table_path)) {
+			return self->schemas[i];
+		}
+	}
+
+	if (!csvtmt_reserve(self->schemas, self->capa, self->len + 1)) {
+		goto failed_to_alloc;
+	}
+
+	errno = 0;
+	CsvTomatoSchema *schema = calloc(1, sizeof(*schema));
+	if (!schema) {
+		goto failed_to_alloc;
+	}
+	schema->table_path = strdup(table_path);
+	if (!schema->table_path) {
+		free(schema);
+		goto failed_to_alloc;
+	}
+
+	self->schemas[self->len++] = schema;
+	return schema;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate schema: %s", strerror(errno));
+	return NULL;
+}
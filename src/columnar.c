@@ -0,0 +1,927 @@
+#include <csvtomato.h>
+
+/*
+	列ストア。
+
+	テーブルをカラムごとのバイナリの配列にして <db>/<table>.col/ に写しておき、
+	SELECTはCSVを解析せずにそこから行を作る。CSVが正本で、列ストアはいつでも作り直せる。
+
+		meta      写したテーブルの版と行数、カラムの持ち方。最後に書いてrenameで置き換える
+		head      行の先頭のCSV上の位置（uint64_t）。論理削除ログと突き合わせる
+		<i>.mode  __MODE__（uint8_t）。1なら論理削除された行
+		<i>.int   INTEGERのカラム（int64_t）
+		<i>.txt   TEXTのカラム。値を'\0'で区切って並べる
+		<i>.end   <i>.txtでの各値の終わり（uint64_t）
+
+	"%ld"で書き直すと元の文字列に戻らない値があるINTEGERのカラムはTEXTとして持つ。
+
+	テーブルは追記と論理削除でしか変わらない（snapshot.c）ので、inodeが同じなら
+	写した長さより後ろの行を追記し、論理削除ログの増えた分をmodeに写せば追いつける。
+
+	作り直しと追記は詰め直し（compact.c）と同じく、共有ロックの間にスナップショットを取り、
+	ロックを持たずに写す。排他ロックは作り直したファイルをrenameしてmetaを書く時と、
+	写している間に追記された分を足す時だけ取る。列ストアを書く文は
+	<table>.col/lockのロックで1つにし、取れなかった文はCSVを読む。
+	SELECTはmetaのinode、長さ、更新時刻と論理削除ログの件数が開いたテーブルと
+	同じ時だけ列ストアから読み、それ以外はCSVを読む。
+*/
+
+typedef struct {
+	CsvTomatoColumnarKind kind;
+	uint64_t bytes; // TEXTの<i>.txtの長さ
+} MetaColumn;
+
+typedef struct {
+	bool usable; // falseなら列に直せない行がある。inodeが変わるまで作り直さない
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t tomb; // 写した論理削除ログの件数
+	uint64_t rows;
+	MetaColumn *columns;
+	size_t columns_len;
+	size_t columns_capa;
+} Meta;
+
+// 列ストアの1ファイルへの書き込み。作り直す時はtmp_pathに書いて最後にrenameする。
+typedef struct {
+	FILE *fp;
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+	char tmp_path[CSVTMT_PATH_SIZE * 2 + 64];
+} Out;
+
+typedef struct {
+	CsvTomatoModel *model;
+	Meta *meta;
+	bool rebuild;
+	Out head;
+	Out *outs; // カラムごとに2つ。値のファイルと、TEXTなら値の終わりのファイル
+	size_t outs_len;
+} Builder;
+
+// <db>/<table>.col/<name>
+static void
+columnar_path(const CsvTomatoModel *model, const char *name, char *dst, size_t dst_size) {
+	snprintf(dst, dst_size, "%s/%s.col/%s", model->db_dir, model->table_name, name);
+}
+
+static const char *
+kind_name(CsvTomatoColumnarKind kind) {
+	switch (kind) {
+	case CSVTMT_COLUMNAR_MODE: return "mode";
+	case CSVTMT_COLUMNAR_INT: return "int";
+	case CSVTMT_COLUMNAR_TEXT: return "txt";
+	}
+	return NULL;
+}
+
+static bool
+parse_kind(const char *s, CsvTomatoColumnarKind *kind) {
+	for (int k = CSVTMT_COLUMNAR_MODE; k <= CSVTMT_COLUMNAR_TEXT; k++) {
+		if (!strcmp(s, kind_name(k))) {
+			*kind = k;
+			return true;
+		}
+	}
+	return false;
+}
+
+// index番目のカラムの値のファイル名。endならTEXTの値の終わりのファイル名。
+static void
+column_file_name(const Meta *meta, size_t index, bool end, char *dst, size_t dst_size) {
+	snprintf(dst, dst_size, "%lu.%s", (unsigned long) index, end ? "end" : kind_name(meta->columns[index].kind));
+}
+
+// index番目のカラムの値のファイルの長さ。
+static uint64_t
+column_file_len(const Meta *meta, size_t index) {
+	switch (meta->columns[index].kind) {
+	case CSVTMT_COLUMNAR_MODE: return meta->rows;
+	case CSVTMT_COLUMNAR_INT: return meta->rows * sizeof(int64_t);
+	case CSVTMT_COLUMNAR_TEXT: return meta->columns[index].bytes;
+	}
+	return 0;
+}
+
+static void
+meta_final(Meta *meta) {
+	free(meta->columns);
+	memset(meta, 0, sizeof(*meta));
+}
+
+// テーブルの今の版を覚える
+static void
+meta_stamp(Meta *meta, const struct stat *st, size_t tomb) {
+	meta->ino = st->st_ino;
+	meta->size = st->st_size;
+	meta->mtime_sec = st->st_mtim.tv_sec;
+	meta->mtime_nsec = st->st_mtim.tv_nsec;
+	meta->tomb = tomb;
+}
+
+static bool
+meta_matches(const Meta *meta, const struct stat *st, size_t tomb) {
+	return meta->ino == (uint64_t) st->st_ino &&
+		meta->size == (uint64_t) st->st_size &&
+		meta->mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+		meta->mtime_nsec == (int64_t) st->st_mtim.tv_nsec &&
+		meta->tomb == tomb;
+}
+
+/**
+ * metaを読む。無いか壊れていたらfalse。
+ *
+ * usable,<0|1>
+ * ino,<n>
+ * size,<n>
+ * mtime,<sec>,<nsec>
+ * tomb,<n>
+ * rows,<n>
+ * column,<mode|int|txt>,<bytes>
+ */
+static bool
+meta_load(const CsvTomatoModel *model, Meta *meta) {
+	CsvTomatoError error = {0};
+	CsvTomatoRow row = {0};
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+
+	meta_final(meta);
+	columnar_path(model, "meta", path, sizeof path);
+	char *src = csvtmt_file_read(path);
+	if (!src) {
+		return false;
+	}
+
+	for (const char *p = src; p && *p; ) {
+		csvtmt_row_clear(&row);
+		p = csvtmt_row_parse_string(&row, p, &error);
+		if (error.error) {
+			goto invalid;
+		}
+		if (row.len == 2 && !strcmp(row.columns[0], "usable")) {
+			meta->usable = !strcmp(row.columns[1], "1");
+		} else if (row.len == 2 && !strcmp(row.columns[0], "ino")) {
+			meta->ino = strtoull(row.columns[1], NULL, 10);
+		} else if (row.len == 2 && !strcmp(row.columns[0], "size")) {
+			meta->size = strtoull(row.columns[1], NULL, 10);
+		} else if (row.len == 3 && !strcmp(row.columns[0], "mtime")) {
+			meta->mtime_sec = strtoll(row.columns[1], NULL, 10);
+			meta->mtime_nsec = strtoll(row.columns[2], NULL, 10);
+		} else if (row.len == 2 && !strcmp(row.columns[0], "tomb")) {
+			meta->tomb = strtoull(row.columns[1], NULL, 10);
+		} else if (row.len == 2 && !strcmp(row.columns[0], "rows")) {
+			meta->rows = strtoull(row.columns[1], NULL, 10);
+		} else if (row.len == 3 && !strcmp(row.columns[0], "column")) {
+			if (!csvtmt_reserve(meta->columns, meta->columns_capa, meta->columns_len + 1)) {
+				goto invalid;
+			}
+			MetaColumn *col = &meta->columns[meta->columns_len++];
+			if (!parse_kind(row.columns[1], &col->kind)) {
+				goto invalid;
+			}
+			col->bytes = strtoull(row.columns[2], NULL, 10);
+		} else if (row.len) {
+			goto invalid;
+		}
+	}
+
+	csvtmt_row_final(&row);
+	free(src);
+	return true;
+invalid:
+	meta_final(meta);
+	csvtmt_row_final(&row);
+	free(src);
+	return false;
+}
+
+// metaを一時ファイルに書いてからrenameする。
+static void
+meta_save(const CsvTomatoModel *model, const Meta *meta, CsvTomatoError *error) {
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+	char tmp_path[CSVTMT_PATH_SIZE * 2 + 64];
+
+	columnar_path(model, "meta", path, sizeof path);
+	snprintf(tmp_path, sizeof tmp_path, "%s.%ld.tmp", path, (long) getpid());
+
+	errno = 0;
+	FILE *fp = fopen(tmp_path, "w");
+	if (!fp) {
+		goto failed_to_open;
+	}
+
+	fprintf(fp, "usable,%d\n", meta->usable);
+	fprintf(fp, "ino,%lu\n", meta->ino);
+	fprintf(fp, "size,%lu\n", meta->size);
+	fprintf(fp, "mtime,%ld,%ld\n", meta->mtime_sec, meta->mtime_nsec);
+	fprintf(fp, "tomb,%lu\n", meta->tomb);
+	fprintf(fp, "rows,%lu\n", meta->rows);
+	for (size_t i = 0; i < meta->columns_len; i++) {
+		fprintf(fp, "column,%s,%lu\n", kind_name(meta->columns[i].kind), meta->columns[i].bytes);
+	}
+
+	if (fflush(fp) != 0 || csvtmt_file_sync_stream(fp, model->sync_level) == -1) {
+		fclose(fp);
+		remove(tmp_path);
+		goto failed_to_write;
+	}
+	fclose(fp);
+	if (csvtmt_file_rename(tmp_path, path) == -1) {
+		remove(tmp_path);
+		goto failed_to_write;
+	}
+	if (csvtmt_file_sync_dir(path, model->sync_level) == -1) {
+		goto failed_to_write;
+	}
+
+	return;
+failed_to_open:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open columnar meta: %s: %s", tmp_path, strerror(errno));
+	return;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write columnar meta: %s: %s", path, strerror(errno));
+}
+
+// 列ストアのnameのファイルの先頭lenバイトを読み込み専用でmmapする。
+static bool
+map_file(const CsvTomatoModel *model, const char *name, size_t len, CsvTomatoColumnarMap *map) {
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+	struct stat st;
+
+	memset(map, 0, sizeof(*map));
+	if (!len) {
+		return true;
+	}
+
+	columnar_path(model, name, path, sizeof path);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < len) {
+		close(fd);
+		return false;
+	}
+	void *ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		return false;
+	}
+	madvise(ptr, len, MADV_SEQUENTIAL);
+
+	map->ptr = ptr;
+	map->len = len;
+	return true;
+}
+
+static void
+unmap_file(CsvTomatoColumnarMap *map) {
+	if (map->ptr) {
+		munmap(map->ptr, map->len);
+	}
+	memset(map, 0, sizeof(*map));
+}
+
+// 追記する時は前に落ちて書きかけた分を切り捨ててから足す。
+static bool
+out_open(Builder *b, Out *out, const char *name, uint64_t len) {
+	columnar_path(b->model, name, out->path, sizeof out->path);
+
+	if (b->rebuild) {
+		snprintf(out->tmp_path, sizeof out->tmp_path, "%s.%ld.tmp", out->path, (long) getpid());
+		out->fp = fopen(out->tmp_path, "w");
+		return out->fp;
+	}
+
+	struct stat st;
+	if (stat(out->path, &st) == -1 || (uint64_t) st.st_size < len) {
+		return false;
+	}
+	if (truncate(out->path, len) == -1) {
+		return false;
+	}
+	out->fp = fopen(out->path, "a");
+	return out->fp;
+}
+
+static bool
+out_close(Out *out, CsvTomatoSyncLevel level) {
+	if (!out->fp) {
+		return true;
+	}
+	bool ok = fflush(out->fp) == 0 && !ferror(out->fp) && csvtmt_file_sync_stream(out->fp, level) != -1;
+	fclose(out->fp);
+	out->fp = NULL;
+	return ok;
+}
+
+static bool
+builder_open(Builder *b, CsvTomatoModel *model, Meta *meta, bool rebuild) {
+	char name[32];
+
+	memset(b, 0, sizeof(*b));
+	b->model = model;
+	b->meta = meta;
+	b->rebuild = rebuild;
+	b->outs = calloc(meta->columns_len * 2, sizeof(b->outs[0]));
+	if (!b->outs) {
+		return false;
+	}
+	b->outs_len = meta->columns_len * 2;
+
+	if (!out_open(b, &b->head, "head", meta->rows * sizeof(uint64_t))) {
+		return false;
+	}
+	for (size_t i = 0; i < meta->columns_len; i++) {
+		column_file_name(meta, i, false, name, sizeof name);
+		if (!out_open(b, &b->outs[i * 2], name, column_file_len(meta, i))) {
+			return false;
+		}
+		if (meta->columns[i].kind == CSVTMT_COLUMNAR_TEXT) {
+			column_file_name(meta, i, true, name, sizeof name);
+			if (!out_open(b, &b->outs[i * 2 + 1], name, meta->rows * sizeof(uint64_t))) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// 作り直しならcommitの時だけtmp_pathをrenameで置き換え、それ以外は捨てる。
+static bool
+out_finish(Out *out, bool commit) {
+	if (!out->tmp_path[0]) {
+		return true;
+	}
+	if (commit) {
+		return csvtmt_file_rename(out->tmp_path, out->path) == 0;
+	}
+	remove(out->tmp_path);
+	return true;
+}
+
+// 開いたファイルを全て閉じる。作り直しのtmp_pathはbuilder_finish()まで残す。
+static bool
+builder_close(Builder *b) {
+	if (!b->model) {
+		return true;
+	}
+	CsvTomatoSyncLevel level = b->model->sync_level;
+	bool ok = out_close(&b->head, level);
+	for (size_t i = 0; i < b->outs_len; i++) {
+		ok = out_close(&b->outs[i], level) && ok;
+	}
+	return ok;
+}
+
+// 作り直しならcommitの時だけ書いたファイルで置き換え、それ以外は捨てる。
+static bool
+builder_finish(Builder *b, bool commit) {
+	bool ok = builder_close(b);
+
+	commit = commit && ok;
+	ok = out_finish(&b->head, commit) && ok;
+	memset(&b->head, 0, sizeof(b->head));
+	for (size_t i = 0; i < b->outs_len; i++) {
+		ok = out_finish(&b->outs[i], commit) && ok;
+	}
+
+	free(b->outs);
+	b->outs = NULL;
+	b->outs_len = 0;
+	return ok;
+}
+
+/**
+ * 1行を列ストアに足す。
+ *
+ * 列に直せない時はfalseを返す。INTEGERのカラムの値が元の文字列に戻らないなら
+ * demoteにそのカラムの位置を入れる。それ以外（カラムの数が違うなど）はSIZE_MAX。
+ */
+static bool
+builder_add_row(Builder *b, size_t offset, const CsvTomatoRow *row, size_t *demote) {
+	Meta *meta = b->meta;
+	uint64_t head = offset;
+
+	*demote = SIZE_MAX;
+	if (row->len != meta->columns_len) {
+		return false;
+	}
+
+	fwrite(&head, sizeof head, 1, b->head.fp);
+	for (size_t i = 0; i < row->len; i++) {
+		MetaColumn *col = &meta->columns[i];
+		const char *s = row->columns[i];
+		FILE *fp = b->outs[i * 2].fp;
+
+		switch (col->kind) {
+		case CSVTMT_COLUMNAR_MODE: {
+			if (strcmp(s, "0") && strcmp(s, "1")) {
+				return false;
+			}
+			uint8_t mode = s[0] == '1';
+			fwrite(&mode, sizeof mode, 1, fp);
+		} break;
+		case CSVTMT_COLUMNAR_INT: {
+			char num[CSVTMT_NUM_STR_SIZE];
+			int64_t value = strtoll(s, NULL, 10);
+			snprintf(num, sizeof num, "%ld", value);
+			if (strcmp(num, s)) {
+				*demote = i;
+				return false;
+			}
+			fwrite(&value, sizeof value, 1, fp);
+		} break;
+		case CSVTMT_COLUMNAR_TEXT: {
+			size_t len = strlen(s) + 1;
+			fwrite(s, 1, len, fp);
+			col->bytes += len;
+			fwrite(&col->bytes, sizeof col->bytes, 1, b->outs[i * 2 + 1].fp);
+		} break;
+		}
+	}
+
+	meta->rows++;
+	return true;
+}
+
+// pから表の終わりまでの行を列ストアに足す。列に直せない行があればfalse。
+static bool
+append_rows(Builder *b, const char *p, size_t *demote, CsvTomatoError *error) {
+	CsvTomatoModel *model = b->model;
+	CsvTomatoRow row = {0};
+
+	*demote = SIZE_MAX;
+	for (;;) {
+		csvtmt_row_clear(&row);
+		const char *head = csvtmt_mmap_parse_row(model, &p, &row, error);
+		if (!head) {
+			break;
+		}
+		csvtmt_readahead(model, head);
+		if (!builder_add_row(b, csvtmt_mmap_offset(model, head), &row, demote)) {
+			csvtmt_row_final(&row);
+			return false;
+		}
+	}
+
+	csvtmt_row_final(&row);
+	return !error->error;
+}
+
+/**
+ * 表の見出しの後ろ（first）から全ての行を読んで列ストアを作り直す。
+ *
+ * 書いたファイルはbの一時ファイルに残すので、builder_finish()で置き換えてからmetaを書く。
+ * 列に直せない行があればbには何も残さず、meta->usableを偽にする。
+ */
+static void
+build(CsvTomatoModel *model, size_t first, Meta *meta, Builder *b, CsvTomatoError *error) {
+	const CsvTomatoHeader *header = model->header;
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+	size_t demote;
+
+	// 作り直している途中で落ちても古いmetaで読まれないように先に消す
+	columnar_path(model, "meta", path, sizeof path);
+	remove(path);
+
+	meta_final(meta);
+	if (!csvtmt_reserve(meta->columns, meta->columns_capa, header->types_len)) {
+		goto failed_to_alloc;
+	}
+	for (size_t i = 0; i < header->types_len; i++) {
+		const CsvTomatoColumnType *type = &header->types[i];
+		MetaColumn *col = &meta->columns[meta->columns_len++];
+		col->bytes = 0;
+		if (!strcmp(type->type_name, CSVTMT_COL_MODE)) {
+			col->kind = CSVTMT_COLUMNAR_MODE;
+		} else if (type->type_def_info.integer) {
+			col->kind = CSVTMT_COLUMNAR_INT;
+		} else {
+			col->kind = CSVTMT_COLUMNAR_TEXT;
+		}
+	}
+
+	// INTEGERに収まらない値があればそのカラムをTEXTにして読み直す
+	for (;;) {
+		meta->rows = 0;
+		for (size_t i = 0; i < meta->columns_len; i++) {
+			meta->columns[i].bytes = 0;
+		}
+		if (!builder_open(b, model, meta, true)) {
+			builder_finish(b, false);
+			goto failed_to_write;
+		}
+
+		bool ok = true;
+		if (first < model->mmap.size) {
+			const char *p = csvtmt_mmap_seek(model, first, 1, error);
+			ok = p && append_rows(b, p, &demote, error);
+		}
+		if (ok) {
+			if (!builder_close(b)) {
+				builder_finish(b, false);
+				goto failed_to_write;
+			}
+			meta->usable = true;
+			return;
+		}
+
+		builder_finish(b, false);
+		if (error->error) {
+			return;
+		}
+		if (demote == SIZE_MAX) {
+			// 列に直せない行がある。CSVから読むように印だけ残す
+			meta->usable = false;
+			meta->rows = 0;
+			return;
+		}
+		meta->columns[demote].kind = CSVTMT_COLUMNAR_TEXT;
+	}
+
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate columnar meta");
+	return;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write columnar store of %s: %s", model->table_path, strerror(errno));
+}
+
+static size_t
+find_row(const uint64_t *heads, size_t rows, uint64_t offset) {
+	size_t lo = 0, hi = rows;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (heads[mid] < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < rows && heads[lo] == offset ? lo : SIZE_MAX;
+}
+
+// 前に写した後に論理削除ログに載った行のうち、tomb件目までのmodeを1にする。
+static bool
+apply_tombstones(CsvTomatoModel *model, const Meta *meta, size_t tomb, CsvTomatoError *error) {
+	CsvTomatoColumnarMap head = {0};
+	char name[32];
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+	int fd = -1;
+	bool ok = false;
+
+	size_t index = 0;
+	for (; index < meta->columns_len; index++) {
+		if (meta->columns[index].kind == CSVTMT_COLUMNAR_MODE) {
+			break;
+		}
+	}
+	if (index == meta->columns_len) {
+		return false;
+	}
+
+	CsvTomatoOffsets *offsets = csvtmt_offsets_new();
+	if (!offsets) {
+		return false;
+	}
+	csvtmt_tomb_log_read(model, meta->tomb, offsets, error);
+	if (error->error) {
+		goto done;
+	}
+	// スナップショットを取った後の論理削除は写さない
+	if (offsets->len > tomb - meta->tomb) {
+		offsets->len = tomb - meta->tomb;
+	}
+	if (!map_file(model, "head", meta->rows * sizeof(uint64_t), &head)) {
+		goto done;
+	}
+
+	column_file_name(meta, index, false, name, sizeof name);
+	columnar_path(model, name, path, sizeof path);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		goto done;
+	}
+
+	for (size_t i = 0; i < offsets->len; i++) {
+		// 今回追記する行はCSVの'1'をそのまま写す
+		size_t row = find_row(head.ptr, meta->rows, offsets->array[i]);
+		if (row == SIZE_MAX) {
+			continue;
+		}
+		uint8_t mode = 1;
+		if (pwrite(fd, &mode, sizeof mode, row) != sizeof mode) {
+			goto done;
+		}
+	}
+	ok = csvtmt_file_sync(fd, model->sync_level) != -1;
+done:
+	if (fd != -1) {
+		close(fd);
+	}
+	unmap_file(&head);
+	csvtmt_offsets_del(offsets);
+	return ok;
+}
+
+// 前に写した後に追記された行と論理削除を足して、列ストアを開いているテーブルに追いつかせる。
+// 追記はmetaの長さより後ろにしか書かないので、前のmetaで読んでいる文には見えない。
+static bool
+extend(CsvTomatoModel *model, Meta *meta, size_t tomb, CsvTomatoError *error) {
+	Builder b = {0};
+	size_t demote;
+
+	if (meta->tomb < tomb && meta->rows) {
+		if (!apply_tombstones(model, meta, tomb, error)) {
+			return false;
+		}
+	}
+
+	if (meta->size < model->mmap.size) {
+		const char *p = csvtmt_mmap_seek(model, meta->size, 1, error);
+		if (!p) {
+			return false;
+		}
+		if (!builder_open(&b, model, meta, false)) {
+			builder_finish(&b, false);
+			return false;
+		}
+		bool ok = append_rows(&b, p, &demote, error);
+		if (!builder_finish(&b, ok) || !ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * metaが開いているテーブル（論理削除はtomb件）と同じ版ならtrue。
+ * 同じinodeに追記されただけなら追いつかせてtrue。作り直すならfalse。
+ * 列に直せない印のmetaはinodeが同じならそのまま使う。
+ */
+static bool
+catch_up(CsvTomatoModel *model, Meta *meta, size_t tomb, CsvTomatoError *error) {
+	const struct stat *st = &model->mmap.st;
+	if (meta->ino != (uint64_t) st->st_ino) {
+		return false;
+	}
+	if (!meta->usable || meta_matches(meta, st, tomb)) {
+		return true;
+	}
+
+	// 長さも論理削除も増えていないのに更新時刻だけ違えば、追記以外で書き換えられている
+	bool grew = meta->size < model->mmap.size || meta->tomb < tomb;
+	if (!grew || meta->size > model->mmap.size || meta->tomb > tomb) {
+		return false;
+	}
+	if (!extend(model, meta, tomb, error)) {
+		csvtmt_error_clear(error);
+		return false;
+	}
+	meta_stamp(meta, st, tomb);
+	return true;
+}
+
+// 列ストアを書く文を1つにする。<table>.col/lockにロックを掛けたfdを返し、取れなければ-1。
+static int
+lock_builder(const CsvTomatoModel *model) {
+	char path[CSVTMT_PATH_SIZE * 2 + 32];
+
+	columnar_path(model, "", path, sizeof path);
+	if (!csvtmt_file_exists(path)) {
+		csvtmt_file_mkdir(path);
+	}
+	columnar_path(model, "lock", path, sizeof path);
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct flock fl = {0};
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+#ifdef F_OFD_SETLK
+	int rc = fcntl(fd, F_OFD_SETLK, &fl);
+#else
+	int rc = fcntl(fd, F_SETLK, &fl);
+#endif
+	if (rc == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * SELECTがテーブルを開く前に呼ぶ。列ストアが無いか古ければ追記か作り直しで追いつかせる。
+ *
+ * 写すのは共有ロックの間に取ったスナップショットで、ロックは持たない。
+ * 最後に排他ロックを取ってファイルを置き換え、写している間に追記された分を足す。
+ * 取った排他ロックはSELECTがテーブルを開くまで持ち続ける。
+ *
+ * 列ストアは写しなので、失敗してもSELECTがCSVを読めばいい。エラーは積まない。
+ */
+void
+csvtmt_columnar_refresh(CsvTomatoModel *model) {
+	CsvTomatoError error = {0};
+	Meta meta = {0};
+	Builder b = {0};
+	struct stat st;
+
+	// まずロックを取らずに見る。新しければ何もしない
+	if (stat(model->table_path, &st) == -1) {
+		return; // 無いテーブルのエラーはSELECTが報告する
+	}
+	bool found = meta_load(model, &meta);
+	bool fresh = found && meta.ino == (uint64_t) st.st_ino &&
+		(!meta.usable || meta_matches(&meta, &st, csvtmt_tomb_log_len(model, st.st_ino)));
+	meta_final(&meta);
+	if (fresh) {
+		return;
+	}
+
+	// 他の文が書いていれば任せて、今回はCSVを読む
+	int lock_fd = lock_builder(model);
+	if (lock_fd == -1) {
+		return;
+	}
+
+	if (!csvtmt_model_lock(model, CSVTMT_LOCK_SHARED, &error)) {
+		goto unlock_builder;
+	}
+	csvtmt_open_mmap_for_read(model, model->table_path, &error);
+	if (error.error) {
+		csvtmt_model_unlock(model);
+		goto unlock_builder;
+	}
+	const char *p = csvtmt_header_load_from_mmap(model, &error);
+	if (!error.error) {
+		csvtmt_snapshot_open(model, &error);
+	}
+	csvtmt_model_unlock(model);
+	if (error.error) {
+		goto done;
+	}
+	csvtmt_scan_advise(model);
+
+	// ロックを待つ間に他の文が追いつかせたかもしれないので見直す
+	size_t tomb = model->snapshot.tomb_len;
+	bool loaded = meta_load(model, &meta);
+	if (loaded && meta.ino == (uint64_t) model->mmap.st.st_ino &&
+		(!meta.usable || meta_matches(&meta, &model->mmap.st, tomb))) {
+		goto done;
+	}
+	if (!loaded || !catch_up(model, &meta, tomb, &error)) {
+		build(model, csvtmt_mmap_offset(model, p), &meta, &b, &error);
+		if (error.error) {
+			goto done;
+		}
+		meta_stamp(&meta, &model->mmap.st, tomb);
+	}
+
+	// 写している間にUPDATEや詰め直しがテーブルを書き直していたら、古いファイルの写しなので捨てる
+	dev_t dev = model->mmap.st.st_dev;
+	ino_t ino = model->mmap.st.st_ino;
+	if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, &error) ||
+		stat(model->table_path, &st) == -1 ||
+		st.st_dev != dev || st.st_ino != ino) {
+		goto done;
+	}
+	if (!builder_finish(&b, true)) {
+		goto done;
+	}
+	meta_save(model, &meta, &error);
+	if (error.error || !meta.usable) {
+		goto done;
+	}
+
+	// 写している間に追記された分は排他ロックを持ったまま足す
+	csvtmt_close_mmap(model);
+	csvtmt_open_mmap_for_read(model, model->table_path, &error);
+	if (error.error) {
+		meta_final(&meta);
+		goto unlock_builder;
+	}
+	tomb = csvtmt_tomb_log_len(model, model->mmap.st.st_ino);
+	if (!meta_matches(&meta, &model->mmap.st, tomb) && catch_up(model, &meta, tomb, &error)) {
+		meta_save(model, &meta, &error);
+	}
+done:
+	builder_finish(&b, false);
+	meta_final(&meta);
+	csvtmt_close_mmap(model);
+unlock_builder:
+	close(lock_fd);
+}
+
+/**
+ * 開いたテーブルと同じ版の列ストアがあればmmapして、SELECTが行をそこから読むようにする。
+ * テーブルを開いてスナップショットを取った後、ロックを手放す前に呼ぶ。
+ */
+void
+csvtmt_columnar_open(CsvTomatoModel *model) {
+	Meta meta = {0};
+	char name[32];
+
+	if (!meta_load(model, &meta) || !meta.usable ||
+		!meta_matches(&meta, &model->mmap.st, model->snapshot.tomb_len)) {
+		goto done;
+	}
+	if (!csvtmt_reserve(model->columnar.columns, model->columnar.columns_capa, meta.columns_len)) {
+		goto done;
+	}
+
+	if (!map_file(model, "head", meta.rows * sizeof(uint64_t), &model->columnar.head)) {
+		goto fail;
+	}
+	for (size_t i = 0; i < meta.columns_len; i++) {
+		CsvTomatoColumnarColumn *col = &model->columnar.columns[model->columnar.columns_len++];
+		memset(col, 0, sizeof(*col));
+		col->kind = meta.columns[i].kind;
+
+		column_file_name(&meta, i, false, name, sizeof name);
+		if (!map_file(model, name, column_file_len(&meta, i), &col->data)) {
+			goto fail;
+		}
+		if (col->kind == CSVTMT_COLUMNAR_TEXT) {
+			column_file_name(&meta, i, true, name, sizeof name);
+			if (!map_file(model, name, meta.rows * sizeof(uint64_t), &col->ends)) {
+				goto fail;
+			}
+		}
+	}
+
+	model->columnar.rows = meta.rows;
+	model->columnar.row = 0;
+	model->columnar.active = true;
+	goto done;
+fail:
+	csvtmt_columnar_close(model);
+done:
+	meta_final(&meta);
+}
+
+void
+csvtmt_columnar_close(CsvTomatoModel *model) {
+	unmap_file(&model->columnar.head);
+	for (size_t i = 0; i < model->columnar.columns_len; i++) {
+		unmap_file(&model->columnar.columns[i].data);
+		unmap_file(&model->columnar.columns[i].ends);
+	}
+	model->columnar.columns_len = 0;
+	model->columnar.rows = 0;
+	model->columnar.row = 0;
+	model->columnar.active = false;
+}
+
+bool
+csvtmt_columnar_at_end(const CsvTomatoModel *model) {
+	return model->columnar.row >= model->columnar.rows;
+}
+
+/**
+ * 列ストアの次の行をmodel->rowに文字列で詰め、行の先頭のCSV上の位置を返す。
+ * 論理削除はスナップショットで見るのでmodel->rowの__MODE__で判断すること。
+ */
+size_t
+csvtmt_columnar_read_row(CsvTomatoModel *model, CsvTomatoError *error) {
+	CsvTomatoRow *row = &model->row;
+	size_t index = model->columnar.row++;
+
+	csvtmt_row_clear(row);
+	model->row_head = NULL;
+	if (!csvtmt_reserve(row->columns, row->capa, model->columnar.columns_len)) {
+		goto failed_to_alloc;
+	}
+
+	for (size_t i = 0; i < model->columnar.columns_len; i++) {
+		const CsvTomatoColumnarColumn *col = &model->columnar.columns[i];
+		char num[CSVTMT_NUM_STR_SIZE];
+		const char *value = num;
+
+		switch (col->kind) {
+		case CSVTMT_COLUMNAR_MODE:
+			value = ((const uint8_t *) col->data.ptr)[index] ? "1" : "0";
+			break;
+		case CSVTMT_COLUMNAR_INT:
+			snprintf(num, sizeof num, "%ld", ((const int64_t *) col->data.ptr)[index]);
+			break;
+		case CSVTMT_COLUMNAR_TEXT: {
+			const uint64_t *ends = col->ends.ptr;
+			value = (const char *) col->data.ptr + (index ? ends[index - 1] : 0);
+		} break;
+		}
+
+		row->columns[i] = strdup(value);
+		if (!row->columns[i]) {
+			goto failed_to_alloc;
+		}
+		row->len++;
+	}
+
+	return ((const uint64_t *) model->columnar.head.ptr)[index];
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate row");
+	return 0;
+}
@@ -0,0 +1,648 @@
+#include <csvtomato.h>
+
+/*
+	テーブルの詰め直し。
+
+	論理削除した行はWHEREの無いUPDATEでテーブルを書き直すまで残るので、
+	DELETEを繰り返すとファイルが伸び続けて走査が遅くなる。
+	ここでは生きている行だけを新しいファイルに書き写してrenameで差し替え、
+	同じ走査で統計も作り直す。
+
+	書き写す間はテーブルのロックを持たない。
+
+		1. 共有ロックを取ってmmapを開き、スナップショットを取って手放す
+		2. スナップショットの行を書き写し、古い位置と新しい位置の対応を覚える
+		3. 排他ロックを取り、2の間に追記された行を書き写す。
+		   2の間に論理削除された行は論理削除ログから読み、新しいファイルでも'1'にする
+		4. renameで差し替えて排他ロックを手放す
+
+	排他ロックを持つのは3と4の間だけなので、前景の文はほとんど待たされない。
+	古いファイルを開いている文はmmapとログのfdでそのまま読み続けられる。
+	2の間にUPDATEがテーブルを書き直していたら（inodeが変わっていたら）差し替えない。
+*/
+
+typedef struct {
+	CsvTomatoModel model;
+	CsvTomatoCompactor *compactor; // NULLなら読み書きを絞らない
+	int64_t beg;
+	uint64_t io_bytes; // 読み書きしたバイト数
+	uint64_t checked_bytes; // 最後に速さを確かめた時のio_bytes
+	CsvTomatoWriter *writer;
+	char tmp_path[CSVTMT_PATH_SIZE * 2 + 32];
+	uint64_t written; // 新しいファイルの長さ
+	CsvTomatoOffsets *old_heads; // 書き写した行の古い位置。昇順
+	CsvTomatoOffsets *new_heads; // 同じ行の新しい位置
+	CsvTomatoTableStats stats;
+	CsvTomatoRow row;
+	bool stopped; // ワーカーが止められたので途中でやめた
+} Compaction;
+
+// stopされるかdeadline（csvtmt_now_ms()の時刻）になるまで待つ。mutexを持って呼ぶ。
+static void
+wait_until(CsvTomatoCompactor *self, int64_t deadline) {
+	while (!self->stop) {
+		int64_t left = deadline - csvtmt_now_ms();
+		if (left <= 0) {
+			return;
+		}
+
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += left / 1000;
+		ts.tv_nsec += (left % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&self->cond, &self->mutex, &ts);
+	}
+}
+
+// msミリ秒待つ。止められたらfalse。
+static bool
+sleep_or_stop(CsvTomatoCompactor *self, int64_t ms) {
+	pthread_mutex_lock(&self->mutex);
+	wait_until(self, csvtmt_now_ms() + ms);
+	bool stop = self->stop;
+	pthread_mutex_unlock(&self->mutex);
+	return !stop;
+}
+
+// 読み書きした分がbytes_per_secに収まるように待つ。止められたらfalse。
+static bool
+throttle(Compaction *c, size_t bytes) {
+	c->io_bytes += bytes;
+
+	CsvTomatoCompactor *self = c->compactor;
+	if (!self || c->io_bytes - c->checked_bytes < CSVTMT_COMPACT_CHUNK_SIZE) {
+		return true;
+	}
+	c->checked_bytes = c->io_bytes;
+
+	pthread_mutex_lock(&self->mutex);
+	if (self->opts.bytes_per_sec) {
+		wait_until(self, c->beg + (int64_t) (c->io_bytes * 1000 / self->opts.bytes_per_sec));
+	}
+	bool stop = self->stop;
+	pthread_mutex_unlock(&self->mutex);
+
+	return !stop;
+}
+
+static void
+compaction_init(Compaction *c, CsvTomato *db, CsvTomatoCompactor *compactor, const char *table_name, CsvTomatoError *error) {
+	memset(c, 0, sizeof(*c));
+	csvtmt_model_init(&c->model, db->db_dir, error);
+	c->model.sync_level = db->sync_level;
+	c->model.io_backend = db->io_backend;
+	c->model.mmap.window = db->mmap_window;
+	c->model.catalog = &db->catalog;
+	c->model.locks = &db->locks;
+	c->model.table_name = table_name;
+	snprintf(c->model.table_path, sizeof c->model.table_path, "%s/%s.csv", db->db_dir, table_name);
+	c->compactor = compactor;
+	c->beg = csvtmt_now_ms();
+}
+
+static void
+compaction_final(Compaction *c) {
+	if (c->writer) {
+		csvtmt_writer_del(c->writer);
+		remove(c->tmp_path);
+	}
+	csvtmt_offsets_del(c->old_heads);
+	csvtmt_offsets_del(c->new_heads);
+	csvtmt_stats_final(&c->stats);
+	csvtmt_row_final(&c->row);
+	csvtmt_model_final(&c->model);
+}
+
+// 1. スナップショットを取り、新しいファイルにヘッダを書く。ヘッダの次の行の先頭を返す。
+static const char *
+open_snapshot(Compaction *c, CsvTomatoError *error) {
+	CsvTomatoModel *model = &c->model;
+
+	if (!csvtmt_model_lock(model, CSVTMT_LOCK_SHARED, error)) {
+		return NULL;
+	}
+	csvtmt_open_mmap_for_read(model, model->table_path, error);
+	if (error->error) {
+		csvtmt_model_unlock(model);
+		return NULL;
+	}
+	const char *p = csvtmt_header_load_from_mmap(model, error);
+	if (!error->error) {
+		csvtmt_snapshot_open(model, error);
+	}
+	csvtmt_model_unlock(model);
+	if (error->error) {
+		return NULL;
+	}
+	csvtmt_scan_advise(model);
+
+	c->old_heads = csvtmt_offsets_new();
+	c->new_heads = csvtmt_offsets_new();
+	if (!c->old_heads || !c->new_heads ||
+		!csvtmt_stats_start(&c->stats, model->header)) {
+		goto failed_to_alloc;
+	}
+
+	char tmp_dir[CSVTMT_PATH_SIZE + 10];
+	snprintf(tmp_dir, sizeof tmp_dir, "%s/tmp", model->db_dir);
+	if (!csvtmt_file_exists(tmp_dir)) {
+		csvtmt_file_mkdir(tmp_dir);
+	}
+	// UPDATEの一時ファイルと名前が重ならないようにする。
+	// 別の詰め直しの書きかけを切り詰めないように、呼ぶたびに名前を変えてO_EXCLで作る
+	static _Atomic uint64_t serial;
+	snprintf(
+		c->tmp_path,
+		sizeof c->tmp_path,
+		"%s/%s.%ld.%" PRIu64 ".compact.csv",
+		tmp_dir,
+		model->table_name,
+		(long) getpid(),
+		atomic_fetch_add(&serial, 1)
+	);
+
+	c->writer = csvtmt_writer_new(c->tmp_path, O_WRONLY | O_CREAT | O_EXCL, error);
+	if (error->error) {
+		return NULL;
+	}
+	csvtmt_writer_use_backend(c->writer, model->io_backend);
+	csvtmt_readahead_start(model);
+	// ヘッダを読んだ直後の窓はファイルの先頭から始まる
+	csvtmt_writer_write(c->writer, model->mmap.ptr, p - model->mmap.ptr, error);
+	c->written = csvtmt_mmap_offset(model, p);
+	return p;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate compaction");
+	return NULL;
+}
+
+// 2. pからテーブルの終わりまでの生きている行を書き写す。
+static void
+copy_rows(Compaction *c, const char *p, CsvTomatoError *error) {
+	CsvTomatoModel *model = &c->model;
+	const CsvTomatoHeader *header = model->header;
+
+	while (p) {
+		csvtmt_row_clear(&c->row);
+		const char *head = csvtmt_mmap_parse_row(model, &p, &c->row, error);
+		if (!head) {
+			break;
+		}
+		csvtmt_readahead(model, head);
+		const char *next = p;
+		size_t io_bytes = next - head;
+
+		if (c->row.len && !csvtmt_is_deleted_row(&c->row)) {
+			if (!csvtmt_offsets_push_back(c->old_heads, csvtmt_mmap_offset(model, head)) ||
+				!csvtmt_offsets_push_back(c->new_heads, c->written)) {
+				goto failed_to_alloc;
+			}
+			csvtmt_writer_write(c->writer, head, next - head, error);
+			c->written += next - head;
+			io_bytes += next - head;
+			if (next[-1] != '\n') {
+				csvtmt_writer_write(c->writer, "\n", 1, error);
+				c->written++;
+			}
+			if (error->error) {
+				return;
+			}
+			csvtmt_stats_add_row(&c->stats, header, &c->row);
+		}
+
+		if (!throttle(c, io_bytes)) {
+			c->stopped = true;
+			return;
+		}
+	}
+	if (error->error) {
+		goto failed_to_parse_row;
+	}
+	return;
+failed_to_parse_row:
+	csvtmt_error_push(error, CSVTMT_ERR_PARSE, "failed to parse row of %s", model->table_path);
+	return;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate compaction");
+}
+
+// ワーカーはロックが空くまで待ち、csvtmt_compact()はbusy_timeoutに従う。
+static bool
+lock_for_swap(Compaction *c, CsvTomatoError *error) {
+	for (int64_t ms = 1; ; ms = ms < 50 ? ms * 2 : 50) {
+		if (csvtmt_model_lock(&c->model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+			return true;
+		}
+		if (!c->compactor || error->elems[error->len - 1].kind != CSVTMT_ERR_BUSY) {
+			return false;
+		}
+		csvtmt_error_clear(error);
+		if (!sleep_or_stop(c->compactor, ms)) {
+			c->stopped = true;
+			return false;
+		}
+	}
+}
+
+static size_t
+find_head(const CsvTomatoOffsets *heads, size_t offset) {
+	size_t lo = 0;
+	size_t hi = heads->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (heads->array[mid] < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < heads->len && heads->array[lo] == offset ? lo : SIZE_MAX;
+}
+
+// 書き写した後に論理削除された行を新しいファイルでも'1'にする。
+static void
+apply_later_tombstones(Compaction *c, int fd, CsvTomatoError *error) {
+	CsvTomatoModel *model = &c->model;
+
+	const CsvTomatoOffsets *later = csvtmt_snapshot_later(model, error);
+	if (error->error) {
+		return;
+	}
+
+	for (size_t i = 0; i < later->len; i++) {
+		// 書き写す前に消された行は新しいファイルに無い
+		size_t index = find_head(c->old_heads, later->array[i]);
+		if (index == SIZE_MAX) {
+			continue;
+		}
+
+		off_t pos = c->new_heads->array[index];
+		char head;
+		errno = 0;
+		if (pread(model->mmap.fd, &head, 1, later->array[i]) != 1) {
+			csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to read tombstone: %s", strerror(errno));
+			return;
+		}
+		if (head == '"') {
+			pos++;
+		}
+		if (pwrite(fd, "1", 1, pos) != 1) {
+			csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write tombstone: %s", strerror(errno));
+			return;
+		}
+		if (c->stats.live) {
+			c->stats.live--;
+		}
+		c->stats.dead++;
+	}
+}
+
+// 3と4。差し替えたらtrue。
+static bool
+swap_table(Compaction *c, CsvTomatoError *error) {
+	CsvTomatoModel *model = &c->model;
+
+	if (!lock_for_swap(c, error)) {
+		return false;
+	}
+
+	struct stat st;
+	errno = 0;
+	if (stat(model->table_path, &st) == -1) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to stat %s: %s", model->table_path, strerror(errno));
+		return false;
+	}
+	if (st.st_dev != model->mmap.st.st_dev || st.st_ino != model->mmap.st.st_ino) {
+		return false; // 書き直したUPDATEが論理削除した行を取り除いている
+	}
+
+	// 排他ロックを持っている間は絞らない
+	c->compactor = NULL;
+	// 追記された分まで読む範囲を広げる
+	if ((size_t) st.st_size > model->mmap.size) {
+		size_t old_size = model->mmap.size;
+		model->mmap.size = st.st_size;
+		const char *p = csvtmt_mmap_seek(model, old_size, 1, error);
+		if (!p) {
+			return false;
+		}
+		copy_rows(c, p, error);
+		if (error->error) {
+			return false;
+		}
+	}
+
+	csvtmt_writer_flush(c->writer, error);
+	if (error->error) {
+		return false;
+	}
+	int fd = c->writer->fd;
+	apply_later_tombstones(c, fd, error);
+	if (error->error) {
+		return false;
+	}
+	if (csvtmt_file_sync(fd, model->sync_level) == -1) {
+		goto failed_to_sync;
+	}
+	csvtmt_writer_del(c->writer);
+	c->writer = NULL;
+
+	if (csvtmt_file_rename(c->tmp_path, model->table_path) == -1) {
+		remove(c->tmp_path);
+		goto failed_to_rename;
+	}
+	if (csvtmt_file_sync_dir(model->table_path, model->sync_level) == -1) {
+		goto failed_to_sync;
+	}
+	csvtmt_tomb_log_remove(model, model->mmap.st.st_ino);
+
+	c->stats.bytes = c->written;
+	c->stats.dirty = true;
+	csvtmt_stats_install(model, &c->stats);
+	return true;
+failed_to_sync:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync compacted table: %s", strerror(errno));
+	return false;
+failed_to_rename:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to rename compacted table: %s", strerror(errno));
+	return false;
+}
+
+// テーブルを詰め直す。差し替えたらtrue。
+static bool
+compact_table(CsvTomato *db, CsvTomatoCompactor *compactor, const char *table_name, CsvTomatoError *error) {
+	Compaction c;
+	bool swapped = false;
+
+	// 同じテーブルを詰め直すのは1つずつ。後から来た方は何もしない
+	CsvTomatoTableLock *lock = csvtmt_lock_begin_compaction(&db->locks, db->db_dir, table_name, error);
+	if (!lock) {
+		return false;
+	}
+
+	compaction_init(&c, db, compactor, table_name, error);
+
+	const char *p = open_snapshot(&c, error);
+	if (!error->error) {
+		copy_rows(&c, p, error);
+	}
+	if (!error->error && !c.stopped) {
+		swapped = swap_table(&c, error);
+	}
+
+	compaction_final(&c);
+	csvtmt_lock_end_compaction(&db->locks, lock);
+	return swapped;
+}
+
+/**
+ * table_nameのテーブルから論理削除した行を取り除き、統計を作り直す。
+ *
+ * 書き写している間はテーブルをロックしないので、他の文は読み書きを続けられる。
+ * その間にWHEREの無いUPDATEがテーブルを書き直した時は何もしない。
+ * 同じデータベースで他のスレッドが同じテーブルを詰め直している時も何もしない。
+ */
+CsvTomatoResult
+csvtmt_compact(CsvTomato *db, const char *table_name, CsvTomatoError *error) {
+	compact_table(db, NULL, table_name, error);
+	return error->error ? CSVTMT_ERROR : CSVTMT_OK;
+}
+
+static CsvTomatoCompactTable *
+find_table(CsvTomatoCompactor *self, const char *table_name, uint64_t bytes) {
+	for (size_t i = 0; i < self->tables_len; i++) {
+		if (!strcmp(self->tables[i].table_name, table_name)) {
+			return &self->tables[i];
+		}
+	}
+
+	if (!csvtmt_reserve(self->tables, self->tables_capa, self->tables_len + 1)) {
+		return NULL;
+	}
+	char *name = strdup(table_name);
+	if (!name) {
+		return NULL;
+	}
+	CsvTomatoCompactTable *table = &self->tables[self->tables_len++];
+	table->table_name = name;
+	table->bytes = bytes;
+	return table;
+}
+
+// 論理削除された行の割合が高いか、前に詰めた時からファイルが伸びていればtrue。
+static bool
+needs_compaction(CsvTomatoCompactor *self, const char *table_name, CsvTomatoError *error) {
+	CsvTomatoModel model;
+	const CsvTomatoCompactOpts *opts = &self->opts;
+	bool need = false;
+
+	csvtmt_model_init(&model, self->db->db_dir, error);
+	model.catalog = &self->db->catalog;
+	model.locks = &self->db->locks;
+	model.table_name = table_name;
+	snprintf(model.table_path, sizeof model.table_path, "%s/%s.csv", self->db->db_dir, table_name);
+
+	// 統計は書く文が排他ロックを持って更新するので、共有ロックを持って読む
+	if (!csvtmt_model_lock(&model, CSVTMT_LOCK_SHARED, error)) {
+		goto done;
+	}
+	csvtmt_header_load_from_table(&model, error);
+	if (error->error) {
+		goto done;
+	}
+
+	const CsvTomatoTableStats *stats = csvtmt_model_stats(&model);
+	if (stats && stats->dead >= opts->min_dead_rows &&
+		stats->dead >= (stats->live + stats->dead) * opts->dead_ratio) {
+		need = true;
+	}
+
+	struct stat st;
+	if (stat(model.table_path, &st) == -1) {
+		goto done;
+	}
+	CsvTomatoCompactTable *table = find_table(self, table_name, st.st_size);
+	if (!table) {
+		goto done;
+	}
+	// 小さな表は伸びても走査が軽いので見ない
+	if (opts->growth_ratio >= 0 &&
+		st.st_size >= CSVTMT_COMPACT_CHUNK_SIZE &&
+		st.st_size > table->bytes * (1 + opts->growth_ratio)) {
+		need = true;
+	}
+
+done:
+	csvtmt_model_final(&model);
+	return need;
+}
+
+static void
+compact_tables(CsvTomatoCompactor *self) {
+	CsvTomatoError error = {0};
+
+	CsvTomatoDir *dir = csvtmt_dir_open(self->db->db_dir);
+	if (!dir) {
+		return;
+	}
+
+	for (;;) {
+		CsvTomatoDirNode *node = csvtmt_dir_read(dir);
+		if (!node) {
+			break;
+		}
+
+		const char *name = csvtmt_dir_node_name(node);
+		size_t len = strlen(name);
+		if (len > 4 && !strcmp(name + len - 4, ".csv")) {
+			char table_name[CSVTMT_PATH_SIZE];
+			snprintf(table_name, sizeof table_name, "%.*s", (int) (len - 4), name);
+
+			// 失敗しても次に見て回る時にやり直す
+			csvtmt_error_clear(&error);
+			if (needs_compaction(self, table_name, &error) &&
+				compact_table(self->db, self, table_name, &error)) {
+				char path[CSVTMT_PATH_SIZE * 2 + 8];
+				snprintf(path, sizeof path, "%s/%s", self->db->db_dir, name);
+				struct stat st;
+				CsvTomatoCompactTable *table = find_table(self, table_name, 0);
+				if (table && stat(path, &st) == 0) {
+					table->bytes = st.st_size;
+				}
+				pthread_mutex_lock(&self->mutex);
+				self->compactions++;
+				pthread_mutex_unlock(&self->mutex);
+			}
+		}
+
+		csvtmt_dir_node_del(node);
+		if (!sleep_or_stop(self, 0)) {
+			break;
+		}
+	}
+
+	csvtmt_dir_close(dir);
+}
+
+static void *
+compactor_main(void *arg) {
+	CsvTomatoCompactor *self = arg;
+
+	pthread_mutex_lock(&self->mutex);
+	for (;;) {
+		wait_until(self, csvtmt_now_ms() + self->opts.interval_ms);
+		if (self->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&self->mutex);
+		compact_tables(self);
+		pthread_mutex_lock(&self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+
+	return NULL;
+}
+
+/**
+ * 表を見て回って詰め直すワーカースレッドを動かす。optsがNULLならデフォルトを使う。
+ *
+ * ワーカーは前景の文と並んで動くので、CSVTMT_OPEN_THREADSAFEで開いたデータベースでしか使えない。
+ * 論理削除された行の割合がdead_ratioを超えるか、ファイルがgrowth_ratioだけ伸びた表を
+ * bytes_per_secの速さで書き写して差し替える。csvtmt_close()で止まる。
+ */
+CsvTomatoResult
+csvtmt_compactor_start(CsvTomato *db, const CsvTomatoCompactOpts *opts, CsvTomatoError *error) {
+	if (!db->threadsafe) {
+		csvtmt_error_push(error, CSVTMT_ERR_EXEC, "compactor needs a database opened with CSVTMT_OPEN_THREADSAFE");
+		return CSVTMT_ERROR;
+	}
+	if (db->compactor) {
+		csvtmt_error_push(error, CSVTMT_ERR_EXEC, "compactor already started");
+		return CSVTMT_ERROR;
+	}
+
+	errno = 0;
+	CsvTomatoCompactor *self = calloc(1, sizeof(*self));
+	if (!self) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate compactor: %s", strerror(errno));
+		return CSVTMT_ERROR;
+	}
+
+	self->db = db;
+	if (opts) {
+		self->opts = *opts;
+	}
+	if (!self->opts.interval_ms) {
+		self->opts.interval_ms = 1000;
+	}
+	if (self->opts.dead_ratio == 0) {
+		self->opts.dead_ratio = 0.2;
+	}
+	if (!self->opts.min_dead_rows) {
+		self->opts.min_dead_rows = 1000;
+	}
+	if (self->opts.growth_ratio == 0) {
+		self->opts.growth_ratio = 1.0;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&self->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&self->mutex, NULL);
+
+	int rc = pthread_create(&self->thread, NULL, compactor_main, self);
+	if (rc) {
+		pthread_cond_destroy(&self->cond);
+		pthread_mutex_destroy(&self->mutex);
+		free(self);
+		csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to start compactor: %s", strerror(rc));
+		return CSVTMT_ERROR;
+	}
+
+	db->compactor = self;
+	return CSVTMT_OK;
+}
+
+// ワーカーを止めて終わるのを待つ。詰め直している途中なら差し替えずにやめる。
+void
+csvtmt_compactor_stop(CsvTomato *db) {
+	CsvTomatoCompactor *self = db->compactor;
+	if (!self) {
+		return;
+	}
+
+	pthread_mutex_lock(&self->mutex);
+	self->stop = true;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->mutex);
+	pthread_join(self->thread, NULL);
+
+	for (size_t i = 0; i < self->tables_len; i++) {
+		free(self->tables[i].table_name);
+	}
+	free(self->tables);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->mutex);
+	free(self);
+	db->compactor = NULL;
+}
+
+// ワーカーが表を詰め直した回数を返す。
+uint64_t
+csvtmt_compactor_count(CsvTomato *db) {
+	CsvTomatoCompactor *self = db->compactor;
+	if (!self) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&self->mutex);
+	uint64_t count = self->compactions;
+	pthread_mutex_unlock(&self->mutex);
+	return count;
+}
@@ -13,12 +13,40 @@ csvtmt_row_parse_string(
 	CsvTomatoRow *self,
 	const char *str,
 	CsvTomatoError *error
+) {
+	return csvtmt_row_parse_string_sep(self, str, ',', error);
+}
+
+// 区切り文字を指定して1行をパースする。
+const char *
+csvtmt_row_parse_string_sep(
+	CsvTomatoRow *self,
+	const char *str,
+	int sep,
+	CsvTomatoError *error
+) {
+	return csvtmt_row_parse_range(self, str, NULL, sep, error);
+}
+
+/**
+ * strから1行をパースする。endがNULLでなければendより先は読まない。
+ *
+ * mmapしたファイルは終わりに'\0'がある保証が無いので、endで止める。
+ * endの手前で行が終わらなければendを返す。
+ */
+const char *
+csvtmt_row_parse_range(
+	CsvTomatoRow *self,
+	const char *str,
+	const char *end,
+	int sep,
+	CsvTomatoError *error
 ) {
 	#undef store
 	#define store() {\
 		if (any_read) {\
-			if (self->len >= csvtmt_numof(self->columns)) {\
-				csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "csv line columns overflow");\
+			if (!csvtmt_reserve(self->columns, self->capa, self->len + 1)) {\
+				csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow csv line columns");\
 				goto fail;\
 			}\
 			char *s = csvtmt_str_esc_del(buf);\
@@ -36,17 +64,15 @@ csvtmt_row_parse_string(
 		}\
 	}\
 
+	#undef at_end
+	#define at_end() ((end && p >= end) || !*p)
+
 	#undef check_crlf
 	#define check_crlf() {\
-		c = *p++;\
-		if (c == EOF) {\
-			goto done;\
-		} else if (c == '\n') {\
-			goto done;\
-		} else {\
-			p--;\
-			goto done;\
-		}	\
+		if (!at_end() && *p == '\n') {\
+			p++;\
+		}\
+		goto done;\
 	}\
 
 	errno = 0;
@@ -57,11 +83,10 @@ csvtmt_row_parse_string(
 	}
 
 	bool any_read = false;
-	int sep = ',';
 	int m = 0;
 	const char *p = str;
 
-	for (; *p; ) {
+	for (; !at_end(); ) {
 		int c = *p++;
 
 		switch (m) {
@@ -86,11 +111,9 @@ csvtmt_row_parse_string(
 			break;
 		case 10: // found begin "
 			if (c == '"') { 
-				c = *p++;
-				if (c == '"') {
-					push(c);
+				if (!at_end() && *p == '"') {
+					push(*p++);
 				} else {
-					p--;
 					m = 20;
 				}
 			} else {
@@ -111,11 +134,9 @@ csvtmt_row_parse_string(
 			break;
 		case 30: // found normal character
 			if (c == '"') {
-				c = *p++;
-				if (c == '"') {
-					push(c);
+				if (!at_end() && *p == '"') {
+					push(*p++);
 				} else {
-					p--;
 					csvtmt_str_clear(buf);
 					m = 10;
 				}
@@ -151,8 +172,8 @@ csvtmt_row_parse_stream(
 	#undef store
 	#define store() {\
 		if (any_read) {\
-			if (self->len >= csvtmt_numof(self->columns)) {\
-				csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "csv line columns overflow");\
+			if (!csvtmt_reserve(self->columns, self->capa, self->len + 1)) {\
+				csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow csv line columns");\
 				goto fail;\
 			}\
 			char *s = csvtmt_str_esc_del(buf);\
@@ -284,8 +305,67 @@ void
 csvtmt_row_final(CsvTomatoRow *self) {
 	for (size_t i = 0; i < self->len; i++) {
 		free(self->columns[i]);
-		self->columns[i] = NULL;
 	}
+	free(self->columns);
+	memset(self, 0, sizeof(*self));
+}
+
+// 値だけ解放して空にする。配列は次の行で使い回す。
+void
+csvtmt_row_clear(CsvTomatoRow *self) {
+	for (size_t i = 0; i < self->len; i++) {
+		free(self->columns[i]);
+	}
+	self->len = 0;
+}
+
+// pからendまでの1行を走査し、各フィールドの生のバイト範囲をspansに格納する。
+// 値のコピーやアンクォートはしない。戻り値は次の行の先頭（改行の次）。
+const char *
+csvtmt_row_scan_spans(
+	const char *p,
+	const char *end,
+	CsvTomatoFieldSpans *spans,
+	CsvTomatoError *error
+) {
+	#undef push_span
+	#define push_span(b, e) {\
+		if (!csvtmt_reserve(spans->array, spans->capa, spans->len + 1)) {\
+			goto failed_to_grow;\
+		}\
+		spans->array[spans->len].beg = b;\
+		spans->array[spans->len++].end = e;\
+	}\
+
+	spans->len = 0;
+	const char *beg = p;
+	bool quoted = false;
+
+	for (; p < end && *p; p++) {
+		if (*p == '"') {
+			quoted = !quoted;  // "" のエスケープはトグル2回で打ち消される
+		} else if (!quoted && (*p == ',' || *p == '\n')) {
+			push_span(beg, p);
+			beg = p + 1;
+			if (*p == '\n') {
+				return p + 1;
+			}
+		}
+	}
+
+	// 改行で終わらない最終行
+	if (p > beg) {
+		push_span(beg, p);
+	}
+	return p;
+failed_to_grow:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow field spans");
+	return NULL;
+}
+
+void
+csvtmt_spans_final(CsvTomatoFieldSpans *self) {
+	free(self->array);
 	memset(self, 0, sizeof(*self));
 }
 
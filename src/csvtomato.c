@@ -12,12 +12,17 @@ csvtmt_stmt_new(const char *db_dir, CsvTomatoError *error) {
 		goto fail;
 	}
 
-	self->tokenizer = csvtmt_tokenizer_new(error);
+	self->arena = csvtmt_arena_new(error);
 	if (error->error) {
 		goto fail;
 	}
 
-	self->parser = csvtmt_parser_new(error);
+	self->tokenizer = csvtmt_tokenizer_new(self->arena, error);
+	if (error->error) {
+		goto fail;
+	}
+
+	self->parser = csvtmt_parser_new(self->arena, error);
 	if (error->error) {
 		goto fail;
 	}
@@ -43,13 +48,13 @@ failed_to_calloc:
 
 void
 csvtmt_stmt_del(CsvTomatoStmt *self) {
-	csvtmt_token_del_all(self->token);
-	csvtmt_node_del_all(self->node);
 	csvtmt_parser_del(self->parser);
 	csvtmt_tokenizer_del(self->tokenizer);
 	csvtmt_opcode_del(self->opcode);
 	csvtmt_executor_del(self->executor);
 	csvtmt_model_final(&self->model);
+	// トークン、AST、op-codeの名前はここでまとめて解放される
+	csvtmt_arena_del(self->arena);
 	free(self);
 }
 
@@ -62,6 +67,10 @@ csvtmt_stmt_step(CsvTomatoStmt *self, CsvTomatoError *error) {
 		self->opcode->len,
 		error
 	);
+	// 行を返している間だけテーブルのロックを持つ
+	if (result != CSVTMT_ROW) {
+		csvtmt_model_unlock(&self->model);
+	}
 	if (error->error) {
 		return CSVTMT_ERROR;
 	}
@@ -112,6 +121,23 @@ CsvTomato *
 csvtmt_open(
 	const char *db_dir,
 	CsvTomatoError *error
+) {
+	return csvtmt_open_v2(db_dir, 0, error);
+}
+
+/**
+ * flagsを指定してデータベースを開く。
+ *
+ * CSVTMT_OPEN_THREADSAFEを指定すると、1つのCsvTomatoを複数のスレッドから
+ * csvtmt_exec()やcsvtmt_prepare()できる。文のキャッシュはプールとして共有し、
+ * カタログは読み書きロックで守る。テーブルへの書き込みはスレッドをまたいで1つずつになる。
+ * 1つのCsvTomatoStmtを同時に複数のスレッドで使ってはいけない。
+ */
+CsvTomato *
+csvtmt_open_v2(
+	const char *db_dir,
+	unsigned flags,
+	CsvTomatoError *error
 ) {
 	errno = 0;
 	CsvTomato *self = calloc(1, sizeof(*self));
@@ -127,6 +153,13 @@ csvtmt_open(
 	}
 
 	snprintf(self->db_dir, sizeof self->db_dir, "%s", db_dir);
+	self->sync_level = CSVTMT_SYNC_NONE;
+	self->threadsafe = flags & CSVTMT_OPEN_THREADSAFE;
+	csvtmt_catalog_init(&self->catalog, self->threadsafe);
+	csvtmt_lock_manager_init(&self->locks, self->threadsafe);
+	if (self->threadsafe) {
+		pthread_mutex_init(&self->stmt_cache_mutex, NULL);
+	}
 
 	return self;
 }
@@ -137,9 +170,304 @@ csvtmt_close(CsvTomato *self) {
 		return;
 	}
 
+	// ワーカーが詰め直している途中のテーブルはそのまま残る
+	csvtmt_compactor_stop(self);
+	for (size_t i = 0; i < self->stmt_cache_len; i++) {
+		free(self->stmt_cache[i].query);
+		csvtmt_stmt_del(self->stmt_cache[i].stmt);
+	}
+	// 統計の書き出しに失敗しても次のANALYZEで作り直せるので閉じる
+	CsvTomatoError error = {0};
+	csvtmt_catalog_flush(&self->catalog, self->sync_level, &error);
+	csvtmt_catalog_final(&self->catalog);
+	csvtmt_lock_manager_final(&self->locks);
+	if (self->threadsafe) {
+		pthread_mutex_destroy(&self->stmt_cache_mutex);
+	}
 	free(self);
 }
 
+void
+csvtmt_set_sync_level(CsvTomato *self, CsvTomatoSyncLevel level) {
+	self->sync_level = level;
+}
+
+/**
+ * I/Oのバックエンドを選ぶ。次に実行する文から使う。
+ *
+ * CSVTMT_IO_URINGはio_uringで大きなテーブルの走査を先読みし、書き込みと同期をまとめて投げる。
+ * この環境でio_uringが使えなければCSVTMT_IO_POSIXのままにする。使うバックエンドを返す。
+ */
+CsvTomatoIoBackend
+csvtmt_set_io_backend(CsvTomato *self, CsvTomatoIoBackend backend) {
+	if (!csvtmt_io_backend_available(backend)) {
+		backend = CSVTMT_IO_POSIX;
+	}
+	self->io_backend = backend;
+	return backend;
+}
+
+/**
+ * テーブルを一度にmmapする大きさを決める。次に実行する文から使う。
+ *
+ * これより大きなテーブルは窓をずらしながら読むので、使うアドレス空間が抑えられる。
+ * ページの大きさに切り上げる。0ならCSVTMT_MMAP_WINDOWに戻す。
+ */
+void
+csvtmt_set_mmap_window(CsvTomato *self, size_t bytes) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	self->mmap_window = (bytes + page - 1) / page * page;
+}
+
+/**
+ * SELECTが列ストア（<db>/<table>.col/）を使うかを決める。次に実行する文から使う。
+ *
+ * 使うとSELECTは列ストアが無いか古ければ作り直すか追記してから、CSVを解析せずに
+ * 列ストアから行を読む。CSVが正本なので、列ストアはいつ消してもいい。
+ */
+void
+csvtmt_set_columnar(CsvTomato *self, bool enabled) {
+	self->columnar = enabled;
+}
+
+// ロックが取れない時にmsミリ秒まで待ってからCSVTMT_ERR_BUSYにする。0なら待たない。
+void
+csvtmt_busy_timeout(CsvTomato *self, int ms) {
+	self->locks.busy_timeout = ms;
+	self->locks.busy_handler = NULL;
+	self->locks.busy_arg = NULL;
+}
+
+// ロックが取れない時にhandlerを呼ぶ。handlerが0を返すまで取り直す。NULLで外す。
+void
+csvtmt_busy_handler(CsvTomato *self, CsvTomatoBusyHandler handler, void *arg) {
+	self->locks.busy_handler = handler;
+	self->locks.busy_arg = arg;
+}
+
+// 直前のcsvtmt_exec()でINSERT、UPDATE、DELETEした行数を返す。
+// スレッドセーフなデータベースでは他のスレッドが実行した文の行数かもしれない。
+size_t
+csvtmt_changes(CsvTomato *self) {
+	return self->changes;
+}
+
+CsvTomatoResult
+csvtmt_copy_from(
+	CsvTomato *self,
+	const char *table_name,
+	const char *path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+) {
+	CsvTomatoModel model;
+
+	csvtmt_model_init(&model, self->db_dir, error);
+	if (error->error) {
+		return CSVTMT_ERROR;
+	}
+
+	model.sync_level = self->sync_level;
+	model.io_backend = self->io_backend;
+	model.mmap.window = self->mmap_window;
+	model.catalog = &self->catalog;
+	model.locks = &self->locks;
+	model.table_name = table_name;
+	snprintf(model.table_path, sizeof model.table_path, "%s/%s.csv", self->db_dir, table_name);
+
+	csvtmt_copy_from_file(&model, path, opts, error);
+	csvtmt_model_final(&model);
+	if (error->error) {
+		return CSVTMT_ERROR;
+	}
+
+	return CSVTMT_OK;
+}
+
+CsvTomatoResult
+csvtmt_copy_to(
+	CsvTomato *self,
+	const char *table_name,
+	const char *path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+) {
+	CsvTomatoModel model;
+
+	csvtmt_model_init(&model, self->db_dir, error);
+	if (error->error) {
+		return CSVTMT_ERROR;
+	}
+
+	model.sync_level = self->sync_level;
+	model.io_backend = self->io_backend;
+	model.mmap.window = self->mmap_window;
+	model.catalog = &self->catalog;
+	model.locks = &self->locks;
+	model.table_name = table_name;
+	snprintf(model.table_path, sizeof model.table_path, "%s/%s.csv", self->db_dir, table_name);
+
+	csvtmt_copy_table_to_file(&model, path, opts, error);
+	csvtmt_model_final(&model);
+	if (error->error) {
+		return CSVTMT_ERROR;
+	}
+
+	return CSVTMT_OK;
+}
+
+/**
+ * テーブルの統計を返す。統計が無い（ANALYZEしていない）時はNULLを返す。
+ *
+ * 返した統計はデータベースが持っていて、次の書き込みで更新される。
+ */
+const CsvTomatoTableStats *
+csvtmt_table_stats(CsvTomato *self, const char *table_name, CsvTomatoError *error) {
+	CsvTomatoModel model;
+
+	csvtmt_model_init(&model, self->db_dir, error);
+	if (error->error) {
+		return NULL;
+	}
+
+	model.catalog = &self->catalog;
+	model.locks = &self->locks;
+	model.table_name = table_name;
+	snprintf(model.table_path, sizeof model.table_path, "%s/%s.csv", self->db_dir, table_name);
+
+	const CsvTomatoTableStats *stats = NULL;
+	csvtmt_header_load_from_table(&model, error);
+	if (!error->error) {
+		stats = csvtmt_model_stats(&model);
+	}
+	csvtmt_model_final(&model);
+
+	return stats;
+}
+
+// キャッシュのキーにするためにクエリを正規化する。
+// 文字列リテラルの外の連続する空白を1つにまとめ、前後の空白を取り除く。
+static char *
+normalize_query(const char *query, CsvTomatoError *error) {
+	errno = 0;
+	char *key = malloc(strlen(query) + 1);
+	if (!key) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
+		return NULL;
+	}
+
+	char *dst = key;
+	char quote = 0;
+	bool space = false;
+
+	for (const char *p = query; *p; p++) {
+		if (quote) {
+			*dst++ = *p;
+			if (*p == '\\' && p[1]) {
+				*dst++ = *++p;
+			} else if (*p == quote) {
+				quote = 0;
+			}
+			continue;
+		}
+		if (isspace((unsigned char) *p)) {
+			space = true;
+			continue;
+		}
+		if (space && dst != key) {
+			*dst++ = ' ';
+		}
+		space = false;
+		if (*p == '"' || *p == '\'') {
+			quote = *p;
+		}
+		*dst++ = *p;
+	}
+
+	*dst = '\0';
+	return key;
+}
+
+static void
+stmt_cache_lock(CsvTomato *self) {
+	if (self->threadsafe) {
+		pthread_mutex_lock(&self->stmt_cache_mutex);
+	}
+}
+
+static void
+stmt_cache_unlock(CsvTomato *self) {
+	if (self->threadsafe) {
+		pthread_mutex_unlock(&self->stmt_cache_mutex);
+	}
+}
+
+// 他のスレッドが実行していない文だけを返す。
+static CsvTomatoStmtCacheEntry *
+stmt_cache_find(CsvTomato *self, const char *query) {
+	for (size_t i = 0; i < self->stmt_cache_len; i++) {
+		CsvTomatoStmtCacheEntry *entry = &self->stmt_cache[i];
+		if (!entry->busy && !strcmp(entry->query, query)) {
+			entry->last_used = ++self->stmt_cache_clock;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static CsvTomatoStmtCacheEntry *
+stmt_cache_find_stmt(CsvTomato *self, const CsvTomatoStmt *stmt) {
+	for (size_t i = 0; i < self->stmt_cache_len; i++) {
+		if (self->stmt_cache[i].stmt == stmt) {
+			return &self->stmt_cache[i];
+		}
+	}
+	return NULL;
+}
+
+// queryとstmtの所有権はキャッシュに移る。満杯なら一番長く使われていない文を捨てる。
+// 全て実行中で捨てられない時はNULLを返し、所有権は呼び出し側に残る。
+static CsvTomatoStmtCacheEntry *
+stmt_cache_put(CsvTomato *self, char *query, CsvTomatoStmt *stmt) {
+	CsvTomatoStmtCacheEntry *entry = NULL;
+
+	if (self->stmt_cache_len < csvtmt_numof(self->stmt_cache)) {
+		entry = &self->stmt_cache[self->stmt_cache_len++];
+	} else {
+		for (size_t i = 0; i < self->stmt_cache_len; i++) {
+			CsvTomatoStmtCacheEntry *cur = &self->stmt_cache[i];
+			if (!cur->busy && (!entry || cur->last_used < entry->last_used)) {
+				entry = cur;
+			}
+		}
+		if (!entry) {
+			return NULL;
+		}
+		free(entry->query);
+		csvtmt_stmt_del(entry->stmt);
+	}
+
+	entry->query = query;
+	entry->stmt = stmt;
+	entry->last_used = ++self->stmt_cache_clock;
+	entry->busy = false;
+	return entry;
+}
+
+static void
+stmt_cache_remove(CsvTomato *self, CsvTomatoStmtCacheEntry *entry) {
+	free(entry->query);
+	csvtmt_stmt_del(entry->stmt);
+	*entry = self->stmt_cache[--self->stmt_cache_len];
+}
+
+/**
+ * 同じクエリはコンパイル済みの文をキャッシュから取り出し、リセットして再実行する。
+ *
+ * スレッドセーフなデータベースでは、キャッシュは文のプールになる。
+ * 取り出した文は実行が終わるまで他のスレッドに渡さず、全て使用中なら新しくコンパイルする。
+ * キャッシュを触る間だけmutexを持ち、実行中は持たない。
+ */
 CsvTomatoResult
 csvtmt_exec(
 	CsvTomato *self,
@@ -147,27 +475,74 @@ csvtmt_exec(
 	CsvTomatoError *error
 ) {
 	CsvTomatoResult result;
+	CsvTomatoStmt *stmt = NULL;
 
-	CsvTomatoStmt *stmt = csvtmt_stmt_new(self->db_dir, error);
+	char *key = normalize_query(query, error);
 	if (error->error) {
-		goto fail;
+		return CSVTMT_ERROR;
 	}
 
-	csvtmt_stmt_prepare(stmt, query, error);
-	if (error->error) {
-		goto fail;
+	stmt_cache_lock(self);
+	self->changes = 0;
+	CsvTomatoStmtCacheEntry *entry = stmt_cache_find(self, key);
+	if (entry) {
+		entry->busy = true;
+		stmt = entry->stmt;
+	}
+	stmt_cache_unlock(self);
+
+	if (entry) {
+		free(key);
+		key = NULL;
+	} else {
+		stmt = csvtmt_stmt_new(self->db_dir, error);
+		if (error->error) {
+			free(key);
+			return CSVTMT_ERROR;
+		}
+
+		csvtmt_stmt_prepare(stmt, query, error);
+		if (error->error) {
+			free(key);
+			csvtmt_stmt_del(stmt);
+			return CSVTMT_ERROR;
+		}
 	}
+	stmt->model.sync_level = self->sync_level;
+	stmt->model.io_backend = self->io_backend;
+	stmt->model.mmap.window = self->mmap_window;
+	stmt->model.columnar.enabled = self->columnar;
+	stmt->model.catalog = &self->catalog;
+	stmt->model.locks = &self->locks;
 
 	result = csvtmt_stmt_step(stmt, error);
-	if (error->error) {
-		goto fail;
+	size_t changes = stmt->model.changes;
+	if (!error->error) {
+		// 開いているテーブルを閉じて次の実行に備える
+		csvtmt_reset(stmt);
 	}
 
-	csvtmt_stmt_del(stmt);
+	stmt_cache_lock(self);
+	// 実行している間に他のスレッドが詰め直しているかもしれないので文で探す
+	entry = key ? NULL : stmt_cache_find_stmt(self, stmt);
+	if (error->error) {
+		// 失敗した文は状態が分からないので捨てる
+		if (entry) {
+			stmt_cache_remove(self, entry);
+		} else {
+			free(key);
+			csvtmt_stmt_del(stmt);
+		}
+	} else if (entry) {
+		entry->busy = false;
+	} else if (!stmt_cache_put(self, key, stmt)) {
+		free(key);
+		csvtmt_stmt_del(stmt);
+	}
+	self->changes = error->error ? 0 : changes;
+	stmt_cache_unlock(self);
 
-	return result;
-fail:
-	return CSVTMT_ERROR;
+	return error->error ? CSVTMT_ERROR : result;
 }
 
 CsvTomatoResult
@@ -181,6 +556,13 @@ csvtmt_prepare(
 	if (error->error) {
 		return CSVTMT_ERROR;
 	}
+	(*stmt)->model.sync_level = self->sync_level;
+	(*stmt)->model.io_backend = self->io_backend;
+	(*stmt)->model.mmap.window = self->mmap_window;
+	(*stmt)->model.columnar.enabled = self->columnar;
+	// 文はデータベースのカタログを指すので、csvtmt_close()より先に解放すること
+	(*stmt)->model.catalog = &self->catalog;
+	(*stmt)->model.locks = &self->locks;
 
 	return csvtmt_stmt_prepare(*stmt, query, error);
 }
@@ -195,6 +577,23 @@ csvtmt_static(void *ptr) {
 	// pass
 }
 
+// index番目（1始まり）のプレースホルダを前の値を外した状態で返す。
+static CsvTomatoOpcodeElem *
+find_place_holder(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+	assert(stmt);
+	assert(stmt->opcode);
+
+	CsvTomatoOpcodeElem *elem = csvtmt_opcode_place_holder(stmt->opcode, index);
+	if (!elem) {
+		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "place holder index %ld out of range", index);
+		return NULL;
+	}
+
+	csvtmt_opcode_unbind_elem(elem);
+	elem->old_kind = CSVTMT_OP_PLACE_HOLDER;
+	return elem;
+}
+
 void
 csvtmt_bind_text(
 	CsvTomatoStmt *stmt,
@@ -204,39 +603,29 @@ csvtmt_bind_text(
 	void (*destructor)(void*),
 	CsvTomatoError *error
 ) {
-	size_t count = 1;
+	CsvTomatoOpcodeElem *elem = find_place_holder(stmt, index, error);
+	if (!elem) {
+		return;
+	}
 
-	assert(stmt);
-	assert(stmt->opcode);
-	for (size_t i = 0; i < stmt->opcode->len; i++) {
-		CsvTomatoOpcodeElem *elem = &stmt->opcode->elems[i];
-		if (elem->kind == CSVTMT_OP_PLACE_HOLDER ||
-			elem->old_kind == CSVTMT_OP_PLACE_HOLDER) {
-			if (count == index) {
-				elem->old_kind = elem->kind;
-				elem->kind = CSVTMT_OP_STRING_VALUE;
-				if (size == -1) {
-					elem->obj.string_value.value = csvtmt_strdup(text, error);
-				} else {
-					char *s = calloc(size, sizeof(char));
-					if (!s) {
-						goto failed_to_calloc;
-					}
-
-					snprintf(s, size-1, "%s", text);
-
-					elem->obj.string_value.value = csvtmt_move(s);
-					elem->obj.string_value.destructor = destructor;
-				}
-				if (error->error) {
-					return;
-				}
-				// puts("bind text");
-				break;
-			}
-			count++;
+	if (size == -1) {
+		char *s = csvtmt_strdup(text, error);
+		if (error->error) {
+			return;
+		}
+		elem->obj.string_value.value = s;
+	} else {
+		char *s = calloc(size, sizeof(char));
+		if (!s) {
+			goto failed_to_calloc;
 		}
+
+		snprintf(s, size-1, "%s", text);
+
+		elem->obj.string_value.value = csvtmt_move(s);
+		elem->obj.string_value.destructor = destructor;
 	}
+	elem->kind = CSVTMT_OP_STRING_VALUE;
 
 	return;
 failed_to_calloc:
@@ -251,25 +640,13 @@ csvtmt_bind_int(
 	int64_t value, 
 	CsvTomatoError *error
 ) {
-	size_t count = 1;
-
-	for (size_t i = 0; i < stmt->opcode->len; i++) {
-		CsvTomatoOpcodeElem *elem = &stmt->opcode->elems[i];
-		if (elem->kind == CSVTMT_OP_PLACE_HOLDER ||
-			elem->old_kind == CSVTMT_OP_PLACE_HOLDER) {
-			if (count == index) {
-				elem->old_kind = elem->kind;
-				elem->kind = CSVTMT_OP_INT_VALUE;
-				elem->obj.int_value.value = value;
-				if (error->error) {
-					return;
-				}
-				// puts("bind int");
-				break;
-			}
-			count++;
-		}
+	CsvTomatoOpcodeElem *elem = find_place_holder(stmt, index, error);
+	if (!elem) {
+		return;
 	}
+
+	elem->kind = CSVTMT_OP_INT_VALUE;
+	elem->obj.int_value.value = value;
 }
 
 void
@@ -279,32 +656,61 @@ csvtmt_bind_double(
 	double value, 
 	CsvTomatoError *error
 ) {
-	size_t count = 1;
-
-	for (size_t i = 0; i < stmt->opcode->len; i++) {
-		CsvTomatoOpcodeElem *elem = &stmt->opcode->elems[i];
-		if (elem->kind == CSVTMT_OP_PLACE_HOLDER ||
-			elem->old_kind == CSVTMT_OP_PLACE_HOLDER) {
-			if (count == index) {
-				elem->old_kind = elem->kind;
-				elem->kind = CSVTMT_OP_DOUBLE_VALUE;
-				elem->obj.double_value.value = value;
-				if (error->error) {
-					return;
-				}
-				break;
-			}
-			count++;
+	CsvTomatoOpcodeElem *elem = find_place_holder(stmt, index, error);
+	if (!elem) {
+		return;
+	}
+
+	elem->kind = CSVTMT_OP_DOUBLE_VALUE;
+	elem->obj.double_value.value = value;
+}
+
+// values[i]を(i+1)番目のプレースホルダにまとめてバインドする。
+// 文字列はコピーするのでvaluesは呼び出し後に解放していい。
+void
+csvtmt_bind_row(
+	CsvTomatoStmt *stmt,
+	const CsvTomatoValue values[],
+	size_t values_len,
+	CsvTomatoError *error
+) {
+	if (values_len > csvtmt_bind_parameter_count(stmt)) {
+		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "too many values to bind. %ld place holders but %ld values", csvtmt_bind_parameter_count(stmt), values_len);
+		return;
+	}
+
+	for (size_t i = 0; i < values_len; i++) {
+		const CsvTomatoValue *value = &values[i];
+		switch (value->kind) {
+		default:
+			csvtmt_error_push(error, CSVTMT_ERR_EXEC, "invalid value kind to bind at %ld", i+1);
+			return;
+		case CSVTMT_VAL_INT:
+			csvtmt_bind_int(stmt, i+1, value->int_value, error);
+			break;
+		case CSVTMT_VAL_DOUBLE:
+			csvtmt_bind_double(stmt, i+1, value->double_value, error);
+			break;
+		case CSVTMT_VAL_STRING:
+			csvtmt_bind_text(stmt, i+1, value->string_value, -1, CSVTMT_TRANSTENT, error);
+			break;
+		}
+		if (error->error) {
+			return;
 		}
 	}
 }
 
+size_t
+csvtmt_bind_parameter_count(CsvTomatoStmt *stmt) {
+	return stmt->opcode->place_holders->len;
+}
+
 CsvTomatoResult
 csvtmt_step(CsvTomatoStmt *stmt, CsvTomatoError *error) {
 	CsvTomatoResult result;
 
-	csvtmt_row_final(&stmt->model.row);
-	memset(&stmt->model.row, 0, sizeof(stmt->model.row));
+	csvtmt_row_clear(&stmt->model.row);
 
 	result = csvtmt_executor_exec(
 		stmt->executor,
@@ -313,58 +719,298 @@ csvtmt_step(CsvTomatoStmt *stmt, CsvTomatoError *error) {
 		stmt->opcode->len,
 		error
 	);
+	if (result != CSVTMT_ROW) {
+		csvtmt_model_unlock(&stmt->model);
+	}
 	if (error->error) {
 		return CSVTMT_ERROR;
 	}
 	return result;
 }
 
+/**
+ * csvtmt_step()と同じだが、SELECTの走査がディスクの読み込みを待ちそうな時は
+ * CSVTMT_WOULD_BLOCKを返す。csvtmt_step_fd()が読めるようになったらもう一度呼ぶ。
+ *
+ * 止まるのは読み込みだけで、ロックは今まで通りbusy_timeoutに従って待つ。
+ * io_uringが使えない環境ではcsvtmt_step()と同じく止まらずに待つ。
+ */
+CsvTomatoResult
+csvtmt_step_async(CsvTomatoStmt *stmt, CsvTomatoError *error) {
+	stmt->model.async.enabled = true;
+	CsvTomatoResult result = csvtmt_step(stmt, error);
+	stmt->model.async.enabled = false;
+	return result;
+}
+
+// CSVTMT_WOULD_BLOCKの後に待つfd。まだ一度も止まっていなければ-1。
+int
+csvtmt_step_fd(CsvTomatoStmt *stmt) {
+	return stmt->model.async.fd ? stmt->model.async.fd : -1;
+}
+
+// セルの配列をまとめて伸ばす。型付きの配列は頼まれた時か一度確保した後だけ持つ。
+static bool
+batch_reserve(CsvTomatoBatch *batch, size_t n) {
+	size_t need = batch->columns_len * n;
+	bool want_ints = batch->flags & CSVTMT_BATCH_INT64;
+	bool want_doubles = batch->flags & CSVTMT_BATCH_DOUBLE;
+
+	if (need <= batch->cells_capa &&
+		(!want_ints || batch->ints) &&
+		(!want_doubles || batch->doubles)) {
+		return true;
+	}
+
+	size_t capa = need > batch->cells_capa ? need : batch->cells_capa;
+
+	#undef grow
+	#define grow(ptr) {\
+		void *p = realloc(ptr, capa * sizeof(*(ptr)));\
+		if (!p) {\
+			return false;\
+		}\
+		ptr = p;\
+	}\
+
+	grow(batch->offsets);
+	grow(batch->lengths);
+	if (want_ints || batch->ints) {
+		grow(batch->ints);
+	}
+	if (want_doubles || batch->doubles) {
+		grow(batch->doubles);
+	}
+	batch->cells_capa = capa;
+	return true;
+}
+
+/**
+ * 最大n行を実行してbatchに列ごとに詰める。
+ *
+ * 1行でも詰めればCSVTMT_ROW、もう行が無ければrows_lenを0にしてCSVTMT_DONEを返す。
+ * 行ごとにcsvtmt_step()とcsvtmt_column_*()を呼ぶより、境界の行き来と
+ * 数値への変換が列ごとにまとまる。batchの配列は呼び出しをまたいで使い回す。
+ */
+CsvTomatoResult
+csvtmt_step_batch(CsvTomatoStmt *stmt, CsvTomatoBatch *batch, size_t n, CsvTomatoError *error) {
+	CsvTomatoModel *model = &stmt->model;
+
+	batch->rows_len = 0;
+	batch->data_len = 0;
+	batch->stride = n;
+
+	// 最後まで返した文をもう一度実行すると先頭からやり直してしまう
+	if (stmt->batch_done) {
+		return CSVTMT_DONE;
+	}
+
+	while (batch->rows_len < n) {
+		CsvTomatoResult result = csvtmt_step(stmt, error);
+		if (result == CSVTMT_ERROR) {
+			return CSVTMT_ERROR;
+		}
+		if (result != CSVTMT_ROW) {
+			stmt->batch_done = true;
+			break;
+		}
+
+		if (batch->rows_len == 0) {
+			batch->columns_len = model->selected_columns_len;
+			if (!batch_reserve(batch, n)) {
+				goto failed_to_alloc;
+			}
+		} else if (model->selected_columns_len != batch->columns_len) {
+			goto invalid_columns_len;
+		}
+
+		size_t row = batch->rows_len++;
+		for (size_t col = 0; col < batch->columns_len; col++) {
+			const char *s = model->selected_columns[col];
+			if (!s) {
+				s = ""; // csvtmt_column_*()と同じく値の無いカラムは空にする
+			}
+			size_t len = strlen(s);
+			size_t cell = col * n + row;
+
+			if (!csvtmt_reserve(batch->data, batch->data_capa, batch->data_len + len + 1)) {
+				goto failed_to_alloc;
+			}
+			memcpy(batch->data + batch->data_len, s, len + 1);
+			batch->offsets[cell] = batch->data_len;
+			batch->lengths[cell] = len;
+			batch->data_len += len + 1;
+
+			if (batch->flags & CSVTMT_BATCH_INT64) {
+				batch->ints[cell] = strtoll(s, NULL, 10);
+			}
+			if (batch->flags & CSVTMT_BATCH_DOUBLE) {
+				batch->doubles[cell] = strtod(s, NULL);
+			}
+		}
+	}
+
+	return batch->rows_len ? CSVTMT_ROW : CSVTMT_DONE;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate batch");
+	return CSVTMT_ERROR;
+invalid_columns_len:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "invalid columns length in batch. expected %ld but got %ld", batch->columns_len, model->selected_columns_len);
+	return CSVTMT_ERROR;
+}
+
+const char *
+csvtmt_batch_text(const CsvTomatoBatch *batch, size_t row, size_t col) {
+	if (row >= batch->rows_len || col >= batch->columns_len) {
+		return NULL;
+	}
+	return batch->data + batch->offsets[col * batch->stride + row];
+}
+
+void
+csvtmt_batch_final(CsvTomatoBatch *batch) {
+	free(batch->data);
+	free(batch->offsets);
+	free(batch->lengths);
+	free(batch->ints);
+	free(batch->doubles);
+	memset(batch, 0, sizeof(*batch));
+}
+
+// 実行状態を巻き戻す。op-codeとバインドした値はそのまま残るので
+// もう一度csvtmt_step()すれば同じ文を再実行できる。
+void
+csvtmt_reset(CsvTomatoStmt *stmt) {
+	csvtmt_model_reset(&stmt->model);
+	stmt->batch_done = false;
+}
+
+// バインドした値を全て外してプレースホルダに戻す。
+void
+csvtmt_clear_bindings(CsvTomatoStmt *stmt) {
+	csvtmt_opcode_clear_bindings(stmt->opcode);
+}
+
 void
 csvtmt_finalize(CsvTomatoStmt *stmt) {
 	csvtmt_stmt_del(stmt);
 }
 
-int
-csvtmt_column_int(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+static bool
+check_column_index(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
 	if (!stmt->model.selected_columns_len) {
 		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "row columns length is 0");
-		return -1;
+		return false;
 	}
 
 	if (index >= stmt->model.selected_columns_len) {
 		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "index out of range");
+		return false;
+	}
+
+	return true;
+}
+
+// 今の行のindex列のキャッシュを返す。行が変わっていたら空にしてから返す。
+static CsvTomatoColumnCache *
+column_cache(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+	CsvTomatoModel *model = &stmt->model;
+
+	if (!check_column_index(stmt, index, error)) {
+		return NULL;
+	}
+
+	if (model->column_cache_capa < model->selected_columns_len) {
+		size_t capa = model->selected_columns_len;
+		CsvTomatoColumnCache *p = realloc(model->column_cache, capa * sizeof(*p));
+		if (!p) {
+			csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow column cache");
+			return NULL;
+		}
+		memset(p + model->column_cache_capa, 0, (capa - model->column_cache_capa) * sizeof(*p));
+		model->column_cache = p;
+		model->column_cache_capa = capa;
+	}
+
+	CsvTomatoColumnCache *cache = &model->column_cache[index];
+	if (cache->serial != model->row_serial) {
+		cache->serial = model->row_serial;
+		cache->flags = 0;
+	}
+
+	return cache;
+}
+
+// 64ビットより狭いので大きなIDは切り詰められる。IDはcsvtmt_column_int64()で読むこと。
+int
+csvtmt_column_int(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+	if (!check_column_index(stmt, index, error)) {
+		return -1;
+	}
+	return (int) csvtmt_column_int64(stmt, index, error);
+}
+
+// 同じ行の同じ列は最初の1回だけ変換して覚えておく。
+int64_t
+csvtmt_column_int64(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+	CsvTomatoColumnCache *cache = column_cache(stmt, index, error);
+	if (!cache) {
 		return -1;
 	}
 
-	return atoi(stmt->model.selected_columns[index]);
+	if (!(cache->flags & CSVTMT_COLUMN_CACHE_INT64)) {
+		const char *s = stmt->model.selected_columns[index];
+		cache->int64_value = s ? strtoll(s, NULL, 10) : 0;
+		cache->flags |= CSVTMT_COLUMN_CACHE_INT64;
+	}
+
+	return cache->int64_value;
 }
 
 double
 csvtmt_column_double(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
-	if (!stmt->model.selected_columns_len) {
-		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "row columns length is 0");
+	CsvTomatoColumnCache *cache = column_cache(stmt, index, error);
+	if (!cache) {
 		return -1.0;
 	}
 
-	if (index >= stmt->model.selected_columns_len) {
-		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "index out of range");
-		return -1.0;
+	if (!(cache->flags & CSVTMT_COLUMN_CACHE_DOUBLE)) {
+		const char *s = stmt->model.selected_columns[index];
+		cache->double_value = s ? strtod(s, NULL) : 0.0;
+		cache->flags |= CSVTMT_COLUMN_CACHE_DOUBLE;
 	}
 
-	return atof(stmt->model.selected_columns[index]);
+	return cache->double_value;
 }
 
 const char *
 csvtmt_column_text(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
-	if (!stmt->model.selected_columns_len) {
-		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "row columns length is 0");
+	if (!check_column_index(stmt, index, error)) {
 		return NULL;
 	}
 
-	if (index >= stmt->model.selected_columns_len) {
-		csvtmt_error_push(error, CSVTMT_ERR_INDEX_OUT_OF_RANGE, "index out of range");
-		return NULL;
+	return stmt->model.selected_columns[index];
+}
+
+// 行のバッファを直接指すのでコピーしない。次のcsvtmt_step()まで有効。
+// 長さはcsvtmt_column_bytes()で取得する。
+const void *
+csvtmt_column_blob(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+	return csvtmt_column_text(stmt, index, error);
+}
+
+size_t
+csvtmt_column_bytes(CsvTomatoStmt *stmt, size_t index, CsvTomatoError *error) {
+	CsvTomatoColumnCache *cache = column_cache(stmt, index, error);
+	if (!cache) {
+		return 0;
 	}
 
-	return stmt->model.selected_columns[index];
+	if (!(cache->flags & CSVTMT_COLUMN_CACHE_BYTES)) {
+		const char *s = stmt->model.selected_columns[index];
+		cache->bytes = s ? strlen(s) : 0;
+		cache->flags |= CSVTMT_COLUMN_CACHE_BYTES;
+	}
+
+	return cache->bytes;
 }
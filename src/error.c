@@ -3,6 +3,7 @@
 void
 csvtmt_error_clear(CsvTomatoError *self) {
 	self->error = false;
+	self->len = 0;
 }
 
 void _Noreturn
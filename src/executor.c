@@ -44,6 +44,170 @@ skip_to(
 	return 0;
 }
 
+// COPY (SELECT ...) TO のヘッダ行を書き出す。カラム名はSELECTのop-codeから拾う。
+static void
+copy_write_header(
+	CsvTomatoModel *model,
+	const CsvTomatoOpcodeElem *opcodes,
+	size_t opcodes_len,
+	CsvTomatoError *error
+) {
+	CsvTomatoWriter *w = model->copy.writer;
+	char sep = model->copy.sep;
+	bool in_names = false;
+	bool first = true;
+
+	#define write_name(name) {\
+		if (!first) {\
+			csvtmt_writer_write(w, &sep, 1, error);\
+		}\
+		csvtmt_writer_write_field(w, name, sep, error);\
+		first = false;\
+	}\
+
+	for (size_t i = model->copy.opcodes_beg; i < opcodes_len; i++) {
+		const CsvTomatoOpcodeElem *op = &opcodes[i];
+		if (op->kind == CSVTMT_OP_COLUMN_NAMES_BEG) {
+			in_names = true;
+		} else if (op->kind == CSVTMT_OP_COLUMN_NAMES_END) {
+			break;
+		} else if (in_names && op->kind == CSVTMT_OP_STAR) {
+			for (size_t j = 0; j < model->header->types_len; j++) {
+				const char *name = model->header->types[j].type_name;
+				if (strcmp(name, CSVTMT_COL_MODE)) {
+					write_name(name);
+				}
+			}
+		} else if (in_names && op->kind == CSVTMT_OP_STRING_VALUE) {
+			write_name(op->obj.string_value.value);
+		}
+	}
+
+	csvtmt_writer_write(w, "\n", 1, error);
+	model->copy.wrote_header = true;
+}
+
+static void
+copy_write_row(
+	CsvTomatoModel *model,
+	const CsvTomatoOpcodeElem *opcodes,
+	size_t opcodes_len,
+	CsvTomatoError *error
+) {
+	CsvTomatoWriter *w = model->copy.writer;
+	char sep = model->copy.sep;
+
+	if (model->copy.header && !model->copy.wrote_header) {
+		copy_write_header(model, opcodes, opcodes_len, error);
+	}
+
+	for (size_t i = 0; i < model->selected_columns_len; i++) {
+		if (i) {
+			csvtmt_writer_write(w, &sep, 1, error);
+		}
+		csvtmt_writer_write_field(w, model->selected_columns[i], sep, error);
+	}
+	csvtmt_writer_write(w, "\n", 1, error);
+}
+
+// UPDATEは元の行を論理削除して編集後の行を追記するので、死んだ行が増える。
+static void
+count_updated_rows(CsvTomatoModel *model) {
+	CsvTomatoTableStats *stats = csvtmt_model_stats(model);
+	csvtmt_stats_add_rows(stats, model->table_path, model->mmap.size, 0, model->changes);
+	csvtmt_stats_add_key_values(
+		stats,
+		model->header,
+		model->update_set_key_values,
+		model->update_set_key_values_len
+	);
+}
+
+// テーブルのヘッダを読んでmmap.curを最初の行に進める。
+// ヘッダを解析し直した時だけ、IDENTのカラム名をヘッダ上の位置に解決し直す。
+// 以降は行ごとに名前を比べずにcolumn_indexesを引く。
+static void
+load_header(
+	CsvTomatoModel *model,
+	const CsvTomatoOpcodeElem *opcodes,
+	size_t opcodes_len,
+	CsvTomatoError *error
+) {
+	model->mmap.cur = (char *) csvtmt_header_load_from_mmap(model, error);
+	if (error->error) {
+		return;
+	}
+	if (model->column_indexes_version == model->header->version) {
+		return;
+	}
+
+	if (!csvtmt_reserve(model->column_indexes, model->column_indexes_capa, opcodes_len)) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow column indexes");
+		return;
+	}
+	for (size_t i = 0; i < opcodes_len; i++) {
+		model->column_indexes[i] = -1;
+		if (opcodes[i].kind == CSVTMT_OP_IDENT) {
+			model->column_indexes[i] = csvtmt_find_type_index(model, opcodes[i].obj.ident.value);
+		}
+	}
+	model->column_indexes_version = model->header->version;
+}
+
+// 文のWHEREが「カラム = リテラル」だけならpredにコンパイルする。
+// それ以外（未バインドのプレースホルダなど）はfalseを返して行ごとの実行に任せる。
+static bool
+compile_predicate(
+	CsvTomatoModel *model,
+	const CsvTomatoOpcodeElem *opcodes,
+	size_t opcodes_len,
+	CsvTomatoOpcodeKind end_kind,
+	CsvTomatoPredicate *pred
+) {
+	size_t i = model->opcodes_index + 1;
+
+	memset(pred, 0, sizeof(*pred));
+	if (i < opcodes_len && opcodes[i].kind == end_kind) {
+		pred->all = true;
+		return true;
+	}
+
+	// WHERE_BEG, IDENT, VALUE, ASSIGN, WHERE_END, end_kind
+	if (i + 5 >= opcodes_len) {
+		return false;
+	}
+	const CsvTomatoOpcodeElem *op = &opcodes[i];
+	if (op[0].kind != CSVTMT_OP_WHERE_BEG ||
+		op[1].kind != CSVTMT_OP_IDENT ||
+		op[3].kind != CSVTMT_OP_ASSIGN ||
+		op[4].kind != CSVTMT_OP_WHERE_END ||
+		op[5].kind != end_kind) {
+		return false;
+	}
+
+	int index = model->column_indexes[i + 1];
+	if (index == -1) {
+		return false; // エラーは行ごとの実行で報告する
+	}
+	pred->column_index = index;
+
+	switch (op[2].kind) {
+	default: return false; break;
+	case CSVTMT_OP_INT_VALUE:
+		snprintf(pred->num, sizeof pred->num, "%ld", op[2].obj.int_value.value);
+		pred->value = pred->num;
+		break;
+	case CSVTMT_OP_DOUBLE_VALUE:
+		snprintf(pred->num, sizeof pred->num, "%f", op[2].obj.double_value.value);
+		pred->value = pred->num;
+		break;
+	case CSVTMT_OP_STRING_VALUE:
+		pred->value = op[2].obj.string_value.value;
+		break;
+	}
+	return true;
+}
+
 typedef struct {
 	CsvTomatoFuncKind kind;
 	const char *column_name;
@@ -58,26 +222,20 @@ csvtmt_executor_exec(
 	size_t opcodes_len,
 	CsvTomatoError *error
 ) {
-	#define check_array(IDENT) {\
-		if (IDENT ## _len >= csvtmt_numof(IDENT)) {\
-			goto array_overflow;\
-		}\
-	}\
-
 	#define cleanup() {\
 		csvtmt_str_del(buf);\
 		buf = NULL;\
 	}\
 
 	#define stack_push(o) {\
-		if (model->stack_len >= csvtmt_numof(model->stack)) {\
+		if (!csvtmt_reserve(model->stack, model->stack_capa, model->stack_len + 1)) {\
 			goto stack_overflow;\
 		}\
 		model->stack[model->stack_len++] = o;\
 	}\
 
 	#define stack_push_kind(k) {\
-		if (model->stack_len >= csvtmt_numof(model->stack)) {\
+		if (!csvtmt_reserve(model->stack, model->stack_capa, model->stack_len + 1)) {\
 			goto stack_overflow;\
 		}\
 		CsvTomatoStackElem o = {.kind=k};\
@@ -98,6 +256,19 @@ csvtmt_executor_exec(
 		dst = model->stack[model->stack_len-1];\
 	}\
 
+	// COPY (SELECT ...) TO の最中は行を返さずに出力ファイルに書く
+	#define return_row() {\
+		if (model->copy.writer) {\
+			copy_write_row(model, opcodes, opcodes_len, error);\
+			if (error->error) {\
+				goto failed_to_copy;\
+			}\
+			csvtmt_row_clear(&model->row);\
+			continue;\
+		}\
+		goto ret_row;\
+	}\
+
 	#define restore_save_index() {\
 		if (model->save_opcodes_index == 0) {\
 			model->opcodes_index = 0;\
@@ -175,6 +346,71 @@ csvtmt_executor_exec(
 		case CSVTMT_OP_SHOW_TABLES_END: {
 			goto done;
 		} break;
+		case CSVTMT_OP_COPY_FROM: {
+			CsvTomatoCopyOpts opts = {
+				.header = op->obj.copy_stmt.header,
+				.delimiter = op->obj.copy_stmt.delimiter,
+			};
+			model->table_name = op->obj.copy_stmt.table_name;
+			store_table_path(model, model->table_name);
+			csvtmt_copy_from_file(model, op->obj.copy_stmt.path, &opts, error);
+			if (error->error) {
+				goto failed_to_copy;
+			}
+		} break;
+		case CSVTMT_OP_COPY_TO: {
+			CsvTomatoCopyOpts opts = {
+				.header = op->obj.copy_stmt.header,
+				.delimiter = op->obj.copy_stmt.delimiter,
+			};
+			model->table_name = op->obj.copy_stmt.table_name;
+			store_table_path(model, model->table_name);
+			csvtmt_copy_table_to_file(model, op->obj.copy_stmt.path, &opts, error);
+			if (error->error) {
+				goto failed_to_copy;
+			}
+		} break;
+		case CSVTMT_OP_ANALYZE: {
+			model->table_name = op->obj.analyze_stmt.table_name;
+			csvtmt_analyze(model, error);
+			if (error->error) {
+				goto failed_to_analyze;
+			}
+		} break;
+		case CSVTMT_OP_COPY_TO_BEG: {
+			// SELECTの行ループから戻ってくることがあるので一度だけ開く
+			if (!model->copy.writer) {
+				model->copy.path = op->obj.copy_stmt.path;
+				model->copy.sep = op->obj.copy_stmt.delimiter ? op->obj.copy_stmt.delimiter : ',';
+				model->copy.header = op->obj.copy_stmt.header;
+				model->copy.wrote_header = false;
+				model->copy.opcodes_beg = model->opcodes_index;
+				snprintf(model->copy.tmp_path, sizeof model->copy.tmp_path, "%s.%ld.tmp", model->copy.path, (long) getpid());
+				model->copy.writer = csvtmt_writer_new(model->copy.tmp_path, O_WRONLY | O_CREAT | O_TRUNC, error);
+				if (error->error) {
+					goto failed_to_copy;
+				}
+				csvtmt_writer_use_backend(model->copy.writer, model->io_backend);
+			}
+		} break;
+		case CSVTMT_OP_COPY_TO_END: {
+			if (model->copy.header && !model->copy.wrote_header) {
+				copy_write_header(model, opcodes, opcodes_len, error);
+			}
+			csvtmt_writer_sync(model->copy.writer, model->sync_level, error);
+			if (error->error) {
+				goto failed_to_copy;
+			}
+			csvtmt_writer_del(model->copy.writer);
+			model->copy.writer = NULL;
+			if (csvtmt_file_rename(model->copy.tmp_path, model->copy.path) == -1) {
+				remove(model->copy.tmp_path);
+				goto failed_to_copy;
+			}
+			if (csvtmt_file_sync_dir(model->copy.path, model->sync_level) == -1) {
+				goto failed_to_copy;
+			}
+		} break;
 		/*
 			UPDATE users SET age = 1, name = "Taro" WHERE age == 1 AND name = "Ken"; 
 			↓
@@ -264,12 +500,15 @@ csvtmt_executor_exec(
 				store_table_path(model, model->table_name);
 				model->update_set_key_values_len = 0;
 
+				if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+					goto failed_to_lock_table;
+				}
 				csvtmt_open_mmap_for_read_write(model, model->table_path, error);
 				if (error->error) {
 					goto failed_to_open_mmap;
 				}				
 
-				model->mmap.cur = (char *) csvtmt_header_read_from_string(&model->header, model->mmap.cur, error);
+				load_header(model, opcodes, opcodes_len, error);
 				if (error->error) {
 					goto failed_to_read_header;
 				}
@@ -285,7 +524,6 @@ csvtmt_executor_exec(
 			}
 
 			model->save_opcodes_index = model->opcodes_index;
-			model->row_head = model->mmap.cur;
 			model->skip = false;
 
 			csvtmt_parse_row_from_mmap(model, error);
@@ -301,26 +539,37 @@ csvtmt_executor_exec(
 					error
 				);
 				model->skip = true;
-				csvtmt_row_final(&model->row);
+				csvtmt_row_clear(&model->row);
 				continue;
 			}
 		} break;
 		case CSVTMT_OP_UPDATE_STMT_END: {
 			// puts("update end");
 			if (model->skip) {
-				if (*model->mmap.cur == '\0') {
-					csvtmt_close_mmap(model);
+				if (csvtmt_mmap_at_end(model, error)) {
+					model->changes = model->rows->len;
 					csvtmt_append_rows_to_table(
 						model->table_path,
 						model->rows,
 						false,
+						model->sync_level,
 						error
 					);
 					if (error->error) {
+						csvtmt_close_mmap(model);
 						goto failed_to_append_rows;
 					}
+					csvtmt_flush_tombstones(model, error);
+					if (!error->error) {
+						csvtmt_sync_mmap(model, error);
+					}
+					csvtmt_close_mmap(model);
+					if (error->error) {
+						goto failed_to_sync_table;
+					}
+					count_updated_rows(model);
 					csvtmt_clear_rows(model->rows);
-					csvtmt_row_final(&model->row);
+					csvtmt_row_clear(&model->row);
 					model->opcodes_index++;
 				} else {
 					restore_save_index();
@@ -329,7 +578,7 @@ csvtmt_executor_exec(
 			}
 
 			not_found = csvtmt_header_has_key_values_types(
-				&model->header,
+				model->header,
 				model->update_set_key_values,
 				model->update_set_key_values_len,
 				error
@@ -343,13 +592,13 @@ csvtmt_executor_exec(
 				stack_top(top);
 
 				if (top.kind != CSVTMT_STACK_ELEM_BOOL_VALUE) {
-					csvtmt_close_mmap(model);
 					csvtmt_update_all(model, error);
+					csvtmt_close_mmap(model);
 					if (error->error) {
 						goto failed_to_update_all;
 					}
 					csvtmt_clear_rows(model->rows);
-					csvtmt_row_final(&model->row);
+					csvtmt_row_clear(&model->row);
 				} else {
 					if (top.obj.bool_value.value) {
 						// match WHERE
@@ -364,7 +613,9 @@ csvtmt_executor_exec(
 						if (error->error) {
 							goto failed_to_store_col_infos;
 						}
-						csvtmt_delete_row_head(model);
+						if (!csvtmt_delete_row_head(model)) {
+							goto array_overflow;
+						}
 						csvtmt_replace_row(model, &model->row, &infos, error);
 						if (error->error) {
 							goto failed_to_replace_row;
@@ -374,33 +625,46 @@ csvtmt_executor_exec(
 						}
 						memset(&model->row, 0, sizeof(model->row));
 					}
-					if (*model->mmap.cur == '\0') {
-						csvtmt_close_mmap(model);
+					if (csvtmt_mmap_at_end(model, error)) {
+						// 編集後の行を先に永続化してから論理削除を同期する。
+						// 途中で落ちても行が消えることは無い。
+						model->changes = model->rows->len;
 						csvtmt_append_rows_to_table(
 							model->table_path,
 							model->rows,
 							false,
+							model->sync_level,
 							error
 						);
 						if (error->error) {
+							csvtmt_close_mmap(model);
 							goto failed_to_append_rows;
 						}
+						csvtmt_flush_tombstones(model, error);
+						if (!error->error) {
+							csvtmt_sync_mmap(model, error);
+						}
+						csvtmt_close_mmap(model);
+						if (error->error) {
+							goto failed_to_sync_table;
+						}
+						count_updated_rows(model);
 						csvtmt_clear_rows(model->rows);
-						csvtmt_row_final(&model->row);
+						csvtmt_row_clear(&model->row);
 					} else {
 						restore_save_index();
-						csvtmt_row_final(&model->row);
+						csvtmt_row_clear(&model->row);
 						continue;
 					}
 				}
 			} else {
-				csvtmt_close_mmap(model);
 				csvtmt_update_all(model, error);
+				csvtmt_close_mmap(model);
 				if (error->error) {
 					goto failed_to_update_all;
 				}
 				csvtmt_clear_rows(model->rows);
-				csvtmt_row_final(&model->row);
+				csvtmt_row_clear(&model->row);
 			}
 		} break;
 		case CSVTMT_OP_UPDATE_SET_BEG: {
@@ -418,11 +682,12 @@ csvtmt_executor_exec(
 				switch (pop.kind) {
 				default: goto invalid_stack_elem_kind; break;
 				case CSVTMT_STACK_ELEM_KEY_VALUE: {
-					if (model->update_set_key_values_len >= csvtmt_numof(model->update_set_key_values)) {
+					if (!csvtmt_reserve(model->update_set_key_values, model->update_set_key_values_capa, model->update_set_key_values_len + 1)) {
 						goto array_overflow;
 					}
 				 	CsvTomatoKeyValue *kv =  &model->update_set_key_values[model->update_set_key_values_len++];
 				 	kv->key = pop.obj.key_value.key;
+				 	kv->index = pop.obj.key_value.index;
 				 	kv->value = pop.obj.key_value.value;
 				 	// printf("kv->key[%s]\n", kv->key);
 				} break;
@@ -438,19 +703,70 @@ csvtmt_executor_exec(
 				model->column_names_len = 0;
 				store_table_path(model, model->table_name);
 
-				csvtmt_open_mmap_for_read_write(model, model->table_path, error);
+				// 列ストアが古ければ先に追いつかせる。その時は排他ロックを持ったまま開く
+				if (model->columnar.enabled) {
+					csvtmt_columnar_refresh(model);
+				}
+				if (!csvtmt_model_lock(model, CSVTMT_LOCK_SHARED, error)) {
+					goto failed_to_lock_table;
+				}
+				// SELECTは論理削除を書かないので読み込み専用で開く
+				csvtmt_open_mmap_for_read(model, model->table_path, error);
 				if (error->error) {
 					goto failed_to_open_mmap;
 				}				
 
-				model->mmap.cur = (char *) csvtmt_header_read_from_string(&model->header, model->mmap.cur, error);
+				// 開いた時点の長さと論理削除ログの長さを覚えれば、
+				// 後から書く文を待たせずに同じ見え方で最後まで読める
+				csvtmt_snapshot_open(model, error);
+				if (error->error) {
+					goto failed_to_open_mmap;
+				}
+				if (model->columnar.enabled) {
+					csvtmt_columnar_open(model);
+				}
+				csvtmt_model_unlock(model);
+				if (!model->columnar.active) {
+					csvtmt_scan_advise(model);
+					csvtmt_readahead_start(model);
+				}
+			}
+
+			// 次の行がまだディスクの上なら、読み込みを投げて呼び出し元に返す。
+			// opcodes_indexを進めないので、次の呼び出しはこのopcodeからやり直す
+			if (model->async.enabled && !model->columnar.active && !csvtmt_async_ready(model, error)) {
+				goto would_block;
+			}
+			if (error->error) {
+				goto failed_to_open_mmap;
+			}
+
+			// 見出しは開いた後の最初の1回だけ読む。非同期なら見出しのページも待たずに済む
+			if (csvtmt_mmap_offset(model, model->mmap.cur) == 0) {
+				load_header(model, opcodes, opcodes_len, error);
 				if (error->error) {
 					goto failed_to_read_header;
 				}
 			}
 
-			if (*model->mmap.cur == '\0') {
+			bool at_end = model->columnar.active ?
+				csvtmt_columnar_at_end(model) :
+				csvtmt_mmap_at_end(model, error);
+			if (at_end) {
 				csvtmt_close_mmap(model);
+				if (model->copy.writer) {
+					model->opcodes_index = skip_to(
+						model,
+						opcodes,
+						opcodes_len,
+						CSVTMT_OP_SELECT_STMT_END,
+						error
+					) + 1;
+					if (error->error) {
+						goto failed_to_copy;
+					}
+					continue;
+				}
 				goto done;
 			}
 
@@ -460,11 +776,22 @@ csvtmt_executor_exec(
 			model->selected_columns_len = 0;
 			model->column_names_len = 0;
 
-			csvtmt_parse_row_from_mmap(model, error);
-			if (error->error) {
-				goto failed_to_parse_row;
+			bool deleted;
+			if (model->columnar.active) {
+				size_t head = csvtmt_columnar_read_row(model, error);
+				if (error->error) {
+					goto failed_to_parse_row;
+				}
+				deleted = csvtmt_snapshot_is_deleted_at(model, head);
+			} else {
+				csvtmt_readahead(model, model->mmap.cur);
+				csvtmt_parse_row_from_mmap(model, error);
+				if (error->error) {
+					goto failed_to_parse_row;
+				}
+				deleted = csvtmt_snapshot_is_deleted(model, model->row_head);
 			}
-			if (csvtmt_is_deleted_row(&model->row)) {
+			if (deleted) {
 				// puts("deleted row");
 				model->opcodes_index = skip_to(
 					model,
@@ -474,7 +801,7 @@ csvtmt_executor_exec(
 					error
 				);
 				model->skip = true;
-				csvtmt_row_final(&model->row);
+				csvtmt_row_clear(&model->row);
 				continue;
 			}
 		} break;
@@ -483,7 +810,7 @@ csvtmt_executor_exec(
 			cur_context = CSVTMT_OP_SELECT_STMT_END;
 
 			if (model->skip) {
-				csvtmt_row_final(&model->row);
+				csvtmt_row_clear(&model->row);
 				restore_save_index();
 				continue;
 			}
@@ -498,7 +825,7 @@ csvtmt_executor_exec(
 						goto failed_to_store_selected_columns;
 					}
 					restore_save_index();
-					goto ret_row;
+					return_row();
 				} else if (top.obj.bool_value.value) {
 					// WHERE match
 					// puts("match");
@@ -507,11 +834,11 @@ csvtmt_executor_exec(
 						goto failed_to_store_selected_columns;
 					}
 					restore_save_index();
-					goto ret_row;
+					return_row();
 				} else {
 					// WHERE not match
 					// puts("where not match");
-					csvtmt_row_final(&model->row);
+					csvtmt_row_clear(&model->row);
 					restore_save_index();
 					continue;
 				}
@@ -523,7 +850,7 @@ csvtmt_executor_exec(
 					goto failed_to_store_selected_columns;
 				}
 				restore_save_index();
-				goto ret_row;
+				return_row();
 			}
 		} break;
 
@@ -532,6 +859,9 @@ csvtmt_executor_exec(
 			model->column_names_len = 0;
 			model->values_len = 0;
 			store_table_path(model, model->table_name);
+			if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+				goto failed_to_lock_table;
+			}
 		} break;
 		case CSVTMT_OP_INSERT_STMT_END: {
 			csvtmt_insert(model, error);
@@ -601,21 +931,49 @@ csvtmt_executor_exec(
 			if (model->mmap.fd == 0) {
 				model->table_name = op->obj.delete_stmt.table_name;
 				store_table_path(model, model->table_name);
+				if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+					goto failed_to_lock_table;
+				}
 				csvtmt_open_mmap_for_read_write(model, model->table_path, error);
 				if (error->error) {
 					goto failed_to_open_mmap;
 				}
 				
-				model->mmap.cur = (char *) csvtmt_header_read_from_string(&model->header, model->mmap.cur, error);	
+				load_header(model, opcodes, opcodes_len, error);
 				if (error->error) {
 					goto failed_to_read_header;
 				}
+				model->changes = 0;
+
+				// 単純なWHEREならop-codeを行ごとに実行せずに1パスで論理削除する
+				CsvTomatoPredicate pred;
+				if (compile_predicate(model, opcodes, opcodes_len, CSVTMT_OP_DELETE_STMT_END, &pred)) {
+					csvtmt_delete(model, &pred, error);
+					if (!error->error) {
+						csvtmt_sync_mmap(model, error);
+					}
+					csvtmt_close_mmap(model);
+					if (error->error) {
+						goto failed_to_delete;
+					}
+					csvtmt_stats_add_rows(csvtmt_model_stats(model), model->table_path, model->mmap.size, -(int64_t) model->changes, model->changes);
+					model->opcodes_index = skip_to(
+						model,
+						opcodes,
+						opcodes_len,
+						CSVTMT_OP_DELETE_STMT_END,
+						error
+					) + 1;
+					if (error->error) {
+						goto failed_to_delete;
+					}
+					continue;
+				}
 			}
 
 			model->mode = CSVTMT_MODE_FIRST;
 			model->save_opcodes_index = model->opcodes_index;
 
-			model->row_head = model->mmap.cur;
 			csvtmt_parse_row_from_mmap(model, error);
 			if (error->error) {
 				goto failed_to_parse_row;
@@ -623,23 +981,37 @@ csvtmt_executor_exec(
 
 		} break;
 		case CSVTMT_OP_DELETE_STMT_END: {
+			bool match = true;
 			if (model->stack_len) {
 				CsvTomatoStackElem top;
 				stack_top(top);
-				if (top.kind != CSVTMT_STACK_ELEM_BOOL_VALUE) {
-					csvtmt_delete_row_head(model);
-				} else if (top.obj.bool_value.value) {
-					csvtmt_delete_row_head(model);
+				if (top.kind == CSVTMT_STACK_ELEM_BOOL_VALUE) {
+					match = top.obj.bool_value.value;
 				}
-			} else {
-				csvtmt_delete_row_head(model);
 			}
-			if (*model->mmap.cur == '\0') {
+			// 消えている行をもう一度ログに載せるとスナップショットから生き返って見える
+			if (match && model->row.len && !csvtmt_is_deleted_row(&model->row)) {
+				model->changes++;
+				if (!csvtmt_delete_row_head(model)) {
+					csvtmt_row_clear(&model->row);
+					goto array_overflow;
+				}
+			}
+			if (csvtmt_mmap_at_end(model, error)) {
+				csvtmt_flush_tombstones(model, error);
+				if (!error->error) {
+					csvtmt_sync_mmap(model, error);
+				}
 				csvtmt_close_mmap(model);
+				if (error->error) {
+					csvtmt_row_clear(&model->row);
+					goto failed_to_sync_table;
+				}
+				csvtmt_stats_add_rows(csvtmt_model_stats(model), model->table_path, model->mmap.size, -(int64_t) model->changes, model->changes);
 			} else {
 				model->opcodes_index = model->save_opcodes_index-1;
 			}
-			csvtmt_row_final(&model->row);
+			csvtmt_row_clear(&model->row);
 		} break;
 
 		// WHERE
@@ -664,7 +1036,10 @@ csvtmt_executor_exec(
 				case CSVTMT_STACK_ELEM_INT_VALUE: {
 					CsvTomatoStackElem elem = {0};
 					elem.kind = CSVTMT_STACK_ELEM_BOOL_VALUE;
-					int index = csvtmt_find_type_index(model, lhs.obj.ident.value);
+					int index = lhs.obj.ident.index;
+					if (index == -1) {
+						index = csvtmt_find_type_index(model, lhs.obj.ident.value);
+					}
 					if (index == -1) {
 						goto not_found_type_name;	
 					}
@@ -683,6 +1058,7 @@ csvtmt_executor_exec(
 					case CSVTMT_MODE_UPDATE_SET: {
 						elem.kind = CSVTMT_STACK_ELEM_KEY_VALUE;
 						elem.obj.key_value.key = lhs.obj.ident.value;
+						elem.obj.key_value.index = index;
 						elem.obj.key_value.value.kind = CSVTMT_VAL_INT;
 						elem.obj.key_value.value.int_value = rhs.obj.int_value.value;
 						stack_push(elem);
@@ -692,7 +1068,10 @@ csvtmt_executor_exec(
 				case CSVTMT_STACK_ELEM_DOUBLE_VALUE: {
 					CsvTomatoStackElem elem = {0};
 					elem.kind = CSVTMT_STACK_ELEM_BOOL_VALUE;
-					int index = csvtmt_find_type_index(model, lhs.obj.ident.value);
+					int index = lhs.obj.ident.index;
+					if (index == -1) {
+						index = csvtmt_find_type_index(model, lhs.obj.ident.value);
+					}
 					if (index == -1) {
 						goto not_found_type_name;	
 					}
@@ -709,6 +1088,7 @@ csvtmt_executor_exec(
 					case CSVTMT_MODE_UPDATE_SET: {
 						elem.kind = CSVTMT_STACK_ELEM_KEY_VALUE;
 						elem.obj.key_value.key = lhs.obj.ident.value;
+						elem.obj.key_value.index = index;
 						elem.obj.key_value.value.kind = CSVTMT_VAL_DOUBLE;
 						elem.obj.key_value.value.double_value = rhs.obj.double_value.value;
 						stack_push(elem);
@@ -718,7 +1098,10 @@ csvtmt_executor_exec(
 				case CSVTMT_STACK_ELEM_STRING_VALUE: {
 					CsvTomatoStackElem elem = {0};
 					elem.kind = CSVTMT_STACK_ELEM_BOOL_VALUE;
-					int index = csvtmt_find_type_index(model, lhs.obj.ident.value);
+					int index = lhs.obj.ident.index;
+					if (index == -1) {
+						index = csvtmt_find_type_index(model, lhs.obj.ident.value);
+					}
 					if (index == -1) {
 						goto not_found_type_name;	
 					}
@@ -733,6 +1116,7 @@ csvtmt_executor_exec(
 					case CSVTMT_MODE_UPDATE_SET: {
 						elem.kind = CSVTMT_STACK_ELEM_KEY_VALUE;
 						elem.obj.key_value.key = lhs.obj.ident.value;
+						elem.obj.key_value.index = index;
 						elem.obj.key_value.value.kind = CSVTMT_VAL_STRING;
 						elem.obj.key_value.value.string_value = rhs.obj.string_value.value;
 						stack_push(elem);
@@ -748,21 +1132,25 @@ csvtmt_executor_exec(
 			CsvTomatoStackElem elem = {0};
 			elem.kind = CSVTMT_STACK_ELEM_IDENT;
 			elem.obj.ident.value = op->obj.ident.value;
+			elem.obj.ident.index = model->column_indexes_version ? model->column_indexes[model->opcodes_index] : -1;
 			stack_push(elem);
 		} break;
 		case CSVTMT_OP_COLUMN_NAMES_BEG: {
 			stack_push_kind(CSVTMT_STACK_ELEM_COLUMN_NAMES_BEG);
 		} break;
 		case CSVTMT_OP_COLUMN_NAMES_END: {
-			const char *cols[CSVTMT_CSV_COLS_SIZE];
-			size_t cols_len = 0;
+			// スタック上のCOLUMN_NAMES_BEGより上の要素を積んだ順に取り出す。
+			size_t beg = model->stack_len;
+			while (beg > 0 && model->stack[beg-1].kind != CSVTMT_STACK_ELEM_COLUMN_NAMES_BEG) {
+				beg--;
+			}
+			if (beg == 0) {
+				goto stack_underflow;
+			}
 
-			while (model->stack_len) {
-				stack_pop(pop);
-				if (pop.kind == CSVTMT_STACK_ELEM_COLUMN_NAMES_BEG) {
-					break;
-				}
-				switch (pop.kind) {
+			for (size_t i = beg; i < model->stack_len; i++) {
+				const CsvTomatoStackElem *elem = &model->stack[i];
+				switch (elem->kind) {
 				default: goto invalid_elem_kind; break;
 				case CSVTMT_STACK_ELEM_STAR:
 					// puts("star");
@@ -775,69 +1163,62 @@ csvtmt_executor_exec(
 					if (model->column_names_is_star) {
 						goto inavlid_column_names_with_star;
 					}
-					check_array(cols);
-					cols[cols_len++] = pop.obj.string_value.value;
+					if (!csvtmt_reserve(model->column_names, model->column_names_capa, model->column_names_len + 1)) {
+						goto array_overflow;
+					}
+					model->column_names[model->column_names_len++] = elem->obj.string_value.value;
 					break;
 				}
 			}
-
-			// 逆順に格納されている配列を順列に直す。
-			for (ssize_t i = cols_len-1; i >= 0; i--) {
-				check_array(model->column_names);
-				model->column_names[model->column_names_len++] = cols[i];	
-			}
-			break;
+			model->stack_len = beg - 1;
 		} break;
 		case CSVTMT_OP_VALUES_BEG: {
-			if (model->values_len >= csvtmt_numof(model->values)) {
-				goto array_overflow;
-			}
 			stack_push_kind(CSVTMT_STACK_ELEM_VALUES_BEG);
 		} break;
 		case CSVTMT_OP_VALUES_END: {
-			if (model->values_len >= csvtmt_numof(model->values)) {
+			size_t old_capa = model->values_capa;
+			if (!csvtmt_reserve(model->values, model->values_capa, model->values_len + 1)) {
 				goto array_overflow;
 			}
+			memset(model->values + old_capa, 0, (model->values_capa - old_capa) * sizeof(model->values[0]));
 
-			CsvTomatoValues *dst_values = &model->values[model->values_len];
-			CsvTomatoValue tmp_value_array[CSVTMT_VALUES_ARRAY_SIZE] = {0};
-			size_t tmp_value_array_len = 0;
-
-			while (model->stack_len) {
-				stack_pop(pop);
+			// スタック上のVALUES_BEGより上の要素を積んだ順に取り出す。
+			size_t beg = model->stack_len;
+			while (beg > 0 && model->stack[beg-1].kind != CSVTMT_STACK_ELEM_VALUES_BEG) {
+				beg--;
+			}
+			if (beg == 0) {
+				goto stack_underflow;
+			}
 
-				if (pop.kind == CSVTMT_STACK_ELEM_VALUES_BEG) {
-					break;
-				}
-				if (tmp_value_array_len >= csvtmt_numof(tmp_value_array)) {
-					goto array_overflow;
-				}
+			CsvTomatoValues *dst_values = &model->values[model->values_len];
+			dst_values->len = 0;
+			if (!csvtmt_reserve(dst_values->values, dst_values->capa, model->stack_len - beg)) {
+				goto array_overflow;
+			}
 
-				CsvTomatoValue *value = &tmp_value_array[tmp_value_array_len++];
+			for (size_t i = beg; i < model->stack_len; i++) {
+				const CsvTomatoStackElem *elem = &model->stack[i];
+				CsvTomatoValue *value = &dst_values->values[dst_values->len++];
+				memset(value, 0, sizeof(*value));
 
-				switch (pop.kind) {
+				switch (elem->kind) {
 				default: goto invalid_elem_kind; break;
 				case CSVTMT_STACK_ELEM_INT_VALUE:
 					value->kind = CSVTMT_VAL_INT;
-					value->int_value = pop.obj.int_value.value;
+					value->int_value = elem->obj.int_value.value;
 					break;
 				case CSVTMT_STACK_ELEM_DOUBLE_VALUE:
 					value->kind = CSVTMT_VAL_DOUBLE;
-					value->double_value = pop.obj.double_value.value;
+					value->double_value = elem->obj.double_value.value;
 					break;
 				case CSVTMT_STACK_ELEM_STRING_VALUE:
 					value->kind = CSVTMT_VAL_STRING;
-					value->string_value = pop.obj.string_value.value;
+					value->string_value = elem->obj.string_value.value;
 					break;
 				}
-
-				// printf("values->len %ld\n", values->len);
-			}
-
-			// 逆順に格納されている配列を順列に直す。
-			for (ssize_t i = tmp_value_array_len-1; i >= 0; i--) {
-				dst_values->values[dst_values->len++] = tmp_value_array[i];	
 			}
+			model->stack_len = beg - 1;
 
 			model->values_len++;
 			// printf("values_len %ld\n", model->values_len);
@@ -866,6 +1247,9 @@ csvtmt_executor_exec(
 			bool if_not_exists = op->obj.create_table_stmt.if_not_exists;
 
 			snprintf(model->table_path, sizeof model->table_path, "%s/%s.csv", model->db_dir, model->table_name);
+			if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+				goto failed_to_lock_table;
+			}
 
 			if (csvtmt_file_exists(model->table_path)) {
 				model->do_create_table = false;
@@ -896,9 +1280,18 @@ csvtmt_executor_exec(
 
 			fprintf(fp, "%s\n", buf->str);
 
+			if (csvtmt_file_sync_stream(fp, model->sync_level) == -1) {
+				fclose(fp);
+				goto failed_to_sync_table;
+			}
 			fclose(fp);
+			if (csvtmt_file_sync_dir(model->table_path, model->sync_level) == -1) {
+				goto failed_to_sync_table;
+			}
 			csvtmt_str_clear(buf);
 
+			csvtmt_stats_reset(model);
+
 			model->do_create_table = false;
 		} break;
 		case CSVTMT_OP_COLUMN_DEF: {
@@ -947,6 +1340,9 @@ done:
 ret_row:
 	cleanup();
 	return CSVTMT_ROW;
+would_block:
+	cleanup();
+	return CSVTMT_WOULD_BLOCK;
 invalid_context:
 	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "invalid context");
 	cleanup();
@@ -967,6 +1363,22 @@ failed_to_replace_row:
 	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to replace row");
 	cleanup();
 	return CSVTMT_ERROR;
+failed_to_copy:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to copy");
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_analyze:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to analyze");
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_delete:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to delete");
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_sync_table:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync table %s", model->table_path);
+	cleanup();
+	return CSVTMT_ERROR;
 failed_to_update_all:
 	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to update all");
 	cleanup();
@@ -1003,6 +1415,10 @@ failed_to_open_mmap:
 	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open mmap");
 	cleanup();
 	return CSVTMT_ERROR;
+failed_to_lock_table:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to lock table %s", model->table_name);
+	cleanup();
+	return CSVTMT_ERROR;
 inavlid_column_names_with_star:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "invalid column names. found star");
 	cleanup();
@@ -1032,7 +1448,7 @@ invalid_type_name:
 	cleanup();
 	return CSVTMT_ERROR;
 stack_overflow:
-	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "stack overflow");
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow stack");
 	cleanup();
 	return CSVTMT_ERROR;
 stack_underflow:
@@ -1047,7 +1463,7 @@ insert_error:
 	cleanup();
 	return CSVTMT_ERROR;	
 array_overflow:
-	csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "array overflow");
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow array");
 	cleanup();
 	return CSVTMT_ERROR;
 invalid_elem_kind:
@@ -155,6 +155,65 @@ csvtmt_file_rename(const char *old, const char *new) {
     return rename(old, new);
 }
 
+/// fdの内容をlevelに応じてディスクに同期する
+/// 成功: 0, 失敗: -1
+int
+csvtmt_file_sync(int fd, CsvTomatoSyncLevel level) {
+#ifdef _WIN32
+    return level == CSVTMT_SYNC_NONE ? 0 : _commit(fd);
+#else
+    switch (level) {
+    case CSVTMT_SYNC_NONE: return 0;
+    case CSVTMT_SYNC_NORMAL: return fdatasync(fd);
+    case CSVTMT_SYNC_FULL: return fsync(fd);
+    }
+    return 0;
+#endif
+}
+
+/// ストリームをフラッシュしてから同期する
+/// 成功: 0, 失敗: -1
+int
+csvtmt_file_sync_stream(FILE *fp, CsvTomatoSyncLevel level) {
+    if (level == CSVTMT_SYNC_NONE) {
+        return 0;
+    }
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+    return csvtmt_file_sync(fileno(fp), level);
+}
+
+/// pathを含むディレクトリを同期する。renameやファイル作成を永続化するためにFULLの時だけ行う
+/// 成功: 0, 失敗: -1
+int
+csvtmt_file_sync_dir(const char *path, CsvTomatoSyncLevel level) {
+    if (level != CSVTMT_SYNC_FULL) {
+        return 0;
+    }
+#ifdef _WIN32
+    return 0; // Windowsではディレクトリを同期できない
+#else
+    char dir[1024];
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        snprintf(dir, sizeof dir, ".");
+    } else if (slash == path) {
+        snprintf(dir, sizeof dir, "/");
+    } else {
+        snprintf(dir, sizeof dir, "%.*s", (int) (slash - path), path);
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+#endif
+}
+
 /// touch 相当の処理
 /// 成功: 0, 失敗: -1
 int csvtmt_file_touch(const char *path) {
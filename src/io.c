@@ -0,0 +1,576 @@
+#include <csvtomato.h>
+
+/*
+	I/Oのバックエンド。
+
+	POSIX: 読むのはmmapのページフォールト任せで、書くのはwrite()とfdatasync()。
+	URING: io_uringで走査の先を深く先読みし、書き込みと同期はまとめて投げる。
+
+	先読みは登録したバッファに読んで捨てるだけで、ページキャッシュに載せるのが目的。
+	走査そのものは今まで通りmmapを読むので、パーサーや論理削除の位置はそのまま使える。
+	キューの深さが1のページフォールトでは使い切れない帯域を、冷えたテーブルの走査で使う。
+*/
+
+#ifdef CSVTMT_HAVE_IO_URING
+
+static int
+ring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+ring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+ring_unmap(CsvTomatoRing *self) {
+	if (self->sq_ptr && self->sq_ptr != MAP_FAILED) {
+		munmap(self->sq_ptr, self->sq_size);
+	}
+	if (self->cq_ptr && self->cq_ptr != MAP_FAILED) {
+		munmap(self->cq_ptr, self->cq_size);
+	}
+	if (self->sqes && self->sqes != MAP_FAILED) {
+		munmap(self->sqes, self->sqes_size);
+	}
+}
+
+/**
+ * depth個の要求を積めるリングを作る。bufsならdepth個の先読みのバッファを登録する。
+ * io_uringが使えない時（古いカーネルやseccompで止められている時）はNULLを返す。
+ */
+CsvTomatoRing *
+csvtmt_ring_new(unsigned depth, bool bufs) {
+	struct io_uring_params params = {0};
+	int fd = ring_setup(depth, &params);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	CsvTomatoRing *self = calloc(1, sizeof(*self));
+	if (!self) {
+		close(fd);
+		return NULL;
+	}
+	self->fd = fd;
+	self->depth = depth;
+
+	self->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	self->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	self->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	self->sq_ptr = mmap(NULL, self->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	self->cq_ptr = mmap(NULL, self->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (self->sq_ptr == MAP_FAILED || self->cq_ptr == MAP_FAILED || self->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	char *sq = self->sq_ptr;
+	self->sq_head = (unsigned *) (sq + params.sq_off.head);
+	self->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	self->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	self->sq_entries = (unsigned *) (sq + params.sq_off.ring_entries);
+	self->sq_array = (unsigned *) (sq + params.sq_off.array);
+	char *cq = self->cq_ptr;
+	self->cq_head = (unsigned *) (cq + params.cq_off.head);
+	self->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	self->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	self->cqes = cq + params.cq_off.cqes;
+
+	if (bufs) {
+		self->bufs = aligned_alloc(CSVTMT_WRITE_ALIGN, (size_t) depth * CSVTMT_IO_CHUNK_SIZE);
+		if (!self->bufs) {
+			goto fail;
+		}
+		// 登録できなければ普通の読み込みで投げる
+		struct iovec iovs[32];
+		if (depth <= csvtmt_numof(iovs)) {
+			for (unsigned i = 0; i < depth; i++) {
+				iovs[i].iov_base = self->bufs + (size_t) i * CSVTMT_IO_CHUNK_SIZE;
+				iovs[i].iov_len = CSVTMT_IO_CHUNK_SIZE;
+			}
+			self->fixed = ring_register(fd, IORING_REGISTER_BUFFERS, iovs, depth) == 0;
+		}
+	}
+
+	return self;
+fail:
+	ring_unmap(self);
+	free(self->bufs);
+	close(fd);
+	free(self);
+	return NULL;
+}
+
+// 投げた要求が全て終わるのを待ってから閉じる。カーネルがバッファに書き込んでいるかもしれない。
+void
+csvtmt_ring_del(CsvTomatoRing *self) {
+	if (!self) {
+		return;
+	}
+
+	uint64_t user_data;
+	int res;
+	if (self->to_submit) {
+		csvtmt_ring_submit(self, 0);
+	}
+	while (self->inflight && csvtmt_ring_reap(self, &user_data, &res, true)) {
+	}
+
+	ring_unmap(self);
+	close(self->fd);
+	free(self->bufs);
+	free(self);
+}
+
+// sqeをキューに積む。満杯ならfalse。
+static bool
+ring_push(CsvTomatoRing *self, const struct io_uring_sqe *sqe) {
+	unsigned head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *self->sq_tail;
+	if (tail - head >= *self->sq_entries) {
+		return false;
+	}
+
+	unsigned index = tail & *self->sq_mask;
+	((struct io_uring_sqe *) self->sqes)[index] = *sqe;
+	self->sq_array[index] = index;
+	__atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	self->to_submit++;
+	return true;
+}
+
+// buf_index番目のバッファにoffsetからlenバイト読む。user_dataはbuf_index。
+bool
+csvtmt_ring_read(CsvTomatoRing *self, int fd, unsigned buf_index, off_t offset, size_t len) {
+	struct io_uring_sqe sqe = {0};
+	sqe.opcode = self->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe.fd = fd;
+	sqe.off = offset;
+	sqe.addr = (uintptr_t) (self->bufs + (size_t) buf_index * CSVTMT_IO_CHUNK_SIZE);
+	sqe.len = len;
+	sqe.buf_index = buf_index;
+	sqe.user_data = buf_index;
+	return ring_push(self, &sqe);
+}
+
+bool
+csvtmt_ring_write(CsvTomatoRing *self, int fd, const void *buf, size_t len, off_t offset, uint64_t user_data) {
+	struct io_uring_sqe sqe = {0};
+	sqe.opcode = IORING_OP_WRITE;
+	sqe.fd = fd;
+	sqe.off = offset;
+	sqe.addr = (uintptr_t) buf;
+	sqe.len = len;
+	sqe.user_data = user_data;
+	return ring_push(self, &sqe);
+}
+
+// 先に積んだ要求が全て終わってから同期する。
+bool
+csvtmt_ring_fsync(CsvTomatoRing *self, int fd, CsvTomatoSyncLevel level, uint64_t user_data) {
+	struct io_uring_sqe sqe = {0};
+	sqe.opcode = IORING_OP_FSYNC;
+	sqe.fd = fd;
+	sqe.flags = IOSQE_IO_DRAIN;
+	sqe.fsync_flags = level == CSVTMT_SYNC_FULL ? 0 : IORING_FSYNC_DATASYNC;
+	sqe.user_data = user_data;
+	return ring_push(self, &sqe);
+}
+
+// 積んだ要求を投げ、wait_nr個が終わるまで待つ。失敗したら-1。
+int
+csvtmt_ring_submit(CsvTomatoRing *self, unsigned wait_nr) {
+	for (;;) {
+		int n = ring_enter(self->fd, self->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		self->to_submit -= n;
+		self->inflight += n;
+		return n;
+	}
+}
+
+// 終わった要求を1つ受け取る。waitなら終わるまで待つ。受け取れなければfalse。
+bool
+csvtmt_ring_reap(CsvTomatoRing *self, uint64_t *user_data, int *res, bool wait) {
+	for (;;) {
+		unsigned head = *self->cq_head;
+		unsigned tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+		if (head != tail) {
+			const struct io_uring_cqe *cqe = &((struct io_uring_cqe *) self->cqes)[head & *self->cq_mask];
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(self->cq_head, head + 1, __ATOMIC_RELEASE);
+			self->inflight--;
+			return true;
+		}
+		if (!wait || !self->inflight) {
+			return false;
+		}
+		if (ring_enter(self->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+// 要求が終わるたびにeventfdに書かせる。epollなどでリングの完了を待てるようになる。
+bool
+csvtmt_ring_notify(CsvTomatoRing *self, int efd) {
+	return ring_register(self->fd, IORING_REGISTER_EVENTFD, &efd, 1) == 0;
+}
+
+#else // CSVTMT_HAVE_IO_URING
+
+CsvTomatoRing *
+csvtmt_ring_new(unsigned depth, bool bufs) {
+	return NULL;
+}
+
+void
+csvtmt_ring_del(CsvTomatoRing *self) {
+}
+
+bool
+csvtmt_ring_read(CsvTomatoRing *self, int fd, unsigned buf_index, off_t offset, size_t len) {
+	return false;
+}
+
+bool
+csvtmt_ring_write(CsvTomatoRing *self, int fd, const void *buf, size_t len, off_t offset, uint64_t user_data) {
+	return false;
+}
+
+bool
+csvtmt_ring_fsync(CsvTomatoRing *self, int fd, CsvTomatoSyncLevel level, uint64_t user_data) {
+	return false;
+}
+
+int
+csvtmt_ring_submit(CsvTomatoRing *self, unsigned wait_nr) {
+	return -1;
+}
+
+bool
+csvtmt_ring_reap(CsvTomatoRing *self, uint64_t *user_data, int *res, bool wait) {
+	return false;
+}
+
+bool
+csvtmt_ring_notify(CsvTomatoRing *self, int efd) {
+	return false;
+}
+
+#endif // CSVTMT_HAVE_IO_URING
+
+// backendをこの環境で使えるか。URINGは実際にリングを作って確かめる。
+bool
+csvtmt_io_backend_available(CsvTomatoIoBackend backend) {
+	if (backend != CSVTMT_IO_URING) {
+		return true;
+	}
+
+	CsvTomatoRing *ring = csvtmt_ring_new(1, false);
+	if (!ring) {
+		return false;
+	}
+	csvtmt_ring_del(ring);
+	return true;
+}
+
+// sizeのファイルを走査するとページキャッシュを押し流してしまうか。
+bool
+csvtmt_scan_too_large(size_t size) {
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || page_size <= 0) {
+		return false;
+	}
+	return size >= (size_t) pages * page_size / CSVTMT_SCAN_DROP_DIV;
+}
+
+/**
+ * 頭から終わりまで一度だけ読む走査のために、開いたmmapへヒントを与える。
+ *
+ * カーネルに順に読むことを伝えて先読みを深くし、最初の範囲はすぐに読ませる。
+ * 物理メモリに比べて大きなファイルは、読み終えたページをcsvtmt_readahead()で捨てて
+ * 他のテーブルのページを追い出さないようにする。
+ */
+void
+csvtmt_scan_advise(CsvTomatoModel *model) {
+	char *ptr = model->mmap.ptr;
+	size_t len = model->mmap.len;
+
+	madvise(ptr, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	// ファイルのTHPが使えるカーネルならTLBのミスが減る。使えなければ無視される
+	if (len >= CSVTMT_SCAN_WILLNEED) {
+		madvise(ptr, len, MADV_HUGEPAGE);
+	}
+#endif
+	posix_fadvise(model->mmap.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	madvise(ptr, len < CSVTMT_SCAN_WILLNEED ? len : CSVTMT_SCAN_WILLNEED, MADV_WILLNEED);
+
+	model->behind.enabled = csvtmt_scan_too_large(model->mmap.size);
+	model->behind.dropped = 0;
+}
+
+// posより前のCSVTMT_SCAN_DROP_CHUNK単位の範囲を、mmapから外してページキャッシュからも落とす。
+static void
+drop_behind(CsvTomatoModel *model, const char *pos) {
+	size_t end = csvtmt_mmap_offset(model, pos) & ~((size_t) CSVTMT_SCAN_DROP_CHUNK - 1);
+	if (end <= model->behind.dropped) {
+		return;
+	}
+
+	// 前の窓の分はmunmapで外れている
+	size_t beg = model->behind.dropped > model->mmap.base ? model->behind.dropped : model->mmap.base;
+	if (end > beg) {
+		madvise(model->mmap.ptr + (beg - model->mmap.base), end - beg, MADV_DONTNEED);
+	}
+	posix_fadvise(model->mmap.fd, model->behind.dropped, end - model->behind.dropped, POSIX_FADV_DONTNEED);
+	model->behind.dropped = end;
+}
+
+// 空いているバッファはfree_bufsのビットで持つ
+_Static_assert(CSVTMT_IO_DEPTH <= 32, "CSVTMT_IO_DEPTH must fit in readahead.free_bufs");
+
+// 走査を始める時に呼ぶ。大きなテーブルならリングを作って先読みを投げ始める。
+void
+csvtmt_readahead_start(CsvTomatoModel *model) {
+	if (model->io_backend != CSVTMT_IO_URING || model->readahead.ring ||
+		model->mmap.size < CSVTMT_IO_READAHEAD_MIN) {
+		return;
+	}
+
+	model->readahead.ring = csvtmt_ring_new(CSVTMT_IO_DEPTH, true);
+	if (!model->readahead.ring) {
+		return;
+	}
+	model->readahead.issued = 0;
+	model->readahead.free_bufs = CSVTMT_IO_DEPTH == 32 ? UINT32_MAX : ((uint32_t) 1 << CSVTMT_IO_DEPTH) - 1;
+	csvtmt_readahead(model, model->mmap.cur);
+}
+
+/**
+ * 走査がposまで進んだ。先読みが半分を切っていたら空いたバッファで続きを投げる。
+ * csvtmt_scan_advise()が大きなファイルと判断していれば、読み終えたページを捨てる。
+ *
+ * 読んだ中身は捨てるので完了は待たない。失敗しても先読みが効かないだけ。
+ */
+void
+csvtmt_readahead(CsvTomatoModel *model, const char *pos) {
+	if (model->behind.enabled) {
+		drop_behind(model, pos);
+	}
+
+	CsvTomatoRing *ring = model->readahead.ring;
+	if (!ring) {
+		return;
+	}
+
+	size_t at = csvtmt_mmap_offset(model, pos);
+	size_t size = model->mmap.size;
+	if (model->readahead.issued >= size ||
+		model->readahead.issued > at + CSVTMT_IO_DEPTH / 2 * CSVTMT_IO_CHUNK_SIZE) {
+		return;
+	}
+	// 追い越されていたら今の位置から読む
+	if (model->readahead.issued < at) {
+		model->readahead.issued = at & ~((size_t) CSVTMT_WRITE_ALIGN - 1);
+	}
+
+	uint64_t user_data;
+	int res;
+	while (csvtmt_ring_reap(ring, &user_data, &res, false)) {
+		model->readahead.free_bufs |= (uint32_t) 1 << user_data;
+	}
+
+	while (model->readahead.free_bufs && model->readahead.issued < size) {
+		unsigned index = __builtin_ctz(model->readahead.free_bufs);
+		size_t len = size - model->readahead.issued;
+		if (len > CSVTMT_IO_CHUNK_SIZE) {
+			len = CSVTMT_IO_CHUNK_SIZE;
+		}
+		if (!csvtmt_ring_read(ring, model->mmap.fd, index, model->readahead.issued, len)) {
+			break;
+		}
+		model->readahead.free_bufs &= ~((uint32_t) 1 << index);
+		model->readahead.issued += len;
+	}
+	csvtmt_ring_submit(ring, 0);
+}
+
+void
+csvtmt_readahead_stop(CsvTomatoModel *model) {
+	csvtmt_ring_del(model->readahead.ring);
+	model->readahead.ring = NULL;
+}
+
+/*
+	csvtmt_step_async()の下回り。
+
+	SELECTの走査は次の行を読む前に、今の位置からCSVTMT_ASYNC_WINDOWの範囲が
+	ページキャッシュに載っているかをmincore()で確かめる。載っていなければ
+	リングで読み込みを投げてCSVTMT_WOULD_BLOCKを返し、完了はeventfdで知らせる。
+	io_uringが使えなければ止まらずに今まで通りページフォールトで待つ。
+*/
+
+// 走査をposから始め直す。開き直したファイルでは前の位置は意味が無い。
+void
+csvtmt_async_rewind(CsvTomatoModel *model) {
+	model->async.ready = 0;
+	model->async.issued = 0;
+}
+
+static bool
+async_setup(CsvTomatoModel *model) {
+#ifdef CSVTMT_HAVE_IO_URING
+	if (model->async.ring) {
+		return true;
+	}
+	if (model->async.unavailable) {
+		return false;
+	}
+
+	model->async.ring = csvtmt_ring_new(CSVTMT_IO_DEPTH, true);
+	if (!model->async.ring) {
+		goto unavailable;
+	}
+	if (!model->async.fd) {
+		int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0) {
+			goto unavailable;
+		}
+		model->async.fd = fd;
+	}
+	if (!csvtmt_ring_notify(model->async.ring, model->async.fd)) {
+		goto unavailable;
+	}
+	return true;
+unavailable:
+	csvtmt_ring_del(model->async.ring);
+	model->async.ring = NULL;
+	model->async.unavailable = true;
+	return false;
+#else
+	model->async.unavailable = true;
+	return false;
+#endif
+}
+
+// [beg, end)で最初に載っていないページの位置。全て載っていればend。
+static size_t
+first_missing(const CsvTomatoModel *model, size_t beg, size_t end) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	unsigned char vec[CSVTMT_ASYNC_WINDOW / 4096 + 1];
+
+	beg &= ~(page - 1);
+	while (beg < end) {
+		size_t len = end - beg;
+		if (len / page >= sizeof vec) {
+			len = (sizeof vec - 1) * page;
+		}
+		if (mincore(model->mmap.ptr + (beg - model->mmap.base), len, vec) == -1) {
+			return end; // 確かめられなければ読んでしまう
+		}
+		size_t pages = (len + page - 1) / page;
+		for (size_t i = 0; i < pages; i++) {
+			if (!(vec[i] & 1)) {
+				return beg + i * page;
+			}
+		}
+		beg += pages * page;
+	}
+	return end;
+}
+
+/**
+ * 走査の今の位置を止まらずに読めるならtrue。
+ *
+ * falseなら読み込みを投げてあるので、async.fdが読めるようになってからもう一度呼ぶ。
+ * 一度読み込んだのに追い出されていた時は、止まり続けないよう諦めてtrueを返す。
+ * 確かめる範囲がmmapの窓からはみ出していれば、mmap.curから窓を取り直す。
+ */
+bool
+csvtmt_async_ready(CsvTomatoModel *model, CsvTomatoError *error) {
+	size_t at = csvtmt_mmap_offset(model, model->mmap.cur);
+	size_t size = model->mmap.size;
+	if (at < model->async.ready || at >= size) {
+		return true;
+	}
+	if (!async_setup(model)) {
+		return true;
+	}
+	char *cur = csvtmt_mmap_seek(model, at, CSVTMT_ASYNC_WINDOW, error);
+	if (!cur) {
+		return true;
+	}
+	model->mmap.cur = cur;
+
+	CsvTomatoRing *ring = model->async.ring;
+	// 知らせを受け取り済みにする。何も終わっていなければEAGAINで返る
+	uint64_t count;
+	if (read(model->async.fd, &count, sizeof count) < 0) {
+		count = 0;
+	}
+	uint64_t user_data;
+	int res;
+	while (csvtmt_ring_reap(ring, &user_data, &res, false)) {
+	}
+	if (ring->inflight) {
+		return false;
+	}
+
+	size_t end = at + CSVTMT_ASYNC_WINDOW;
+	if (end > size) {
+		end = size;
+	}
+	size_t missing = first_missing(model, at, end);
+	// 窓の終わりを跨ぐ行でページフォールトしないよう、1チャンク手前で次を確かめる
+	size_t ready = end < size && end - at > CSVTMT_IO_CHUNK_SIZE ? end - CSVTMT_IO_CHUNK_SIZE : end;
+	if (missing >= end || model->async.issued >= end) {
+		model->async.ready = ready;
+		return true;
+	}
+
+	size_t pos = missing;
+	unsigned index = 0;
+	while (pos < end && index < ring->depth) {
+		size_t len = end - pos;
+		if (len > CSVTMT_IO_CHUNK_SIZE) {
+			len = CSVTMT_IO_CHUNK_SIZE;
+		}
+		if (!csvtmt_ring_read(ring, model->mmap.fd, index++, pos, len)) {
+			break;
+		}
+		pos += len;
+	}
+	if (index == 0 || csvtmt_ring_submit(ring, 0) < 0) {
+		model->async.ready = ready;
+		return true;
+	}
+	model->async.issued = end;
+	return false;
+}
+
+void
+csvtmt_async_final(CsvTomatoModel *model) {
+	csvtmt_ring_del(model->async.ring);
+	model->async.ring = NULL;
+	if (model->async.fd) {
+		close(model->async.fd);
+		model->async.fd = 0;
+	}
+}
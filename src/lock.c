@@ -0,0 +1,353 @@
+#include <csvtomato.h>
+
+// OFDロックはfdごとに掛かるので、同じプロセスの別の接続とも衝突する。
+// 無い環境ではプロセス単位のロックになる。
+#ifdef F_OFD_SETLK
+	#define LOCK_CMD F_OFD_SETLK
+#else
+	#define LOCK_CMD F_SETLK
+#endif
+
+static int
+set_lock(int fd, CsvTomatoLockMode mode) {
+	struct flock fl = {0};
+	switch (mode) {
+	case CSVTMT_LOCK_NONE: fl.l_type = F_UNLCK; break;
+	case CSVTMT_LOCK_SHARED: fl.l_type = F_RDLCK; break;
+	case CSVTMT_LOCK_EXCLUSIVE: fl.l_type = F_WRLCK; break;
+	}
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0; // ファイル全体
+	return fcntl(fd, LOCK_CMD, &fl);
+}
+
+// ロックが取れなかった時に呼ぶ。もう一度試すならtrue。
+static bool
+wait_busy(CsvTomatoLockManager *self, int count, int64_t beg) {
+	if (self->busy_handler) {
+		return self->busy_handler(self->busy_arg, count);
+	}
+
+	int64_t left = self->busy_timeout - (csvtmt_now_ms() - beg);
+	if (left <= 0) {
+		return false;
+	}
+
+	// 1msから倍々に伸ばし、50msで頭打ちにする
+	int64_t ms = count < 6 ? (int64_t) 1 << count : 50;
+	if (ms > left) {
+		ms = left;
+	}
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+	return true;
+}
+
+// <db>/lock/<table>.lockを開く。writableでなければ読み込み専用で開き、無くても作らない。
+static int
+open_lock_file(const char *db_dir, const char *table_name, bool writable) {
+	char path[CSVTMT_PATH_SIZE * 2 + 16];
+
+	if (!writable) {
+		snprintf(path, sizeof path, "%s/lock/%s.lock", db_dir, table_name);
+		return open(path, O_RDONLY | O_CLOEXEC);
+	}
+
+	snprintf(path, sizeof path, "%s/lock", db_dir);
+	if (!csvtmt_file_exists(path)) {
+		csvtmt_file_mkdir(path);
+	}
+	snprintf(path, sizeof path, "%s/lock/%s.lock", db_dir, table_name);
+	return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/**
+ * table_nameのロックを返す。無ければロックファイルを開いて作る。
+ *
+ * 共有ロックはF_RDLCKなので読み込み専用のfdで取れる。ロックファイルが既にあれば
+ * 読み込み専用で開き、SELECTだけならデータベースのディレクトリに書き込まない。
+ */
+static CsvTomatoTableLock *
+find_lock(
+	CsvTomatoLockManager *self,
+	const char *db_dir,
+	const char *table_name,
+	CsvTomatoLockMode mode,
+	CsvTomatoError *error
+) {
+	for (size_t i = 0; i < self->len; i++) {
+		if (!strcmp(self->locks[i]->table_name, table_name)) {
+			return self->locks[i];
+		}
+	}
+
+	if (!csvtmt_reserve(self->locks, self->capa, self->len + 1)) {
+		goto failed_to_alloc;
+	}
+
+	errno = 0;
+	CsvTomatoTableLock *lock = calloc(1, sizeof(*lock));
+	if (!lock) {
+		goto failed_to_alloc;
+	}
+	lock->table_name = strdup(table_name);
+	if (!lock->table_name) {
+		free(lock);
+		goto failed_to_alloc;
+	}
+
+	lock->fd = -1;
+	if (mode != CSVTMT_LOCK_EXCLUSIVE) {
+		lock->fd = open_lock_file(db_dir, table_name, false);
+	}
+	lock->writable = lock->fd == -1;
+	if (lock->writable) {
+		lock->fd = open_lock_file(db_dir, table_name, true);
+	}
+	if (lock->fd == -1) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open lock file of %s: %s", table_name, strerror(errno));
+		free(lock->table_name);
+		free(lock);
+		return NULL;
+	}
+
+	self->locks[self->len++] = lock;
+	return lock;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate lock: %s", strerror(errno));
+	return NULL;
+}
+
+void
+csvtmt_lock_manager_init(CsvTomatoLockManager *self, bool threadsafe) {
+	memset(self, 0, sizeof(*self));
+	self->threadsafe = threadsafe;
+	if (threadsafe) {
+		pthread_mutex_init(&self->mutex, NULL);
+	}
+}
+
+static void
+manager_lock(CsvTomatoLockManager *self) {
+	if (self->threadsafe) {
+		pthread_mutex_lock(&self->mutex);
+	}
+}
+
+static void
+manager_unlock(CsvTomatoLockManager *self) {
+	if (self->threadsafe) {
+		pthread_mutex_unlock(&self->mutex);
+	}
+}
+
+/**
+ * 読み込み専用で開いたロックファイルを書き込みできるfdに開き直す。mutexを持って呼ぶ。
+ *
+ * OFDロックはfdごとなので、古いfdの共有ロックを新しいfdで取り直してから古いfdを閉じる。
+ * 取り直す間も共有ロックは途切れない。
+ */
+static bool
+reopen_writable(CsvTomatoTableLock *lock, const char *db_dir, CsvTomatoError *error) {
+	errno = 0;
+	int fd = open_lock_file(db_dir, lock->table_name, true);
+	if (fd == -1) {
+		goto failed_to_open;
+	}
+	if (lock->mode != CSVTMT_LOCK_NONE && set_lock(fd, lock->mode) == -1) {
+		close(fd);
+		goto failed_to_open;
+	}
+
+	close(lock->fd);
+	lock->fd = fd;
+	lock->writable = true;
+	return true;
+failed_to_open:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open lock file of %s: %s", lock->table_name, strerror(errno));
+	return false;
+}
+
+// スレッドセーフなら同じデータベースの他の文が持つロックとも衝突させる
+static bool
+conflicts_in_process(const CsvTomatoLockManager *self, const CsvTomatoTableLock *lock, CsvTomatoLockMode mode) {
+	if (!self->threadsafe) {
+		return false;
+	}
+	if (mode == CSVTMT_LOCK_EXCLUSIVE) {
+		return lock->shared_refs || lock->exclusive_refs;
+	}
+	return lock->exclusive_refs;
+}
+
+void
+csvtmt_lock_manager_final(CsvTomatoLockManager *self) {
+	for (size_t i = 0; i < self->len; i++) {
+		close(self->locks[i]->fd); // OFDロックもここで外れる
+		free(self->locks[i]->table_name);
+		free(self->locks[i]);
+	}
+	free(self->locks);
+	if (self->threadsafe) {
+		pthread_mutex_destroy(&self->mutex);
+	}
+	memset(self, 0, sizeof(*self));
+}
+
+/**
+ * table_nameのロックをmodeで取る。
+ *
+ * 既に同じデータベースの文が十分なロックを持っていれば参照を増やすだけ。
+ * スレッドセーフなデータベースでは同じデータベースの文どうしも排他する。
+ * 他が持っていればbusy_handlerかbusy_timeoutに従って待ち、
+ * 諦めたらCSVTMT_ERR_BUSYを積んでNULLを返す。待つ間はmutexを外す。
+ */
+CsvTomatoTableLock *
+csvtmt_lock_acquire(
+	CsvTomatoLockManager *self,
+	const char *db_dir,
+	const char *table_name,
+	CsvTomatoLockMode mode,
+	CsvTomatoError *error
+) {
+	int64_t beg = csvtmt_now_ms();
+
+	for (int count = 0; ; count++) {
+		manager_lock(self);
+
+		CsvTomatoTableLock *lock = find_lock(self, db_dir, table_name, mode, error);
+		if (!lock) {
+			manager_unlock(self);
+			return NULL;
+		}
+		if (mode == CSVTMT_LOCK_EXCLUSIVE && !lock->writable &&
+			!reopen_writable(lock, db_dir, error)) {
+			manager_unlock(self);
+			return NULL;
+		}
+
+		bool busy = conflicts_in_process(self, lock, mode);
+		if (!busy && lock->mode < mode) {
+			if (set_lock(lock->fd, mode) == 0) {
+				lock->mode = mode;
+			} else if (errno == EAGAIN || errno == EACCES || errno == EINTR) {
+				busy = true;
+			} else {
+				csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to lock table %s: %s", table_name, strerror(errno));
+				manager_unlock(self);
+				return NULL;
+			}
+		}
+
+		if (!busy) {
+			if (mode == CSVTMT_LOCK_EXCLUSIVE) {
+				lock->exclusive_refs++;
+			} else {
+				lock->shared_refs++;
+			}
+			manager_unlock(self);
+			return lock;
+		}
+
+		manager_unlock(self);
+		if (!wait_busy(self, count, beg)) {
+			csvtmt_error_push(error, CSVTMT_ERR_BUSY, "table %s is locked", table_name);
+			return NULL;
+		}
+	}
+}
+
+// csvtmt_lock_acquire()と同じmodeで呼ぶ。参照が無くなった分だけロックを弱める。
+void
+csvtmt_lock_release(CsvTomatoLockManager *self, CsvTomatoTableLock *lock, CsvTomatoLockMode mode) {
+	manager_lock(self);
+
+	if (mode == CSVTMT_LOCK_EXCLUSIVE) {
+		lock->exclusive_refs--;
+	} else {
+		lock->shared_refs--;
+	}
+
+	CsvTomatoLockMode want = CSVTMT_LOCK_NONE;
+	if (lock->exclusive_refs) {
+		want = CSVTMT_LOCK_EXCLUSIVE;
+	} else if (lock->shared_refs) {
+		want = CSVTMT_LOCK_SHARED;
+	}
+
+	// 弱めるのは待たずに必ず成功する
+	if (want < lock->mode) {
+		set_lock(lock->fd, want);
+		lock->mode = want;
+	}
+
+	manager_unlock(self);
+}
+
+/**
+ * table_nameを詰め直す間の印を付ける。
+ *
+ * 同じデータベースで既に詰め直していればエラーを積まずにNULLを返す。
+ * 詰め直しは表のロックを持たずに書き写すので、ロックとは別に数える。
+ */
+CsvTomatoTableLock *
+csvtmt_lock_begin_compaction(
+	CsvTomatoLockManager *self,
+	const char *db_dir,
+	const char *table_name,
+	CsvTomatoError *error
+) {
+	manager_lock(self);
+	CsvTomatoTableLock *lock = find_lock(self, db_dir, table_name, CSVTMT_LOCK_NONE, error);
+	if (lock) {
+		if (lock->compacting) {
+			lock = NULL;
+		} else {
+			lock->compacting = true;
+		}
+	}
+	manager_unlock(self);
+	return lock;
+}
+
+void
+csvtmt_lock_end_compaction(CsvTomatoLockManager *self, CsvTomatoTableLock *lock) {
+	manager_lock(self);
+	lock->compacting = false;
+	manager_unlock(self);
+}
+
+// 文が今のテーブルのロックをmodeで持つようにする。持っていたロックは取った後に手放す。
+bool
+csvtmt_model_lock(CsvTomatoModel *model, CsvTomatoLockMode mode, CsvTomatoError *error) {
+	if (!model->locks) {
+		return true;
+	}
+	if (model->lock && model->lock_mode >= mode &&
+		!strcmp(model->lock->table_name, model->table_name)) {
+		return true;
+	}
+
+	CsvTomatoTableLock *lock = csvtmt_lock_acquire(model->locks, model->db_dir, model->table_name, mode, error);
+	if (!lock) {
+		return false;
+	}
+
+	csvtmt_model_unlock(model);
+	model->lock = lock;
+	model->lock_mode = mode;
+
+	return true;
+}
+
+void
+csvtmt_model_unlock(CsvTomatoModel *model) {
+	if (!model->lock) {
+		return;
+	}
+
+	csvtmt_lock_release(model->locks, model->lock, model->lock_mode);
+	model->lock = NULL;
+	model->lock_mode = CSVTMT_LOCK_NONE;
+}
@@ -28,13 +28,17 @@ csvtmt_model_init(
 ) {
 	memset(self, 0, sizeof(*self));
 	snprintf(self->db_dir, sizeof self->db_dir, "%s", db_dir);
+	self->sync_level = CSVTMT_SYNC_NONE;
+	self->schema = &self->own_schema;
 }
 
 void
 csvtmt_model_final(CsvTomatoModel *self) {
 	csvtmt_row_final(&self->row);
+	csvtmt_readahead_stop(self);
+	csvtmt_async_final(self);
 	if (self->mmap.fd) {
-		munmap(self->mmap.ptr, self->mmap.size);
+		munmap(self->mmap.ptr, self->mmap.len);
 		close(self->mmap.fd);
 		self->mmap.ptr = self->mmap.cur = NULL;
 		self->mmap.fd = 0;
@@ -47,6 +51,76 @@ csvtmt_model_final(CsvTomatoModel *self) {
 		csvtmt_clear_rows(self->rows);
 		csvtmt_rows_del(self->rows);
 	}
+	if (self->copy.writer) {
+		// 書きかけのCOPY TOの出力は捨てる
+		csvtmt_writer_del(self->copy.writer);
+		remove(self->copy.tmp_path);
+		self->copy.writer = NULL;
+	}
+	csvtmt_snapshot_close(self);
+	csvtmt_columnar_close(self);
+	csvtmt_model_unlock(self);
+
+	free(self->stack);
+	free(self->columnar.columns);
+	csvtmt_offsets_del(self->tombstones);
+	csvtmt_offsets_del(self->snapshot.later);
+	free(self->column_names);
+	for (size_t i = 0; i < self->values_capa; i++) {
+		free(self->values[i].values);
+	}
+	free(self->values);
+	free(self->update_set_key_values);
+	free(self->selected_columns);
+	free(self->column_cache);
+	csvtmt_header_unref(self->header);
+	csvtmt_schema_final(&self->own_schema);
+	free(self->column_indexes);
+	free(self->selected_indexes);
+}
+
+// 実行状態だけを巻き戻して同じop-codeをもう一度実行できるようにする。
+// 開いているmmapやファイルは閉じる。rowsのバッファは使い回す。
+void
+csvtmt_model_reset(CsvTomatoModel *self) {
+	if (self->mmap.fd) {
+		csvtmt_close_mmap(self);
+	}
+	if (self->fp) {
+		fclose(self->fp);
+		self->fp = NULL;
+	}
+	if (self->copy.writer) {
+		csvtmt_writer_del(self->copy.writer);
+		remove(self->copy.tmp_path);
+		self->copy.writer = NULL;
+	}
+	csvtmt_model_unlock(self);
+	if (self->rows) {
+		csvtmt_clear_rows(self->rows);
+	}
+	if (self->tombstones) {
+		csvtmt_offsets_clear(self->tombstones);
+	}
+	csvtmt_row_final(&self->row);
+	memset(&self->row, 0, sizeof(self->row));
+
+	for (size_t i = 0; i < self->values_len; i++) {
+		self->values[i].len = 0;
+	}
+	self->values_len = 0;
+	self->column_names_len = 0;
+	self->column_names_is_star = false;
+	self->update_set_key_values_len = 0;
+	self->selected_columns_len = 0;
+	self->stack_len = 0;
+	self->opcodes_index = 0;
+	self->save_opcodes_index = 0;
+	self->do_create_table = false;
+	self->skip = false;
+	self->row_head = NULL;
+	self->mode = CSVTMT_MODE_FIRST;
+	self->changes = 0;
 }
 
 static void
@@ -79,60 +153,30 @@ type_parse_column(
 	size_t index,
 	CsvTomatoError *error
 ) {
-	char *name = self->type_name;
-	size_t name_len = 0;
-	size_t name_size = sizeof(self->type_name);
-	char *def = self->type_def;
-	size_t def_len = 0;
-	size_t def_size = sizeof(self->type_def);
-	int m = 0;
+	const char *p = col;
+	while (*p && !isspace(*p)) {
+		p++;
+	}
+	size_t name_len = p - col;
+	while (*p && isspace(*p)) {
+		p++;
+	}
 
 	self->index = index;
-
-	for (const char *p = col; *p; p++) {
-		switch (m) {
-		case 0:
-			if (isspace(*p)) {
-				m = 10;
-			} else {
-				if (name_len >= name_size) {
-					goto overflow;
-				}
-				name[name_len++] = *p;
-				name[name_len] = 0;
-			}
-			break;
-		case 10:
-			if (isspace(*p)) {
-				// pass
-			} else {
-				if (def_len >= def_size) {
-					goto overflow;
-				}
-				def[def_len++] = *p;
-				def[def_len] = 0;
-				m = 20;
-			}
-			break;
-		case 20:
-			if (def_len >= def_size) {
-				goto overflow;
-			}
-			def[def_len++] = *p;
-			def[def_len] = 0;
-			m = 20;
-			break;
-		}
+	self->type_name = strndup(col, name_len);
+	self->type_def = strdup(p);
+	if (!self->type_name || !self->type_def) {
+		goto failed_to_alloc;
 	}
 
-	type_parse_type_def(self, def, error);
+	type_parse_type_def(self, self->type_def, error);
 	if (error->error) {
 		return;
 	}
 
 	return;
-overflow:
-	csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "buffer overflow in parse type column");
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory for type column");
 }
 
 static void
@@ -141,14 +185,16 @@ header_parse_types(
 	CsvTomatoRow *row,
 	CsvTomatoError *error
 ) {
-	self->types_len = 0;
+	csvtmt_header_final(self);
+
+	if (!csvtmt_reserve(self->types, self->types_capa, row->len)) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow header types");
+		return;
+	}
 
 	for (size_t i = 0; i < row->len; i++) {
-		if (self->types_len >= csvtmt_numof(self->types)) {
-			csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "header types overflow");
-			return;
-		}
 		CsvTomatoColumnType *type = &self->types[self->types_len++];
+		memset(type, 0, sizeof(*type));
 		type_parse_column(type, row->columns[i], i, error);
 		if (error->error) {
 			csvtmt_error_push(error, CSVTMT_ERR_PARSE, "failed to parse header column");
@@ -157,6 +203,47 @@ header_parse_types(
 	}
 }
 
+// ヘッダの型を解放する。配列は次の読み込みで使い回すので残す。
+void
+csvtmt_header_final(CsvTomatoHeader *self) {
+	for (size_t i = 0; i < self->types_len; i++) {
+		free(self->types[i].type_name);
+		free(self->types[i].type_def);
+	}
+	self->types_len = 0;
+}
+
+// スキーマに載せるヘッダを作る。作った側が参照を1つ持つ。
+CsvTomatoHeader *
+csvtmt_header_new(void) {
+	CsvTomatoHeader *self = calloc(1, sizeof(*self));
+	if (!self) {
+		return NULL;
+	}
+	atomic_init(&self->refs, 1);
+	return self;
+}
+
+// 参照を増やす。差し替えられないよう、スキーマから取る時はカタログのロックを持って呼ぶ。
+CsvTomatoHeader *
+csvtmt_header_ref(CsvTomatoHeader *self) {
+	if (self) {
+		atomic_fetch_add(&self->refs, 1);
+	}
+	return self;
+}
+
+// 参照を離す。最後の参照なら解放する。
+void
+csvtmt_header_unref(CsvTomatoHeader *self) {
+	if (!self || atomic_fetch_sub(&self->refs, 1) != 1) {
+		return;
+	}
+	csvtmt_header_final(self);
+	free(self->types);
+	free(self);
+}
+
 const char *
 csvtmt_header_read_from_string(CsvTomatoHeader *self, const char *p, CsvTomatoError *error) {
 	CsvTomatoRow row = {0};
@@ -174,10 +261,263 @@ csvtmt_header_read_from_string(CsvTomatoHeader *self, const char *p, CsvTomatoEr
 	return p;
 
 failed_to_parse_types:
+	csvtmt_row_final(&row);
 	csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "failed to header types");
 	return NULL;
 }
 
+// 今のテーブルのスキーマを選ぶ。カタログがあればデータベースで共有するものを使う。
+static CsvTomatoSchema *
+model_schema(CsvTomatoModel *model, CsvTomatoError *error) {
+	if (!model->catalog) {
+		return model->schema;
+	}
+	if (model->schema != &model->own_schema &&
+		!strcmp(model->schema->table_path, model->table_path)) {
+		return model->schema;
+	}
+
+	csvtmt_catalog_write_lock(model->catalog);
+	CsvTomatoSchema *schema = csvtmt_catalog_find(model->catalog, model->table_path, error);
+	csvtmt_catalog_unlock(model->catalog);
+	if (error->error) {
+		return NULL;
+	}
+	model->schema = schema;
+	return schema;
+}
+
+static bool
+schema_is_fresh(const CsvTomatoSchema *schema, const struct stat *st) {
+	return schema->line &&
+		schema->dev == st->st_dev &&
+		schema->ino == st->st_ino &&
+		schema->mtime.tv_sec == st->st_mtim.tv_sec &&
+		schema->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// スキーマの今のヘッダの参照を文に持たせる。カタログのロックを持って呼ぶ。
+static void
+model_take_header(CsvTomatoModel *model, CsvTomatoSchema *schema) {
+	CsvTomatoHeader *old = model->header;
+	model->header = csvtmt_header_ref(schema->header);
+	csvtmt_header_unref(old);
+}
+
+// pから始まるヘッダ行が前回と同じなら解析を省き、違えば新しいヘッダを解析して
+// 差し替える。どちらでもstの情報を覚え、文にヘッダを持たせて次の行の先頭を返す。
+// 書き込みロックを持って呼ぶ。
+static const char *
+schema_load(
+	CsvTomatoModel *model,
+	CsvTomatoSchema *schema,
+	const char *p,
+	size_t line_len,
+	const struct stat *st,
+	CsvTomatoError *error
+) {
+	if (schema->line &&
+		schema->line_len == line_len &&
+		!memcmp(schema->line, p, line_len)) {
+		goto hit;
+	}
+
+	CsvTomatoHeader *header = csvtmt_header_new();
+	if (!header) {
+		goto failed_to_alloc;
+	}
+	const char *next = csvtmt_header_read_from_string(header, p, error);
+	if (error->error) {
+		csvtmt_header_unref(header);
+		return NULL;
+	}
+	line_len = next - p;
+
+	char *line = realloc(schema->line, line_len + 1);
+	if (!line) {
+		csvtmt_header_unref(header);
+		goto failed_to_alloc;
+	}
+	memcpy(line, p, line_len);
+	line[line_len] = '\0';
+	schema->line = line;
+	schema->line_len = line_len;
+
+	// 前のヘッダを持っている文があれば、離すまで残る
+	if (model->catalog) {
+		header->version = ++model->catalog->clock;
+	} else {
+		header->version = schema->header ? schema->header->version + 1 : 1;
+	}
+	csvtmt_header_unref(schema->header);
+	schema->header = header;
+
+hit:
+	schema->dev = st->st_dev;
+	schema->ino = st->st_ino;
+	schema->mtime = st->st_mtim;
+	model_take_header(model, schema);
+	return p + line_len;
+failed_to_alloc:
+	free(schema->line);
+	schema->line = NULL;
+	schema->line_len = 0;
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate header cache");
+	return NULL;
+}
+
+/**
+ * 開いているmmapの先頭からヘッダを読み、次の行の先頭を返す。
+ *
+ * 前回と同じファイル（dev, ino, mtime）ならヘッダの解析を省く。
+ * ファイルが変わっていてもヘッダ行のバイト列が同じなら解析を省く。
+ * 追記ではヘッダは変わらないので、INSERTの後でも型を解析し直さない。
+ * 解析し直した時はヘッダのversionを進めてカラムの解決をやり直させる。
+ * 文はmodel->headerに取った参照を読むので、他の文が差し替えても変わらない。
+ */
+const char *
+csvtmt_header_load_from_mmap(CsvTomatoModel *model, CsvTomatoError *error) {
+	const char *p = csvtmt_mmap_seek(model, 0, 1, error);
+	if (!p) {
+		return NULL;
+	}
+	const char *nl = memchr(p, '\n', csvtmt_mmap_end(model) - p);
+	// 窓に収まらないヘッダは窓を広げて探す
+	while (!nl && model->mmap.len < model->mmap.size) {
+		p = csvtmt_mmap_seek(model, 0, model->mmap.len * 2, error);
+		if (!p) {
+			return NULL;
+		}
+		nl = memchr(p, '\n', csvtmt_mmap_end(model) - p);
+	}
+	size_t line_len = nl ? (size_t) (nl - p + 1) : model->mmap.size;
+
+	CsvTomatoSchema *schema = model_schema(model, error);
+	if (error->error) {
+		return NULL;
+	}
+
+	csvtmt_catalog_read_lock(model->catalog);
+	bool fresh = schema_is_fresh(schema, &model->mmap.st) && schema->line_len == line_len;
+	if (fresh) {
+		model_take_header(model, schema);
+	}
+	csvtmt_catalog_unlock(model->catalog);
+	if (fresh) {
+		return p + line_len;
+	}
+
+	csvtmt_catalog_write_lock(model->catalog);
+	const char *next = schema_load(model, schema, p, line_len, &model->mmap.st, error);
+	csvtmt_catalog_unlock(model->catalog);
+	return next;
+}
+
+/**
+ * mmapを開かずにテーブルのヘッダを読む。INSERTとCOPY FROMで使う。
+ *
+ * stat()の結果がスキーマと同じならファイルを開かない。
+ * 違えばヘッダ行だけをpread()で読んでmmapの時と同じように比べる。
+ */
+void
+csvtmt_header_load_from_table(CsvTomatoModel *model, CsvTomatoError *error) {
+	int fd = -1;
+	char *buf = NULL;
+	size_t buf_capa = 0;
+	size_t len = 0;
+	struct stat st;
+
+	#undef cleanup
+	#define cleanup() {\
+		free(buf);\
+		if (fd != -1) {\
+			close(fd);\
+		}\
+	}\
+
+	CsvTomatoSchema *schema = model_schema(model, error);
+	if (error->error) {
+		return;
+	}
+
+	errno = 0;
+	if (stat(model->table_path, &st) == -1) {
+		goto failed_to_open_table;
+	}
+	csvtmt_catalog_read_lock(model->catalog);
+	bool fresh = schema_is_fresh(schema, &st);
+	if (fresh) {
+		model_take_header(model, schema);
+	}
+	csvtmt_catalog_unlock(model->catalog);
+	if (fresh) {
+		return;
+	}
+
+	errno = 0;
+	fd = open(model->table_path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		goto failed_to_open_table;
+	}
+
+	// 1行目の改行まで読む
+	for (;;) {
+		if (!csvtmt_reserve(buf, buf_capa, len + 512 + 1)) {
+			goto failed_to_alloc;
+		}
+		errno = 0;
+		ssize_t n = pread(fd, buf + len, buf_capa - len - 1, len);
+		if (n == -1) {
+			goto failed_to_read;
+		}
+		if (n == 0) {
+			break;
+		}
+		char *nl = memchr(buf + len, '\n', n);
+		len += n;
+		if (nl) {
+			len = nl - buf + 1;
+			break;
+		}
+	}
+	buf[len] = '\0';
+
+	csvtmt_catalog_write_lock(model->catalog);
+	schema_load(model, schema, buf, len, &st, error);
+	csvtmt_catalog_unlock(model->catalog);
+	cleanup();
+	return;
+failed_to_open_table:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open table: %s: %s", model->table_path, strerror(errno));
+	cleanup();
+	return;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate header buffer");
+	cleanup();
+	return;
+failed_to_read:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to read table: %s: %s", model->table_path, strerror(errno));
+	cleanup();
+	return;
+}
+
+// 自分で追記しただけのテーブルはヘッダが変わらないので、
+// 書いた後のmtimeを覚えて次の文でもstat()だけで済ませる。
+static void
+schema_touch(CsvTomatoModel *model, int fd) {
+	struct stat st;
+	CsvTomatoSchema *schema = model->schema;
+
+	if (fstat(fd, &st) == -1) {
+		return;
+	}
+	csvtmt_catalog_write_lock(model->catalog);
+	if (schema->line && schema->dev == st.st_dev && schema->ino == st.st_ino) {
+		schema->mtime = st.st_mtim;
+	}
+	csvtmt_catalog_unlock(model->catalog);
+}
+
 void
 csvtmt_header_read_from_stream(CsvTomatoHeader *self, FILE *fp, CsvTomatoError *error) {
 	CsvTomatoRow row = {0};
@@ -197,6 +537,7 @@ csvtmt_header_read_from_stream(CsvTomatoHeader *self, FILE *fp, CsvTomatoError *
 	csvtmt_row_final(&row);
 	return;
 failed_to_parse_types:
+	csvtmt_row_final(&row);
 	csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "failed to header types");
 	return;
 }
@@ -226,6 +567,7 @@ csvtmt_header_read_from_table(CsvTomatoHeader *self, const char *table_path, Csv
 	csvtmt_row_final(&row);
 	return;
 failed_to_parse_types:
+	csvtmt_row_final(&row);
 	csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "failed to header types");
 	return;
 }
@@ -265,6 +607,9 @@ csvtmt_header_has_key_values_types(
 	CsvTomatoError *error
 ) {
 	for (size_t i = 0; i < key_values_len; i++) {
+		if (key_values[i].index > 0) {
+			continue; // 解決済み。0は__MODE__なので書き換えられない
+		}
 		bool found = false;
 		for (size_t j = 0; j < self->types_len; j++) {
 			const CsvTomatoColumnType *type = &self->types[j];
@@ -284,10 +629,12 @@ csvtmt_header_has_key_values_types(
 	return NULL;
 }
 
+// AUTOINCREMENTのIDをn個まとめて確保し、先頭のIDを返す。
 static uint64_t
-gen_auto_increment_id(
+reserve_auto_increment_ids(
 	CsvTomatoModel *model,
 	const char *type_name,
+	uint64_t n,
 	CsvTomatoError *error
 ) {
 	char id_dir[CSVTMT_PATH_SIZE * 2];
@@ -312,15 +659,23 @@ gen_auto_increment_id(
 	uint64_t id;
 	char line[1024];
 
-	fgets(line, sizeof line, id_fp);
-	id = atoi(line);
+	if (!fgets(line, sizeof line, id_fp)) {
+		line[0] = '\0'; // 作ったばかりの空のIDファイル
+	}
+	id = strtoull(line, NULL, 10);
 	if (id == 0) {
 		id = 1;
 	}
 
 	fseek(id_fp, 0, SEEK_SET);
-	fprintf(id_fp, "%ld", id+1);
+	fprintf(id_fp, "%ld", id+n);
 
+	// IDファイルが巻き戻るとIDが重複するので行より先に永続化する
+	errno = 0;
+	if (csvtmt_file_sync_stream(id_fp, model->sync_level) == -1) {
+		fclose(id_fp);
+		goto failed_to_sync_file;
+	}
 	fclose(id_fp);
 
 	return id;
@@ -328,15 +683,26 @@ gen_auto_increment_id(
 failed_to_open_file:
 	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open id file: %s", strerror(errno));
 	return 0;
+failed_to_sync_file:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync id file: %s", strerror(errno));
+	return 0;
+}
+
+static uint64_t
+gen_auto_increment_id(
+	CsvTomatoModel *model,
+	const char *type_name,
+	CsvTomatoError *error
+) {
+	return reserve_auto_increment_ids(model, type_name, 1, error);
 }
 
 void
 csvtmt_parse_row_from_mmap(CsvTomatoModel *model, CsvTomatoError *error) {
-	memset(&model->row, 0, sizeof(model->row));
-	model->mmap.cur = (char *) csvtmt_row_parse_string(&model->row, model->mmap.cur, error);
-	if (error->error) {
-		return;
-	}
+	csvtmt_row_clear(&model->row);
+	const char *p = model->mmap.cur;
+	model->row_head = (char *) csvtmt_mmap_parse_row(model, &p, &model->row, error);
+	model->mmap.cur = (char *) p;
 }
 
 void
@@ -446,7 +812,7 @@ string_to_value(const char *str) {
 	switch (m) {
 	case 10: // int
 		val.kind = CSVTMT_VAL_INT;
-		val.int_value = atoi(str);	
+		val.int_value = strtoll(str, NULL, 10);
 		break;
 	case 20: // string
 		val.kind = CSVTMT_VAL_STRING;
@@ -509,114 +875,181 @@ mkdir_tmp_dir(const char *db_dir, char *tmp_dir, size_t tmp_dir_size) {
 	}
 }
 
+// 区切られたフィールドが "1"（論理削除済み）か判定する。
+static bool
+span_is_deleted(const CsvTomatoFieldSpan *span) {
+	const char *p = span->beg;
+	const char *end = span->end;
+	if (p < end && *p == '"') {
+		p++;
+		end--;
+	}
+	return end - p == 1 && *p == '1';
+}
+
+/**
+ * WHEREの無いUPDATEでテーブル全体を書き換える。
+ *
+ * 開いているmmapから行を走査し、変更の無いフィールドはバイト列のまま
+ * コピーする。SETされるカラムは事前に一度だけエンコードしておき、
+ * 該当フィールドだけを差し替える。論理削除済みの行はここで取り除く。
+ * 出力はバッファ付きのwriterでtmpファイルに書き、最後にrenameする。
+ */
 int
 csvtmt_update_all(CsvTomatoModel *model, CsvTomatoError *error) {
-	FILE *fin, *fout;
 	CsvTomatoColumnInfoArray infos = {0};
+	size_t ncols = model->header->types_len;
+	char **repl = NULL;
+	bool *set = NULL;
+	CsvTomatoFieldSpans spans = {0};
+	CsvTomatoWriter *w = NULL;
+	char tmp_path[CSVTMT_PATH_SIZE * 2 + 32];
 
 	csvtmt_store_column_infos(model, &infos, model->update_set_key_values, model->update_set_key_values_len, error);
 	if (error->error) {
 		return CSVTMT_ERROR;
 	}
 
-	errno = 0;
-	fin = fopen(model->table_path, "r");
-	if (!fin) {
-		goto failed_to_open_table;
+	repl = calloc(ncols, sizeof(*repl));
+	set = calloc(ncols, sizeof(*set));
+	if (!repl || !set) {
+		goto failed_to_alloc;
+	}
+
+	for (size_t i = 0; i < infos.len; i++) {
+		CsvTomatoColumnInfo *info = &infos.array[i];
+		free(repl[info->index]);
+		set[info->index] = true;
+		repl[info->index] = value_to_column(&info->value, true, error);
+		if (error->error) {
+			goto failed_to_value_to_string;
+		}
 	}
 
 	char tmp_dir[CSVTMT_PATH_SIZE + 10];
 	mkdir_tmp_dir(model->db_dir, tmp_dir, sizeof tmp_dir);
 
-	char tmp_path[CSVTMT_PATH_SIZE * 2 + 10];
-	snprintf(tmp_path, sizeof tmp_path, "%s/tmp.csv", tmp_dir);
+	// 同じdbを扱う別のテーブルやプロセスと衝突しないようにする
+	snprintf(tmp_path, sizeof tmp_path, "%s/%s.%ld.csv", tmp_dir, model->table_name, (long) getpid());
 
-	fout = fopen(tmp_path, "w");
-	if (!fout) {
+	w = csvtmt_writer_new(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, error);
+	if (error->error) {
 		goto failed_to_open_tmp_file;
 	}
+	csvtmt_writer_use_backend(w, model->io_backend);
 
-	CsvTomatoRow row = {0};
-	size_t nline = 0;
-
-	for (;; nline++) {
-		csvtmt_row_final(&row);
-		int ret = csvtmt_row_parse_stream(&row, fin, error);
+	// ヘッダはそのままコピーする
+	const char *next = csvtmt_mmap_seek(model, 0, 1, error);
+	const char *p = next ? csvtmt_mmap_scan_row(model, &next, &spans, error) : NULL;
+	if (error->error) {
+		goto failed_to_scan;
+	}
+	if (p) {
+		csvtmt_writer_write(w, p, next - p, error);
 		if (error->error) {
-			goto failed_to_parse_stream;
-		}
-		if (ret == EOF) {
-			break;
+			goto failed_to_write;
 		}
+	}
 
-		// csvtmt_row_show(&row);
-		if (row.len && !strcmp(row.columns[0], "1")) {
+	model->changes = 0;
+	csvtmt_readahead_start(model);
+	while (p && (p = csvtmt_mmap_scan_row(model, &next, &spans, error))) {
+		csvtmt_readahead(model, p);
+		if (spans.len && span_is_deleted(&spans.array[0])) {
 			continue; // this row deleted
 		}
+		model->changes++;
 
-		if (nline != 0) {
-			for (size_t ii = 0; ii < infos.len; ii++) {
-				CsvTomatoColumnInfo *info = &infos.array[ii];
-
-				for (size_t ci = 0; ci < row.len; ci++) {
-					if (info->index == ci) {
-						char *s = value_to_column(&info->value, false, error);
-						if (error->error) {
-							goto failed_to_value_to_string;
-						}
-						csvtmt_row_set_clone(&row, info->index, s, error);
-						free(s);
-						if (error->error) {
-							goto failed_to_replace;
-						}		
-					}
-				}
+		// 差し替えの無い区間はまとめて書き出す
+		const char *copied = p;
+		for (size_t ci = 0; ci < spans.len && ci < ncols; ci++) {
+			if (!set[ci]) {
+				continue;
+			}
+			csvtmt_writer_write(w, copied, spans.array[ci].beg - copied, error);
+			if (repl[ci]) {
+				csvtmt_writer_write_str(w, repl[ci], error);
 			}
+			if (error->error) {
+				goto failed_to_write;
+			}
+			copied = spans.array[ci].end;
 		}
-
-		csvtmt_row_append_to_stream(&row, fout, true, error);
+		csvtmt_writer_write(w, copied, next - copied, error);
 		if (error->error) {
-			goto failed_to_append_to_stream;
+			goto failed_to_write;
 		}
+		if (next > p && next[-1] != '\n') {
+			csvtmt_writer_write(w, "\n", 1, error);
+			if (error->error) {
+				goto failed_to_write;
+			}
+		}
+	}
+	if (error->error) {
+		goto failed_to_scan;
+	}
 
-		csvtmt_row_final(&row);
+	csvtmt_writer_sync(w, model->sync_level, error);
+	if (error->error) {
+		goto failed_to_write;
 	}
+	csvtmt_writer_del(w);
+	w = NULL;
 
 	if (csvtmt_file_rename(tmp_path, model->table_path) == -1) {
 		goto failed_to_rename_csv_file;
 	}
+	if (csvtmt_file_sync_dir(model->table_path, model->sync_level) == -1) {
+		goto failed_to_sync_dir;
+	}
+	csvtmt_tomb_log_remove(model, model->mmap.st.st_ino);
 
-	fclose(fin);
-	fclose(fout);
+	// 書き直した表には論理削除した行が残らない
+	CsvTomatoTableStats *stats = csvtmt_model_stats(model);
+	csvtmt_stats_set_rows(stats, model->table_path, model->changes, 0);
+	csvtmt_stats_add_key_values(stats, model->header, model->update_set_key_values, model->update_set_key_values_len);
+
+	for (size_t i = 0; i < ncols; i++) {
+		free(repl[i]);
+	}
+	free(repl);
+	free(set);
+	csvtmt_spans_final(&spans);
 	return CSVTMT_OK;
 
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory");
+	goto cleanup;
 failed_to_value_to_string:
 	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to value to string");
-	return CSVTMT_ERROR;
+	goto cleanup;
+failed_to_open_tmp_file:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open tmp file: %s", tmp_path);
+	goto cleanup;
+failed_to_scan:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to scan table");
+	goto cleanup;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write tmp file: %s", tmp_path);
+	goto cleanup;
 failed_to_rename_csv_file:
 	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to rename csv file");
-	return CSVTMT_ERROR;
-failed_to_open_table:
-	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open table: %s: %s", model->table_path, strerror(errno));
-	return CSVTMT_ERROR;
-failed_to_open_tmp_file:
-	fclose(fin);
-	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open tmp file: %s: %s", tmp_path, strerror(errno));
-	return CSVTMT_ERROR;
-failed_to_parse_stream:
-	fclose(fin);
-	fclose(fout);
-	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to parse stream");
-	return CSVTMT_ERROR;
-failed_to_append_to_stream:
-	fclose(fin);
-	fclose(fout);
-	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to append to stream");
-	return CSVTMT_ERROR;
-failed_to_replace:
-	fclose(fin);
-	fclose(fout);
-	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to replace column");
+	goto cleanup;
+failed_to_sync_dir:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync directory of %s: %s", model->table_path, strerror(errno));
+	goto cleanup;
+cleanup:
+	if (w) {
+		csvtmt_writer_del(w);
+		remove(tmp_path);
+	}
+	for (size_t i = 0; repl && i < ncols; i++) {
+		free(repl[i]);
+	}
+	free(repl);
+	free(set);
+	csvtmt_spans_final(&spans);
 	return CSVTMT_ERROR;
 }
 
@@ -631,8 +1064,31 @@ csvtmt_store_column_infos(
 	// ヘッダのタイプ列にkvsのkeyがあるか見る。
 	// あれば、そのタイプのインデックスを得る。
 	// このインデックスがWHERE比較をする列番号になる。
-	CsvTomatoColumnType *types = model->header.types;
-	size_t types_len = model->header.types_len;
+	CsvTomatoColumnType *types = model->header->types;
+	size_t types_len = model->header->types_len;
+	bool resolved = true;
+
+	// 全部のkeyの位置が解決済みなら名前を比べなくていい
+	for (size_t kvi = 0; kvi < kvs_len; kvi++) {
+		if (kvs[kvi].index < 0 || (size_t) kvs[kvi].index >= types_len) {
+			resolved = false;
+			break;
+		}
+	}
+	if (resolved) {
+		for (size_t kvi = 0; kvi < kvs_len; kvi++) {
+			CsvTomatoColumnInfo info = {
+				.key = types[kvs[kvi].index].type_name,
+				.index = kvs[kvi].index,
+				.value = kvs[kvi].value,
+			};
+			csvtmt_column_info_array_push(infos, info, error);
+			if (error->error) {
+				goto array_overflow;
+			}
+		}
+		return;
+	}
 
 	for (size_t ti = 0; ti < types_len; ti++) {
 		CsvTomatoColumnType *type = &types[ti];
@@ -659,21 +1115,49 @@ array_overflow:
 	return;
 }
 
+// SELECTするカラム名をヘッダ上の位置に解決する。
+// 文のop-codeは実行ごとに同じなので、ヘッダが変わらない限り1回だけ行う。
+static void
+resolve_selected_columns(CsvTomatoModel *model, CsvTomatoError *error) {
+	if (model->selected_indexes_version == model->header->version &&
+		model->header->version) {
+		return;
+	}
+	if (!csvtmt_reserve(model->selected_indexes, model->selected_indexes_capa, model->column_names_len)) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow selected indexes");
+		return;
+	}
+
+	for (size_t ci = 0; ci < model->column_names_len; ci++) {
+		int index = csvtmt_find_type_index(model, model->column_names[ci]);
+		if (index == -1) {
+			csvtmt_error_push(error, CSVTMT_ERR_EXEC, "not found column: %s", model->column_names[ci]);
+			return;
+		}
+		model->selected_indexes[ci] = index;
+	}
+	model->selected_indexes_version = model->header->version;
+}
+
 void
 csvtmt_store_selected_columns(CsvTomatoModel *model, CsvTomatoRow *row, CsvTomatoError *error) {
-	CsvTomatoColumnType *types = model->header.types;
-	size_t tlen = model->header.types_len;
-	const char **cols = model->column_names;
-	const char *col;
+	size_t tlen = model->header->types_len;
 	size_t clen = model->column_names_len;
 	bool star = model->column_names_is_star;
-	CsvTomatoColumnType *type;
 
 	if (tlen != row->len) {
 		csvtmt_error_push(error, CSVTMT_ERR_EXEC, "invalid row length");
 		return;
 	}
 
+	if (!csvtmt_reserve(model->selected_columns, model->selected_columns_capa, star ? row->len : clen)) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to grow selected columns");
+		return;
+	}
+
+	// 前の行で変換した値を全て古くする
+	model->row_serial++;
+
 	if (star) {
 		model->selected_columns_len = row->len-1;
 
@@ -681,21 +1165,15 @@ csvtmt_store_selected_columns(CsvTomatoModel *model, CsvTomatoRow *row, CsvTomat
 			model->selected_columns[i-1] = row->columns[i];
 		}
 	} else {
+		resolve_selected_columns(model, error);
+		if (error->error) {
+			return;
+		}
+
 		model->selected_columns_len = clen;
 
-		for (size_t ti = 0; ti < tlen; ti++) {
-			type = &types[ti];
-			for (size_t ci = 0; ci < clen; ci++) {
-				col = cols[ci];
-				if (!strcmp(type->type_name, col)) {
-					if (model->selected_columns_len >= csvtmt_numof(model->selected_columns)) {
-						csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "selected columns overflow");
-						return;
-					}
-					model->selected_columns[ci] = row->columns[ti];
-					break;
-				}
-			}
+		for (size_t ci = 0; ci < clen; ci++) {
+			model->selected_columns[ci] = row->columns[model->selected_indexes[ci]];
 		}
 	}
 }
@@ -736,6 +1214,34 @@ where_match(CsvTomatoColumnInfoArray *where_infos, CsvTomatoRow *row) {
 	return NULL;
 }
 */
+static size_t
+page_size(void) {
+	long n = sysconf(_SC_PAGESIZE);
+	return n > 0 ? (size_t) n : 4096;
+}
+
+// ファイルの[base, base + len)を窓としてmmapする。今の窓は外す。
+static bool
+map_window(CsvTomatoModel *model, size_t base, size_t len) {
+	void *ptr = mmap(NULL, len, model->mmap.prot, MAP_SHARED, model->mmap.fd, base);
+	if (ptr == MAP_FAILED) {
+		return false;
+	}
+	if (model->mmap.ptr) {
+		munmap(model->mmap.ptr, model->mmap.len);
+	}
+	model->mmap.ptr = ptr;
+	model->mmap.base = base;
+	model->mmap.len = len;
+	return true;
+}
+
+/**
+ * テーブルを開き、先頭からmmap.windowの大きさの窓をmmapする。
+ *
+ * 窓より大きなテーブルはcsvtmt_mmap_scan_row()などで読み進めると窓がずれるので、
+ * 使うアドレス空間とページの数はテーブルの大きさによらず抑えられる。
+ */
 void
 csvtmt_open_mmap(
 	CsvTomatoModel *model,
@@ -758,9 +1264,15 @@ csvtmt_open_mmap(
 	}
 
 	model->mmap.size = st.st_size;
+	model->mmap.st = st;
+	model->mmap.prot = mmap_mode;
+	model->mmap.ptr = NULL;
 
-	model->mmap.ptr = mmap(NULL, model->mmap.size, mmap_mode, MAP_SHARED, model->mmap.fd, 0);
-	if (model->mmap.ptr == MAP_FAILED) {
+	size_t len = model->mmap.window ? model->mmap.window : CSVTMT_MMAP_WINDOW;
+	if (len > model->mmap.size) {
+		len = model->mmap.size;
+	}
+	if (!map_window(model, 0, len)) {
 		close(model->mmap.fd);
 		goto failed_to_mmap;
 	}
@@ -799,91 +1311,255 @@ csvtmt_open_mmap_for_read_write(
 
 void
 csvtmt_close_mmap(CsvTomatoModel *model) {
-	munmap(model->mmap.ptr, model->mmap.size);
+	csvtmt_readahead_stop(model);
+	csvtmt_async_rewind(model);
+	csvtmt_snapshot_close(model);
+	csvtmt_columnar_close(model);
+	munmap(model->mmap.ptr, model->mmap.len);
 	close(model->mmap.fd);
 	model->mmap.ptr = NULL;
 	model->mmap.fd = 0;
+	model->mmap.base = 0;
+	model->mmap.len = 0;
+	model->mmap.dirty = false;
+	model->behind.enabled = false;
 }
 
-CsvTomatoResult
-csvtmt_delete(CsvTomatoModel *model, CsvTomatoError *error) {
-	/*
-	bool has_where = model->where_key_values_len;
-	CsvTomatoRow row = {0};
-	
-	if (has_where) {
-		// DELETEではWHEREにマッチする行は論理削除を行う。
-		CsvTomatoColumnInfoArray where_infos = {0};
+// pのファイルの先頭からの位置。
+size_t
+csvtmt_mmap_offset(const CsvTomatoModel *model, const char *p) {
+	return model->mmap.base + (size_t) (p - model->mmap.ptr);
+}
 
-		csvtmt_store_column_infos(model, &where_infos, model->where_key_values, model->where_key_values_len, error);
-		if (error->error) {
-			goto array_overflow;
+// 今の窓で読める終わり。ファイルの終わりの先にあるページの余りは含めない。
+const char *
+csvtmt_mmap_end(const CsvTomatoModel *model) {
+	size_t len = model->mmap.size - model->mmap.base;
+	return model->mmap.ptr + (len < model->mmap.len ? len : model->mmap.len);
+}
+
+/**
+ * ファイルのoffsetからneedバイト（ファイルの終わりまで）が窓に入るようにし、
+ * offsetの位置を返す。窓をずらすと前の窓を指すポインタは使えなくなる。
+ */
+char *
+csvtmt_mmap_seek(CsvTomatoModel *model, size_t offset, size_t need, CsvTomatoError *error) {
+	size_t size = model->mmap.size;
+	size_t want = offset + need < size ? offset + need : size;
+	if (offset >= model->mmap.base && want <= model->mmap.base + model->mmap.len) {
+		return model->mmap.ptr + (offset - model->mmap.base);
+	}
+
+	size_t page = page_size();
+	size_t base = offset & ~(page - 1);
+	size_t len = model->mmap.window ? model->mmap.window : CSVTMT_MMAP_WINDOW;
+	if (len < want - base) {
+		len = want - base;
+	}
+	if (len > size - base) {
+		len = size - base;
+	}
+	errno = 0;
+	if (!map_window(model, base, len)) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to mmap window of %s: %s", model->table_path, strerror(errno));
+		return NULL;
+	}
+	// 窓をずらすのは走査が先へ進む時なので、次の窓も順に読む
+	madvise(model->mmap.ptr, model->mmap.len, MADV_SEQUENTIAL);
+	return model->mmap.ptr + (offset - base);
+}
+
+// pが窓の終わりなら次の窓に進める。テーブルの終わりか'\0'ならNULL。
+static const char *
+mmap_next(CsvTomatoModel *model, const char *p, CsvTomatoError *error) {
+	if (p >= csvtmt_mmap_end(model)) {
+		size_t offset = csvtmt_mmap_offset(model, p);
+		if (offset >= model->mmap.size) {
+			return NULL;
+		}
+		p = csvtmt_mmap_seek(model, offset, 1, error);
+		if (!p) {
+			return NULL;
 		}
+	}
+	return *p ? p : NULL;
+}
 
-		CsvTomatoRow row = {0};
-		char *p = model->mmap.cur;
+// 行の走査がnextで止まったのが、窓の終わりで行が切れたせいかもしれないか。
+static bool
+row_is_cut(const CsvTomatoModel *model, const char *next, const char *end) {
+	return next == end && csvtmt_mmap_offset(model, end) < model->mmap.size;
+}
 
-		for (; *p; ) {
-			char *head = p;
-			p = (char *) csvtmt_row_parse_string(&row, p, error);
-			if (error->error) {
-				goto failed_to_parse_csv;
-			}
-			if (!strcmp(row.columns[0], "1")) {
-				csvtmt_row_final(&row);
-				continue; // this line deleted
-			}
+// mmap.curがテーブルの終わりか。窓の終わりに来ていれば次の窓に進める。
+bool
+csvtmt_mmap_at_end(CsvTomatoModel *model, CsvTomatoError *error) {
+	const char *p = mmap_next(model, model->mmap.cur, error);
+	if (!p) {
+		return true;
+	}
+	model->mmap.cur = (char *) p;
+	return false;
+}
 
-			CsvTomatoColumnInfo *winfo = where_match(&where_infos, &row);
-			if (winfo) {
-				// match
-				if (*head == '"') {
-					head++;
-				}
-				// __MODE__ column to 1 (delete)
-				*head = '1';
-			}
+/**
+ * *posから1行を走査してspansに入れ、*posを次の行の先頭に進める。行の先頭を返す。
+ * テーブルの終わりかエラーならNULL。
+ *
+ * 窓の終わりで行が切れていたら、行の先頭から窓を取り直して走査し直す。
+ * 窓より長い行なら窓を広げる。返した行とspansは次に呼ぶまで使える。
+ */
+const char *
+csvtmt_mmap_scan_row(CsvTomatoModel *model, const char **pos, CsvTomatoFieldSpans *spans, CsvTomatoError *error) {
+	const char *head = mmap_next(model, *pos, error);
+	if (!head) {
+		return NULL;
+	}
 
-			csvtmt_row_final(&row);
+	for (;;) {
+		const char *end = csvtmt_mmap_end(model);
+		const char *next = csvtmt_row_scan_spans(head, end, spans, error);
+		if (!next) {
+			return NULL;
+		}
+		if (!row_is_cut(model, next, end)) {
+			*pos = next;
+			return head;
 		}
+		head = csvtmt_mmap_seek(model, csvtmt_mmap_offset(model, head), (end - head) * 2, error);
+		if (!head) {
+			return NULL;
+		}
+	}
+}
 
-		model->mmap.cur = p;
+// csvtmt_mmap_scan_row()と同じように*posから1行をrowにパースする。
+const char *
+csvtmt_mmap_parse_row(CsvTomatoModel *model, const char **pos, CsvTomatoRow *row, CsvTomatoError *error) {
+	const char *head = mmap_next(model, *pos, error);
+	if (!head) {
+		return NULL;
+	}
 
-	} else {
-		// 全論理削除。
-		char *p = model->mmap.cur;
+	for (;;) {
+		const char *end = csvtmt_mmap_end(model);
+		const char *next = csvtmt_row_parse_range(row, head, end, ',', error);
+		if (!next) {
+			return NULL;
+		}
+		if (!row_is_cut(model, next, end)) {
+			*pos = next;
+			return head;
+		}
+		csvtmt_row_clear(row);
+		head = csvtmt_mmap_seek(model, csvtmt_mmap_offset(model, head), (end - head) * 2, error);
+		if (!head) {
+			return NULL;
+		}
+	}
+}
 
-		for (; *p; ) {
-			char *head = p;
-			p = (char *) csvtmt_row_parse_string(&row, p, error);
-			if (error->error) {
-				goto failed_to_parse_csv;
-			}
-			if (!strcmp(row.columns[0], "1")) {
-				csvtmt_row_final(&row);
-				continue; // this line deleted
+// mmap上の論理削除をsync_levelに応じてディスクに同期する。
+// 論理削除が無ければ何もしないので文の終わりで1回だけ呼べばいい。
+void
+csvtmt_sync_mmap(CsvTomatoModel *model, CsvTomatoError *error) {
+	if (!model->mmap.dirty || model->sync_level == CSVTMT_SYNC_NONE) {
+		return;
+	}
+
+	// 前の窓で書いた分はmunmapしてもページキャッシュに残るのでfdの同期で足りる
+	int flags = model->sync_level == CSVTMT_SYNC_FULL ? MS_SYNC : MS_ASYNC;
+	errno = 0;
+	if (msync(model->mmap.ptr, model->mmap.len, flags) == -1) {
+		goto failed_to_sync;
+	}
+	if (csvtmt_file_sync(model->mmap.fd, model->sync_level) == -1) {
+		goto failed_to_sync;
+	}
+
+	model->mmap.dirty = false;
+	return;
+failed_to_sync:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync table: %s", strerror(errno));
+}
+
+// 生のフィールドをアンクォートした値がsと等しいか調べる。
+static bool
+span_equals(const CsvTomatoFieldSpan *span, const char *s) {
+	const char *p = span->beg;
+	const char *end = span->end;
+
+	if (p < end && *p == '"') {
+		p++;
+		if (p < end && end[-1] == '"') {
+			end--;
+		}
+		for (; p < end; p++, s++) {
+			if (*p == '"' && p + 1 < end && p[1] == '"') {
+				p++; // "" -> "
 			}
-			if (*head == '"') {
-				head++;
+			if (*s != *p) {
+				return false;
 			}
-			// __MODE__ column to 1 (delete)
-			*head = '1';
-
-			csvtmt_row_final(&row);
 		}
+		return *s == '\0';
+	}
+
+	size_t len = end - p;
+	return strlen(s) == len && !memcmp(p, s, len);
+}
 
-		model->mmap.cur = p;
+/**
+ * DELETEを1パスで実行する。
+ *
+ * 開いているmmapの残りの行を走査してpredにマッチする生きている行の先頭を集め、
+ * 走査が終わってからまとめて__MODE__を'1'にする。行の解釈やop-codeの
+ * 再実行は行わない。同期は呼び出し側で文の終わりに1回だけ行う。
+ */
+CsvTomatoResult
+csvtmt_delete(CsvTomatoModel *model, const CsvTomatoPredicate *pred, CsvTomatoError *error) {
+	CsvTomatoFieldSpans spans = {0};
+	const char *p = model->mmap.cur;
+
+	csvtmt_readahead_start(model);
+	for (const char *head; (head = csvtmt_mmap_scan_row(model, &p, &spans, error)); ) {
+		csvtmt_readahead(model, head);
+		if (!spans.len || span_is_deleted(&spans.array[0])) {
+			continue; // this row deleted
+		}
+		if (!pred->all) {
+			if (pred->column_index >= spans.len ||
+				!span_equals(&spans.array[pred->column_index], pred->value)) {
+				continue;
+			}
+		}
+		model->row_head = (char *) head;
+		if (!csvtmt_delete_row_head(model)) {
+			goto failed_to_allocate;
+		}
+	}
+	if (error->error) {
+		goto failed_to_scan;
 	}
+	model->row_head = NULL;
+	model->changes = model->tombstones ? model->tombstones->len : 0;
+	model->mmap.cur = (char *) p;
 
+	csvtmt_flush_tombstones(model, error);
+	csvtmt_spans_final(&spans);
+	if (error->error) {
+		return CSVTMT_ERROR;
+	}
 	return CSVTMT_DONE;
-failed_to_parse_csv:
-	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to parse csv line");
+
+failed_to_allocate:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate row offsets");
+	csvtmt_spans_final(&spans);
 	return CSVTMT_ERROR;
-array_overflow:
-	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "array overflow");
+failed_to_scan:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to scan table");
+	csvtmt_spans_final(&spans);
 	return CSVTMT_ERROR;
-	*/
-	return 0;
 }
 
 CsvTomatoResult
@@ -892,7 +1568,7 @@ csvtmt_update(CsvTomatoModel *model, CsvTomatoError *error) {
 	const char *not_found = NULL;
 	
 	not_found = csvtmt_header_has_key_values_types(
-		&model->header,
+		model->header,
 		model->update_set_key_values,
 		model->update_set_key_values_len,
 		error
@@ -1007,7 +1683,7 @@ csvtmt_select(CsvTomatoModel *model, CsvTomatoError *error) {
 	bool has_where = model->where_key_values_len;
 
 	if (model->mmap.fd == 0) {
-		csvtmt_header_read_from_table(&model->header, model->table_path, error);
+		csvtmt_header_read_from_table(model->header, model->table_path, error);
 		if (error->error) {
 			goto failed_to_header_read;
 		}
@@ -1016,7 +1692,7 @@ csvtmt_select(CsvTomatoModel *model, CsvTomatoError *error) {
 		// だった場合はヘッダにid, nameが有るか調べる。
 		// そのインデックスの位置にVALUESをセットする。
 		not_found = csvtmt_header_has_column_types(
-			&model->header,
+			model->header,
 			model->column_names,
 			model->column_names_len,
 			error
@@ -1087,6 +1763,7 @@ csvtmt_select(CsvTomatoModel *model, CsvTomatoError *error) {
 
 			CsvTomatoColumnInfo *winfo = where_match(&where_infos, &row);
 			if (winfo) {
+				csvtmt_row_final(&model->row);
 				model->row = row;
 				store_selected_columns(model, &model->row, error);
 				if (error->error) {
@@ -1109,6 +1786,7 @@ csvtmt_select(CsvTomatoModel *model, CsvTomatoError *error) {
 				continue; // this line deleted
 			}
 
+			csvtmt_row_final(&model->row);
 			model->row = row;
 
 			store_selected_columns(model, &model->row, error);
@@ -1235,7 +1913,7 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 		csvtmt_str_del(buf);\
 	}\
 
-	csvtmt_header_read_from_table(&model->header, model->table_path, error);
+	csvtmt_header_load_from_table(model, error);
 	if (error->error) {
 		goto failed_to_header_read;
 	}
@@ -1244,7 +1922,7 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 	// だった場合はヘッダにid, nameが有るか調べる。
 	// そのインデックスの位置にVALUESをセットする。
 	not_found = csvtmt_header_has_column_types(
-		&model->header,
+		model->header,
 		model->column_names,
 		model->column_names_len,
 		error
@@ -1252,6 +1930,7 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 	if (not_found) {
 		goto invalid_column;
 	}
+	CsvTomatoTableStats *stats = csvtmt_model_stats(model);
 
 	// open table
 	errno = 0;
@@ -1259,6 +1938,10 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 	if (!fp) {
 		goto failed_to_open_table;
 	}
+	struct stat st;
+	if (fstat(fileno(fp), &st) == -1) {
+		goto failed_to_open_table;
+	}
 
 	buf = csvtmt_str_new();
 	if (!buf) {
@@ -1280,8 +1963,8 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 		// types:t1,t2,t3
 		// column_names:t1,t3
 		// values:1,3
-		for (size_t j = 0; j < model->header.types_len; j++) {
-			const CsvTomatoColumnType *type = &model->header.types[j];
+		for (size_t j = 0; j < model->header->types_len; j++) {
+			const CsvTomatoColumnType *type = &model->header->types[j];
 			if (!strcmp(type->type_name, CSVTMT_COL_MODE)) {
 				csvtmt_str_append(buf, "0,");
 				continue;
@@ -1308,6 +1991,7 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 					goto failed_to_gen_type_string;
 				}
 				csvtmt_str_append(buf, col);
+				csvtmt_stats_add_value(stats, model->header, j, col);
 			} else {
 				// values_indexはカラムに含まれている。
 				if (values_index >= values->len) {
@@ -1322,10 +2006,12 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 				case CSVTMT_VAL_INT:
 					snprintf(sbuf, sizeof sbuf, "%ld", value->int_value);
 					csvtmt_str_append(buf, sbuf);
+					csvtmt_stats_add_value(stats, model->header, j, sbuf);
 					break;
 				case CSVTMT_VAL_DOUBLE:
 					snprintf(sbuf, sizeof sbuf, "%f", value->double_value);
 					csvtmt_str_append(buf, sbuf);
+					csvtmt_stats_add_value(stats, model->header, j, sbuf);
 					break;
 				case CSVTMT_VAL_STRING: {
 					assert(value->string_value);
@@ -1335,6 +2021,7 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 					}
 					csvtmt_str_append(buf, s);
 					free(s);
+					csvtmt_stats_add_value(stats, model->header, j, value->string_value);
 				} break;
 				}
 			}
@@ -1346,9 +2033,23 @@ csvtmt_insert(CsvTomatoModel *model, CsvTomatoError *error) {
 		fprintf(fp, "%s\n", buf->str);
 	}
 
+	errno = 0;
+	if (csvtmt_file_sync_stream(fp, model->sync_level) == -1) {
+		goto failed_to_sync_table;
+	}
+	if (fflush(fp) == 0) {
+		schema_touch(model, fileno(fp));
+	}
+	model->changes = model->values_len;
+	csvtmt_stats_add_rows(stats, model->table_path, st.st_size, model->values_len, 0);
+
 	cleanup();
 	return CSVTMT_OK;
 
+failed_to_sync_table:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync table %s. %s", model->table_path, strerror(errno));
+	cleanup();
+	return CSVTMT_ERROR;
 failed_to_wrap_column:
 	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to wrap column");
 	cleanup();
@@ -1386,10 +2087,460 @@ values_index_out_of_ragen:
 	return CSVTMT_ERROR;
 }
 
+// クォートの外にある改行を数えて、レコード数の上限を求める。
+static size_t
+count_records(const char *p, const char *end) {
+	size_t n = 0;
+	bool quoted = false;
+
+	for (const char *q = p; q < end && *q; q++) {
+		if (*q == '"') {
+			quoted = !quoted;
+		} else if (*q == '\n' && !quoted) {
+			n++;
+		}
+	}
+	if (end > p && end[-1] != '\n') {
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * src_pathのCSVファイルをテーブルの末尾に一括で追記する。
+ *
+ * opts->headerが真ならソースの1行目をカラム名として扱い、テーブルの
+ * ヘッダと照合する。偽ならソースのカラムは__MODE__を除いたテーブルの
+ * カラムと同じ並びとみなす。ソースに無いAUTOINCREMENTカラムのIDは
+ * 行数分をまとめて確保する。途中で失敗した場合は追記した分を切り詰める。
+ */
+CsvTomatoResult
+csvtmt_copy_from_file(
+	CsvTomatoModel *model,
+	const char *src_path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+) {
+	int src_fd = -1;
+	char *src = MAP_FAILED;
+	size_t src_size = 0;
+	CsvTomatoWriter *w = NULL;
+	CsvTomatoString *buf = NULL;
+	CsvTomatoRow row = {0};
+	int *map = NULL;
+	uint64_t *next_ids = NULL;
+	size_t src_cols = 0;
+	off_t orig_size = 0;
+	const char *bad_col = NULL;
+	int sep = opts && opts->delimiter ? opts->delimiter : ',';
+
+	#undef cleanup
+	#define cleanup() {\
+		csvtmt_row_final(&row);\
+		free(map);\
+		free(next_ids);\
+		csvtmt_str_del(buf);\
+		csvtmt_writer_del(w);\
+		if (src != MAP_FAILED) {\
+			munmap(src, src_size);\
+		}\
+		if (src_fd != -1) {\
+			close(src_fd);\
+		}\
+	}\
+
+	if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+		return CSVTMT_ERROR;
+	}
+
+	csvtmt_header_load_from_table(model, error);
+	if (error->error) {
+		goto failed_to_header_read;
+	}
+
+	map = calloc(model->header->types_len, sizeof(*map));
+	next_ids = calloc(model->header->types_len, sizeof(*next_ids));
+	if (!map || !next_ids) {
+		goto failed_to_allocate_map;
+	}
+
+	errno = 0;
+	src_fd = open(src_path, O_RDONLY);
+	if (src_fd == -1) {
+		goto failed_to_open_src;
+	}
+
+	struct stat st;
+	if (fstat(src_fd, &st) == -1) {
+		goto failed_to_open_src;
+	}
+	src_size = st.st_size;
+	if (src_size == 0) {
+		cleanup();
+		return CSVTMT_OK;
+	}
+
+	src = mmap(NULL, src_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+	if (src == MAP_FAILED) {
+		goto failed_to_mmap;
+	}
+	madvise(src, src_size, MADV_SEQUENTIAL);
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	const char *p = src;
+	const char *end = src + src_size;
+
+	// テーブルのカラム -> ソースのカラム の対応表を作る。
+	for (size_t j = 0; j < model->header->types_len; j++) {
+		map[j] = -1;
+	}
+	if (opts && opts->header) {
+		p = csvtmt_row_parse_range(&row, p, end, sep, error);
+		if (error->error) {
+			goto failed_to_parse_row;
+		}
+		for (size_t i = 0; i < row.len; i++) {
+			int index = csvtmt_find_type_index(model, row.columns[i]);
+			if (index == -1 ||
+				!strcmp(row.columns[i], CSVTMT_COL_MODE) ||
+				map[index] != -1) {
+				bad_col = row.columns[i];
+				goto invalid_column;
+			}
+			map[index] = i;
+		}
+		src_cols = row.len;
+		csvtmt_row_final(&row);
+	} else {
+		for (size_t j = 0; j < model->header->types_len; j++) {
+			if (strcmp(model->header->types[j].type_name, CSVTMT_COL_MODE)) {
+				map[j] = src_cols++;
+			}
+		}
+	}
+
+	// ソースに無いAUTOINCREMENTカラムのIDはまとめて確保しておく。
+	size_t nrecords = count_records(p, end);
+	for (size_t j = 0; j < model->header->types_len; j++) {
+		const CsvTomatoColumnType *type = &model->header->types[j];
+		if (map[j] == -1 &&
+			type->type_def_info.integer &&
+			type->type_def_info.autoincrement &&
+			nrecords) {
+			next_ids[j] = reserve_auto_increment_ids(model, type->type_name, nrecords, error);
+			if (error->error) {
+				goto failed_to_reserve_ids;
+			}
+		}
+	}
+
+	w = csvtmt_writer_new(model->table_path, O_WRONLY | O_APPEND, error);
+	if (error->error) {
+		goto failed_to_open_table;
+	}
+	csvtmt_writer_use_backend(w, model->io_backend);
+	if (fstat(w->fd, &st) == -1) {
+		goto failed_to_open_table;
+	}
+	orig_size = st.st_size;
+
+	buf = csvtmt_str_new();
+	if (!buf) {
+		goto failed_to_allocate_buffer;
+	}
+
+	CsvTomatoTableStats *stats = csvtmt_model_stats(model);
+	const CsvTomatoHeader *header = model->header;
+	size_t nrows = 0;
+
+	while (p < end && *p) {
+		csvtmt_row_clear(&row);
+		p = csvtmt_row_parse_range(&row, p, end, sep, error);
+		if (error->error) {
+			goto failed_to_parse_row;
+		}
+		if (row.len == 0) {
+			continue; // empty line
+		}
+		if (row.len != src_cols) {
+			goto invalid_columns_len;
+		}
+
+		csvtmt_str_clear(buf);
+
+		for (size_t j = 0; j < model->header->types_len; j++) {
+			const CsvTomatoColumnType *type = &model->header->types[j];
+			if (j) {
+				csvtmt_str_push_back(buf, ',');
+			}
+
+			if (!strcmp(type->type_name, CSVTMT_COL_MODE)) {
+				csvtmt_str_push_back(buf, '0');
+			} else if (map[j] != -1) {
+				const char *col = row.columns[map[j]];
+				csvtmt_stats_add_value(stats, header, j, col);
+				if (type->type_def_info.text || strpbrk(col, ",\"\r\n")) {
+					char *s = csvtmt_wrap_column(col, error);
+					if (!s || error->error) {
+						goto failed_to_wrap_column;
+					}
+					csvtmt_str_append(buf, s);
+					free(s);
+				} else {
+					csvtmt_str_append(buf, col);
+				}
+			} else if (next_ids[j]) {
+				char num[CSVTMT_NUM_STR_SIZE];
+				snprintf(num, sizeof num, "%ld", next_ids[j]++);
+				csvtmt_str_append(buf, num);
+				csvtmt_stats_add_value(stats, header, j, num);
+			} else {
+				char col[1024];
+				type_gen_column_default_value(model, type, col, sizeof col, error);
+				if (error->error) {
+					goto failed_to_gen_type_string;
+				}
+				csvtmt_str_append(buf, col);
+				csvtmt_stats_add_value(stats, header, j, col);
+			}
+		}
+
+		csvtmt_str_push_back(buf, '\n');
+		csvtmt_writer_write(w, buf->str, buf->len, error);
+		if (error->error) {
+			goto failed_to_write;
+		}
+		nrows++;
+	}
+
+	csvtmt_writer_sync(w, model->sync_level, error);
+	if (error->error) {
+		goto failed_to_write;
+	}
+	csvtmt_stats_add_rows(stats, model->table_path, orig_size, nrows, 0);
+
+	// 一度しか読まない取り込み元で他のテーブルのページを追い出さない。
+	// mmapしたままのページは落ちないので先に外す
+	if (csvtmt_scan_too_large(src_size)) {
+		munmap(src, src_size);
+		src = MAP_FAILED;
+		posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	cleanup();
+	return CSVTMT_OK;
+
+failed_to_header_read:
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_allocate_map:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate column map");
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_open_src:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open %s: %s", src_path, strerror(errno));
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_mmap:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to mmap %s: %s", src_path, strerror(errno));
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_parse_row:
+	csvtmt_error_push(error, CSVTMT_ERR_PARSE, "failed to parse row of %s", src_path);
+	goto rollback;
+invalid_column:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "invalid column name. \"%s\" is not in header types", bad_col);
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_reserve_ids:
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_open_table:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open table %s", model->table_path);
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_allocate_buffer:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate buffer");
+	goto rollback;
+invalid_columns_len:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "invalid columns length. expected \"%ld\" but got \"%ld\"", src_cols, row.len);
+	goto rollback;
+failed_to_wrap_column:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to wrap column");
+	goto rollback;
+failed_to_gen_type_string:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to generate type column value");
+	goto rollback;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write table %s", model->table_path);
+	goto rollback;
+rollback:
+	if (w) {
+		// 書きかけの行を残さない
+		csvtmt_writer_truncate(w, orig_size);
+	}
+	cleanup();
+	return CSVTMT_ERROR;
+}
+
+/**
+ * テーブルの生きている行をdst_pathに書き出す。
+ *
+ * 区切り文字が','ならmmapから__MODE__カラムの後ろのバイト列を
+ * そのままコピーする。それ以外の区切り文字では行をパースして
+ * 書き直す。出力は一時ファイルに書いてから最後にrenameする。
+ */
+CsvTomatoResult
+csvtmt_copy_table_to_file(
+	CsvTomatoModel *model,
+	const char *dst_path,
+	const CsvTomatoCopyOpts *opts,
+	CsvTomatoError *error
+) {
+	CsvTomatoWriter *w = NULL;
+	CsvTomatoRow row = {0};
+	CsvTomatoFieldSpans spans = {0};
+	char tmp_path[CSVTMT_PATH_SIZE + 32];
+	char sep = opts && opts->delimiter ? opts->delimiter : ',';
+
+	#undef cleanup
+	#define cleanup() {\
+		csvtmt_row_final(&row);\
+		csvtmt_spans_final(&spans);\
+		if (w) {\
+			csvtmt_writer_del(w);\
+			remove(tmp_path);\
+		}\
+		if (model->mmap.ptr) {\
+			csvtmt_close_mmap(model);\
+		}\
+	}\
+
+	if (!csvtmt_model_lock(model, CSVTMT_LOCK_SHARED, error)) {
+		return CSVTMT_ERROR;
+	}
+
+	csvtmt_open_mmap_for_read(model, model->table_path, error);
+	if (error->error) {
+		return CSVTMT_ERROR;
+	}
+	csvtmt_scan_advise(model);
+
+	const char *next = csvtmt_header_load_from_mmap(model, error);
+	if (error->error) {
+		goto failed_to_read_header;
+	}
+
+	snprintf(tmp_path, sizeof tmp_path, "%s.%ld.tmp", dst_path, (long) getpid());
+	w = csvtmt_writer_new(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, error);
+	if (error->error) {
+		goto failed_to_open_dst;
+	}
+	csvtmt_writer_use_backend(w, model->io_backend);
+
+	if (opts && opts->header) {
+		bool first = true;
+		for (size_t j = 0; j < model->header->types_len; j++) {
+			const char *name = model->header->types[j].type_name;
+			if (!strcmp(name, CSVTMT_COL_MODE)) {
+				continue;
+			}
+			if (!first) {
+				csvtmt_writer_write(w, &sep, 1, error);
+			}
+			csvtmt_writer_write_field(w, name, sep, error);
+			first = false;
+		}
+		csvtmt_writer_write(w, "\n", 1, error);
+		if (error->error) {
+			goto failed_to_write;
+		}
+	}
+
+	csvtmt_readahead_start(model);
+	for (const char *p; (p = csvtmt_mmap_scan_row(model, &next, &spans, error)); ) {
+		csvtmt_readahead(model, p);
+		if (spans.len == 0 || span_is_deleted(&spans.array[0])) {
+			continue;
+		}
+
+		if (sep == ',') {
+			if (spans.len > 1) {
+				csvtmt_writer_write(w, spans.array[1].beg, next - spans.array[1].beg, error);
+			}
+			if (spans.len == 1 || next[-1] != '\n') {
+				csvtmt_writer_write(w, "\n", 1, error);
+			}
+		} else {
+			csvtmt_row_clear(&row);
+			csvtmt_row_parse_range(&row, p, next, ',', error);
+			if (error->error) {
+				goto failed_to_scan;
+			}
+			for (size_t i = 1; i < row.len; i++) {
+				if (i > 1) {
+					csvtmt_writer_write(w, &sep, 1, error);
+				}
+				csvtmt_writer_write_field(w, row.columns[i], sep, error);
+			}
+			csvtmt_writer_write(w, "\n", 1, error);
+		}
+		if (error->error) {
+			goto failed_to_write;
+		}
+	}
+	if (error->error) {
+		goto failed_to_scan;
+	}
+
+	csvtmt_writer_sync(w, model->sync_level, error);
+	if (error->error) {
+		goto failed_to_write;
+	}
+	csvtmt_writer_del(w);
+	w = NULL;
+
+	if (csvtmt_file_rename(tmp_path, dst_path) == -1) {
+		goto failed_to_rename;
+	}
+	if (csvtmt_file_sync_dir(dst_path, model->sync_level) == -1) {
+		goto failed_to_sync_dir;
+	}
+
+	cleanup();
+	return CSVTMT_OK;
+
+failed_to_read_header:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to read header");
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_open_dst:
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_scan:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to scan table");
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write %s", dst_path);
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_rename:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to rename %s", dst_path);
+	remove(tmp_path);
+	cleanup();
+	return CSVTMT_ERROR;
+failed_to_sync_dir:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync directory of %s: %s", dst_path, strerror(errno));
+	cleanup();
+	return CSVTMT_ERROR;
+}
+
 int
 csvtmt_find_type_index(CsvTomatoModel *model, const char *type_name) {
-	for (int i = 0; i < model->header.types_len; i++) {
-		const CsvTomatoColumnType *type = &model->header.types[i];
+	for (int i = 0; i < model->header->types_len; i++) {
+		const CsvTomatoColumnType *type = &model->header->types[i];
 		if (!strcmp(type->type_name, type_name)) {
 			return i;
 		}
@@ -1397,15 +2548,82 @@ csvtmt_find_type_index(CsvTomatoModel *model, const char *type_name) {
 	return -1;
 }
 
-void
+// 今の行を論理削除する行に加える。__MODE__はcsvtmt_flush_tombstones()でまとめて書き換える。
+bool
 csvtmt_delete_row_head(CsvTomatoModel *model) {
-	char *p = model->row_head;
-	if (p) {
-		if (*p == '"') {
-			p++;
+	if (!model->row_head) {
+		return true;
+	}
+	if (!model->tombstones) {
+		model->tombstones = csvtmt_offsets_new();
+		if (!model->tombstones) {
+			return false;
+		}
+	}
+	return csvtmt_offsets_push_back(model->tombstones, csvtmt_mmap_offset(model, model->row_head));
+}
+
+static int
+compare_offsets(const void *a, const void *b) {
+	size_t x = *(const size_t *) a;
+	size_t y = *(const size_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * 集めた行の__MODE__を'1'にする。同期は呼び出し側でcsvtmt_sync_mmap()する。
+ *
+ * 先に論理削除ログへ追記するので、スナップショットを取った文は
+ * ここで消された行をまだ生きているとみなせる。
+ * 行を位置の順に並べて窓ごとにmmapで書き、終わったら元の窓に戻す。
+ */
+void
+csvtmt_flush_tombstones(CsvTomatoModel *model, CsvTomatoError *error) {
+	CsvTomatoOffsets *tombs = model->tombstones;
+	if (!tombs || !tombs->len) {
+		return;
+	}
+
+	csvtmt_tomb_log_append(model, tombs, error);
+	if (error->error) {
+		return;
+	}
+
+	qsort(tombs->array, tombs->len, sizeof(tombs->array[0]), compare_offsets);
+	size_t base = model->mmap.base;
+	size_t len = model->mmap.len;
+	size_t cur = model->mmap.cur ? csvtmt_mmap_offset(model, model->mmap.cur) : 0;
+
+	model->mmap.dirty = true;
+	for (size_t i = 0; i < tombs->len; i++) {
+		// クォートされた__MODE__は次のバイトを書く
+		char *mode = csvtmt_mmap_seek(model, tombs->array[i], 2, error);
+		if (!mode) {
+			goto failed_to_seek;
 		}
-		*p = '1';
+		if (*mode == '"') {
+			mode++;
+		}
+		*mode = '1'; // __MODE__ column to 1 (delete)
+	}
+	csvtmt_offsets_clear(tombs);
+
+	if (model->mmap.base == base && model->mmap.len == len) {
+		return;
 	}
+	errno = 0;
+	if (!map_window(model, base, len)) {
+		goto failed_to_map;
+	}
+	if (model->mmap.cur) {
+		model->mmap.cur = model->mmap.ptr + (cur - base);
+	}
+	return;
+failed_to_seek:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write tombstone");
+	return;
+failed_to_map:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to mmap window of %s: %s", model->table_path, strerror(errno));
 }
 
 void
@@ -1413,6 +2631,7 @@ csvtmt_append_rows_to_table(
 	const char *table_path,
 	CsvTomatoRows *rows,
 	bool wrap,
+	CsvTomatoSyncLevel sync_level,
 	CsvTomatoError *error
 ) {
 	FILE *fp = fopen(table_path, "a");
@@ -1429,6 +2648,11 @@ csvtmt_append_rows_to_table(
 		}
 	}
 
+	errno = 0;
+	if (csvtmt_file_sync_stream(fp, sync_level) == -1) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync table: %s: %s", table_path, strerror(errno));
+	}
+
 	fclose(fp);
 	return;
 failed_to_append:
@@ -1446,5 +2670,5 @@ csvtmt_clear_rows(CsvTomatoRows *rows) {
 
 bool
 csvtmt_is_deleted_row(const CsvTomatoRow *row) {
-	return !strcmp(row->columns[0], "1");
+	return row->len && !strcmp(row->columns[0], "1");
 }
@@ -18,75 +18,66 @@ csvtmt_opcode_new(CsvTomatoError *error) {
 		return NULL;
 	}
 
+	self->place_holders = csvtmt_offsets_new();
+	if (!self->place_holders) {
+		free(self->elems);
+		free(self);
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocat memory (3): %s", strerror(errno));
+		return NULL;
+	}
+
 	return self;
 }
 
+// バインドで確保した値を解放する。
+// 名前やリテラルの文字列は文のarenaが持っているのでここでは解放しない。
 static void
-destroy_elem(CsvTomatoOpcodeElem *elem) {
-	switch (elem->kind) {
-	case CSVTMT_OP_NONE: break;
-	case CSVTMT_OP_STAR: break;
-	case CSVTMT_OP_PLACE_HOLDER: break;
-	case CSVTMT_OP_ASSIGN: break;
-	case CSVTMT_OP_SHOW_TABLES_BEG: 
-		free(elem->obj.show_tables_stmt.db_name);
-		break;
-	case CSVTMT_OP_SHOW_TABLES_END: break;
-	case CSVTMT_OP_CREATE_TABLE_STMT_BEG:
-		free(elem->obj.create_table_stmt.table_name);
-		break;
-	case CSVTMT_OP_CREATE_TABLE_STMT_END: break;
-	case CSVTMT_OP_SELECT_STMT_BEG:
-		free(elem->obj.select_stmt.table_name);
-		break;
-	case CSVTMT_OP_SELECT_STMT_END: break;	
-	case CSVTMT_OP_INSERT_STMT_BEG:
-		free(elem->obj.insert_stmt.table_name);
-		break;
-	case CSVTMT_OP_INSERT_STMT_END: break;
-	case CSVTMT_OP_UPDATE_STMT_BEG:
-		free(elem->obj.update_stmt.table_name);
-		break;
-	case CSVTMT_OP_UPDATE_STMT_END: break;
-	case CSVTMT_OP_UPDATE_SET_BEG: break;
-	case CSVTMT_OP_UPDATE_SET_END: break;
-	case CSVTMT_OP_DELETE_STMT_BEG:
-		free(elem->obj.update_stmt.table_name);
-		break;
-	case CSVTMT_OP_DELETE_STMT_END: break;
-	case CSVTMT_OP_WHERE_BEG: break;
-	case CSVTMT_OP_WHERE_END: break;
-	case CSVTMT_OP_IDENT:
-		free(elem->obj.ident.value);
-		break;
-	case CSVTMT_OP_STRING_VALUE:
-		if (elem->obj.string_value.destructor) {
-			elem->obj.string_value.destructor(elem->obj.string_value.value);
-		} else {
-			free(elem->obj.string_value.value);
-		}
-		break;
-	case CSVTMT_OP_INT_VALUE: break;
-	case CSVTMT_OP_DOUBLE_VALUE: break;
-	case CSVTMT_OP_COLUMN_DEF:
-		free(elem->obj.column_def.column_name);
-		break;
-	case CSVTMT_OP_COLUMN_NAMES_BEG: break;
-	case CSVTMT_OP_COLUMN_NAMES_END: break;
-	case CSVTMT_OP_VALUES_BEG: break;
-	case CSVTMT_OP_VALUES_END: break;
+destroy_bound_value(CsvTomatoOpcodeElem *elem) {
+	if (elem->kind != CSVTMT_OP_STRING_VALUE) {
+		return;
+	}
+	if (elem->obj.string_value.destructor) {
+		elem->obj.string_value.destructor(elem->obj.string_value.value);
+	} else {
+		free(elem->obj.string_value.value);
+	}
+}
+
+// バインドされたプレースホルダの値を解放してPLACE_HOLDERに戻す。
+void
+csvtmt_opcode_unbind_elem(CsvTomatoOpcodeElem *elem) {
+	if (elem->old_kind != CSVTMT_OP_PLACE_HOLDER ||
+		elem->kind == CSVTMT_OP_PLACE_HOLDER) {
+		return;
+	}
+	destroy_bound_value(elem);
+	memset(&elem->obj, 0, sizeof(elem->obj));
+	elem->kind = CSVTMT_OP_PLACE_HOLDER;
+}
+
+void
+csvtmt_opcode_clear_bindings(CsvTomatoOpcode *self) {
+	for (size_t i = 0; i < self->place_holders->len; i++) {
+		csvtmt_opcode_unbind_elem(&self->elems[self->place_holders->array[i]]);
 	}
 }
 
+// index番目（1始まり）のプレースホルダのop-codeを返す。範囲外ならNULL。
+CsvTomatoOpcodeElem *
+csvtmt_opcode_place_holder(CsvTomatoOpcode *self, size_t index) {
+	if (index == 0 || index > self->place_holders->len) {
+		return NULL;
+	}
+	return &self->elems[self->place_holders->array[index-1]];
+}
+
 void
 csvtmt_opcode_del(CsvTomatoOpcode *self) {
 	if (!self) {
 		return;
 	}
-	for (size_t i = 0; i < self->len; i++) {
-		CsvTomatoOpcodeElem *elem = &self->elems[i];
-		destroy_elem(elem);
-	}
+	csvtmt_opcode_clear_bindings(self);
+	csvtmt_offsets_del(self->place_holders);
 	free(self->elems);
 	free(self);
 }
@@ -128,6 +119,8 @@ static void opcode_sql_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomat
 static void opcode_create_table_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
 static void opcode_show_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
 static void opcode_show_tables_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
+static void opcode_copy_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
+static void opcode_analyze_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
 static void opcode_select_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
 static void opcode_insert_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
 static void opcode_update_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error);
@@ -170,6 +163,8 @@ opcode_sql_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *erro
 	opcode_update_stmt(self, node->obj.sql_stmt.update_stmt, error);
 	opcode_delete_stmt(self, node->obj.sql_stmt.delete_stmt, error);
 	opcode_show_stmt(self, node->obj.sql_stmt.show_stmt, error);
+	opcode_copy_stmt(self, node->obj.sql_stmt.copy_stmt, error);
+	opcode_analyze_stmt(self, node->obj.sql_stmt.analyze_stmt, error);
 }
 
 static void
@@ -482,6 +477,81 @@ opcode_show_tables_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoErr
 	}	
 }
 
+// SELECT * FROM table_name （WHERE無し）か調べる。
+static bool
+is_select_all(const CsvTomatoNode *select) {
+	const CsvTomatoNode *expr = select->obj.select_stmt.expr_list;
+	if (select->obj.select_stmt.where_expr || !expr || expr->next) {
+		return false;
+	}
+	const CsvTomatoNode *column_name = expr->obj.expr.column_name;
+	return column_name && column_name->obj.column_name.star;
+}
+
+static void
+opcode_copy_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error) {
+	if (!node) {
+		return;
+	}
+	assert(node->kind == CSVTMT_ND_COPY_STMT);
+
+	CsvTomatoNode *select = node->obj.copy_stmt.select_stmt;
+	CsvTomatoOpcodeElem elem = {0};
+
+	elem.kind = node->obj.copy_stmt.to ? CSVTMT_OP_COPY_TO : CSVTMT_OP_COPY_FROM;
+	elem.obj.copy_stmt.path = csvtmt_move(node->obj.copy_stmt.path);
+	node->obj.copy_stmt.path = NULL;
+	elem.obj.copy_stmt.header = node->obj.copy_stmt.header;
+	elem.obj.copy_stmt.delimiter = node->obj.copy_stmt.delimiter;
+
+	if (select && is_select_all(select)) {
+		// SELECT * FROM t はテーブルをそのままコピーできる
+		elem.obj.copy_stmt.table_name = csvtmt_move(select->obj.select_stmt.table_name);
+		select->obj.select_stmt.table_name = NULL;
+	} else if (select) {
+		// SELECTの結果を1行ずつ書き出す
+		elem.kind = CSVTMT_OP_COPY_TO_BEG;
+		push(self, elem, error);
+		if (error->error) {
+			return;
+		}
+
+		opcode_select_stmt(self, select, error);
+		if (error->error) {
+			return;
+		}
+
+		CsvTomatoOpcodeElem end = {
+			.kind = CSVTMT_OP_COPY_TO_END,
+		};
+		push(self, end, error);
+		return;
+	} else {
+		elem.obj.copy_stmt.table_name = csvtmt_move(node->obj.copy_stmt.table_name);
+		node->obj.copy_stmt.table_name = NULL;
+	}
+
+	push(self, elem, error);
+	if (error->error) {
+		return;
+	}
+}
+
+static void
+opcode_analyze_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error) {
+	if (!node) {
+		return;
+	}
+	assert(node->kind == CSVTMT_ND_ANALYZE_STMT);
+
+	CsvTomatoOpcodeElem elem = {0};
+	elem.kind = CSVTMT_OP_ANALYZE;
+	elem.obj.analyze_stmt.table_name = csvtmt_move(node->obj.analyze_stmt.table_name);
+	node->obj.analyze_stmt.table_name = NULL;
+
+	push(self, elem, error);
+}
+
 static void
 opcode_delete_stmt(CsvTomatoOpcode *self, CsvTomatoNode *node, CsvTomatoError *error) {
 	if (!node) {
@@ -756,6 +826,12 @@ opcode_expr(
 	}
 
 	if (node->obj.expr.place_holder) {
+		// バインド時に?の番号から直接引けるように位置を覚えておく
+		if (!csvtmt_offsets_push_back(self->place_holders, self->len)) {
+			csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to push place holder");
+			return;
+		}
+
 		CsvTomatoOpcodeElem elem = {0};
 		elem.kind = CSVTMT_OP_PLACE_HOLDER;
 		push(self, elem, error);
@@ -1,11 +1,10 @@
 #include <csvtomato.h>
 
+// ノードはarenaから取る。構文エラーで捨てたノードもarenaと一緒に解放される。
 CsvTomatoNode *
-csvtmt_node_new(CsvTomatoNodeKind kind, CsvTomatoError *error) {
-	errno = 0;
-	CsvTomatoNode *self = calloc(1, sizeof(*self));
+csvtmt_node_new(CsvTomatoArena *arena, CsvTomatoNodeKind kind, CsvTomatoError *error) {
+	CsvTomatoNode *self = csvtmt_arena_alloc(arena, sizeof(*self), error);
 	if (!self) {
-		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
 		return NULL;
 	}
 
@@ -14,152 +13,8 @@ csvtmt_node_new(CsvTomatoNodeKind kind, CsvTomatoError *error) {
 	return self;
 }
 
-void
-csvtmt_node_del(CsvTomatoNode *self) {
-	if (!self) {
-		return;
-	}
-
-	free(self);
-}
-
-static void 
-del_all_node_list(CsvTomatoNode *list) {
-	for (CsvTomatoNode *cur = list; cur; ) {
-		CsvTomatoNode *rm = cur;
-		cur = cur->next;
-		csvtmt_node_del_all(rm);
-	}
-}
-
-void
-csvtmt_node_del_all(CsvTomatoNode *self) {
-	if (!self) {
-		return;
-	}
-
-	switch (self->kind) {
-	case CSVTMT_ND_NONE:
-		break;
-	case CSVTMT_ND_FUNCTION:
-		csvtmt_node_del_all(self->obj.function.expr);
-		break;
-	case CSVTMT_ND_SHOW_STMT:
-		csvtmt_node_del_all(self->obj.show_stmt.show_tables_stmt);
-		break;
-	case CSVTMT_ND_SHOW_TABLES_STMT:
-		free(self->obj.show_tables_stmt.db_name);
-		self->obj.show_tables_stmt.db_name = NULL;
-		break;
-	case CSVTMT_ND_STMT_LIST:
-		// puts("CSVTMT_ND_STMT_LIST");
-		for (CsvTomatoNode *cur = self->obj.sql_stmt_list.sql_stmt_list; cur; ) {
-			CsvTomatoNode *rm = cur;
-			cur = cur->next;
-			csvtmt_node_del_all(rm);
-		}
-		break;
-	case CSVTMT_ND_STMT:
-		// puts("CSVTMT_ND_STMT");
-		csvtmt_node_del_all(self->obj.sql_stmt.create_table_stmt);
-		csvtmt_node_del_all(self->obj.sql_stmt.insert_stmt);
-		csvtmt_node_del_all(self->obj.sql_stmt.select_stmt);
-		csvtmt_node_del_all(self->obj.sql_stmt.update_stmt);
-		csvtmt_node_del_all(self->obj.sql_stmt.delete_stmt);
-		csvtmt_node_del_all(self->obj.sql_stmt.show_stmt);
-		break;
-	case CSVTMT_ND_CREATE_TABLE_STMT:
-		// puts("CSVTMT_ND_CREATE_TABLE_STMT");
-		free(self->obj.create_table_stmt.table_name);
-		for (CsvTomatoNode *cur = self->obj.create_table_stmt.column_def_list; cur; ) {
-			CsvTomatoNode *rm = cur;
-			cur = cur->next;
-			csvtmt_node_del_all(rm);
-		}
-		break;
-	case CSVTMT_ND_SELECT_STMT:
-		free(self->obj.select_stmt.table_name);
-
-		if (self->obj.select_stmt.function) {
-			csvtmt_node_del_all(self->obj.select_stmt.function);
-		} else {
-			for (CsvTomatoNode *cur = self->obj.select_stmt.column_name_list; cur; ) {
-				CsvTomatoNode *rm = cur;
-				cur = cur->next;
-				csvtmt_node_del_all(rm);
-			}
-		}
-		csvtmt_node_del_all(self->obj.select_stmt.where_expr);
-		break;
-	case CSVTMT_ND_INSERT_STMT:
-		free(self->obj.insert_stmt.table_name);
-
-		for (CsvTomatoNode *cur = self->obj.insert_stmt.column_name_list; cur; ) {
-			CsvTomatoNode *rm = cur;
-			cur = cur->next;
-			csvtmt_node_del_all(rm);
-		}
-		for (CsvTomatoNode *cur = self->obj.insert_stmt.values_list; cur; ) {
-			CsvTomatoNode *rm = cur;
-			cur = cur->next;
-			csvtmt_node_del_all(rm);
-		}
-		break;
-	case CSVTMT_ND_UPDATE_STMT:
-		free(self->obj.update_stmt.table_name);
-
-		for (CsvTomatoNode *cur = self->obj.update_stmt.assign_expr_list; cur; ) {
-			CsvTomatoNode *rm = cur;
-			cur = cur->next;
-			csvtmt_node_del_all(rm);
-		}
-
-		csvtmt_node_del_all(self->obj.update_stmt.where_expr);
-		break;
-	case CSVTMT_ND_DELETE_STMT:
-		free(self->obj.delete_stmt.table_name);
-		csvtmt_node_del_all(self->obj.delete_stmt.where_expr);
-		break;
-	case CSVTMT_ND_VALUES:
-		for (CsvTomatoNode *cur = self->obj.values.expr_list; cur; ) {
-			CsvTomatoNode *rm = cur;
-			cur = cur->next;
-			csvtmt_node_del_all(rm);
-		}		
-		break;
-	case CSVTMT_ND_EXPR:
-		csvtmt_node_del_all(self->obj.expr.assign_expr);
-		csvtmt_node_del_all(self->obj.expr.number);
-		csvtmt_node_del_all(self->obj.expr.string);
-		csvtmt_node_del_all(self->obj.expr.function);
-		break;
-	case CSVTMT_ND_ASSIGN_EXPR:
-		free(self->obj.assign_expr.ident);
-		csvtmt_node_del_all(self->obj.assign_expr.expr);
-		break;
-	case CSVTMT_ND_STRING:
-		free(self->obj.string.string);
-		break;
-	case CSVTMT_ND_NUMBER:
-		break;
-	case CSVTMT_ND_COLUMN_NAME:
-		free(self->obj.column_name.column_name);
-		break;
-	case CSVTMT_ND_COLUMN_DEF:
-		// puts("CSVTMT_ND_COLUMN_DEF");
-		free(self->obj.column_def.column_name);
-		csvtmt_node_del_all(self->obj.column_def.column_constraint);
-		break;
-	case CSVTMT_ND_COLUMN_CONSTRAINT:
-		// puts("CSVTMT_ND_COLUMN_CONSTRAINT");
-		break;
-	}
-
-	free(self);
-}
-
 CsvTomatoParser *
-csvtmt_parser_new(CsvTomatoError *error) {
+csvtmt_parser_new(CsvTomatoArena *arena, CsvTomatoError *error) {
 	errno = 0;
 	CsvTomatoParser *self = calloc(1, sizeof(*self));
 	if (!self) {
@@ -167,6 +22,8 @@ csvtmt_parser_new(CsvTomatoError *error) {
 		return NULL;
 	}
 
+	self->arena = arena;
+
 	return self;
 }
 
@@ -190,6 +47,8 @@ static CsvTomatoNode *parse_update_stmt(CsvTomatoParser *self, CsvTomatoToken **
 static CsvTomatoNode *parse_delete_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
 static CsvTomatoNode *parse_show_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
 static CsvTomatoNode *parse_show_tables_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
+static CsvTomatoNode *parse_copy_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
+static CsvTomatoNode *parse_analyze_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
 static CsvTomatoNode *parse_column_name(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
 static CsvTomatoNode *parse_values(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
 static CsvTomatoNode *parse_expr(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error);
@@ -228,6 +87,22 @@ text(CsvTomatoToken **token) {
 	return (*token)->text;
 }
 
+// 予約語にしていない語か調べる。識別子として読んだトークンを大文字小文字を区別せずに比べる。
+// COPYのように文の中でだけ意味を持つ語は、カラム名やテーブル名に使えるように予約しない。
+static bool
+is_word(CsvTomatoToken **token, const char *word) {
+	size_t len = strlen(word);
+	return kind(token) == CSVTMT_TK_IDENT &&
+		(*token)->len == len &&
+		!strncasecmp(text(token), word, len);
+}
+
+// トークンの文字列をNUL終端してarenaにコピーする。
+static char *
+dup_text(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
+	return csvtmt_arena_strndup(self->arena, (*token)->text, (*token)->len, error);
+}
+
 static void
 node_push(CsvTomatoNode *node, CsvTomatoNode *n) {
 	CsvTomatoNode *tail = NULL;
@@ -271,7 +146,7 @@ csvtmt_parser_parse(
 
 static CsvTomatoNode * 
 parse_sql_stmt_list(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_STMT_LIST, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_STMT_LIST, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -280,7 +155,6 @@ parse_sql_stmt_list(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoErro
 
 	sql_stmt_list = parse_sql_stmt(self, token, error);
 	if (!sql_stmt_list || error->error) {
-		csvtmt_node_del_all(n1);
 		return NULL;
 	}
 
@@ -304,13 +178,12 @@ parse_sql_stmt_list(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoErro
 	n1->obj.sql_stmt_list.sql_stmt_list = sql_stmt_list;
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode * 
 parse_sql_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -363,15 +236,30 @@ parse_sql_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *er
 		return n1;
 	}
 
+	n1->obj.sql_stmt.copy_stmt = parse_copy_stmt(self, token, error);
+	if (error->error) {
+		goto fail;
+	}
+	if (n1->obj.sql_stmt.copy_stmt) {
+		return n1;
+	}
+
+	n1->obj.sql_stmt.analyze_stmt = parse_analyze_stmt(self, token, error);
+	if (error->error) {
+		goto fail;
+	}
+	if (n1->obj.sql_stmt.analyze_stmt) {
+		return n1;
+	}
+
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode * 
 parse_create_table_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
 	CsvTomatoToken *save = *token;
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_CREATE_TABLE_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_CREATE_TABLE_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -415,7 +303,7 @@ parse_create_table_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomato
 		goto fail;
 	}
 
-	n1->obj.create_table_stmt.table_name = csvtmt_strdup(text(token), error);
+	n1->obj.create_table_stmt.table_name = dup_text(self, token, error);
 	if (error->error) {
 		goto fail;
 	}
@@ -463,7 +351,6 @@ parse_create_table_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomato
 
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
@@ -480,7 +367,7 @@ is_valid_type_name(CsvTomatoTokenKind kind) {
 
 static CsvTomatoNode * 
 parse_column_def(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_COLUMN_DEF, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_COLUMN_DEF, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -488,14 +375,14 @@ parse_column_def(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *
 	if (kind(token) != CSVTMT_TK_IDENT) {
 		goto fail;
 	}
-	n1->obj.column_def.column_name = csvtmt_strdup(text(token), error);
+	n1->obj.column_def.column_name = dup_text(self, token, error);
 	if (error->error) {
 		goto fail;
 	}
 	next(token);
 
 	if (!is_valid_type_name(kind(token))) {
-		csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "invalid type name: %d: %s", kind(token), text(token));
+		csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "invalid type name: %d: %.*s", kind(token), (int) (*token)->len, text(token));
 		goto fail;
 	}
 	n1->obj.column_def.type_name = kind(token);
@@ -515,13 +402,12 @@ parse_column_def(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *
 ok:
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode * 
 parse_column_constraint(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_COLUMN_CONSTRAINT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_COLUMN_CONSTRAINT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -557,14 +443,12 @@ parse_column_constraint(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomato
 			goto fail;
 		}
 	} else {
-		csvtmt_node_del_all(n1);
 		return NULL;  // not error
 	}
 
 ok:
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
@@ -575,7 +459,7 @@ parse_delete_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 		return NULL;
 	}
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_DELETE_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_DELETE_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -593,7 +477,7 @@ parse_delete_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	if (kind(token) != CSVTMT_TK_IDENT) {
 		goto not_found_table_name;
 	} else {
-		n1->obj.delete_stmt.table_name = csvtmt_strdup(text(token), error);
+		n1->obj.delete_stmt.table_name = dup_text(self, token, error);
 		if (error->error) {
 			goto failed_to_strdup;
 		}
@@ -611,22 +495,17 @@ parse_delete_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	return n1;
 failed_to_parse_expr:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to parse WHERE expression on DELETE");
-	csvtmt_node_del_all(n1);
 	return NULL;
 failed_to_strdup:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to strdup");
-	csvtmt_node_del_all(n1);
 	return NULL;
 not_found_table_name:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found table name on DELETE");
-	csvtmt_node_del_all(n1);
 	return NULL;
 not_found_from:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found FROM on DELETE");
-	csvtmt_node_del_all(n1);
 	return NULL;
 ret_null:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
@@ -637,7 +516,7 @@ parse_show_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *e
 		return NULL;
 	}
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_SHOW_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_SHOW_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -657,12 +536,10 @@ parse_show_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *e
 	return n1;
 ret_null:
 	*token = *save;
-	csvtmt_node_del_all(n1);
 	return NULL;
 invalid_show_stmt:
 	*token = *save;
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "invalid SHOW statement");
-	csvtmt_node_del_all(n1);
 	return NULL;	
 }
 
@@ -673,7 +550,7 @@ parse_show_tables_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoE
 		return NULL;
 	}
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_SHOW_TABLES_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_SHOW_TABLES_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -693,7 +570,7 @@ parse_show_tables_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoE
 		if (kind(token) != CSVTMT_TK_IDENT) {
 			goto not_found_db_name;
 		} else {
-			n1->obj.show_tables_stmt.db_name = csvtmt_strdup(text(token), error);
+			n1->obj.show_tables_stmt.db_name = dup_text(self, token, error);
 			if (error->error) {
 				goto failed_to_strdup;
 			}
@@ -704,17 +581,167 @@ parse_show_tables_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoE
 	return n1;
 ret_null:
 	*token = *save;
-	csvtmt_node_del_all(n1);
 	return NULL;
 failed_to_strdup:
 	*token = *save;
 	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to strdup");
-	csvtmt_node_del_all(n1);
 	return NULL;
 not_found_db_name:
 	*token = *save;
 	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "not found database name on SHOW TABLES FROM");
-	csvtmt_node_del_all(n1);
+	return NULL;
+}
+
+// COPY table_name ( FROM | TO ) string [ WITH '(' copy_option ( ',' copy_option ) * ')' ]
+// COPY '(' select_stmt ')' TO string [ WITH '(' copy_option ( ',' copy_option ) * ')' ]
+// copy_option ::= HEADER | DELIMITER string
+static CsvTomatoNode *
+parse_copy_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
+	if (is_end(token)) {
+		return NULL;
+	}
+	if (!is_word(token, "copy")) {
+		return NULL;
+	}
+
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_COPY_STMT, error);
+	if (error->error) {
+		return NULL;
+	}
+
+	next(token);
+	if (kind(token) == CSVTMT_TK_BEG_PAREN) {
+		next(token);
+		n1->obj.copy_stmt.select_stmt = parse_select_stmt(self, token, error);
+		if (error->error || !n1->obj.copy_stmt.select_stmt) {
+			goto not_found_select_stmt;
+		}
+		if (kind(token) != CSVTMT_TK_END_PAREN) {
+			goto not_found_end_paren;
+		}
+		next(token);
+	} else if (kind(token) != CSVTMT_TK_IDENT) {
+		goto not_found_table_name;
+	} else {
+		n1->obj.copy_stmt.table_name = dup_text(self, token, error);
+		if (error->error) {
+			goto failed_to_strdup;
+		}
+		next(token);
+	}
+
+	if (is_word(token, "to")) {
+		n1->obj.copy_stmt.to = true;
+		next(token);
+	} else if (kind(token) == CSVTMT_TK_FROM && !n1->obj.copy_stmt.select_stmt) {
+		next(token);
+	} else {
+		goto not_found_from_or_to;
+	}
+
+	if (kind(token) != CSVTMT_TK_STRING) {
+		goto not_found_path;
+	} else {
+		n1->obj.copy_stmt.path = dup_text(self, token, error);
+		if (error->error) {
+			goto failed_to_strdup;
+		}
+		next(token);
+	}
+
+	if (is_word(token, "with")) {
+		next(token);
+		if (kind(token) != CSVTMT_TK_BEG_PAREN) {
+			goto not_found_beg_paren;
+		}
+		next(token);
+
+		for (;;) {
+			if (is_word(token, "header")) {
+				n1->obj.copy_stmt.header = true;
+				next(token);
+			} else if (is_word(token, "delimiter")) {
+				next(token);
+				if (kind(token) != CSVTMT_TK_STRING || (*token)->len != 1) {
+					goto invalid_delimiter;
+				}
+				n1->obj.copy_stmt.delimiter = text(token)[0];
+				next(token);
+			} else {
+				goto invalid_option;
+			}
+
+			if (kind(token) == CSVTMT_TK_COMMA) {
+				next(token);
+			} else {
+				break;
+			}
+		}
+
+		if (kind(token) != CSVTMT_TK_END_PAREN) {
+			goto not_found_end_paren;
+		}
+		next(token);
+	}
+
+	return n1;
+failed_to_strdup:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to strdup");
+	return NULL;
+not_found_table_name:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found table name on COPY");
+	return NULL;
+not_found_select_stmt:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found SELECT statement on COPY");
+	return NULL;
+not_found_from_or_to:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found FROM or TO on COPY");
+	return NULL;
+not_found_path:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found file path on COPY");
+	return NULL;
+not_found_beg_paren:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found '(' after WITH on COPY");
+	return NULL;
+not_found_end_paren:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found ')' on COPY");
+	return NULL;
+invalid_delimiter:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "DELIMITER must be a single character string on COPY");
+	return NULL;
+invalid_option:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "invalid option on COPY");
+	return NULL;
+}
+
+// ANALYZE [ table_name ]
+// ANALYZEは文の先頭でだけ予約語として読む
+static CsvTomatoNode *
+parse_analyze_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
+	if (is_end(token)) {
+		return NULL;
+	}
+	if (!is_word(token, "analyze")) {
+		return NULL;
+	}
+
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_ANALYZE_STMT, error);
+	if (error->error) {
+		return NULL;
+	}
+
+	next(token);
+	if (kind(token) == CSVTMT_TK_IDENT) {
+		n1->obj.analyze_stmt.table_name = dup_text(self, token, error);
+		if (error->error) {
+			goto failed_to_strdup;
+		}
+		next(token);
+	}
+
+	return n1;
+failed_to_strdup:
+	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to strdup");
 	return NULL;
 }
 
@@ -725,7 +752,7 @@ parse_update_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 		return NULL;
 	}
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_UPDATE_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_UPDATE_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -741,7 +768,7 @@ parse_update_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	if (kind(token) != CSVTMT_TK_IDENT) {
 		goto not_found_table_name;
 	} else {
-		n1->obj.update_stmt.table_name = csvtmt_strdup(text(token), error);
+		n1->obj.update_stmt.table_name = dup_text(self, token, error);
 		if (!n1->obj.update_stmt.table_name) {
 			goto fail_allocate;
 		}
@@ -791,27 +818,21 @@ parse_update_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	return n1;
 
 ret_null:
-	csvtmt_node_del_all(n1);
 	return NULL;
 not_found_set:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found SET on update statement");
-	csvtmt_node_del_all(n1);
 	return NULL;	
 not_found_table_name:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found table name on update statement");
-	csvtmt_node_del_all(n1);
 	return NULL;	
 fail_parse_assign_expr:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to parse assign expression on update statement");
-	csvtmt_node_del_all(n1);
 	return NULL;	
 fail_parse_where_expr:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to parse WHERE expression on update statement");
-	csvtmt_node_del_all(n1);
 	return NULL;	
 fail_allocate:
 	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
-	csvtmt_node_del_all(n1);
 	return NULL;	
 }
 
@@ -824,33 +845,27 @@ parse_count_func(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *
 		return NULL;
 	}
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_COUNT_FUNC, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_COUNT_FUNC, error);
 	if (error->error) {
 		goto failed_to_allocate_node;
 	}
 
 ret_null:
 	*token = *save;
-	csvtmt_node_del_all(n1);
 	return NULL;
 failed_to_parse_column_name:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to parse column name on count function");
 	return NULL;
 failed_to_allocate_node:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to allocate node on count function");
 	return NULL;
 not_found_column_name:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found column name on count function");
 	return NULL;
 not_found_beg_paren:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found begin paren in count function");
 	return NULL;
 not_found_end_paren:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found end paren in count function");
 	return NULL;
 }
@@ -864,7 +879,7 @@ parse_function(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *er
 		return NULL;
 	}
 
-	n1 = csvtmt_node_new(CSVTMT_ND_FUNCTION, error);
+	n1 = csvtmt_node_new(self->arena, CSVTMT_ND_FUNCTION, error);
 	if (error->error) {
 		goto failed_to_allocate_node;
 	}	
@@ -900,14 +915,11 @@ parse_function(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *er
 	return n1;
 ret_null:
 	*token = *save;
-	csvtmt_node_del_all(n1);
 	return NULL;
 failed_to_parse_expr:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to parse expression on function");
 	return NULL;
 failed_to_allocate_node:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to allocate node on function");
 	return NULL;
 }
@@ -922,7 +934,7 @@ parse_select_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	}
 	next(token);
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_SELECT_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_SELECT_STMT, error);
 	if (error->error) {
 		goto failed_to_allocate_node;
 	}
@@ -940,7 +952,6 @@ parse_select_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 
 		CsvTomatoNode *expr = parse_expr(self, token, error);
 		if (error->error || !expr) {
-			csvtmt_node_del_all(expr_list);
 			goto failed_to_parse_expr_list;
 		}
 
@@ -958,7 +969,7 @@ parse_select_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	if (kind(token) != CSVTMT_TK_IDENT) {
 		goto not_found_table_name;
 	} else {
-		n1->obj.select_stmt.table_name = csvtmt_strdup(text(token), error);
+		n1->obj.select_stmt.table_name = dup_text(self, token, error);
 		if (error->error) {
 			goto failed_to_strdup;
 		}
@@ -1017,12 +1028,12 @@ parse_insert_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 		return NULL;
 	}
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_INSERT_STMT, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_INSERT_STMT, error);
 	if (error->error) {
 		return NULL;
 	}
 
-	n1->obj.insert_stmt.table_name = csvtmt_strdup(text(token), error);
+	n1->obj.insert_stmt.table_name = dup_text(self, token, error);
 	if (error->error) {
 		goto fail;
 	}
@@ -1105,19 +1116,18 @@ parse_insert_stmt(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode *
 parse_column_name(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_COLUMN_NAME, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_COLUMN_NAME, error);
 	if (error->error) {
 		return NULL;
 	}
 
 	if (kind(token) == CSVTMT_TK_IDENT) {
-		n1->obj.column_name.column_name = csvtmt_strdup(text(token), error);
+		n1->obj.column_name.column_name = dup_text(self, token, error);
 		if (error->error) {
 			goto fail;
 		}
@@ -1132,7 +1142,6 @@ parse_column_name(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "invalid column name state");
 	return NULL;
 }
@@ -1144,7 +1153,7 @@ parse_values(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *erro
 	}
 	next(token);
 
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_VALUES, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_VALUES, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -1187,7 +1196,6 @@ parse_values(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *erro
 
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
@@ -1197,7 +1205,7 @@ parse_assign_expr(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 		return NULL;
 	}
 	
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_ASSIGN_EXPR, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_ASSIGN_EXPR, error);
 	if (error->error) {
 		return NULL;
 	}	
@@ -1205,7 +1213,7 @@ parse_assign_expr(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 	if (kind(token) != CSVTMT_TK_IDENT) {
 		goto ret_null;
 	} else {
-		n1->obj.assign_expr.ident = csvtmt_strdup(text(token), error);
+		n1->obj.assign_expr.ident = dup_text(self, token, error);
 		if (!n1->obj.assign_expr.ident) {
 			goto fail_allocate;
 		}
@@ -1228,25 +1236,21 @@ parse_assign_expr(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError
 
 	return n1;
 ret_null:
-	csvtmt_node_del_all(n1);
 	return NULL;
 not_found_assign:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "not found assign in assign expr");
-	csvtmt_node_del_all(n1);
 	return NULL;
 fail_parse_expr:
 	csvtmt_error_push(error, CSVTMT_ERR_SYNTAX, "failed to parse expr in assign expr");
-	csvtmt_node_del_all(n1);
 	return NULL;
 fail_allocate:
 	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode *
 parse_expr(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_EXPR, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_EXPR, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -1305,13 +1309,12 @@ parse_expr(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error)
 	}
 
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode *
 parse_number(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_NUMBER, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_NUMBER, error);
 	if (error->error) {
 		return NULL;
 	}	
@@ -1329,19 +1332,18 @@ parse_number(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *erro
 	
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
 
 static CsvTomatoNode *
 parse_string(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *error) {
-	CsvTomatoNode *n1 = csvtmt_node_new(CSVTMT_ND_STRING, error);
+	CsvTomatoNode *n1 = csvtmt_node_new(self->arena, CSVTMT_ND_STRING, error);
 	if (error->error) {
 		return NULL;
 	}
 
 	if (kind(token) == CSVTMT_TK_STRING) {
-		n1->obj.string.string = csvtmt_strdup(text(token), error);
+		n1->obj.string.string = dup_text(self, token, error);
 		if (error->error) {
 			goto fail;
 		}
@@ -1352,6 +1354,5 @@ parse_string(CsvTomatoParser *self, CsvTomatoToken **token, CsvTomatoError *erro
 
 	return n1;
 fail:
-	csvtmt_node_del_all(n1);
 	return NULL;
 }
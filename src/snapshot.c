@@ -0,0 +1,321 @@
+#include <csvtomato.h>
+
+/*
+	スナップショット読み込み。
+
+	テーブルは追記と論理削除でしか変わらないので、行の版は次のように決まる。
+
+		作られた版: 行の位置。開いた時のファイル長より後ろの行はまだ無い
+		消された版: 論理削除ログ上の位置。開いた時のログ長より後ろの削除はまだ無い
+
+	論理削除ログ <db>/tomb/<table>.<inode>.log は論理削除した行の先頭の位置（uint64_t）を
+	書き込んだ順に並べたもの。書く文は__MODE__を'1'にする前にログへ追記するので、
+	読む文から'1'が見えた時は必ずログにも載っている。
+	UPDATEがテーブルを書き直すとinodeが変わるので、ログもinodeごとに分ける。
+	古いinodeを開いている文は書き直し前のファイルとログを見続ける。
+*/
+
+static void
+tomb_log_path(char *dst, size_t dst_size, const char *db_dir, const char *table_name, ino_t ino) {
+	snprintf(dst, dst_size, "%s/tomb/%s.%lu.log", db_dir, table_name, (unsigned long) ino);
+}
+
+// 開いているテーブルの論理削除ログを開く。O_CREATが無ければ作らないので、
+// 読むだけの文はデータベースのディレクトリに書き込まない。
+static int
+open_tomb_log(CsvTomatoModel *model, int flags) {
+	char path[CSVTMT_PATH_SIZE * 2 + 48];
+
+	if (flags & O_CREAT) {
+		snprintf(path, sizeof path, "%s/tomb", model->db_dir);
+		if (!csvtmt_file_exists(path)) {
+			csvtmt_file_mkdir(path);
+		}
+	}
+	tomb_log_path(path, sizeof path, model->db_dir, model->table_name, model->mmap.st.st_ino);
+
+	return open(path, flags | O_CLOEXEC, 0644);
+}
+
+// 論理削除する行の位置をログに追記する。__MODE__を書き換える前に呼ぶこと。
+void
+csvtmt_tomb_log_append(CsvTomatoModel *model, const CsvTomatoOffsets *offsets, CsvTomatoError *error) {
+	uint64_t buf[512];
+
+	errno = 0;
+	int fd = open_tomb_log(model, O_WRONLY | O_APPEND | O_CREAT);
+	if (fd == -1) {
+		goto failed_to_open;
+	}
+
+	for (size_t i = 0; i < offsets->len; ) {
+		size_t n = 0;
+		for (; n < csvtmt_numof(buf) && i < offsets->len; n++, i++) {
+			buf[n] = offsets->array[i];
+		}
+		if (write(fd, buf, n * sizeof(buf[0])) != (ssize_t) (n * sizeof(buf[0]))) {
+			close(fd);
+			goto failed_to_write;
+		}
+	}
+
+	close(fd);
+	return;
+failed_to_open:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open tombstone log: %s", strerror(errno));
+	return;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write tombstone log: %s", strerror(errno));
+}
+
+// inodeがinoのテーブルの論理削除ログの件数。ログが無ければ0。
+size_t
+csvtmt_tomb_log_len(const CsvTomatoModel *model, ino_t ino) {
+	char path[CSVTMT_PATH_SIZE * 2 + 48];
+	struct stat st;
+
+	tomb_log_path(path, sizeof path, model->db_dir, model->table_name, ino);
+	if (stat(path, &st) == -1) {
+		return 0;
+	}
+	return st.st_size / sizeof(uint64_t);
+}
+
+/**
+ * 開いているテーブルの論理削除ログのfrom件目から後ろをdstに読み足す。ログが無ければ何もしない。
+ * テーブルの排他ロックを持っている間に呼ぶ。持っていなければ書きかけの分まで読むので、
+ * スナップショットを取った時の件数までしか使わないこと。
+ */
+void
+csvtmt_tomb_log_read(CsvTomatoModel *model, size_t from, CsvTomatoOffsets *dst, CsvTomatoError *error) {
+	uint64_t buf[512];
+
+	errno = 0;
+	int fd = open_tomb_log(model, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return;
+		}
+		goto failed_to_open;
+	}
+
+	for (off_t pos = (off_t) from * sizeof(buf[0]); ; ) {
+		ssize_t n = pread(fd, buf, sizeof buf, pos);
+		if (n == -1) {
+			close(fd);
+			goto failed_to_read;
+		}
+		for (size_t i = 0; i < (size_t) n / sizeof(buf[0]); i++) {
+			if (!csvtmt_offsets_push_back(dst, buf[i])) {
+				close(fd);
+				goto failed_to_alloc;
+			}
+		}
+		if ((size_t) n < sizeof buf) {
+			break;
+		}
+		pos += n;
+	}
+
+	close(fd);
+	return;
+failed_to_open:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open tombstone log: %s", strerror(errno));
+	return;
+failed_to_read:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to read tombstone log: %s", strerror(errno));
+	return;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to read tombstone log");
+}
+
+// テーブルを書き直した後に古いinodeのログを消す。開いている文はfdで読み続けられる。
+void
+csvtmt_tomb_log_remove(CsvTomatoModel *model, ino_t ino) {
+	char path[CSVTMT_PATH_SIZE * 2 + 48];
+	tomb_log_path(path, sizeof path, model->db_dir, model->table_name, ino);
+	remove(path);
+}
+
+/**
+ * 開いたmmapのスナップショットを取る。テーブルのロックを持っている間に呼ぶ。
+ *
+ * ログは開いておく。後から書き直しでログが消されても、開いた後の論理削除を
+ * 読めるようにするため。ログが無ければ論理削除は0件として作らずに進み、
+ * 後で'1'の行に出会った時に開く。
+ */
+void
+csvtmt_snapshot_open(CsvTomatoModel *model, CsvTomatoError *error) {
+	struct stat st = {0};
+
+	errno = 0;
+	int fd = open_tomb_log(model, O_RDONLY);
+	if (fd == -1 && errno != ENOENT) {
+		goto failed_to_open;
+	}
+	if (fd != -1 && fstat(fd, &st) == -1) {
+		close(fd);
+		goto failed_to_open;
+	}
+
+	if (model->snapshot.later) {
+		csvtmt_offsets_clear(model->snapshot.later);
+	} else {
+		model->snapshot.later = csvtmt_offsets_new();
+		if (!model->snapshot.later) {
+			if (fd != -1) {
+				close(fd);
+			}
+			csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate snapshot");
+			return;
+		}
+	}
+
+	model->snapshot.active = true;
+	model->snapshot.fd = fd == -1 ? 0 : fd;
+	model->snapshot.tomb_len = st.st_size / sizeof(uint64_t);
+	return;
+failed_to_open:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open tombstone log: %s", strerror(errno));
+}
+
+void
+csvtmt_snapshot_close(CsvTomatoModel *model) {
+	if (model->snapshot.fd) {
+		close(model->snapshot.fd);
+		model->snapshot.fd = 0;
+	}
+	model->snapshot.active = false;
+}
+
+static int
+compare_offsets(const void *a, const void *b) {
+	size_t x = *(const size_t *) a;
+	size_t y = *(const size_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * 開いた後に増えたログを読み足す。laterは位置の昇順に並べ直す。
+ *
+ * 開いた時にログが無かったら、その後に作られたログの全てが開いた後の論理削除になる。
+ * 開く前に書き直しでログが消されていたら読めないので、'1'の行は消えたものとみなす。
+ * ログの長さが読んだ分から変わっていなければ読まない。
+ */
+static void
+read_later_tombstones(CsvTomatoModel *model) {
+	uint64_t buf[512];
+	CsvTomatoOffsets *later = model->snapshot.later;
+	size_t len = later->len;
+	struct stat st;
+
+	if (!model->snapshot.fd) {
+		int fd = open_tomb_log(model, O_RDONLY);
+		if (fd == -1) {
+			return;
+		}
+		model->snapshot.fd = fd;
+	}
+
+	off_t pos = (off_t) (model->snapshot.tomb_len + len) * sizeof(buf[0]);
+	if (fstat(model->snapshot.fd, &st) == -1 || st.st_size < pos + (off_t) sizeof(buf[0])) {
+		return;
+	}
+
+	for (;;) {
+		ssize_t n = pread(model->snapshot.fd, buf, sizeof buf, pos);
+		if (n <= 0) {
+			break;
+		}
+		// 書きかけの端数は次に読む
+		size_t count = (size_t) n / sizeof(buf[0]);
+		for (size_t i = 0; i < count; i++) {
+			if (!csvtmt_offsets_push_back(later, buf[i])) {
+				goto done;
+			}
+		}
+		if ((size_t) n < sizeof buf) {
+			break;
+		}
+		pos += count * sizeof(buf[0]);
+	}
+
+done:
+	if (later->len != len) {
+		qsort(later->array, later->len, sizeof(later->array[0]), compare_offsets);
+	}
+}
+
+static bool
+later_has(const CsvTomatoOffsets *later, size_t offset) {
+	size_t lo = 0;
+	size_t hi = later->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (later->array[mid] < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < later->len && later->array[lo] == offset;
+}
+
+/**
+ * スナップショットから見てrow_headから始まる今の行が消されているか。
+ *
+ * '1'でもスナップショットを取った後に消された行なら生きているとみなす。
+ * 後から消された行は少ないはずなので、ログは'1'に出会った時だけ、
+ * 伸びていれば読み足す。
+ */
+bool
+csvtmt_snapshot_is_deleted(CsvTomatoModel *model, const char *row_head) {
+	return csvtmt_snapshot_is_deleted_at(model, csvtmt_mmap_offset(model, row_head));
+}
+
+// csvtmt_snapshot_is_deleted()と同じ。行をファイルの先頭からの位置で指す。
+bool
+csvtmt_snapshot_is_deleted_at(CsvTomatoModel *model, size_t offset) {
+	if (!csvtmt_is_deleted_row(&model->row)) {
+		return false;
+	}
+	if (!model->snapshot.active) {
+		return true;
+	}
+
+	if (later_has(model->snapshot.later, offset)) {
+		return false;
+	}
+
+	size_t len = model->snapshot.later->len;
+	read_later_tombstones(model);
+	if (model->snapshot.later->len == len) {
+		return true;
+	}
+	return !later_has(model->snapshot.later, offset);
+}
+
+/**
+ * スナップショットを取った後に論理削除された行の位置を全て返す。
+ * テーブルの排他ロックを持っている間に呼ぶ。読み切れなかった時はエラーを積む。
+ */
+const CsvTomatoOffsets *
+csvtmt_snapshot_later(CsvTomatoModel *model, CsvTomatoError *error) {
+	read_later_tombstones(model);
+	if (!model->snapshot.fd) {
+		return model->snapshot.later; // ログが無いので論理削除も無い
+	}
+
+	struct stat st;
+	errno = 0;
+	if (fstat(model->snapshot.fd, &st) == -1) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to stat tombstone log: %s", strerror(errno));
+		return NULL;
+	}
+	if ((size_t) st.st_size / sizeof(uint64_t) != model->snapshot.tomb_len + model->snapshot.later->len) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to read tombstone log");
+		return NULL;
+	}
+
+	return model->snapshot.later;
+}
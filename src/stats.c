@@ -0,0 +1,638 @@
+#include <csvtomato.h>
+
+// 統計は実行計画のための見積もりなので、統計の失敗で文を失敗させない。
+// 確保に失敗した時などはvalidを落としてANALYZEに任せる。
+
+void
+csvtmt_stats_final(CsvTomatoTableStats *self) {
+	for (size_t i = 0; i < self->columns_len; i++) {
+		free(self->columns[i].name);
+		free(self->columns[i].min);
+		free(self->columns[i].max);
+	}
+	free(self->columns);
+	memset(self, 0, sizeof(*self));
+}
+
+static void
+stats_invalidate(CsvTomatoTableStats *self) {
+	csvtmt_stats_final(self);
+	self->loaded = true;
+}
+
+// <db>/<table>.csv -> <db>/stats/<table>.csv
+static void
+stats_path(const char *table_path, char *dst, size_t dst_size) {
+	const char *slash = strrchr(table_path, '/');
+	if (!slash) {
+		snprintf(dst, dst_size, "stats/%s", table_path);
+	} else {
+		snprintf(dst, dst_size, "%.*s/stats/%s", (int) (slash - table_path), table_path, slash + 1);
+	}
+}
+
+static uint64_t
+hash_value(const char *s) {
+	// FNV-1aの下位ビットは偏るので最後に混ぜる
+	uint64_t h = 14695981039346656037ULL;
+	for (; *s; s++) {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// 小さい方からK個のハッシュ値を昇順に保つ
+static void
+kmv_add(CsvTomatoColumnStats *col, uint64_t h) {
+	size_t lo = 0, hi = col->kmv_len;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (col->kmv[mid] < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < col->kmv_len && col->kmv[lo] == h) {
+		return;
+	}
+	if (lo >= CSVTMT_STATS_KMV_SIZE) {
+		return;
+	}
+
+	size_t n = col->kmv_len < CSVTMT_STATS_KMV_SIZE ? col->kmv_len : CSVTMT_STATS_KMV_SIZE - 1;
+	memmove(&col->kmv[lo + 1], &col->kmv[lo], (n - lo) * sizeof(col->kmv[0]));
+	col->kmv[lo] = h;
+	if (col->kmv_len < CSVTMT_STATS_KMV_SIZE) {
+		col->kmv_len++;
+	}
+}
+
+/**
+ * index番目のカラムの異なる値の数の見積もりを返す。
+ *
+ * K個より少なければ正確な数になる。K個あればK番目に小さいハッシュ値の
+ * 位置から (K-1) / (kmv[K-1] / 2^64) として見積もる。生きている行数は超えない。
+ */
+uint64_t
+csvtmt_stats_distinct(const CsvTomatoTableStats *self, size_t index) {
+	if (index >= self->columns_len) {
+		return 0;
+	}
+
+	const CsvTomatoColumnStats *col = &self->columns[index];
+	uint64_t n = col->kmv_len;
+	if (n == CSVTMT_STATS_KMV_SIZE) {
+		double kth = (double) col->kmv[n - 1] / 18446744073709551616.0;
+		n = kth > 0 ? (uint64_t) ((CSVTMT_STATS_KMV_SIZE - 1) / kth) : n;
+	}
+	return n < self->live ? n : self->live;
+}
+
+static int
+value_cmp(const CsvTomatoColumnType *type, const char *a, const char *b) {
+	if (type->type_def_info.integer) {
+		long long x = strtoll(a, NULL, 10);
+		long long y = strtoll(b, NULL, 10);
+		return (x > y) - (x < y);
+	}
+	return strcmp(a, b);
+}
+
+static bool
+stats_resize(CsvTomatoTableStats *self, const CsvTomatoHeader *header) {
+	if (self->columns_len == header->types_len) {
+		return true;
+	}
+	if (self->columns_len) {
+		return false; // ヘッダが変わった
+	}
+	if (!csvtmt_reserve(self->columns, self->columns_capa, header->types_len)) {
+		return false;
+	}
+	for (size_t i = 0; i < header->types_len; i++) {
+		CsvTomatoColumnStats *col = &self->columns[self->columns_len];
+		memset(col, 0, sizeof(*col));
+		col->name = strdup(header->types[i].type_name);
+		if (!col->name) {
+			return false;
+		}
+		self->columns_len++;
+	}
+	return true;
+}
+
+// ヘッダに合わせた空の統計を用意する。ANALYZEや表の詰め直しで作り直す時に使う。
+bool
+csvtmt_stats_start(CsvTomatoTableStats *self, const CsvTomatoHeader *header) {
+	memset(self, 0, sizeof(*self));
+	if (!stats_resize(self, header)) {
+		return false;
+	}
+	self->loaded = self->valid = true;
+	return true;
+}
+
+// 生きている行を数え、値をカラムの統計に加える。
+void
+csvtmt_stats_add_row(CsvTomatoTableStats *self, const CsvTomatoHeader *header, const CsvTomatoRow *row) {
+	self->live++;
+	for (size_t i = 0; i < row->len && i < header->types_len; i++) {
+		csvtmt_stats_add_value(self, header, i, row->columns[i]);
+	}
+}
+
+// 作り直した統計をスキーマの統計と置き換える。statsは空になる。
+void
+csvtmt_stats_install(CsvTomatoModel *model, CsvTomatoTableStats *stats) {
+	csvtmt_stats_final(&model->schema->stats);
+	model->schema->stats = *stats;
+	model->schema->stats.dirty = true;
+	memset(stats, 0, sizeof(*stats));
+}
+
+// index番目のカラムに書き込んだ値でmin/maxを広げ、distinctの見積もりに加える。
+void
+csvtmt_stats_add_value(CsvTomatoTableStats *self, const CsvTomatoHeader *header, size_t index, const char *value) {
+	if (!self || !value || index >= header->types_len) {
+		return;
+	}
+	if (!stats_resize(self, header)) {
+		stats_invalidate(self);
+		return;
+	}
+
+	const CsvTomatoColumnType *type = &header->types[index];
+	if (!strcmp(type->type_name, CSVTMT_COL_MODE)) {
+		return;
+	}
+
+	CsvTomatoColumnStats *col = &self->columns[index];
+	if (!col->min || value_cmp(type, value, col->min) < 0) {
+		char *s = strdup(value);
+		if (!s) {
+			goto failed_to_alloc;
+		}
+		free(col->min);
+		col->min = s;
+	}
+	if (!col->max || value_cmp(type, value, col->max) > 0) {
+		char *s = strdup(value);
+		if (!s) {
+			goto failed_to_alloc;
+		}
+		free(col->max);
+		col->max = s;
+	}
+	kmv_add(col, hash_value(value));
+	self->dirty = true;
+	return;
+failed_to_alloc:
+	stats_invalidate(self);
+}
+
+// UPDATEのSETの値をカラムの統計に加える。
+void
+csvtmt_stats_add_key_values(
+	CsvTomatoTableStats *self,
+	const CsvTomatoHeader *header,
+	const CsvTomatoKeyValue *key_values,
+	size_t key_values_len
+) {
+	if (!self) {
+		return;
+	}
+
+	for (size_t i = 0; i < key_values_len; i++) {
+		const CsvTomatoKeyValue *kv = &key_values[i];
+		char num[CSVTMT_NUM_STR_SIZE];
+		const char *value = num;
+
+		switch (kv->value.kind) {
+		default: continue;
+		case CSVTMT_VAL_INT: snprintf(num, sizeof num, "%ld", kv->value.int_value); break;
+		case CSVTMT_VAL_DOUBLE: snprintf(num, sizeof num, "%f", kv->value.double_value); break;
+		case CSVTMT_VAL_STRING: value = kv->value.string_value; break;
+		}
+
+		for (size_t j = 0; j < header->types_len; j++) {
+			if (!strcmp(header->types[j].type_name, kv->key)) {
+				csvtmt_stats_add_value(self, header, j, value);
+				break;
+			}
+		}
+	}
+}
+
+static void
+stats_update_bytes(CsvTomatoTableStats *self, const char *table_path) {
+	struct stat st;
+	if (stat(table_path, &st) == -1) {
+		stats_invalidate(self);
+		return;
+	}
+	self->bytes = st.st_size;
+}
+
+/**
+ * 書き込んだ行数を足す。DELETEはliveを減らしてdeadを増やす。
+ *
+ * beforeはこの文が書く前の表のサイズ。統計が覚えているサイズと違えば、
+ * 別のプロセスが数えていない行を書いているので差分は足さずに統計を捨てる。
+ */
+void
+csvtmt_stats_add_rows(CsvTomatoTableStats *self, const char *table_path, uint64_t before, int64_t live, int64_t dead) {
+	if (!self) {
+		return;
+	}
+	if (before != self->bytes) {
+		stats_invalidate(self);
+		return;
+	}
+
+	self->live = live < 0 && (uint64_t) -live > self->live ? 0 : self->live + live;
+	self->dead = dead < 0 && (uint64_t) -dead > self->dead ? 0 : self->dead + dead;
+	self->dirty = true;
+	stats_update_bytes(self, table_path);
+}
+
+// 表を書き直した時は行数を置き換える。
+void
+csvtmt_stats_set_rows(CsvTomatoTableStats *self, const char *table_path, uint64_t live, uint64_t dead) {
+	if (!self) {
+		return;
+	}
+
+	self->live = live;
+	self->dead = dead;
+	self->dirty = true;
+	stats_update_bytes(self, table_path);
+}
+
+static void
+parse_kmv(CsvTomatoColumnStats *col, const char *hex) {
+	size_t len = strlen(hex);
+	for (size_t i = 0; i + 16 <= len && col->kmv_len < CSVTMT_STATS_KMV_SIZE; i += 16) {
+		char buf[17];
+		memcpy(buf, hex + i, 16);
+		buf[16] = '\0';
+		col->kmv[col->kmv_len++] = strtoull(buf, NULL, 16);
+	}
+}
+
+/**
+ * スキーマの表の統計をファイルから読む。
+ *
+ * ファイルが無い、壊れている、表のサイズが記録と違う（別のプロセスが書いた、
+ * 書き出す前に落ちた）時はvalidをfalseにする。読むのはスキーマごとに1回。
+ */
+void
+csvtmt_stats_load(CsvTomatoSchema *schema) {
+	CsvTomatoTableStats *self = &schema->stats;
+	CsvTomatoError error = {0};
+	CsvTomatoRow row = {0};
+	char path[CSVTMT_PATH_SIZE + 16];
+	struct stat st;
+
+	csvtmt_stats_final(self);
+	self->loaded = true;
+
+	stats_path(schema->table_path, path, sizeof path);
+	char *src = csvtmt_file_read(path);
+	if (!src) {
+		return;
+	}
+
+	for (const char *p = src; p && *p; ) {
+		csvtmt_row_clear(&row);
+		p = csvtmt_row_parse_string(&row, p, &error);
+		if (error.error) {
+			goto invalid;
+		}
+		if (row.len == 2 && !strcmp(row.columns[0], "live")) {
+			self->live = strtoull(row.columns[1], NULL, 10);
+		} else if (row.len == 2 && !strcmp(row.columns[0], "dead")) {
+			self->dead = strtoull(row.columns[1], NULL, 10);
+		} else if (row.len == 2 && !strcmp(row.columns[0], "bytes")) {
+			self->bytes = strtoull(row.columns[1], NULL, 10);
+		} else if ((row.len == 3 || row.len == 5) && !strcmp(row.columns[0], "column")) {
+			if (!csvtmt_reserve(self->columns, self->columns_capa, self->columns_len + 1)) {
+				goto invalid;
+			}
+			CsvTomatoColumnStats *col = &self->columns[self->columns_len++];
+			memset(col, 0, sizeof(*col));
+			col->name = csvtmt_move(row.columns[1]);
+			row.columns[1] = NULL;
+			parse_kmv(col, row.columns[2]);
+			if (row.len == 5) {
+				col->min = csvtmt_move(row.columns[3]);
+				col->max = csvtmt_move(row.columns[4]);
+				row.columns[3] = row.columns[4] = NULL;
+			}
+		} else if (row.len) {
+			goto invalid;
+		}
+	}
+
+	if (stat(schema->table_path, &st) == -1 || (uint64_t) st.st_size != self->bytes) {
+		goto invalid;
+	}
+
+	self->valid = true;
+	csvtmt_row_final(&row);
+	free(src);
+	return;
+invalid:
+	stats_invalidate(self);
+	csvtmt_row_final(&row);
+	free(src);
+}
+
+static void
+write_field(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"') {
+			fputc('"', fp);
+		}
+		fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/**
+ * スキーマの表の統計を<db>/stats/<table>.csvに書き出す。
+ *
+ * live,<n>
+ * dead,<n>
+ * bytes,<n>
+ * column,<name>,<kmv hex>[,<min>,<max>]
+ *
+ * 一時ファイルに書いてからrenameするので、読む側が半端なファイルを見ることは無い。
+ */
+void
+csvtmt_stats_save(CsvTomatoSchema *schema, CsvTomatoSyncLevel level, CsvTomatoError *error) {
+	CsvTomatoTableStats *self = &schema->stats;
+	char path[CSVTMT_PATH_SIZE + 16];
+	char tmp_path[CSVTMT_PATH_SIZE + 48];
+
+	if (!self->valid) {
+		return;
+	}
+
+	stats_path(schema->table_path, path, sizeof path);
+	char *slash = strrchr(path, '/');
+	*slash = '\0';
+	if (!csvtmt_file_exists(path)) {
+		csvtmt_file_mkdir(path);
+	}
+	*slash = '/';
+	snprintf(tmp_path, sizeof tmp_path, "%s.%ld.tmp", path, (long) getpid());
+
+	errno = 0;
+	FILE *fp = fopen(tmp_path, "w");
+	if (!fp) {
+		goto failed_to_open;
+	}
+
+	fprintf(fp, "live,%lu\n", self->live);
+	fprintf(fp, "dead,%lu\n", self->dead);
+	fprintf(fp, "bytes,%lu\n", self->bytes);
+	for (size_t i = 0; i < self->columns_len; i++) {
+		const CsvTomatoColumnStats *col = &self->columns[i];
+		fputs("column,", fp);
+		write_field(fp, col->name);
+		fputc(',', fp);
+		for (size_t j = 0; j < col->kmv_len; j++) {
+			fprintf(fp, "%016lx", col->kmv[j]);
+		}
+		if (col->min && col->max) {
+			fputc(',', fp);
+			write_field(fp, col->min);
+			fputc(',', fp);
+			write_field(fp, col->max);
+		}
+		fputc('\n', fp);
+	}
+
+	if (fflush(fp) != 0 || csvtmt_file_sync_stream(fp, level) == -1) {
+		fclose(fp);
+		remove(tmp_path);
+		goto failed_to_write;
+	}
+	fclose(fp);
+	if (csvtmt_file_rename(tmp_path, path) == -1) {
+		remove(tmp_path);
+		goto failed_to_write;
+	}
+	if (csvtmt_file_sync_dir(path, level) == -1) {
+		goto failed_to_write;
+	}
+
+	self->dirty = false;
+	return;
+failed_to_open:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open stats file: %s: %s", tmp_path, strerror(errno));
+	return;
+failed_to_write:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write stats file: %s: %s", path, strerror(errno));
+	return;
+}
+
+// 読み込んだ統計のカラムが今のヘッダと同じ並びか調べる。
+static bool
+stats_match_header(const CsvTomatoTableStats *self, const CsvTomatoHeader *header) {
+	if (self->columns_len != header->types_len) {
+		return false;
+	}
+	for (size_t i = 0; i < self->columns_len; i++) {
+		if (strcmp(self->columns[i].name, header->types[i].type_name)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * 書き込み中の表の統計を返す。統計が無い時はNULLを返す。
+ *
+ * 統計はカタログのスキーマに持つので、データベースを通さない文では扱わない。
+ * ヘッダを読んだ後（model->schemaが表のスキーマを指している時）に呼ぶこと。
+ */
+CsvTomatoTableStats *
+csvtmt_model_stats(CsvTomatoModel *model) {
+	if (!model->catalog || model->schema == &model->own_schema) {
+		return NULL;
+	}
+
+	CsvTomatoSchema *schema = model->schema;
+	CsvTomatoTableStats *self = &schema->stats;
+	if (!self->loaded) {
+		csvtmt_stats_load(schema);
+		if (self->columns_len && !stats_match_header(self, model->header)) {
+			stats_invalidate(self);
+		}
+	}
+
+	return self->valid ? self : NULL;
+}
+
+// CREATE TABLEで作った空の表の統計を用意する。
+void
+csvtmt_stats_reset(CsvTomatoModel *model) {
+	CsvTomatoError error = {0};
+	if (!model->catalog) {
+		return;
+	}
+
+	csvtmt_catalog_write_lock(model->catalog);
+	CsvTomatoSchema *schema = csvtmt_catalog_find(model->catalog, model->table_path, &error);
+	csvtmt_catalog_unlock(model->catalog);
+	if (error.error) {
+		return;
+	}
+
+	csvtmt_stats_final(&schema->stats);
+	schema->stats.loaded = true;
+	schema->stats.valid = true;
+	csvtmt_stats_set_rows(&schema->stats, model->table_path, 0, 0);
+}
+
+static void
+analyze_table(CsvTomatoModel *model, CsvTomatoError *error) {
+	CsvTomatoTableStats stats = {0};
+	CsvTomatoRow row = {0};
+
+	#undef cleanup
+	#define cleanup() {\
+		csvtmt_row_final(&row);\
+		csvtmt_stats_final(&stats);\
+		if (model->mmap.ptr) {\
+			csvtmt_close_mmap(model);\
+		}\
+	}\
+
+	// 統計を書き換えるので書く文と同じく排他する
+	if (!csvtmt_model_lock(model, CSVTMT_LOCK_EXCLUSIVE, error)) {
+		return;
+	}
+
+	csvtmt_open_mmap_for_read(model, model->table_path, error);
+	if (error->error) {
+		return;
+	}
+	csvtmt_scan_advise(model);
+
+	const char *p = csvtmt_header_load_from_mmap(model, error);
+	if (error->error) {
+		goto failed_to_read_header;
+	}
+	const CsvTomatoHeader *header = model->header;
+	if (!csvtmt_stats_start(&stats, header)) {
+		goto failed_to_alloc;
+	}
+	stats.bytes = model->mmap.size;
+
+	while (p) {
+		csvtmt_row_clear(&row);
+		const char *head = csvtmt_mmap_parse_row(model, &p, &row, error);
+		if (!head) {
+			break;
+		}
+		csvtmt_readahead(model, head);
+		if (row.len == 0) {
+			continue;
+		}
+		if (csvtmt_is_deleted_row(&row)) {
+			stats.dead++;
+			continue;
+		}
+		csvtmt_stats_add_row(&stats, header, &row);
+		if (!stats.valid) {
+			goto failed_to_alloc;
+		}
+	}
+	if (error->error) {
+		goto failed_to_parse_row;
+	}
+	stats.dirty = true;
+
+	if (model->catalog) {
+		csvtmt_stats_install(model, &stats);
+		csvtmt_stats_save(model->schema, model->sync_level, error);
+	} else {
+		CsvTomatoSchema tmp = { .table_path = model->table_path, .stats = stats };
+		csvtmt_stats_save(&tmp, model->sync_level, error);
+	}
+	if (error->error) {
+		goto fail;
+	}
+
+	cleanup();
+	return;
+failed_to_read_header:
+	csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to read header of %s", model->table_path);
+	goto fail;
+failed_to_alloc:
+	csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate stats");
+	goto fail;
+failed_to_parse_row:
+	csvtmt_error_push(error, CSVTMT_ERR_PARSE, "failed to parse row of %s", model->table_path);
+	goto fail;
+fail:
+	cleanup();
+}
+
+/**
+ * ANALYZE [table_name]
+ *
+ * 表を走査して統計を作り直し、統計ファイルに書き出す。
+ * model->table_nameがNULLならデータベースの全ての表を対象にする。
+ */
+CsvTomatoResult
+csvtmt_analyze(CsvTomatoModel *model, CsvTomatoError *error) {
+	if (model->table_name) {
+		snprintf(model->table_path, sizeof model->table_path, "%s/%s.csv", model->db_dir, model->table_name);
+		analyze_table(model, error);
+		return error->error ? CSVTMT_ERROR : CSVTMT_OK;
+	}
+
+	CsvTomatoDir *dir = csvtmt_dir_open(model->db_dir);
+	if (!dir) {
+		csvtmt_error_push(error, CSVTMT_ERR_EXEC, "failed to open directory \"%s\"", model->db_dir);
+		return CSVTMT_ERROR;
+	}
+
+	for (;;) {
+		CsvTomatoDirNode *node = csvtmt_dir_read(dir);
+		if (!node) {
+			break;
+		}
+
+		const char *name = csvtmt_dir_node_name(node);
+		size_t len = strlen(name);
+		if (len > 4 && !strcmp(name + len - 4, ".csv")) {
+			char table_name[CSVTMT_PATH_SIZE];
+			snprintf(table_name, sizeof table_name, "%.*s", (int) (len - 4), name);
+			snprintf(model->table_path, sizeof model->table_path, "%s/%s", model->db_dir, name);
+			model->table_name = table_name;
+			analyze_table(model, error);
+			csvtmt_model_unlock(model);
+			model->table_name = NULL;
+		}
+
+		csvtmt_dir_node_del(node);
+		if (error->error) {
+			break;
+		}
+	}
+
+	csvtmt_dir_close(dir);
+	return error->error ? CSVTMT_ERROR : CSVTMT_OK;
+}
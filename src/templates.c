@@ -2,3 +2,4 @@
 
 DEF_STRING(CsvTomatoString, csvtmt_str, char, 0)
 DEF_ARRAY(CsvTomatoRows, csvtmt_rows, CsvTomatoRow, (CsvTomatoRow){0})
+DEF_ARRAY(CsvTomatoOffsets, csvtmt_offsets, size_t, 0)
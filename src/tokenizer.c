@@ -2,14 +2,13 @@
 
 CsvTomatoToken *
 csvtmt_token_new(
+	CsvTomatoArena *arena,
 	CsvTomatoTokenKind kind,
 	CsvTomatoError *error
 ) {
-	errno = 0;
-	CsvTomatoToken *self = calloc(1, sizeof(*self));
+	CsvTomatoToken *self = csvtmt_arena_alloc(arena, sizeof(*self), error);
 	if (!self) {
-		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
-		return NULL;		
+		return NULL;
 	}
 
 	self->kind = kind;
@@ -17,30 +16,8 @@ csvtmt_token_new(
 	return self;
 }
 
-void
-csvtmt_token_del(CsvTomatoToken *self) {
-	if (!self) {
-		return;
-	}
-
-	free(self);
-}
-
-void
-csvtmt_token_del_all(CsvTomatoToken *self) {
-	if (!self) {
-		return;
-	}
-
-	for (CsvTomatoToken *cur = self; cur; ) {
-		CsvTomatoToken *rm = cur;
-		cur = cur->next;
-		csvtmt_token_del(rm);
-	}
-}
-
 CsvTomatoTokenizer *
-csvtmt_tokenizer_new(CsvTomatoError *error) {
+csvtmt_tokenizer_new(CsvTomatoArena *arena, CsvTomatoError *error) {
 	errno = 0;
 	CsvTomatoTokenizer *self = calloc(1, sizeof(CsvTomatoTokenizer));
 	if (!self) {
@@ -48,6 +25,8 @@ csvtmt_tokenizer_new(CsvTomatoError *error) {
 		return NULL;
 	}
 
+	self->arena = arena;
+
 	return self;
 }
 
@@ -60,100 +39,189 @@ csvtmt_tokenizer_del(CsvTomatoTokenizer *self) {
 	free(self);
 }
 
+// 文字種の表。1文字ずつisalpha()などを呼ばずに表引きで分岐する。
+// 非ASCIIの文字は従来のisalpha()（Cロケール）と同じくCC_NONEになる。
+enum {
+	CC_NONE,
+	CC_SPACE,
+	CC_ALPHA,
+	CC_DIGIT,
+	CC_UNDERSCORE,
+	CC_DOT,
+	CC_QUOTE,
+	CC_PUNCT,
+};
+
+static const unsigned char char_classes[256] = {
+	[' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+	['A'] = CC_ALPHA, ['B'] = CC_ALPHA, ['C'] = CC_ALPHA, ['D'] = CC_ALPHA, ['E'] = CC_ALPHA, ['F'] = CC_ALPHA, ['G'] = CC_ALPHA, ['H'] = CC_ALPHA,
+	['I'] = CC_ALPHA, ['J'] = CC_ALPHA, ['K'] = CC_ALPHA, ['L'] = CC_ALPHA, ['M'] = CC_ALPHA, ['N'] = CC_ALPHA, ['O'] = CC_ALPHA, ['P'] = CC_ALPHA,
+	['Q'] = CC_ALPHA, ['R'] = CC_ALPHA, ['S'] = CC_ALPHA, ['T'] = CC_ALPHA, ['U'] = CC_ALPHA, ['V'] = CC_ALPHA, ['W'] = CC_ALPHA, ['X'] = CC_ALPHA,
+	['Y'] = CC_ALPHA, ['Z'] = CC_ALPHA,
+	['a'] = CC_ALPHA, ['b'] = CC_ALPHA, ['c'] = CC_ALPHA, ['d'] = CC_ALPHA, ['e'] = CC_ALPHA, ['f'] = CC_ALPHA, ['g'] = CC_ALPHA, ['h'] = CC_ALPHA,
+	['i'] = CC_ALPHA, ['j'] = CC_ALPHA, ['k'] = CC_ALPHA, ['l'] = CC_ALPHA, ['m'] = CC_ALPHA, ['n'] = CC_ALPHA, ['o'] = CC_ALPHA, ['p'] = CC_ALPHA,
+	['q'] = CC_ALPHA, ['r'] = CC_ALPHA, ['s'] = CC_ALPHA, ['t'] = CC_ALPHA, ['u'] = CC_ALPHA, ['v'] = CC_ALPHA, ['w'] = CC_ALPHA, ['x'] = CC_ALPHA,
+	['y'] = CC_ALPHA, ['z'] = CC_ALPHA,
+	['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT, ['4'] = CC_DIGIT,
+	['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT, ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+	['_'] = CC_UNDERSCORE, ['.'] = CC_DOT, ['"'] = CC_QUOTE, ['\''] = CC_QUOTE,
+	[';'] = CC_PUNCT, ['='] = CC_PUNCT, ['('] = CC_PUNCT, [')'] = CC_PUNCT,
+	['?'] = CC_PUNCT, ['*'] = CC_PUNCT, [','] = CC_PUNCT,
+};
+
+// 1文字のトークン
+static const CsvTomatoTokenKind punct_kinds[256] = {
+	[';'] = CSVTMT_TK_SEMICOLON,
+	['='] = CSVTMT_TK_ASSIGN,
+	['('] = CSVTMT_TK_BEG_PAREN,
+	[')'] = CSVTMT_TK_END_PAREN,
+	['?'] = CSVTMT_TK_PLACE_HOLDER,
+	['*'] = CSVTMT_TK_STAR,
+	[','] = CSVTMT_TK_COMMA,
+};
+
+static inline int
+char_class(char c) {
+	return char_classes[(unsigned char) c];
+}
+
+// 予約語を長さと先頭の文字で絞り込んでから比べる。
+// 識別子は英字で始まるので | 0x20 で小文字にできる。
+static CsvTomatoTokenKind
+keyword_kind(const char *s, size_t len) {
+	#undef kw
+	#define kw(word, kind) if (!strncasecmp(s, word, len)) { return kind; }
+
+	switch (len) {
+	case 2:
+		switch (s[0] | 0x20) {
+		case 'i': kw("if", CSVTMT_TK_IF); break;
+		}
+		break;
+	case 3:
+		switch (s[0] | 0x20) {
+		case 's': kw("set", CSVTMT_TK_SET); break;
+		case 'n': kw("not", CSVTMT_TK_NOT); break;
+		case 'k': kw("key", CSVTMT_TK_KEY); break;
+		}
+		break;
+	case 4:
+		switch (s[0] | 0x20) {
+		case 's': kw("show", CSVTMT_TK_SHOW); break;
+		case 'f': kw("from", CSVTMT_TK_FROM); break;
+		case 'i': kw("into", CSVTMT_TK_INTO); break;
+		case 't': kw("text", CSVTMT_TK_TEXT); break;
+		case 'n': kw("null", CSVTMT_TK_NULL); break;
+		}
+		break;
+	case 5:
+		switch (s[0] | 0x20) {
+		case 'c': kw("count", CSVTMT_TK_COUNT); break;
+		case 'w': kw("where", CSVTMT_TK_WHERE); break;
+		case 't': kw("table", CSVTMT_TK_TABLE); break;
+		}
+		break;
+	case 6:
+		switch (s[0] | 0x20) {
+		case 'c': kw("create", CSVTMT_TK_CREATE); break;
+		case 's': kw("select", CSVTMT_TK_SELECT); break;
+		case 'u': kw("update", CSVTMT_TK_UPDATE); break;
+		case 'd': kw("delete", CSVTMT_TK_DELETE); break;
+		case 't': kw("tables", CSVTMT_TK_TABLES); break;
+		case 'i': kw("insert", CSVTMT_TK_INSERT); break;
+		case 'v': kw("values", CSVTMT_TK_VALUES); break;
+		case 'e': kw("exists", CSVTMT_TK_EXISTS); break;
+		}
+		break;
+	case 7:
+		switch (s[0] | 0x20) {
+		case 'i': kw("integer", CSVTMT_TK_INTEGER); break;
+		case 'p': kw("primary", CSVTMT_TK_PRIMARY); break;
+		}
+		break;
+	case 13:
+		kw("autoincrement", CSVTMT_TK_AUTOINCREMENT);
+		break;
+	}
+
+	return CSVTMT_TK_IDENT;
+}
+
 static CsvTomatoToken *
 tokenize_ident(CsvTomatoTokenizer *self, CsvTomatoError *error) {
-	CsvTomatoToken *tok = csvtmt_token_new(CSVTMT_TK_IDENT, error);
+	CsvTomatoToken *tok = csvtmt_token_new(self->arena, CSVTMT_TK_IDENT, error);
 	if (error->error) {
 		return NULL;
 	}
 
-	#undef push
-	#define push(c) {\
-		if (tok->len >= CSVTMT_STR_SIZE) {\
-			csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "token buffer overflow (1)");\
-			return NULL;\
-		}\
-		tok->text[tok->len++] = c;\
-		tok->text[tok->len] = 0;\
-	}\
+	tok->text = self->code + self->index;
 
 	for (; self->index < self->len; self->index++) {
-		char c1 = self->code[self->index];
+		int cc = char_class(self->code[self->index]);
 
-		if (isalpha(c1) || c1 == '_') {
-			push(c1);
+		if (cc == CC_ALPHA || cc == CC_UNDERSCORE) {
+			tok->len++;
 		} else {
 			self->index--;
 			break;
 		}
 	}
 
-	if (!strcasecmp(tok->text, "create")) tok->kind = CSVTMT_TK_CREATE;
-	else if (!strcasecmp(tok->text, "select")) tok->kind = CSVTMT_TK_SELECT;
-	else if (!strcasecmp(tok->text, "update")) tok->kind = CSVTMT_TK_UPDATE;
-	else if (!strcasecmp(tok->text, "delete")) tok->kind = CSVTMT_TK_DELETE;
-	else if (!strcasecmp(tok->text, "show")) tok->kind = CSVTMT_TK_SHOW;
-	else if (!strcasecmp(tok->text, "count")) tok->kind = CSVTMT_TK_COUNT;
-	else if (!strcasecmp(tok->text, "tables")) tok->kind = CSVTMT_TK_TABLES;
-	else if (!strcasecmp(tok->text, "from")) tok->kind = CSVTMT_TK_FROM;
-	else if (!strcasecmp(tok->text, "set")) tok->kind = CSVTMT_TK_SET;
-	else if (!strcasecmp(tok->text, "insert")) tok->kind = CSVTMT_TK_INSERT;
-	else if (!strcasecmp(tok->text, "into")) tok->kind = CSVTMT_TK_INTO;
-	else if (!strcasecmp(tok->text, "where")) tok->kind = CSVTMT_TK_WHERE;
-	else if (!strcasecmp(tok->text, "values")) tok->kind = CSVTMT_TK_VALUES;
-	else if (!strcasecmp(tok->text, "table")) tok->kind = CSVTMT_TK_TABLE;
-	else if (!strcasecmp(tok->text, "if")) tok->kind = CSVTMT_TK_IF;
-	else if (!strcasecmp(tok->text, "not")) tok->kind = CSVTMT_TK_NOT;
-	else if (!strcasecmp(tok->text, "exists")) tok->kind = CSVTMT_TK_EXISTS;
-	else if (!strcasecmp(tok->text, "integer")) tok->kind = CSVTMT_TK_INTEGER;
-	else if (!strcasecmp(tok->text, "primary")) tok->kind = CSVTMT_TK_PRIMARY;
-	else if (!strcasecmp(tok->text, "autoincrement")) tok->kind = CSVTMT_TK_AUTOINCREMENT;
-	else if (!strcasecmp(tok->text, "key")) tok->kind = CSVTMT_TK_KEY;
-	else if (!strcasecmp(tok->text, "text")) tok->kind = CSVTMT_TK_TEXT;
-	else if (!strcasecmp(tok->text, "not")) tok->kind = CSVTMT_TK_NOT;
-	else if (!strcasecmp(tok->text, "null")) tok->kind = CSVTMT_TK_NULL;
+	tok->kind = keyword_kind(tok->text, tok->len);
 
 	return tok;
 }
 
+// 文字列はクエリの中をそのまま指す。エスケープを含む時だけarenaに書き直す。
 static CsvTomatoToken *
 tokenize_string(
 	CsvTomatoTokenizer *self, 
 	CsvTomatoError *error,
 	char quote
 ) {
-	CsvTomatoToken *tok = csvtmt_token_new(CSVTMT_TK_STRING, error);
+	CsvTomatoToken *tok = csvtmt_token_new(self->arena, CSVTMT_TK_STRING, error);
 	if (error->error) {
 		return NULL;
 	}
 
-	#undef push
-	#define push(c) {\
-		if (tok->len >= CSVTMT_STR_SIZE) {\
-			csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "token buffer overflow (2)");\
-			return NULL;\
-		}\
-		tok->text[tok->len++] = c;\
-		tok->text[tok->len] = 0;\
-	}\
-
 	self->index++; // quote
 
+	size_t beg = self->index;
+	bool escaped = false;
+
 	for (; self->index < self->len; self->index++) {
 		char c1 = self->code[self->index];
 
 		if (c1 == quote) {
 			break;
 		} else if (c1 == '\\') {
+			escaped = true;
 			self->index++;
-			if (self->index < self->len) {
-				c1 = self->code[self->index];
-				push(c1);
+		}
+	}
+
+	const char *src = self->code + beg;
+	size_t src_len = (self->index < self->len ? self->index : self->len) - beg;
+
+	if (!escaped) {
+		tok->text = src;
+		tok->len = src_len;
+		return tok;
+	}
+
+	char *dst = csvtmt_arena_alloc(self->arena, src_len, error);
+	if (!dst) {
+		return NULL;
+	}
+	for (size_t i = 0; i < src_len; i++) {
+		if (src[i] == '\\') {
+			if (++i >= src_len) {
+				break;
 			}
-		} else {
-			push(c1);
 		}
+		dst[tok->len++] = src[i];
 	}
+	tok->text = dst;
 
 	return tok;
 }
@@ -163,28 +231,20 @@ tokenize_number(
 	CsvTomatoTokenizer *self, 
 	CsvTomatoError *error
 ) {
-	CsvTomatoToken *tok = csvtmt_token_new(CSVTMT_TK_INT, error);
+	CsvTomatoToken *tok = csvtmt_token_new(self->arena, CSVTMT_TK_INT, error);
 	if (error->error) {
 		return NULL;
 	}
 
-	#undef push
-	#define push(c) {\
-		if (tok->len >= CSVTMT_STR_SIZE) {\
-			csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "token buffer overflow (3)");\
-			return NULL;\
-		}\
-		tok->text[tok->len++] = c;\
-		tok->text[tok->len] = 0;\
-	}\
+	tok->text = self->code + self->index;
 
 	for (; self->index < self->len; self->index++) {
-		char c1 = self->code[self->index];
+		int cc = char_class(self->code[self->index]);
 
-		if (isdigit(c1)) {
-			push(c1);
-		} else if (c1 == '.') {
-			push(c1);
+		if (cc == CC_DIGIT) {
+			tok->len++;
+		} else if (cc == CC_DOT) {
+			tok->len++;
 			tok->kind = CSVTMT_TK_DOUBLE;
 		} else {
 			self->index--;
@@ -192,10 +252,18 @@ tokenize_number(
 		}
 	}
 
+	char num[CSVTMT_NUM_STR_SIZE];
+	if (tok->len >= sizeof num) {
+		csvtmt_error_push(error, CSVTMT_ERR_BUF_OVERFLOW, "token buffer overflow (3)");
+		return NULL;
+	}
+	memcpy(num, tok->text, tok->len);
+	num[tok->len] = '\0';
+
 	if (tok->kind == CSVTMT_TK_INT) {
-		tok->int_value = atoi(tok->text);
+		tok->int_value = strtoll(num, NULL, 10);
 	} else {
-		tok->double_value = atof(tok->text);
+		tok->double_value = atof(num);
 	}
 
 	return tok;
@@ -211,7 +279,7 @@ csvtmt_tokenizer_tokenize(
 	self->len = strlen(code);
 	self->code = code;
 
-	CsvTomatoToken *tok = csvtmt_token_new(CSVTMT_TK_ROOT, error);
+	CsvTomatoToken *tok = csvtmt_token_new(self->arena, CSVTMT_TK_ROOT, error);
 	if (error->error) {
 		return NULL;
 	}
@@ -219,7 +287,7 @@ csvtmt_tokenizer_tokenize(
 	CsvTomatoToken *root = tok;
 
 	#define store(kind) {\
-		tok->next = csvtmt_token_new(kind, error);\
+		tok->next = csvtmt_token_new(self->arena, kind, error);\
 		if (error->error) {\
 			goto fail;\
 		}\
@@ -229,43 +297,34 @@ csvtmt_tokenizer_tokenize(
 	for (; self->index < self->len; self->index++) {
 		char c1 = self->code[self->index];
 
-		if (isspace(c1)) {
-			// pass
-		} else if (isalpha(c1)) {
+		switch (char_class(c1)) {
+		case CC_SPACE:
+			break;
+		case CC_ALPHA:
 			tok->next = tokenize_ident(self, error);
 			if (error->error) {
 				goto fail;
 			}
 			tok = tok->next;
-		} else if (isdigit(c1)) {
+			break;
+		case CC_DIGIT:
 			tok->next = tokenize_number(self, error);
 			if (error->error) {
 				goto fail;
 			}
 			tok = tok->next;
-		} else if (c1 == '"' || c1 == '\'') {
+			break;
+		case CC_QUOTE:
 			tok->next = tokenize_string(self, error, c1);
 			if (error->error) {
 				goto fail;
 			}
-			tok = tok->next;			
-		} else if (c1 == ';') {
-			store(CSVTMT_TK_SEMICOLON);
-		} else if (c1 == '=') {
-			store(CSVTMT_TK_ASSIGN);
-		} else if (c1 == '(') {
-			store(CSVTMT_TK_BEG_PAREN);
-		} else if (c1 == ')') {
-			store(CSVTMT_TK_END_PAREN);
-		} else if (c1 == '?') {
-			store(CSVTMT_TK_PLACE_HOLDER);
-		} else if (c1 == '*') {
-			store(CSVTMT_TK_STAR);
-		} else if (c1 == ',') {
-			store(CSVTMT_TK_COMMA);
-		} else if (c1 == '?') {
-			store(CSVTMT_TK_PLACE_HOLDER);
-		} else {
+			tok = tok->next;
+			break;
+		case CC_PUNCT:
+			store(punct_kinds[(unsigned char) c1]);
+			break;
+		default:
 			csvtmt_error_push(error, CSVTMT_ERR_TOKENIZE, "not supported character '%c' on tokenize", c1);
 			goto fail;
 		}
@@ -273,6 +332,5 @@ csvtmt_tokenizer_tokenize(
 
 	return root;
 fail:
-	csvtmt_token_del_all(root);
 	return NULL;
 }
@@ -47,6 +47,37 @@ csvtmt_strdup(const char *s, CsvTomatoError *error) {
 	return p;
 }
 
+// 単調増加する時計のミリ秒。経過時間を測るのに使う。
+int64_t
+csvtmt_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// *arrayの容量をneed個以上に伸ばす。容量は倍々で増やすので要素の追加は償却O(1)。
+// 失敗した時は*arrayと*capaはそのまま。
+bool
+csvtmt_grow(void **array, size_t *capa, size_t need, size_t elem_size) {
+	if (need <= *capa) {
+		return true;
+	}
+
+	size_t new_capa = *capa ? *capa : 4;
+	while (new_capa < need) {
+		new_capa *= 2;
+	}
+
+	void *p = realloc(*array, new_capa * elem_size);
+	if (!p) {
+		return false;
+	}
+
+	*array = p;
+	*capa = new_capa;
+	return true;
+}
+
 void
 csvtmt_quick_exec(const char *db_dir, const char *query) {
 	CsvTomatoError error = {0};
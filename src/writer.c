@@ -0,0 +1,296 @@
+#include <csvtomato.h>
+
+CsvTomatoWriter *
+csvtmt_writer_new(const char *path, int flags, CsvTomatoError *error) {
+	errno = 0;
+	CsvTomatoWriter *self = calloc(1, sizeof(*self));
+	if (!self) {
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate memory: %s", strerror(errno));
+		return NULL;
+	}
+
+	// ページ境界に揃えたバッファにまとめてから書き出す。
+	self->capa = CSVTMT_WRITE_BUF_SIZE;
+	self->buf = aligned_alloc(CSVTMT_WRITE_ALIGN, self->capa);
+	if (!self->buf) {
+		free(self);
+		csvtmt_error_push(error, CSVTMT_ERR_MEM, "failed to allocate write buffer: %s", strerror(errno));
+		return NULL;
+	}
+
+	errno = 0;
+	self->fd = open(path, flags, 0644);
+	if (self->fd == -1) {
+		free(self->buf);
+		free(self);
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	self->offset = flags & O_APPEND ? lseek(self->fd, 0, SEEK_END) : 0;
+
+	return self;
+}
+
+// backendがURINGならio_uringで書く。使えなければ今まで通りwrite()で書く。
+void
+csvtmt_writer_use_backend(CsvTomatoWriter *self, CsvTomatoIoBackend backend) {
+	if (backend != CSVTMT_IO_URING || self->ring) {
+		return;
+	}
+
+	self->spare = aligned_alloc(CSVTMT_WRITE_ALIGN, self->capa);
+	if (!self->spare) {
+		return;
+	}
+	self->ring = csvtmt_ring_new(4, false);
+	if (!self->ring) {
+		free(self->spare);
+		self->spare = NULL;
+	}
+}
+
+static void
+write_all(CsvTomatoWriter *self, const char *p, size_t len, CsvTomatoError *error) {
+	while (len) {
+		errno = 0;
+		ssize_t n = pwrite(self->fd, p, len, self->offset);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write: %s", strerror(errno));
+			return;
+		}
+		p += n;
+		len -= n;
+		self->offset += n;
+	}
+}
+
+enum {
+	RING_WRITE,
+	RING_SYNC,
+};
+
+// 投げた書き込みが終わるのを待つ。短く書かれた時は残りをその場で書く。
+static void
+wait_pending(CsvTomatoWriter *self, CsvTomatoError *error) {
+	if (!self->pending) {
+		return;
+	}
+	self->pending = false;
+
+	uint64_t user_data;
+	int res = -EIO;
+	errno = 0;
+	if (!csvtmt_ring_reap(self->ring, &user_data, &res, true) && errno) {
+		res = -errno;
+	}
+	if (res < 0) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to write: %s", strerror(-res));
+		return;
+	}
+
+	self->offset += res;
+	if ((size_t) res < self->pending_len) {
+		write_all(self, self->spare + res, self->pending_len - res, error);
+	}
+}
+
+// bufをio_uringに投げてspareと入れ替え、待たずに次を書き溜められるようにする。
+static void
+submit_buf(CsvTomatoWriter *self, CsvTomatoError *error) {
+	wait_pending(self, error);
+	if (error->error || !self->len) {
+		return;
+	}
+
+	if (!csvtmt_ring_write(self->ring, self->fd, self->buf, self->len, self->offset, RING_WRITE) ||
+		csvtmt_ring_submit(self->ring, 0) < 0) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to submit write: %s", strerror(errno));
+		return;
+	}
+
+	char *buf = self->buf;
+	self->buf = self->spare;
+	self->spare = buf;
+	self->pending = true;
+	self->pending_len = self->len;
+	self->len = 0;
+}
+
+// 残りの書き込みと同期を1回のシステムコールで投げる。
+static void
+sync_ring(CsvTomatoWriter *self, CsvTomatoSyncLevel level, CsvTomatoError *error) {
+	wait_pending(self, error);
+	if (error->error) {
+		return;
+	}
+
+	size_t len = self->len;
+	if (len && !csvtmt_ring_write(self->ring, self->fd, self->buf, len, self->offset, RING_WRITE)) {
+		goto failed_to_submit;
+	}
+	if (!csvtmt_ring_fsync(self->ring, self->fd, level, RING_SYNC)) {
+		goto failed_to_submit;
+	}
+	if (csvtmt_ring_submit(self->ring, len ? 2 : 1) < 0) {
+		goto failed_to_submit;
+	}
+	self->len = 0;
+
+	bool short_write = false;
+	for (int i = len ? 2 : 1; i > 0; i--) {
+		uint64_t user_data;
+		int res;
+		errno = 0;
+		if (!csvtmt_ring_reap(self->ring, &user_data, &res, true)) {
+			csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to wait write: %s", strerror(errno));
+			return;
+		}
+		if (res < 0) {
+			csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to %s: %s", user_data == RING_WRITE ? "write" : "sync", strerror(-res));
+			continue;
+		}
+		if (user_data == RING_WRITE) {
+			self->offset += res;
+			if ((size_t) res < len) {
+				write_all(self, self->buf + res, len - res, error);
+				short_write = true;
+			}
+		}
+	}
+
+	// 残りを書いたのは同期の後なのでもう一度同期する
+	errno = 0;
+	if (!error->error && short_write && csvtmt_file_sync(self->fd, level) == -1) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync: %s", strerror(errno));
+	}
+	return;
+failed_to_submit:
+	csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to submit sync: %s", strerror(errno));
+}
+
+void
+csvtmt_writer_flush(CsvTomatoWriter *self, CsvTomatoError *error) {
+	if (self->ring) {
+		submit_buf(self, error);
+		if (!error->error) {
+			wait_pending(self, error);
+		}
+		return;
+	}
+	if (!self->len) {
+		return;
+	}
+	write_all(self, self->buf, self->len, error);
+	self->len = 0;
+}
+
+void
+csvtmt_writer_write(
+	CsvTomatoWriter *self,
+	const void *data,
+	size_t len,
+	CsvTomatoError *error
+) {
+	if (self->len + len > self->capa) {
+		if (self->ring && len < self->capa) {
+			submit_buf(self, error);
+		} else {
+			csvtmt_writer_flush(self, error);
+		}
+		if (error->error) {
+			return;
+		}
+		if (len >= self->capa) {
+			// バッファより大きい範囲は直接書き出す。
+			write_all(self, data, len, error);
+			return;
+		}
+	}
+
+	memcpy(self->buf + self->len, data, len);
+	self->len += len;
+}
+
+void
+csvtmt_writer_write_str(CsvTomatoWriter *self, const char *s, CsvTomatoError *error) {
+	csvtmt_writer_write(self, s, strlen(s), error);
+}
+
+// バッファを書き出してからlevelに応じてディスクに同期する。
+void
+csvtmt_writer_sync(CsvTomatoWriter *self, CsvTomatoSyncLevel level, CsvTomatoError *error) {
+	if (self->ring && level != CSVTMT_SYNC_NONE) {
+		sync_ring(self, level, error);
+		return;
+	}
+
+	csvtmt_writer_flush(self, error);
+	if (error->error) {
+		return;
+	}
+
+	errno = 0;
+	if (csvtmt_file_sync(self->fd, level) == -1) {
+		csvtmt_error_push(error, CSVTMT_ERR_FILE_IO, "failed to sync: %s", strerror(errno));
+	}
+}
+
+// 1カラムを書き出す。区切り文字や改行、クォートを含む場合だけクォートする。
+void
+csvtmt_writer_write_field(
+	CsvTomatoWriter *self,
+	const char *col,
+	int sep,
+	CsvTomatoError *error
+) {
+	bool need_quote = false;
+	for (const char *p = col; *p; p++) {
+		if (*p == sep || *p == '"' || *p == '\r' || *p == '\n') {
+			need_quote = true;
+			break;
+		}
+	}
+	if (!need_quote) {
+		csvtmt_writer_write_str(self, col, error);
+		return;
+	}
+
+	char *s = csvtmt_wrap_column(col, error);
+	if (!s) {
+		return;
+	}
+	csvtmt_writer_write_str(self, s, error);
+	free(s);
+}
+
+// 書きかけを捨ててsizeに切り詰める。投げた書き込みは終わるのを待つ。
+void
+csvtmt_writer_truncate(CsvTomatoWriter *self, off_t size) {
+	if (self->pending) {
+		uint64_t user_data;
+		int res;
+		csvtmt_ring_reap(self->ring, &user_data, &res, true);
+		self->pending = false;
+	}
+	self->len = 0;
+	self->offset = size;
+	ftruncate(self->fd, size);
+}
+
+// 書き残しは捨てる。必要なら先にcsvtmt_writer_flush()を呼ぶこと。
+void
+csvtmt_writer_del(CsvTomatoWriter *self) {
+	if (!self) {
+		return;
+	}
+
+	// 投げた書き込みが終わるのを待ってからバッファを捨てる
+	csvtmt_ring_del(self->ring);
+	close(self->fd);
+	free(self->buf);
+	free(self->spare);
+	free(self);
+}
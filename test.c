@@ -1,15 +1,18 @@
 #include "csvtomato.h"
 #include <assert.h>
+#include <poll.h>
 
 #undef clear
 #define clear(table_name) {\
 	csvtmt_file_remove("test_db/" table_name ".csv");\
 	csvtmt_file_remove("test_db/id/" table_name "__id.txt");\
+	csvtmt_file_remove("test_db/stats/" table_name ".csv");\
 }\
 
 #undef define_vars
 #define define_vars()\
 	CsvTomatoError error = {0};\
+	CsvTomatoArena *a;\
 	CsvTomatoTokenizer *t;\
 	CsvTomatoParser *p;\
 	CsvTomatoExecutor *e;\
@@ -30,8 +33,9 @@
 #define setup() {\
 	csvtmt_error_clear(&error);\
 	csvtmt_model_init(&model, "test_db", &error);\
-	t = csvtmt_tokenizer_new(&error);\
-	p = csvtmt_parser_new(&error);\
+	a = csvtmt_arena_new(&error);\
+	t = csvtmt_tokenizer_new(a, &error);\
+	p = csvtmt_parser_new(a, &error);\
 	o = csvtmt_opcode_new(&error);\
 	e = csvtmt_executor_new(&error);\
 }\
@@ -40,9 +44,7 @@
 #define cleanup() {\
 	csvtmt_model_final(&model);\
 	memset(&model, 0, sizeof(model));\
-	csvtmt_token_del_all(token);\
 	token = NULL;\
-	csvtmt_node_del_all(node);\
 	node = NULL;\
 	csvtmt_parser_del(p);\
 	p = NULL;\
@@ -52,6 +54,8 @@
 	o = NULL;\
 	csvtmt_executor_del(e);\
 	e = NULL;\
+	csvtmt_arena_del(a);\
+	a = NULL;\
 }\
 
 #undef exec
@@ -286,6 +290,14 @@ assert_file(const char *path, const char *s) {
 	}
 }
 
+void
+write_file(const char *path, const char *s) {
+	FILE *fp = fopen(path, "w");
+	assert(fp);
+	fputs(s, fp);
+	fclose(fp);
+}
+
 void 
 test_tomato(void) {
 	CsvTomatoError error = {0};
@@ -666,47 +678,1624 @@ test_executor_common(void) {
 		"0,3,\"Tamako\",200\n"		
 	);
 	// UPDATEの全置換では論理削除した行は自動的にドロップする。
+	// SETしないカラムは元のバイト列のまま書き戻される。
 	exec(
 		"UPDATE users SET age = 123, id = 3",
-		"\"__MODE__\",\"id INTEGER PRIMARY KEY AUTOINCREMENT\",\"name TEXT NOT NULL\",\"age INTEGER\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"		
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT NOT NULL,age INTEGER\n"
+		"0,3,\"Tamako\",123\n"
+		"0,3,\"Tamako\",123\n"
+		"0,3,\"Tamako\",123\n"		
 	);
 	exec(
 		"INSERT INTO users (name, age) VALUES (\"Hanako\", 223), (\"Taro\", 223)",
-		"\"__MODE__\",\"id INTEGER PRIMARY KEY AUTOINCREMENT\",\"name TEXT NOT NULL\",\"age INTEGER\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"		
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT NOT NULL,age INTEGER\n"
+		"0,3,\"Tamako\",123\n"
+		"0,3,\"Tamako\",123\n"
+		"0,3,\"Tamako\",123\n"		
 		"0,4,\"Hanako\",223\n"
 		"0,5,\"Taro\",223\n"
 	);
 	exec(
 		"DELETE FROM users WHERE age = 223",
-		"\"__MODE__\",\"id INTEGER PRIMARY KEY AUTOINCREMENT\",\"name TEXT NOT NULL\",\"age INTEGER\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"
-		"\"0\",\"3\",\"Tamako\",\"123\"\n"		
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT NOT NULL,age INTEGER\n"
+		"0,3,\"Tamako\",123\n"
+		"0,3,\"Tamako\",123\n"
+		"0,3,\"Tamako\",123\n"		
 		"1,4,\"Hanako\",223\n"
 		"1,5,\"Taro\",223\n"
 	);
 	exec(
 		"DELETE FROM users",
-		"\"__MODE__\",\"id INTEGER PRIMARY KEY AUTOINCREMENT\",\"name TEXT NOT NULL\",\"age INTEGER\"\n"
-		"\"1\",\"3\",\"Tamako\",\"123\"\n"
-		"\"1\",\"3\",\"Tamako\",\"123\"\n"
-		"\"1\",\"3\",\"Tamako\",\"123\"\n"		
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT NOT NULL,age INTEGER\n"
+		"1,3,\"Tamako\",123\n"
+		"1,3,\"Tamako\",123\n"
+		"1,3,\"Tamako\",123\n"		
 		"1,4,\"Hanako\",223\n"
 		"1,5,\"Taro\",223\n"
 	);
 }
 
+void
+test_copy(void) {
+	define_vars();
+
+	clear("items");
+	exec(
+		"CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+	);
+
+	// HEADERありではソースの1行目のカラム名でテーブルのカラムに対応付ける。
+	// ソースに無いAUTOINCREMENTカラムには連番を振る。
+	write_file("test_db/items_src.csv",
+		"price,name\n"
+		"100,Apple\n"
+		"300,\"Big, Melon\"\n"
+	);
+	exec(
+		"COPY items FROM 'test_db/items_src.csv' WITH (HEADER)",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+		"0,1,\"Apple\",100\n"
+		"0,2,\"Big, Melon\",300\n"
+	);
+
+	// HEADERなしではテーブルのカラム順で読む。
+	write_file("test_db/items_src.csv",
+		"10;Lemon;50\n"
+	);
+	exec(
+		"COPY items FROM 'test_db/items_src.csv' WITH (DELIMITER ';')",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+		"0,1,\"Apple\",100\n"
+		"0,2,\"Big, Melon\",300\n"
+		"0,10,\"Lemon\",50\n"
+	);
+	exec(
+		"INSERT INTO items (name, price) VALUES (\"Peach\", 80)",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+		"0,1,\"Apple\",100\n"
+		"0,2,\"Big, Melon\",300\n"
+		"0,10,\"Lemon\",50\n"
+		"0,3,\"Peach\",80\n"
+	);
+
+	write_file("test_db/items_src.csv",
+		"name,color\n"
+		"Grape,purple\n"
+	);
+	exec_fail(
+		"COPY items FROM 'test_db/items_src.csv' WITH (HEADER)",
+		"\"color\" is not in header types"
+	);
+
+	// 列数の合わない行があれば追記した分は取り消す。
+	write_file("test_db/items_src.csv",
+		"20,Kiwi,60\n"
+		"21,Fig\n"
+	);
+	exec_fail(
+		"COPY items FROM 'test_db/items_src.csv'",
+		"invalid columns length"
+	);
+	assert(assert_file(
+		"test_db/items.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+		"0,1,\"Apple\",100\n"
+		"0,2,\"Big, Melon\",300\n"
+		"0,10,\"Lemon\",50\n"
+		"0,3,\"Peach\",80\n"
+	));
+
+	csvtmt_file_remove("test_db/items_src.csv");
+
+	// COPY TO は論理削除した行と__MODE__カラムを除いて書き出す。
+	exec(
+		"DELETE FROM items WHERE id = 10",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+		"0,1,\"Apple\",100\n"
+		"0,2,\"Big, Melon\",300\n"
+		"1,10,\"Lemon\",50\n"
+		"0,3,\"Peach\",80\n"
+	);
+	exec(
+		"COPY items TO 'test_db/items_out.csv' WITH (HEADER)",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,price INTEGER\n"
+		"0,1,\"Apple\",100\n"
+		"0,2,\"Big, Melon\",300\n"
+		"1,10,\"Lemon\",50\n"
+		"0,3,\"Peach\",80\n"
+	);
+	assert(assert_file(
+		"test_db/items_out.csv",
+		"id,name,price\n"
+		"1,\"Apple\",100\n"
+		"2,\"Big, Melon\",300\n"
+		"3,\"Peach\",80\n"
+	));
+
+	setup();
+	token = csvtmt_tokenizer_tokenize(t, "COPY (SELECT price, name FROM items WHERE price = 300) TO 'test_db/items_out.csv' WITH (HEADER, DELIMITER ';')", &error);
+	die();
+	node = csvtmt_parser_parse(p, token, &error);
+	die();
+	csvtmt_opcode_parse(o, node, &error);
+	die();
+	assert(csvtmt_executor_exec(e, &model, o->elems, o->len, &error) == CSVTMT_DONE);
+	die();
+	cleanup();
+	assert(assert_file(
+		"test_db/items_out.csv",
+		"price;name\n"
+		"300;Big, Melon\n"
+	));
+
+	csvtmt_file_remove("test_db/items_out.csv");
+
+	// COPYの中でだけ意味を持つ語はカラム名に使える。
+	clear("words");
+	exec(
+		"CREATE TABLE words (copy TEXT, with TEXT, header TEXT, delimiter TEXT, to TEXT);",
+		"__MODE__,copy TEXT,with TEXT,header TEXT,delimiter TEXT,to TEXT\n"
+	);
+	exec(
+		"INSERT INTO words (copy, with, header, delimiter, to) VALUES (\"c\", \"w\", \"h\", \";\", \"t\")",
+		"__MODE__,copy TEXT,with TEXT,header TEXT,delimiter TEXT,to TEXT\n"
+		"0,\"c\",\"w\",\"h\",\";\",\"t\"\n"
+	);
+	exec(
+		"DELETE FROM words WHERE to = \"t\"",
+		"__MODE__,copy TEXT,with TEXT,header TEXT,delimiter TEXT,to TEXT\n"
+		"1,\"c\",\"w\",\"h\",\";\",\"t\"\n"
+	);
+	clear("words");
+}
+
+void
+test_sync(void) {
+	CsvTomatoError error = {0};
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	#undef sync_exec
+	#define sync_exec(query) {\
+		csvtmt_exec(db, query, &error);\
+		if (error.error) {\
+			csvtmt_error_show(&error);\
+		}\
+		assert(!error.error);\
+	}\
+
+	// 既定では同期しない。
+	assert(db->sync_level == CSVTMT_SYNC_NONE);
+
+	// FULLではディレクトリも同期するが結果は変わらない。
+	csvtmt_set_sync_level(db, CSVTMT_SYNC_FULL);
+	clear("notes");
+	sync_exec("CREATE TABLE notes (id INTEGER PRIMARY KEY AUTOINCREMENT, body TEXT);");
+	sync_exec("INSERT INTO notes (body) VALUES (\"a\"), (\"b\"), (\"c\")");
+	sync_exec("UPDATE notes SET body = \"B\" WHERE id = 2");
+	sync_exec("DELETE FROM notes WHERE id = 1");
+	assert(assert_file(
+		"test_db/notes.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,body TEXT\n"
+		"1,1,\"a\"\n"
+		"1,2,\"b\"\n"
+		"0,3,\"c\"\n"
+		"0,2,\"B\"\n"
+	));
+
+	// NONEでは同期しない。
+	csvtmt_set_sync_level(db, CSVTMT_SYNC_NONE);
+	sync_exec("INSERT INTO notes (body) VALUES (\"d\")");
+	sync_exec("UPDATE notes SET body = \"x\"");
+	assert(assert_file(
+		"test_db/notes.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,body TEXT\n"
+		"0,3,\"x\"\n"
+		"0,2,\"x\"\n"
+		"0,4,\"x\"\n"
+	));
+
+	clear("notes");
+	csvtmt_close(db);
+}
+
+void
+test_delete(void) {
+	CsvTomatoError error = {0};
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	#undef delete_exec
+	#define delete_exec(query) {\
+		csvtmt_exec(db, query, &error);\
+		if (error.error) {\
+			csvtmt_error_show(&error);\
+		}\
+		assert(!error.error);\
+	}\
+
+	clear("logs");
+	delete_exec("CREATE TABLE logs (id INTEGER PRIMARY KEY AUTOINCREMENT, tag TEXT, n INTEGER);");
+	delete_exec("INSERT INTO logs (tag, n) VALUES (\"a,b\", 1), (\"x\", 2), (\"a,b\", 3), (\"y\", 1)");
+	assert(csvtmt_changes(db) == 4);
+
+	// クォートされたフィールドもアンクォートして比較する。
+	delete_exec("DELETE FROM logs WHERE tag = \"a,b\"");
+	assert(csvtmt_changes(db) == 2);
+
+	// 論理削除済みの行は数えない。
+	delete_exec("DELETE FROM logs WHERE n = 1");
+	assert(csvtmt_changes(db) == 1);
+	assert(assert_file(
+		"test_db/logs.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,tag TEXT,n INTEGER\n"
+		"1,1,\"a,b\",1\n"
+		"0,2,\"x\",2\n"
+		"1,3,\"a,b\",3\n"
+		"1,4,\"y\",1\n"
+	));
+
+	delete_exec("DELETE FROM logs WHERE n = 100");
+	assert(csvtmt_changes(db) == 0);
+	delete_exec("DELETE FROM logs");
+	assert(csvtmt_changes(db) == 1);
+
+	clear("logs");
+	csvtmt_close(db);
+}
+
+void
+test_reset(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("pets");
+	csvtmt_exec(db, "CREATE TABLE pets (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, age INTEGER);", &error);
+	assert(!error.error);
+
+	// 一度prepareしたINSERTをバインドし直して繰り返し実行する。
+	csvtmt_prepare(db, "INSERT INTO pets (name, age) VALUES (?, ?);", &stmt, &error);
+	assert(!error.error);
+
+	const char *names[] = {"Pochi", "Tama", "Hachi"};
+	for (size_t i = 0; i < csvtmt_numof(names); i++) {
+		csvtmt_bind_text(stmt, 1, names[i], -1, CSVTMT_TRANSTENT, &error);
+		csvtmt_bind_int(stmt, 2, i + 1, &error);
+		assert(!error.error);
+		assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+		assert(!error.error);
+		csvtmt_reset(stmt);
+	}
+
+	// バインドを外すと未バインドのプレースホルダとして扱われる。
+	csvtmt_clear_bindings(stmt);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ERROR);
+	csvtmt_error_clear(&error);
+	csvtmt_finalize(stmt);
+
+	assert(assert_file(
+		"test_db/pets.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,age INTEGER\n"
+		"0,1,\"Pochi\",1\n"
+		"0,2,\"Tama\",2\n"
+		"0,3,\"Hachi\",3\n"
+	));
+
+	// 途中まで読んだSELECTもresetで先頭から読み直せる。
+	csvtmt_prepare(db, "SELECT name FROM pets WHERE age = ?;", &stmt, &error);
+	assert(!error.error);
+	csvtmt_bind_int(stmt, 1, 2, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Tama"));
+	csvtmt_reset(stmt);
+
+	csvtmt_bind_int(stmt, 1, 3, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Hachi"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	// 複数行のVALUESにcsvtmt_bind_row()でまとめてバインドする。
+	csvtmt_prepare(db, "INSERT INTO pets (name, age) VALUES (?, ?), (?, ?);", &stmt, &error);
+	assert(!error.error);
+	assert(csvtmt_bind_parameter_count(stmt) == 4);
+
+	CsvTomatoValue row[] = {
+		{ .kind = CSVTMT_VAL_STRING, .string_value = "Kuro" },
+		{ .kind = CSVTMT_VAL_INT, .int_value = 4 },
+		{ .kind = CSVTMT_VAL_STRING, .string_value = "Shiro" },
+		{ .kind = CSVTMT_VAL_INT, .int_value = 5 },
+	};
+	csvtmt_bind_row(stmt, row, csvtmt_numof(row), &error);
+	assert(!error.error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+
+	csvtmt_bind_int(stmt, 5, 0, &error);
+	assert(error.error);
+	csvtmt_error_clear(&error);
+	csvtmt_finalize(stmt);
+
+	assert(assert_file(
+		"test_db/pets.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT,age INTEGER\n"
+		"0,1,\"Pochi\",1\n"
+		"0,2,\"Tama\",2\n"
+		"0,3,\"Hachi\",3\n"
+		"0,4,\"Kuro\",4\n"
+		"0,5,\"Shiro\",5\n"
+	));
+
+	clear("pets");
+	csvtmt_close(db);
+}
+
+void
+test_stmt_cache(void) {
+	CsvTomatoError error = {0};
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("birds");
+	csvtmt_exec(db, "CREATE TABLE birds (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	assert(!error.error);
+	assert(db->stmt_cache_len == 1);
+
+	// 空白の違いは同じクエリとして扱い、キャッシュした文を再実行する。
+	csvtmt_exec(db, "INSERT INTO birds (name) VALUES (\"a  b\");", &error);
+	csvtmt_exec(db, "  INSERT INTO  birds (name)\n VALUES (\"a  b\");", &error);
+	assert(!error.error);
+	assert(db->stmt_cache_len == 2);
+	assert(csvtmt_changes(db) == 1);
+
+	assert(csvtmt_exec(db, "SELECT * FROM birds;", &error) == CSVTMT_ROW);
+	assert(csvtmt_exec(db, "SELECT * FROM birds;", &error) == CSVTMT_ROW);
+	assert(!error.error);
+	assert(db->stmt_cache_len == 3);
+
+	assert(assert_file(
+		"test_db/birds.csv",
+		"__MODE__,id INTEGER PRIMARY KEY AUTOINCREMENT,name TEXT\n"
+		"0,1,\"a  b\"\n"
+		"0,2,\"a  b\"\n"
+	));
+
+	// 失敗した文はキャッシュに残さない。
+	csvtmt_exec(db, "INSERT INTO birds (color) VALUES (\"red\");", &error);
+	assert(error.error);
+	csvtmt_error_clear(&error);
+	assert(db->stmt_cache_len == 3);
+
+	// 満杯になったら一番長く使われていない文を捨てる。
+	for (int i = 0; i < CSVTMT_STMT_CACHE_SIZE; i++) {
+		char query[128];
+		snprintf(query, sizeof query, "DELETE FROM birds WHERE id = %d;", 100 + i);
+		csvtmt_exec(db, query, &error);
+		assert(!error.error);
+	}
+	assert(db->stmt_cache_len == CSVTMT_STMT_CACHE_SIZE);
+	for (size_t i = 0; i < db->stmt_cache_len; i++) {
+		assert(strncmp(db->stmt_cache[i].query, "INSERT", 6));
+	}
+
+	clear("birds");
+	csvtmt_close(db);
+}
+
+void
+test_wide_table(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	// 以前の固定長配列（カラム128個、VALUES32個）を超える幅のテーブル。
+	// カラム名はca, cb, ... と2文字の英字で付ける。
+	enum { N = 200 };
+	static char query[N * 32];
+	size_t n;
+
+	clear("wide");
+	n = snprintf(query, sizeof query, "CREATE TABLE wide (");
+	for (int i = 0; i < N; i++) {
+		n += snprintf(query + n, sizeof query - n, "%sc%c%c INTEGER", i ? ", " : "", 'a' + i / 26, 'a' + i % 26);
+	}
+	snprintf(query + n, sizeof query - n, ");");
+	csvtmt_exec(db, query, &error);
+	assert(!error.error);
+
+	n = snprintf(query, sizeof query, "INSERT INTO wide (");
+	for (int i = 0; i < N; i++) {
+		n += snprintf(query + n, sizeof query - n, "%sc%c%c", i ? ", " : "", 'a' + i / 26, 'a' + i % 26);
+	}
+	n += snprintf(query + n, sizeof query - n, ") VALUES (");
+	for (int i = 0; i < N; i++) {
+		n += snprintf(query + n, sizeof query - n, "%s%d", i ? ", " : "", i);
+	}
+	snprintf(query + n, sizeof query - n, ");");
+	csvtmt_exec(db, query, &error);
+	assert(!error.error);
+
+	csvtmt_exec(db, "UPDATE wide SET chr = 7;", &error);
+	assert(!error.error);
+
+	csvtmt_prepare(db, "SELECT cfu, chr FROM wide;", &stmt, &error);
+	assert(!error.error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(csvtmt_column_int(stmt, 0, &error) == 150);
+	assert(csvtmt_column_int(stmt, 1, &error) == 7);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	clear("wide");
+	csvtmt_close(db);
+}
+
+void
+test_arena(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoArena *arena = csvtmt_arena_new(&error);
+	assert(arena);
+
+	// 小さな確保はチャンクを共有し、大きな確保は専用のチャンクになる。
+	char *s1 = csvtmt_arena_strndup(arena, "abcdef", 3, &error);
+	char *big = csvtmt_arena_alloc(arena, CSVTMT_ARENA_CHUNK_SIZE * 2, &error);
+	char *s2 = csvtmt_arena_strndup(arena, "xyz", 3, &error);
+	assert(!error.error);
+	assert(!strcmp(s1, "abc"));
+	assert(!strcmp(s2, "xyz"));
+	assert(big[0] == 0 && big[CSVTMT_ARENA_CHUNK_SIZE * 2 - 1] == 0);
+	assert((uintptr_t) big % _Alignof(max_align_t) == 0);
+
+	// トークンはクエリの中を指す。エスケープを含む文字列だけコピーされる。
+	const char *query = "SELECT * FROM t WHERE a = \"x\\\"y\" AND b = 'plain'";
+	CsvTomatoTokenizer *t = csvtmt_tokenizer_new(arena, &error);
+	CsvTomatoToken *tok = csvtmt_tokenizer_tokenize(t, query, &error);
+	assert(!error.error);
+	size_t nstrings = 0;
+	for (; tok; tok = tok->next) {
+		if (tok->kind == CSVTMT_TK_SELECT) {
+			assert(tok->text == query && tok->len == 6);
+		} else if (tok->kind == CSVTMT_TK_STRING && nstrings++ == 0) {
+			assert(tok->len == 3 && !memcmp(tok->text, "x\"y", 3));
+		} else if (tok->kind == CSVTMT_TK_STRING) {
+			assert(tok->text == strstr(query, "plain") && tok->len == 5);
+		}
+	}
+	assert(nstrings == 2);
+
+	csvtmt_tokenizer_del(t);
+	csvtmt_arena_del(arena);
+}
+
+void
+test_keywords(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoArena *arena = csvtmt_arena_new(&error);
+	CsvTomatoTokenizer *t = csvtmt_tokenizer_new(arena, &error);
+	assert(!error.error);
+
+	// 大文字小文字を区別せず、長さが違えば予約語にならない。
+	CsvTomatoTokenKind hope[] = {
+		CSVTMT_TK_SELECT, CSVTMT_TK_SELECT, CSVTMT_TK_IDENT, CSVTMT_TK_IDENT,
+		CSVTMT_TK_AUTOINCREMENT, CSVTMT_TK_IDENT, CSVTMT_TK_IDENT, CSVTMT_TK_IDENT,
+		CSVTMT_TK_COMMA, CSVTMT_TK_DOUBLE, CSVTMT_TK_STAR,
+	};
+	CsvTomatoToken *tok = csvtmt_tokenizer_tokenize(t, "select SeLeCt selects sel AutoIncrement DELIMITER To t_o, 1.5*", &error);
+	assert(!error.error);
+	tok = tok->next; // root
+	for (size_t i = 0; i < csvtmt_numof(hope); i++, tok = tok->next) {
+		assert(tok && tok->kind == hope[i]);
+	}
+	assert(!tok);
+
+	csvtmt_tokenizer_tokenize(t, "SELECT # FROM t", &error);
+	assert(error.error);
+
+	csvtmt_tokenizer_del(t);
+	csvtmt_arena_del(arena);
+}
+
+void
+test_schema_cache(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Apple\", 100), (\"Melon\", 300);", &error);
+	assert(!error.error);
+
+	csvtmt_prepare(db, "SELECT name, price FROM fruits WHERE price = 300;", &stmt, &error);
+	assert(!error.error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Melon"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	uint64_t version = stmt->model.header->version;
+	assert(version == 1);
+
+	// 追記ではヘッダは変わらないので解析し直さない。
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Peach\", 300);", &error);
+	assert(!error.error);
+	csvtmt_reset(stmt);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Peach"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(stmt->model.header->version == version);
+
+	// カラムの並びが変わったテーブルでは位置を解決し直す。
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (price INTEGER, name TEXT, id INTEGER PRIMARY KEY AUTOINCREMENT);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (price, name) VALUES (300, \"Lemon\");", &error);
+	assert(!error.error);
+	csvtmt_reset(stmt);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Lemon"));
+	assert(csvtmt_column_int(stmt, 1, &error) == 300);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	assert(stmt->model.header->version == version + 1);
+	csvtmt_finalize(stmt);
+
+	// ヘッダに無いカラムをSELECTしたらエラー
+	csvtmt_prepare(db, "SELECT nosuch, name FROM fruits;", &stmt, &error);
+	assert(!error.error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ERROR);
+	assert(error.error);
+	assert(!strcmp(error.elems[0].message, "not found column: nosuch"));
+	csvtmt_finalize(stmt);
+
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+void
+test_catalog(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *a, *b;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Apple\", 100);", &error);
+	assert(!error.error);
+	assert(db->catalog.len == 1);
+	uint64_t version = db->catalog.schemas[0]->header->version;
+
+	// INSERTを繰り返してもヘッダは解析し直さない
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Melon\", 300);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Peach\", 200);", &error);
+	assert(!error.error);
+	assert(db->catalog.schemas[0]->header->version == version);
+
+	// 別の文でも同じスキーマを使う
+	csvtmt_prepare(db, "SELECT name FROM fruits WHERE price = 300;", &a, &error);
+	csvtmt_prepare(db, "SELECT price FROM fruits WHERE name = \"Peach\";", &b, &error);
+	assert(!error.error);
+	assert(csvtmt_step(a, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(a, 0, &error), "Melon"));
+	assert(csvtmt_step(b, &error) == CSVTMT_ROW);
+	assert(csvtmt_column_int(b, 0, &error) == 200);
+	assert(a->model.schema == b->model.schema);
+	assert(a->model.schema == db->catalog.schemas[0]);
+	assert(db->catalog.schemas[0]->header->version == version);
+	assert(a->model.header == db->catalog.schemas[0]->header);
+	csvtmt_finalize(b);
+
+	// 作り直したテーブルはINSERTでも検出する
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (price INTEGER, name TEXT);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Lemon\", 150);", &error);
+	assert(!error.error);
+	assert(db->catalog.len == 1);
+	assert(db->catalog.schemas[0]->header->version != version);
+	assert(db->catalog.schemas[0]->header->types_len == 3);
+
+	// 読み直す前から持っている文のヘッダは差し替わらない
+	assert(a->model.header != db->catalog.schemas[0]->header);
+	assert(a->model.header->version == version);
+	assert(a->model.header->types_len == 4);
+	csvtmt_finalize(a);
+
+	csvtmt_prepare(db, "SELECT name FROM fruits WHERE price = 150;", &a, &error);
+	assert(csvtmt_step(a, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(a, 0, &error), "Lemon"));
+	assert(csvtmt_step(a, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(a);
+
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+void
+test_stats(void) {
+	CsvTomatoError error = {0};
+	const CsvTomatoTableStats *stats;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Apple\", 100), (\"Melon\", 1200), (\"Peach\", 300);", &error);
+	csvtmt_exec(db, "DELETE FROM fruits WHERE name = \"Peach\";", &error);
+	assert(!error.error);
+
+	// 書き込みで更新される
+	stats = csvtmt_table_stats(db, "fruits", &error);
+	assert(!error.error);
+	assert(stats);
+	assert(stats->live == 2);
+	assert(stats->dead == 1);
+	assert(stats->columns_len == 4);
+	assert(!strcmp(stats->columns[3].name, "price"));
+	assert(!strcmp(stats->columns[3].min, "100"));
+	assert(!strcmp(stats->columns[3].max, "1200")); // INTEGERは数値で比べる
+	assert(!strcmp(stats->columns[2].min, "Apple"));
+	assert(!strcmp(stats->columns[2].max, "Peach"));
+	assert(csvtmt_stats_distinct(stats, 2) == 2);
+
+	csvtmt_exec(db, "UPDATE fruits SET price = 50 WHERE name = \"Apple\";", &error);
+	assert(!error.error);
+	assert(stats->live == 2);
+	assert(stats->dead == 2);
+	assert(!strcmp(stats->columns[3].min, "50"));
+
+	// 閉じる時に書き出し、開き直すと読み込む
+	csvtmt_close(db);
+	assert(csvtmt_file_exists("test_db/stats/fruits.csv"));
+	db = csvtmt_open("test_db", &error);
+	stats = csvtmt_table_stats(db, "fruits", &error);
+	assert(stats);
+	assert(stats->live == 2);
+	assert(stats->dead == 2);
+	assert(!strcmp(stats->columns[3].max, "1200"));
+	assert(csvtmt_stats_distinct(stats, 1) == 2);
+
+	// 表が外で書き換えられたら統計は使わない
+	FILE *fp = fopen("test_db/fruits.csv", "a");
+	fputs("0,9,\"Lemon\",400\n", fp);
+	fclose(fp);
+	csvtmt_close(db);
+	db = csvtmt_open("test_db", &error);
+	assert(!csvtmt_table_stats(db, "fruits", &error));
+
+	// ANALYZEで作り直す
+	csvtmt_exec(db, "ANALYZE fruits;", &error);
+	assert(!error.error);
+	stats = csvtmt_table_stats(db, "fruits", &error);
+	assert(stats);
+	assert(stats->live == 3);
+	assert(stats->dead == 2);
+	assert(!strcmp(stats->columns[3].min, "50"));
+	assert(!strcmp(stats->columns[3].max, "1200"));
+	assert(csvtmt_stats_distinct(stats, 2) == 3);
+
+	csvtmt_exec(db, "ANALYZE;", &error);
+	assert(!error.error);
+	csvtmt_exec(db, "ANALYZE nothing;", &error);
+	assert(error.error);
+	csvtmt_error_clear(&error);
+
+	// 文の先頭でなければANALYZEはカラム名に使える
+	clear("jobs");
+	csvtmt_exec(db, "CREATE TABLE jobs (analyze TEXT);", &error);
+	csvtmt_exec(db, "INSERT INTO jobs (analyze) VALUES (\"daily\");", &error);
+	csvtmt_exec(db, "analyze jobs;", &error);
+	assert(!error.error);
+	stats = csvtmt_table_stats(db, "jobs", &error);
+	assert(stats && stats->live == 1);
+	assert(!strcmp(stats->columns[1].name, "analyze"));
+	clear("jobs");
+
+	// 別のハンドルが書いた行は数えられないので統計を捨てる
+	CsvTomato *other = csvtmt_open("test_db", &error);
+	assert(other);
+	csvtmt_exec(other, "INSERT INTO fruits (name, price) VALUES (\"Grape\", 500);", &error);
+	assert(!error.error);
+	stats = csvtmt_table_stats(other, "fruits", &error);
+	assert(stats);
+	assert(stats->live == 4);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Mango\", 600);", &error);
+	assert(!error.error);
+	assert(!csvtmt_table_stats(db, "fruits", &error));
+	csvtmt_close(other);
+	csvtmt_close(db);
+	db = csvtmt_open("test_db", &error);
+	assert(!csvtmt_table_stats(db, "fruits", &error));
+	csvtmt_exec(db, "ANALYZE fruits;", &error);
+	assert(!error.error);
+	stats = csvtmt_table_stats(db, "fruits", &error);
+	assert(stats);
+	assert(stats->live == 5);
+
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+void
+test_step_batch(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomatoBatch batch = { .flags = CSVTMT_BATCH_INT64 };
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Apple\", 100), (\"Melon\", 1200), (\"Peach\", 300);", &error);
+	assert(!error.error);
+
+	csvtmt_prepare(db, "SELECT name, price FROM fruits;", &stmt, &error);
+	assert(!error.error);
+
+	assert(csvtmt_step_batch(stmt, &batch, 2, &error) == CSVTMT_ROW);
+	assert(batch.rows_len == 2);
+	assert(batch.columns_len == 2);
+	assert(!strcmp(csvtmt_batch_text(&batch, 0, 0), "Apple"));
+	assert(!strcmp(csvtmt_batch_text(&batch, 1, 0), "Melon"));
+	assert(batch.lengths[0 * batch.stride + 1] == 5);
+	assert(batch.ints[1 * batch.stride + 0] == 100);
+	assert(batch.ints[1 * batch.stride + 1] == 1200);
+	assert(!csvtmt_batch_text(&batch, 2, 0));
+
+	assert(csvtmt_step_batch(stmt, &batch, 2, &error) == CSVTMT_ROW);
+	assert(batch.rows_len == 1);
+	assert(!strcmp(csvtmt_batch_text(&batch, 0, 0), "Peach"));
+	assert(batch.ints[1 * batch.stride + 0] == 300);
+
+	assert(csvtmt_step_batch(stmt, &batch, 2, &error) == CSVTMT_DONE);
+	assert(batch.rows_len == 0);
+	assert(!error.error);
+
+	// 後から型付きの列を頼んでも埋まる
+	csvtmt_reset(stmt);
+	batch.flags |= CSVTMT_BATCH_DOUBLE;
+	assert(csvtmt_step_batch(stmt, &batch, 8, &error) == CSVTMT_ROW);
+	assert(batch.rows_len == 3);
+	assert(batch.doubles[1 * batch.stride + 2] == 300.0);
+	csvtmt_finalize(stmt);
+
+	// ヘッダに無いカラムは落ちずにエラーになる
+	csvtmt_prepare(db, "SELECT nosuch, name FROM fruits;", &stmt, &error);
+	assert(!error.error);
+	assert(csvtmt_step_batch(stmt, &batch, 2, &error) == CSVTMT_ERROR);
+	assert(error.error);
+	csvtmt_error_clear(&error);
+
+	csvtmt_batch_final(&batch);
+	csvtmt_finalize(stmt);
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+static void
+test_column_types(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name, price) VALUES (\"Apple\", 5000000000), (\"Melon\", 1.5);", &error);
+	assert(!error.error);
+
+	csvtmt_prepare(db, "SELECT name, price FROM fruits;", &stmt, &error);
+	assert(!error.error);
+
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(csvtmt_column_int64(stmt, 1, &error) == 5000000000LL);
+	assert(csvtmt_column_int64(stmt, 1, &error) == 5000000000LL);
+	assert(csvtmt_column_bytes(stmt, 0, &error) == 5);
+	assert(!memcmp(csvtmt_column_blob(stmt, 0, &error), "Apple", 5));
+	assert(!error.error);
+
+	// 次の行では変換し直す
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(csvtmt_column_int64(stmt, 1, &error) == 1);
+	assert(csvtmt_column_double(stmt, 1, &error) == 1.5);
+	assert(csvtmt_column_int(stmt, 1, &error) == 1);
+	assert(csvtmt_column_bytes(stmt, 0, &error) == 5);
+	assert(!error.error);
+
+	csvtmt_column_bytes(stmt, 2, &error);
+	assert(error.error);
+	assert(error.elems[0].kind == CSVTMT_ERR_INDEX_OUT_OF_RANGE);
+
+	csvtmt_finalize(stmt);
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+static int
+busy_count_handler(void *arg, int count) {
+	int *calls = arg;
+	*calls = count + 1;
+	return count < 2; // 3回目で諦める
+}
+
+static void
+test_lock(void) {
+	CsvTomatoError error = {0};
+	CsvTomato *reader = csvtmt_open("test_db", &error);
+	CsvTomato *writer = csvtmt_open("test_db", &error);
+	assert(reader && writer);
+
+	clear("fruits");
+	csvtmt_exec(writer, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Apple\"), (\"Melon\");", &error);
+	assert(!error.error);
+
+	CsvTomatoTableLock *lock = csvtmt_lock_acquire(&reader->locks, "test_db", "fruits", CSVTMT_LOCK_SHARED, &error);
+	assert(lock);
+	assert(!lock->writable); // 共有ロックは読み込み専用のfdで取る
+
+	// 読むだけなら並べる
+	assert(csvtmt_exec(writer, "SELECT name FROM fruits;", &error) == CSVTMT_ROW);
+	assert(!error.error);
+
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Apple\";", &error);
+	assert(error.error);
+	assert(error.elems[0].kind == CSVTMT_ERR_BUSY);
+	csvtmt_error_clear(&error);
+
+	int calls = 0;
+	csvtmt_busy_handler(writer, busy_count_handler, &calls);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Peach\");", &error);
+	assert(error.error);
+	assert(error.elems[0].kind == CSVTMT_ERR_BUSY);
+	assert(calls == 3);
+	csvtmt_error_clear(&error);
+
+	csvtmt_busy_timeout(writer, 10);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Peach\");", &error);
+	assert(error.elems[0].kind == CSVTMT_ERR_BUSY);
+	csvtmt_error_clear(&error);
+
+	// 同じ接続の文はロックを共有する。排他ロックを取る時に書き込みできるfdに開き直す
+	csvtmt_exec(reader, "INSERT INTO fruits (name) VALUES (\"Peach\");", &error);
+	assert(!error.error);
+	assert(lock->writable);
+
+	csvtmt_lock_release(&reader->locks, lock, CSVTMT_LOCK_SHARED);
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Apple\";", &error);
+	assert(!error.error);
+	assert(csvtmt_changes(writer) == 1);
+
+	clear("fruits");
+	csvtmt_close(reader);
+	csvtmt_close(writer);
+}
+
+static void
+test_snapshot(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *reader = csvtmt_open("test_db", &error);
+	CsvTomato *writer = csvtmt_open("test_db", &error);
+	assert(reader && writer);
+
+	clear("fruits");
+	csvtmt_exec(writer, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Apple\"), (\"Melon\"), (\"Peach\");", &error);
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Peach\";", &error);
+	assert(!error.error);
+
+	csvtmt_prepare(reader, "SELECT name FROM fruits;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Apple"));
+
+	// 読んでいる途中でも書く文は待たされない
+	csvtmt_exec(writer, "UPDATE fruits SET name = \"Lemon\" WHERE name = \"Melon\";", &error);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Grape\");", &error);
+	assert(!error.error);
+
+	// 開いた時点の行だけが見える
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Melon"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+
+	csvtmt_reset(stmt);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Apple"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Lemon"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Grape"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	// 論理削除ログが無ければ読むだけの文は作らず、開いた後に作られたログを読む
+	clear("fruits");
+	csvtmt_exec(writer, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Apple\"), (\"Melon\");", &error);
+	assert(!error.error);
+	struct stat st;
+	char tomb[CSVTMT_PATH_SIZE];
+	assert(stat("test_db/fruits.csv", &st) == 0);
+	snprintf(tomb, sizeof tomb, "test_db/tomb/fruits.%lu.log", (unsigned long) st.st_ino);
+	remove(tomb);
+
+	csvtmt_prepare(reader, "SELECT name FROM fruits;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!csvtmt_file_exists(tomb));
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Melon\";", &error);
+	assert(!error.error);
+	assert(csvtmt_file_exists(tomb));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Melon"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	// 開いた後の論理削除がファイルの後ろから順にログに載っても見える
+	clear("fruits");
+	csvtmt_exec(writer, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	csvtmt_exec(writer, "INSERT INTO fruits (name) VALUES (\"Apple\"), (\"Melon\"), (\"Peach\"), (\"Grape\");", &error);
+	assert(!error.error);
+
+	csvtmt_prepare(reader, "SELECT name FROM fruits;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Apple"));
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Grape\";", &error);
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Peach\";", &error);
+	csvtmt_exec(writer, "DELETE FROM fruits WHERE name = \"Melon\";", &error);
+	assert(!error.error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Melon"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Peach"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Grape"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	clear("fruits");
+	csvtmt_close(reader);
+	csvtmt_close(writer);
+}
+
+typedef struct {
+	CsvTomato *db;
+	int inserts;
+	bool failed;
+} ThreadsafeArg;
+
+static void *
+threadsafe_worker(void *p) {
+	ThreadsafeArg *arg = p;
+	CsvTomatoError error = {0};
+
+	for (int i = 0; i < arg->inserts; i++) {
+		csvtmt_exec(arg->db, "INSERT INTO fruits (name) VALUES (\"Apple\");", &error);
+		csvtmt_exec(arg->db, "SELECT name FROM fruits;", &error);
+		if (error.error) {
+			arg->failed = true;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void
+test_threadsafe(void) {
+	enum { NTHREADS = 8, NINSERTS = 20 };
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open_v2("test_db", CSVTMT_OPEN_THREADSAFE, &error);
+	assert(db);
+	csvtmt_busy_timeout(db, 10000);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	assert(!error.error);
+
+	pthread_t threads[NTHREADS];
+	ThreadsafeArg args[NTHREADS];
+	for (int i = 0; i < NTHREADS; i++) {
+		args[i] = (ThreadsafeArg) { .db = db, .inserts = NINSERTS };
+		assert(!pthread_create(&threads[i], NULL, threadsafe_worker, &args[i]));
+	}
+	for (int i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], NULL);
+		assert(!args[i].failed);
+	}
+
+	// 書き込みはスレッドをまたいで1つずつなのでIDは重ならない
+	csvtmt_prepare(db, "SELECT id FROM fruits;", &stmt, &error);
+	bool seen[NTHREADS * NINSERTS + 1] = {0};
+	int rows = 0;
+	while (csvtmt_step(stmt, &error) == CSVTMT_ROW) {
+		int64_t id = csvtmt_column_int64(stmt, 0, &error);
+		assert(id >= 1 && id <= NTHREADS * NINSERTS);
+		assert(!seen[id]);
+		seen[id] = true;
+		rows++;
+	}
+	assert(!error.error);
+	assert(rows == NTHREADS * NINSERTS);
+
+	csvtmt_finalize(stmt);
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+typedef struct {
+	CsvTomato *db;
+	int loops;
+	bool failed;
+} CompactArg;
+
+static void *
+compact_worker(void *p) {
+	CompactArg *arg = p;
+	CsvTomatoError error = {0};
+
+	for (int i = 0; i < arg->loops; i++) {
+		if (csvtmt_compact(arg->db, "fruits", &error) != CSVTMT_OK) {
+			arg->failed = true;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static size_t
+file_size(const char *path) {
+	struct stat st;
+	assert(stat(path, &st) == 0);
+	return st.st_size;
+}
+
+static void
+test_compact(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	CsvTomato *reader = csvtmt_open("test_db", &error);
+	assert(db && reader);
+
+	clear("fruits");
+	csvtmt_exec(db, "CREATE TABLE fruits (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	csvtmt_exec(db, "INSERT INTO fruits (name) VALUES (\"Apple\"), (\"Melon\"), (\"Peach\"), (\"Lemon\"), (\"Grape\");", &error);
+	csvtmt_exec(db, "DELETE FROM fruits WHERE name = \"Melon\";", &error);
+	csvtmt_exec(db, "DELETE FROM fruits WHERE name = \"Peach\";", &error);
+	assert(!error.error);
+	size_t before = file_size("test_db/fruits.csv");
+
+	csvtmt_prepare(reader, "SELECT name FROM fruits;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Apple"));
+
+	assert(csvtmt_compact(db, "fruits", &error) == CSVTMT_OK);
+	assert(file_size("test_db/fruits.csv") < before);
+	const CsvTomatoTableStats *stats = csvtmt_table_stats(db, "fruits", &error);
+	assert(stats && stats->live == 3 && stats->dead == 0);
+
+	// 読んでいる途中の文は古いファイルを読み続ける
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Lemon"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Grape"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+	csvtmt_close(reader);
+
+	// スレッドセーフでなければワーカーは動かせない
+	assert(csvtmt_compactor_start(db, NULL, &error) == CSVTMT_ERROR);
+	csvtmt_error_clear(&error);
+	csvtmt_close(db);
+
+	db = csvtmt_open_v2("test_db", CSVTMT_OPEN_THREADSAFE, &error);
+	assert(db);
+	CsvTomatoCompactOpts opts = { .interval_ms = 10, .min_dead_rows = 1 };
+	assert(csvtmt_compactor_start(db, &opts, &error) == CSVTMT_OK);
+
+	before = file_size("test_db/fruits.csv");
+	csvtmt_exec(db, "DELETE FROM fruits WHERE name = \"Lemon\";", &error);
+	assert(!error.error);
+	// ワーカーはDELETEの前から動いていて、縮まない詰め直しも数えるので、縮むまで待つ
+	for (int i = 0; i < 500 && file_size("test_db/fruits.csv") >= before; i++) {
+		nanosleep(&(struct timespec) { .tv_nsec = 10 * 1000000 }, NULL);
+	}
+	assert(csvtmt_compactor_count(db));
+	assert(file_size("test_db/fruits.csv") < before);
+
+	csvtmt_prepare(db, "SELECT name FROM fruits;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Apple"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Grape"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	// 同じテーブルを詰め直している間は、後から来た詰め直しは何もしない
+	CsvTomatoTableLock *lock = csvtmt_lock_begin_compaction(&db->locks, db->db_dir, "fruits", &error);
+	assert(lock);
+	assert(!csvtmt_lock_begin_compaction(&db->locks, db->db_dir, "fruits", &error));
+	assert(!error.error);
+	csvtmt_exec(db, "DELETE FROM fruits WHERE name = \"Grape\";", &error);
+	before = file_size("test_db/fruits.csv");
+	assert(csvtmt_compact(db, "fruits", &error) == CSVTMT_OK);
+	assert(file_size("test_db/fruits.csv") == before);
+	csvtmt_lock_end_compaction(&db->locks, lock);
+	assert(csvtmt_compact(db, "fruits", &error) == CSVTMT_OK);
+	assert(file_size("test_db/fruits.csv") < before);
+
+	// 2つのスレッドとワーカーが追記の最中に同じテーブルを詰め直しても行は失われない
+	enum { NCOMPACTS = 2, NINSERTS = 50 };
+	csvtmt_busy_timeout(db, 10000);
+	pthread_t threads[NCOMPACTS + 1];
+	CompactArg args[NCOMPACTS];
+	for (int i = 0; i < NCOMPACTS; i++) {
+		args[i] = (CompactArg) { .db = db, .loops = 20 };
+		assert(!pthread_create(&threads[i], NULL, compact_worker, &args[i]));
+	}
+	ThreadsafeArg inserter = { .db = db, .inserts = NINSERTS };
+	assert(!pthread_create(&threads[NCOMPACTS], NULL, threadsafe_worker, &inserter));
+	for (int i = 0; i < NCOMPACTS + 1; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (int i = 0; i < NCOMPACTS; i++) {
+		assert(!args[i].failed);
+	}
+	assert(!inserter.failed);
+
+	csvtmt_prepare(db, "SELECT name FROM fruits;", &stmt, &error);
+	int rows = 0;
+	while (csvtmt_step(stmt, &error) == CSVTMT_ROW) {
+		rows++;
+	}
+	assert(!error.error);
+	assert(rows == 1 + NINSERTS);
+
+	csvtmt_finalize(stmt);
+	clear("fruits");
+	csvtmt_close(db);
+}
+
+static void
+test_io_backend(void) {
+	enum { NROWS = 50000 };
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	// io_uringが使えない環境ではPOSIXのままで、結果は変わらない
+	CsvTomatoIoBackend backend = csvtmt_set_io_backend(db, CSVTMT_IO_URING);
+	assert(backend == CSVTMT_IO_URING || backend == CSVTMT_IO_POSIX);
+
+	clear("items");
+	csvtmt_exec(db, "CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	assert(!error.error);
+
+	FILE *fp = fopen("test_db/items_src.csv", "w");
+	assert(fp);
+	fprintf(fp, "name,price\n");
+	for (int i = 0; i < NROWS; i++) {
+		fprintf(fp, "item%d,%d\n", i, i % 2);
+	}
+	fclose(fp);
+
+	CsvTomatoCopyOpts opts = { .header = true };
+	assert(csvtmt_copy_from(db, "items", "test_db/items_src.csv", &opts, &error) == CSVTMT_OK);
+	assert(file_size("test_db/items.csv") > CSVTMT_IO_READAHEAD_MIN);
+
+	csvtmt_exec(db, "DELETE FROM items WHERE price = 1;", &error);
+	assert(!error.error);
+	assert(csvtmt_changes(db) == NROWS / 2);
+
+	csvtmt_prepare(db, "SELECT name FROM items;", &stmt, &error);
+	int rows = 0;
+	while (csvtmt_step(stmt, &error) == CSVTMT_ROW) {
+		rows++;
+	}
+	assert(!error.error);
+	assert(rows == NROWS / 2);
+	csvtmt_finalize(stmt);
+
+	assert(csvtmt_compact(db, "items", &error) == CSVTMT_OK);
+	assert(csvtmt_copy_to(db, "items", "test_db/items_out.csv", &opts, &error) == CSVTMT_OK);
+	fp = fopen("test_db/items_out.csv", "r");
+	assert(fp);
+	int lines = 0;
+	for (int c; (c = fgetc(fp)) != EOF; ) {
+		lines += c == '\n';
+	}
+	fclose(fp);
+	assert(lines == NROWS / 2 + 1);
+
+	csvtmt_file_remove("test_db/items_src.csv");
+	csvtmt_file_remove("test_db/items_out.csv");
+	clear("items");
+	csvtmt_close(db);
+}
+
+static void
+test_step_async(void) {
+	enum { NROWS = 100000 };
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	clear("items");
+	csvtmt_exec(db, "CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	assert(!error.error);
+
+	FILE *fp = fopen("test_db/items_src.csv", "w");
+	assert(fp);
+	fprintf(fp, "name,price\n");
+	for (int i = 0; i < NROWS; i++) {
+		fprintf(fp, "item%d,%d\n", i, i % 2);
+	}
+	fclose(fp);
+
+	CsvTomatoCopyOpts opts = { .header = true };
+	assert(csvtmt_copy_from(db, "items", "test_db/items_src.csv", &opts, &error) == CSVTMT_OK);
+	assert(file_size("test_db/items.csv") > CSVTMT_ASYNC_WINDOW);
+
+	// ページキャッシュから落としておけば、走査は読み込みを待つことになる
+	int fd = open("test_db/items.csv", O_RDONLY);
+	assert(fd >= 0);
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	csvtmt_prepare(db, "SELECT name FROM items;", &stmt, &error);
+	assert(!error.error);
+	assert(csvtmt_step_fd(stmt) == -1);
+
+	int rows = 0;
+	for (;;) {
+		CsvTomatoResult result = csvtmt_step_async(stmt, &error);
+		if (result == CSVTMT_WOULD_BLOCK) {
+			struct pollfd pfd = { .fd = csvtmt_step_fd(stmt), .events = POLLIN };
+			assert(pfd.fd >= 0);
+			assert(poll(&pfd, 1, 5000) == 1);
+			continue;
+		}
+		if (result != CSVTMT_ROW) {
+			break;
+		}
+		if (rows == 0) {
+			assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "item0"));
+		}
+		rows++;
+	}
+	assert(!error.error);
+	assert(rows == NROWS);
+	csvtmt_finalize(stmt);
+
+	csvtmt_file_remove("test_db/items_src.csv");
+	clear("items");
+	csvtmt_close(db);
+}
+
+static void
+test_scan_advise(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+
+	assert(!csvtmt_scan_too_large(0));
+	assert(csvtmt_scan_too_large(SIZE_MAX));
+
+	clear("users");
+	csvtmt_exec(db, "CREATE TABLE users (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT);", &error);
+	csvtmt_exec(db, "INSERT INTO users (name) VALUES ('Alice');", &error);
+	assert(!error.error);
+
+	// SELECTは書き込めないテーブルでも読める
+	assert(chmod("test_db/users.csv", 0444) == 0);
+	csvtmt_prepare(db, "SELECT name FROM users;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "Alice"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+	assert(chmod("test_db/users.csv", 0644) == 0);
+
+	clear("users");
+	csvtmt_close(db);
+}
+
+static int
+count_rows(CsvTomato *db, const char *query, size_t long_len) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	csvtmt_prepare(db, query, &stmt, &error);
+	assert(!error.error);
+	int rows = 0;
+	bool found = long_len == 0;
+	while (csvtmt_step(stmt, &error) == CSVTMT_ROW) {
+		found |= strlen(csvtmt_column_text(stmt, 0, &error)) == long_len;
+		rows++;
+	}
+	assert(!error.error);
+	assert(found);
+	csvtmt_finalize(stmt);
+	return rows;
+}
+
+static void
+test_mmap_window(void) {
+	enum { NROWS = 2000 };
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	assert(db);
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	clear("items");
+	csvtmt_exec(db, "CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	assert(!error.error);
+
+	// 最後の行でファイルをページの大きさちょうどにする。mmapの終わりに'\0'は無い
+	csvtmt_prepare(db, "INSERT INTO items (name, price) VALUES (?, 1);", &stmt, &error);
+	int n = 0;
+	for (; file_size("test_db/items.csv") + 100 < page; n++) {
+		csvtmt_bind_text(stmt, 1, "item", -1, CSVTMT_TRANSTENT, &error);
+		assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+		csvtmt_reset(stmt);
+	}
+	char id[32];
+	size_t left = page - file_size("test_db/items.csv") - 8 - snprintf(id, sizeof id, "%d", n + 1);
+	char *name = calloc(1, page * 4);
+	assert(name);
+	memset(name, 'x', left);
+	csvtmt_bind_text(stmt, 1, name, -1, CSVTMT_TRANSTENT, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	csvtmt_finalize(stmt);
+	n++;
+	assert(!error.error);
+	assert(file_size("test_db/items.csv") == (long) page);
+
+	assert(count_rows(db, "SELECT name FROM items;", left) == n);
+	csvtmt_exec(db, "UPDATE items SET price = 2 WHERE price = 1;", &error);
+	assert(!error.error);
+	assert(csvtmt_changes(db) == n);
+
+	// 1ページの窓で、窓を跨ぐ行と窓より長い行を読む
+	csvtmt_set_mmap_window(db, 1);
+	clear("items");
+	csvtmt_exec(db, "CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	assert(!error.error);
+
+	FILE *fp = fopen("test_db/items_src.csv", "w");
+	assert(fp);
+	fprintf(fp, "name,price\n");
+	memset(name, 'y', page * 3);
+	for (int i = 0; i < NROWS; i++) {
+		fprintf(fp, "%s,%d\n", i == NROWS / 2 ? name : "item", i % 2);
+	}
+	fclose(fp);
+	CsvTomatoCopyOpts opts = { .header = true };
+	assert(csvtmt_copy_from(db, "items", "test_db/items_src.csv", &opts, &error) == CSVTMT_OK);
+
+	assert(count_rows(db, "SELECT name FROM items;", page * 3) == NROWS);
+	csvtmt_exec(db, "DELETE FROM items WHERE price = 1;", &error);
+	assert(!error.error);
+	assert(csvtmt_changes(db) == NROWS / 2);
+	csvtmt_exec(db, "UPDATE items SET price = 3 WHERE price = 0;", &error);
+	assert(csvtmt_changes(db) == NROWS / 2);
+	csvtmt_exec(db, "UPDATE items SET price = 4;", &error);
+	assert(csvtmt_changes(db) == NROWS / 2);
+	assert(!error.error);
+	assert(count_rows(db, "SELECT name FROM items WHERE price = 4;", page * 3) == NROWS / 2);
+
+	csvtmt_exec(db, "DELETE FROM items WHERE id = 1;", &error);
+	assert(csvtmt_compact(db, "items", &error) == CSVTMT_OK);
+	assert(count_rows(db, "SELECT name FROM items;", page * 3) == NROWS / 2 - 1);
+
+	csvtmt_exec(db, "ANALYZE items;", &error);
+	assert(!error.error);
+	const CsvTomatoTableStats *stats = csvtmt_table_stats(db, "items", &error);
+	assert(stats && stats->live == NROWS / 2 - 1 && stats->dead == 0);
+
+	assert(csvtmt_copy_to(db, "items", "test_db/items_out.csv", &opts, &error) == CSVTMT_OK);
+	fp = fopen("test_db/items_out.csv", "r");
+	assert(fp);
+	int lines = 0;
+	for (int c; (c = fgetc(fp)) != EOF; ) {
+		lines += c == '\n';
+	}
+	fclose(fp);
+	assert(lines == NROWS / 2);
+
+	free(name);
+	csvtmt_file_remove("test_db/items_src.csv");
+	csvtmt_file_remove("test_db/items_out.csv");
+	clear("items");
+	csvtmt_close(db);
+}
+
+// 列ストアの<db>/<table>.col/を消す
+static void
+clear_columnar(const char *table_name) {
+	char dir_path[256];
+	snprintf(dir_path, sizeof dir_path, "test_db/%s.col", table_name);
+	DIR *dir = opendir(dir_path);
+	if (!dir) {
+		return;
+	}
+	for (struct dirent *ent; (ent = readdir(dir)); ) {
+		if (ent->d_name[0] != '.') {
+			char path[512];
+			snprintf(path, sizeof path, "%s/%s", dir_path, ent->d_name);
+			csvtmt_file_remove(path);
+		}
+	}
+	closedir(dir);
+	csvtmt_file_remove(dir_path);
+}
+
+// itemsの全ての行を"name:price,"でつなげる。最後の行を列ストアから読んだかをactiveに返す
+static void
+select_items(CsvTomato *db, char *dst, size_t dst_size, bool *active) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+
+	dst[0] = '\0';
+	*active = false;
+	csvtmt_prepare(db, "SELECT name, price FROM items;", &stmt, &error);
+	while (csvtmt_step(stmt, &error) == CSVTMT_ROW) {
+		size_t len = strlen(dst);
+		snprintf(dst + len, dst_size - len, "%s:%s,",
+			csvtmt_column_text(stmt, 0, &error), csvtmt_column_text(stmt, 1, &error));
+		*active = stmt->model.columnar.active;
+	}
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+}
+
+static ino_t
+file_ino(const char *path) {
+	struct stat st;
+	assert(stat(path, &st) == 0);
+	return st.st_ino;
+}
+
+static void
+test_columnar(void) {
+	CsvTomatoError error = {0};
+	CsvTomatoStmt *stmt;
+	CsvTomato *db = csvtmt_open("test_db", &error);
+	CsvTomato *plain = csvtmt_open("test_db", &error);
+	assert(db && plain);
+	char got[1024], want[1024];
+	bool active;
+
+	clear("items");
+	clear_columnar("items");
+	csvtmt_set_columnar(db, true);
+	csvtmt_exec(plain, "CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, price INTEGER);", &error);
+	csvtmt_exec(plain, "INSERT INTO items (name, price) VALUES (\"a,b\", 10), (\"\", 0), (\"c\", 20);", &error);
+	assert(!error.error);
+
+	// 最初のSELECTで作り、CSVから読んだのと同じ行を返す
+	select_items(plain, want, sizeof want, &active);
+	assert(!active);
+	assert(!strcmp(want, "a,b:10,:0,c:20,"));
+	select_items(db, got, sizeof got, &active);
+	assert(active && !strcmp(got, want));
+	ino_t head_ino = file_ino("test_db/items.col/head");
+
+	// 追記と論理削除は作り直さずに足す
+	csvtmt_exec(plain, "INSERT INTO items (name, price) VALUES (\"d\", 30);", &error);
+	csvtmt_exec(plain, "DELETE FROM items WHERE name = \"c\";", &error);
+	assert(!error.error);
+	select_items(plain, want, sizeof want, &active);
+	select_items(db, got, sizeof got, &active);
+	assert(active && !strcmp(got, want));
+	assert(!strcmp(got, "a,b:10,:0,d:30,"));
+	assert(file_ino("test_db/items.col/head") == head_ino);
+
+	// 読んでいる途中に消された行は、他の文が列ストアに写しても見え続ける
+	csvtmt_prepare(db, "SELECT name FROM items;", &stmt, &error);
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(stmt->model.columnar.active);
+	csvtmt_exec(plain, "DELETE FROM items WHERE name = \"d\";", &error);
+	select_items(db, got, sizeof got, &active);
+	assert(active && !strcmp(got, "a,b:10,:0,"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), ""));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_ROW);
+	assert(!strcmp(csvtmt_column_text(stmt, 0, &error), "d"));
+	assert(csvtmt_step(stmt, &error) == CSVTMT_DONE);
+	assert(!error.error);
+	csvtmt_finalize(stmt);
+
+	// INTEGERに戻らない値のカラムはTEXTとして持つ
+	csvtmt_exec(plain, "INSERT INTO items (name, price) VALUES (\"e\", 1.5);", &error);
+	assert(!error.error);
+	select_items(plain, want, sizeof want, &active);
+	select_items(db, got, sizeof got, &active);
+	assert(active && !strcmp(got, want));
+	char *meta = csvtmt_file_read("test_db/items.col/meta");
+	assert(meta && strstr(meta, "column,int") && strstr(meta, "column,txt,"));
+	free(meta);
+
+	// 書き直したテーブルと、外から追記されたテーブルにも追いつく
+	csvtmt_exec(plain, "UPDATE items SET price = 40 WHERE name = \"e\";", &error);
+	assert(!error.error);
+	FILE *fp = fopen("test_db/items.csv", "a");
+	assert(fp);
+	fputs("0,100,\"f\",50\n", fp);
+	fclose(fp);
+	select_items(plain, want, sizeof want, &active);
+	select_items(db, got, sizeof got, &active);
+	assert(active && !strcmp(got, want));
+	assert(strstr(got, "e:40,") && strstr(got, "f:50,"));
+
+	// 他の文が列ストアを書いている間は待たずにCSVを読む
+	csvtmt_exec(plain, "INSERT INTO items (name, price) VALUES (\"g\", 60);", &error);
+	assert(!error.error);
+	select_items(plain, want, sizeof want, &active);
+	int fd = open("test_db/items.col/lock", O_RDWR);
+	assert(fd != -1);
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	assert(fcntl(fd, F_OFD_SETLK, &fl) == 0);
+	select_items(db, got, sizeof got, &active);
+	assert(!active && !strcmp(got, want));
+	close(fd);
+	select_items(db, got, sizeof got, &active);
+	assert(active && !strcmp(got, want));
+
+	csvtmt_set_columnar(db, false);
+	select_items(db, got, sizeof got, &active);
+	assert(!active && !strcmp(got, want));
+
+	clear("items");
+	clear_columnar("items");
+	csvtmt_close(db);
+	csvtmt_close(plain);
+}
+
 int 
 main(void) {
 	test_tomato();	
 	test_csv();
 	test_executor_common();
+	test_copy();
+	test_sync();
+	test_delete();
+	test_reset();
+	test_stmt_cache();
+	test_wide_table();
+	test_arena();
+	test_keywords();
+	test_schema_cache();
+	test_catalog();
+	test_stats();
+	test_step_batch();
+	test_column_types();
+	test_lock();
+	test_snapshot();
+	test_threadsafe();
+	test_compact();
+	test_io_backend();
+	test_step_async();
+	test_scan_advise();
+	test_mmap_window();
+	test_columnar();
 	puts("OK");
 	return 0;
 }